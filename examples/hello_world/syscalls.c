@@ -5,8 +5,27 @@
 #include <stdint.h>
 
 #define	syscall_exit            1
+#define	syscall_open            2
+#define	syscall_close           3
 #define	syscall_read            4
 #define	syscall_write           5
+#define	syscall_lseek           6
+#define	syscall_unlink          7
+#define	syscall_getpid          8
+#define	syscall_fstat           10
+#define	syscall_brk             11
+#define	syscall_memcpy          0x5200
+#define	syscall_memset          0x5201
+#define	syscall_memcmp          0x5202
+#define	syscall_strlen          0x5203
+
+// Stat record filled in by rISA for syscall_fstat
+struct risa_stat {
+  uint32_t mode;
+  uint32_t size;
+  uint32_t blksize;
+  uint32_t blocks;
+};
 
 // syscall helper =====================================================================================================
 
@@ -27,6 +46,16 @@ static long syscall(long syscall_type, long arg0, long arg1, long arg2) {
   return a0;
 }
 
+// Raw call for the host-accelerated intrinsics (results aren't errno-style)
+static long accel_call(long accel_type, long arg0, long arg1, long arg2) {
+  register long a0          asm("a0") = arg0;
+  register long a1          asm("a1") = arg1;
+  register long a2          asm("a2") = arg2;
+  register long syscall_id  asm("a7") = accel_type;
+  asm volatile("scall" : "+r"(a0) : "r"(a1), "r"(a2), "r"(syscall_id) : "memory");
+  return a0;
+}
+
 // Stubs ==============================================================================================================
 
 void _exit(int status) {
@@ -35,41 +64,89 @@ void _exit(int status) {
 }
 
 ssize_t _write(int file, const void *ptr, size_t len) {
-  syscall(syscall_write, (long)file, (long)ptr, (long)len);
-  return len; // rISA writes all the chars here, so we just return len (finished)
+  return syscall(syscall_write, (long)file, (long)ptr, (long)len);
 }
 
 ssize_t _read(int file, void *ptr, size_t len) {
   return syscall(syscall_read, (long)file, (long)ptr, (long)len);
 }
 
+int _open(const char *name, int flags, int mode) {
+  return syscall(syscall_open, (long)name, (long)flags, (long)mode);
+}
+
+int _close(int file) {
+  return syscall(syscall_close, (long)file, 0, 0);
+}
+
+int _lseek(int file, int ptr, int dir) {
+  return syscall(syscall_lseek, (long)file, (long)ptr, (long)dir);
+}
+
+int _unlink(const char *name) {
+  return syscall(syscall_unlink, (long)name, 0, 0);
+}
+
 int _fstat(int file, struct stat *st) {
-  st->st_mode = S_IFCHR;
+  struct risa_stat rst;
+  if (syscall(syscall_fstat, (long)file, (long)&rst, 0) < 0) {
+    return -1;
+  }
+  st->st_mode = rst.mode;
+  st->st_size = rst.size;
+  st->st_blksize = rst.blksize;
+  st->st_blocks = rst.blocks;
   return 0;
 }
 
+int _isatty(int file) {
+  struct stat st;
+  if (_fstat(file, &st) < 0) {
+    return 0;
+  }
+  return S_ISCHR(st.st_mode);
+}
+
 void *_sbrk(int incr) {
   extern char _end;
   static char *heap = NULL;
   char *prev_heap;
 
+  // rISA bounds the break by its memory size and the current stack pointer
   if (heap == NULL) {
-    heap = (char*)&_end;
+    heap = (char*)syscall(syscall_brk, (long)&_end, 0, 0);
   }
   prev_heap = heap;
-
-  // Collision check
-  register long sp asm("sp");
-  if ((heap + incr) > sp) {
-    return NULL;
+  if ((char*)syscall(syscall_brk, (long)(heap + incr), 0, 0) != (heap + incr)) {
+    errno = ENOMEM;
+    return (void*)-1;
   }
 
   heap += incr;
   return (void*)prev_heap;
 }
 
-int _getpid(void)                       { return 1;     }
-int _close(int file)                    { return -1;    }
-int _isatty(int file)                   { return 1;     }
-int _lseek(int file, int ptr, int dir)  { return 0;     }
-void _kill(int pid, int sig)            { return;       }
+int _getpid(void)                       { return syscall(syscall_getpid, 0, 0, 0); }
+void _kill(int pid, int sig)            { return; }
+
+// Host-accelerated overrides of newlib's byte-loop routines ==========================================================
+
+void *memcpy(void *dst, const void *src, size_t len) {
+  return (void*)accel_call(syscall_memcpy, (long)dst, (long)src, (long)len);
+}
+
+void *memmove(void *dst, const void *src, size_t len) {
+  return (void*)accel_call(syscall_memcpy, (long)dst, (long)src, (long)len);
+}
+
+void *memset(void *dst, int c, size_t len) {
+  return (void*)accel_call(syscall_memset, (long)dst, (long)c, (long)len);
+}
+
+int memcmp(const void *lhs, const void *rhs, size_t len) {
+  return (int)accel_call(syscall_memcmp, (long)lhs, (long)rhs, (long)len);
+}
+
+size_t strlen(const char *str) {
+  return (size_t)accel_call(syscall_strlen, (long)str, 0, 0);
+}
@@ -1,18 +1,39 @@
 #include <stdio.h>
 #include "risa.h"
 
-DLLEXPORT void risaMmioHandler(rv32iHart_t *cpu) {
-    printf("MMIO HELLO WORLD - target address is: ( 0x%08x )\n", cpu->targetAddress);
-    return;
+// Example handler library (handler ABI v2) - a byte-wide "UART" data register and hello-world prints.
+// Uses the fixed callback names so it can also be linked in at build time (-DRISA_STATIC_HANDLER=<this file>).
+#define EXAMPLE_UART_BASE   0x10000000
+#define EXAMPLE_UART_SIZE   0x100
+
+uint32_t risaHandlerMmio(void *ctx, risaSim *hart, uint32_t addr, uint32_t width, uint32_t value, int isWrite) {
+    if (isWrite && addr == EXAMPLE_UART_BASE) {
+        putchar((int)(value & 0xff));
+        return 0;
+    }
+    printf("MMIO HELLO WORLD - %s of %u byte(s) at ( 0x%08x )\n", isWrite ? "write" : "read", width, addr);
+    return 0;
 }
-DLLEXPORT void risaIntHandler(rv32iHart_t *cpu) {
-    printf("INTERRUPT HELLO WORLD - interrupt timeout is ( %d )\n", cpu->intPeriodVal);
+int risaHandlerEnv(void *ctx, risaSim *hart, RisaEnvKind kind) {
+    return 0; // Not subscribed - default syscall handler
 }
-DLLEXPORT void risaInitHandler(rv32iHart_t *cpu) {
-    printf("INIT HELLO WORLD\n");
-    return;
+void risaHandlerInterrupt(void *ctx, risaSim *hart, uint64_t cycle) {
+    printf("INTERRUPT HELLO WORLD - cycle ( %llu )\n", (unsigned long long)cycle);
 }
-DLLEXPORT void risaExitHandler(rv32iHart_t *cpu) {
+void risaHandlerExit(void *ctx, risaSim *hart) {
     printf("EXIT HELLO WORLD\n");
-    return;
-}
\ No newline at end of file
+}
+
+DLLEXPORT int risaHandlerRegister(risaSim *hart, risaHandlers *handlers) {
+    if (handlers->abiVersion != RISA_HANDLER_ABI_VERSION) {
+        return -1;
+    }
+    printf("INIT HELLO WORLD\n");
+    handlers->events = RISA_EVENT_MMIO | RISA_EVENT_INTERRUPT | RISA_EVENT_EXIT;
+    handlers->mmioBase = EXAMPLE_UART_BASE;
+    handlers->mmioSize = EXAMPLE_UART_SIZE;
+    handlers->mmio = risaHandlerMmio;
+    handlers->interrupt = risaHandlerInterrupt;
+    handlers->exit = risaHandlerExit;
+    return 0;
+}
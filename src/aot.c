@@ -0,0 +1,620 @@
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <spawn.h>
+#include <sys/wait.h>
+extern char **environ;
+#endif
+
+#include "aot.h"
+#include "events.h"
+
+#define AOT_HASH_SEED           0xcbf29ce484222325ULL   // FNV-1a offset basis
+#define AOT_MAX_BUILD_ARGS      64
+
+// How translation treats an instruction
+typedef enum {
+    AOT_INST_INTERPRET = 0,     // Left to the interpreter (FP, CSRs, ECALL/EBREAK/FENCE/WFI/MRET, invalid)
+    AOT_INST_PLAIN,             // ALU/LUI/AUIPC/load/store - the block goes on
+    AOT_INST_BRANCH,
+    AOT_INST_JAL,
+    AOT_INST_JALR
+} AotInstKind;
+
+typedef struct {
+    u32 pc;
+    u32 len;
+    u32 end;                    // AotBlockEnd
+} AotFoundBlock;
+
+typedef struct {
+    const u8        *image;
+    u32             words;
+    u8              *leader;    // Per word - a block starts there
+    u32             *work;      // Leaders still to scan
+    u32             workCount;
+    AotFoundBlock   *blocks;
+    u32             blockCount;
+} AotScan;
+
+static u64 aotHash(u64 hash, const u8 *data, u32 len) {
+    for (u32 i=0; i<len; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static u32 aotWord(const AotScan *scan, u32 word) {
+    u32 inst;
+    memcpy(&inst, scan->image + (word << 2), sizeof(inst));
+    return inst;
+}
+
+// Only the encodings the interpreter executes as RV32I - anything else keeps its interpreter behaviour
+static AotInstKind aotClassify(u32 inst) {
+    u32 funct3 = GET_FUNCT3(inst);
+    u32 funct7 = GET_FUNCT7(inst);
+    switch (GET_OPCODE(inst)) {
+        case 0x37:                                                                          // LUI
+        case 0x17: { return AOT_INST_PLAIN; }                                               // AUIPC
+        case 0x13: {                                                                        // OP-IMM
+            if (funct3 == 0x1) {
+                return (funct7 == 0x0) ? AOT_INST_PLAIN : AOT_INST_INTERPRET;
+            }
+            if (funct3 == 0x5) {
+                return (funct7 == 0x0 || funct7 == 0x20) ? AOT_INST_PLAIN : AOT_INST_INTERPRET;
+            }
+            return AOT_INST_PLAIN;
+        }
+        case 0x33: {                                                                        // OP
+            if (funct7 == 0x0 || (funct7 == 0x20 && (funct3 == 0x0 || funct3 == 0x5))) {
+                return AOT_INST_PLAIN;
+            }
+            return AOT_INST_INTERPRET;
+        }
+        case 0x03: { return (funct3 == 0x3 || funct3 > 0x5) ? AOT_INST_INTERPRET : AOT_INST_PLAIN; }   // Loads
+        case 0x23: { return (funct3 > 0x2) ? AOT_INST_INTERPRET : AOT_INST_PLAIN; }                    // Stores
+        case 0x63: { return (funct3 == 0x2 || funct3 == 0x3) ? AOT_INST_INTERPRET : AOT_INST_BRANCH; }
+        case 0x6f: { return AOT_INST_JAL; }
+        case 0x67: { return (funct3 == 0x0) ? AOT_INST_JALR : AOT_INST_INTERPRET; }
+        default:   { return AOT_INST_INTERPRET; }
+    }
+}
+
+// Execution can go on after an instruction left to the interpreter (i.e. it isn't an invalid word or MRET)
+static int aotFallsThrough(u32 inst) {
+    return (inst & 0x3) == 0x3 && g_opcodeToFormat[GET_OPCODE(inst)] != Undefined && inst != 0x30200073;
+}
+
+static s32 aotBranchOffset(u32 inst) {
+    u32 immPartial = GET_IMM_4_1(inst) | (GET_IMM_10_5(inst) << 4) | (GET_IMM_11_B(inst) << 10) |
+        (GET_IMM_12(inst) << 11);
+    return (s32)(immPartial << 20) >> 19;
+}
+
+static s32 aotJumpOffset(u32 inst) {
+    u32 immPartial = GET_IMM_10_1(inst) | (GET_IMM_11_J(inst) << 10) | (GET_IMM_19_12(inst) << 11) |
+        (GET_IMM_20(inst) << 19);
+    return (s32)(immPartial << 12) >> 11;
+}
+
+static void aotAddLeader(AotScan *scan, u32 pc) {
+    u32 word = pc >> 2;
+    if ((pc & 0x3) || word >= scan->words || scan->leader[word]) {
+        return;
+    }
+    scan->leader[word] = 1;
+    scan->work[scan->workCount++] = word;
+}
+
+// Follow a leader to the end of its run, adding the leaders it leads to (branch/jump targets, return sites)
+static void aotScanLeader(AotScan *scan, u32 word) {
+    for (; word < scan->words; ++word) {
+        u32 pc = word << 2;
+        u32 inst = aotWord(scan, word);
+        switch (aotClassify(inst)) {
+            case AOT_INST_PLAIN: {
+                continue;
+            }
+            case AOT_INST_BRANCH: {
+                aotAddLeader(scan, pc + aotBranchOffset(inst));
+                aotAddLeader(scan, pc + 4);
+                return;
+            }
+            case AOT_INST_JAL: {
+                aotAddLeader(scan, pc + aotJumpOffset(inst));
+                if (GET_RD(inst) != ZERO) {
+                    aotAddLeader(scan, pc + 4);
+                }
+                return;
+            }
+            case AOT_INST_JALR: {
+                if (GET_RD(inst) != ZERO) {
+                    aotAddLeader(scan, pc + 4);
+                }
+                return;
+            }
+            default: {
+                if (aotFallsThrough(inst)) {
+                    aotAddLeader(scan, pc + 4);
+                }
+                return;
+            }
+        }
+    }
+}
+
+// Block starting at a leader - up to a branch/jump, the next leader or an interpreted instruction (a block cut at
+// AOT_MAX_BLOCK makes the rest of its run a leader, still to come in address order)
+static void aotFindBlock(AotScan *scan, u32 first) {
+    AotFoundBlock block = { first << 2, 0, AOT_END_FALLTHROUGH };
+    for (u32 word=first; word < scan->words && (word == first || !scan->leader[word]); ++word) {
+        AotInstKind kind = aotClassify(aotWord(scan, word));
+        if (kind == AOT_INST_INTERPRET) {
+            break;
+        }
+        if (block.len == AOT_MAX_BLOCK) {
+            scan->leader[word] = 1;
+            break;
+        }
+        block.len++;
+        if (kind != AOT_INST_PLAIN) {
+            block.end = (kind == AOT_INST_BRANCH) ? AOT_END_BRANCH :
+                ((kind == AOT_INST_JAL) ? AOT_END_JAL : AOT_END_JALR);
+            break;
+        }
+    }
+    if (block.len != 0) {
+        scan->blocks[scan->blockCount++] = block;
+    }
+}
+
+// "X[reg]" as a C expression (x0 reads as a constant)
+static const char *aotReg(char *buf, u32 reg) {
+    if (reg == ZERO) {
+        return "0u";
+    }
+    sprintf(buf, "X[%u]", reg);
+    return buf;
+}
+
+// One ALU/LUI/AUIPC/load/store - "count" is its position in the block (from 1)
+static void aotEmitPlain(FILE *out, u32 pc, u32 inst, u32 count) {
+    static const char *aluOps[8] = { "+", "<<", "", "", "^", ">>", "|", "&" };
+    char rs1Buf[8];
+    char rs2Buf[8];
+    u32 rd = GET_RD(inst);
+    u32 funct3 = GET_FUNCT3(inst);
+    int alt = (GET_FUNCT7(inst) == 0x20);
+    const char *rs1 = aotReg(rs1Buf, GET_RS1(inst));
+    const char *rs2 = aotReg(rs2Buf, GET_RS2(inst));
+    s32 imm = (s32)inst >> 20;
+    switch (GET_OPCODE(inst)) {
+        case 0x37:
+        case 0x17: {
+            u32 value = (inst & 0xfffff000) + ((GET_OPCODE(inst) == 0x17) ? pc : 0);
+            if (rd != ZERO) {
+                fprintf(out, "    X[%u] = 0x%08xu;\n", rd, value);
+            }
+            break;
+        }
+        case 0x13: {
+            if (rd == ZERO) {
+                break;
+            }
+            switch (funct3) {
+                case 0x1: { fprintf(out, "    X[%u] = %s << %u;\n", rd, rs1, GET_RS2(inst));                   break; }
+                case 0x2: { fprintf(out, "    X[%u] = ((s32)%s < %d) ? 1u : 0u;\n", rd, rs1, imm);             break; }
+                case 0x3: { fprintf(out, "    X[%u] = (%s < 0x%08xu) ? 1u : 0u;\n", rd, rs1, (u32)imm);        break; }
+                case 0x5: {
+                    fprintf(out, alt ? "    X[%u] = (u32)((s32)%s >> %u);\n" : "    X[%u] = %s >> %u;\n", rd, rs1,
+                        GET_RS2(inst));
+                    break;
+                }
+                default:  { fprintf(out, "    X[%u] = %s %s 0x%08xu;\n", rd, rs1, aluOps[funct3], (u32)imm);   break; }
+            }
+            break;
+        }
+        case 0x33: {
+            if (rd == ZERO) {
+                break;
+            }
+            switch (funct3) {
+                case 0x0: { fprintf(out, "    X[%u] = %s %s %s;\n", rd, rs1, alt ? "-" : "+", rs2);             break; }
+                case 0x1: { fprintf(out, "    X[%u] = %s << (%s & 0x1f);\n", rd, rs1, rs2);                     break; }
+                case 0x2: { fprintf(out, "    X[%u] = ((s32)%s < (s32)%s) ? 1u : 0u;\n", rd, rs1, rs2);         break; }
+                case 0x3: { fprintf(out, "    X[%u] = (%s < %s) ? 1u : 0u;\n", rd, rs1, rs2);                   break; }
+                case 0x5: {
+                    fprintf(out, alt ? "    X[%u] = (u32)((s32)%s >> (%s & 0x1f));\n" :
+                        "    X[%u] = %s >> (%s & 0x1f);\n", rd, rs1, rs2);
+                    break;
+                }
+                default:  { fprintf(out, "    X[%u] = %s %s %s;\n", rd, rs1, aluOps[funct3], rs2);              break; }
+            }
+            break;
+        }
+        case 0x03: {
+            u32 width = 1u << (funct3 & 0x3);
+            const char *cast = (funct3 == 0x0) ? "(u32)(s32)(s8)" : ((funct3 == 0x1) ? "(u32)(s32)(s16)" : "");
+            // Loads to x0 still happen (device reads have side effects)
+            if (rd == ZERO) {
+                fprintf(out, "    (void)aotLoad(cpu, rt, %s + 0x%08xu, %u, 0x%08xu, start + %u);\n", rs1, (u32)imm,
+                    width, pc, count);
+            }
+            else {
+                fprintf(out, "    X[%u] = %saotLoad(cpu, rt, %s + 0x%08xu, %u, 0x%08xu, start + %u);\n", rd, cast,
+                    rs1, (u32)imm, width, pc, count);
+            }
+            fprintf(out, "    AOT_CHECK(cpu, start, %u, 0x%08xu);\n", count, pc);
+            break;
+        }
+        case 0x23: {
+            s32 storeImm = (s32)((GET_IMM_4_0(inst) | (GET_IMM_11_5(inst) << 5)) << 20) >> 20;
+            fprintf(out, "    aotStore(cpu, rt, %s + 0x%08xu, %u, %s, 0x%08xu, start + %u);\n", rs1, (u32)storeImm,
+                1u << funct3, rs2, pc, count);
+            fprintf(out, "    AOT_CHECK(cpu, start, %u, 0x%08xu);\n", count, pc);
+            break;
+        }
+    }
+}
+
+// Branch/jump ending a block - always leaves it
+static void aotEmitExit(FILE *out, u32 pc, u32 inst, u32 count) {
+    static const char *branchConds[8] = {
+        "%s == %s", "%s != %s", "", "", "(s32)%s < (s32)%s", "(s32)%s >= (s32)%s", "%s < %s", "%s >= %s"
+    };
+    char rs1Buf[8];
+    char rs2Buf[8];
+    char cond[32];
+    u32 rd = GET_RD(inst);
+    const char *rs1 = aotReg(rs1Buf, GET_RS1(inst));
+    const char *rs2 = aotReg(rs2Buf, GET_RS2(inst));
+    switch (aotClassify(inst)) {
+        case AOT_INST_BRANCH: {
+            sprintf(cond, branchConds[GET_FUNCT3(inst)], rs1, rs2);
+            fprintf(out, "    AOT_EXIT(cpu, start, %u, (%s) ? 0x%08xu : 0x%08xu);\n", count, cond,
+                pc + aotBranchOffset(inst), pc + 4);
+            break;
+        }
+        case AOT_INST_JAL: {
+            if (rd != ZERO) {
+                fprintf(out, "    X[%u] = 0x%08xu;\n", rd, pc + 4);
+            }
+            fprintf(out, "    AOT_EXIT(cpu, start, %u, 0x%08xu);\n", count, pc + aotJumpOffset(inst));
+            break;
+        }
+        default: {
+            // Target read before the link register is written (rd may be rs1)
+            fprintf(out, "    const u32 target = (%s + 0x%08xu) & ~1u;\n", rs1, (u32)((s32)inst >> 20));
+            if (rd != ZERO) {
+                fprintf(out, "    X[%u] = 0x%08xu;\n", rd, pc + 4);
+            }
+            fprintf(out, "    AOT_EXIT(cpu, start, %u, target);\n", count);
+            break;
+        }
+    }
+}
+
+static void aotEmitBlock(FILE *out, const AotScan *scan, const AotFoundBlock *block) {
+    fprintf(out, "\nstatic u32 aotBlock_%08x(rv32iHart_t *cpu, const AotRuntime *rt) {\n", block->pc);
+    fprintf(out, "    const u64 start = cpu->cycleCounter;\n");
+    for (u32 i=0; i<block->len; ++i) {
+        u32 pc = block->pc + (i << 2);
+        u32 inst = aotWord(scan, pc >> 2);
+        fprintf(out, "    // 0x%08x: 0x%08x\n", pc, inst);
+        if (i == block->len - 1 && block->end != AOT_END_FALLTHROUGH) {
+            aotEmitExit(out, pc, inst, i + 1);
+        }
+        else {
+            aotEmitPlain(out, pc, inst, i + 1);
+        }
+    }
+    if (block->end == AOT_END_FALLTHROUGH) {
+        fprintf(out, "    AOT_EXIT(cpu, start, %u, 0x%08xu);\n", block->len, block->pc + (block->len << 2));
+    }
+    fprintf(out, "}\n");
+}
+
+int aotTranslate(const u8 *image, u32 size, const u32 *entries, u32 entryCount, FILE *out, u32 *blockCount) {
+    AotScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.image = image;
+    scan.words = size >> 2;
+    scan.leader = (u8*)calloc(scan.words + 1, sizeof(u8));
+    scan.work = (u32*)calloc(scan.words + 1, sizeof(u32));
+    scan.blocks = (AotFoundBlock*)calloc(scan.words + 1, sizeof(AotFoundBlock));
+    if (scan.leader == NULL || scan.work == NULL || scan.blocks == NULL) {
+        free(scan.leader);
+        free(scan.work);
+        free(scan.blocks);
+        return ENOMEM;
+    }
+    // Leaders reachable from the entry points through direct branches/jumps and fall-through
+    for (u32 i=0; i<entryCount; ++i) {
+        aotAddLeader(&scan, entries[i]);
+    }
+    while (scan.workCount != 0) {
+        aotScanLeader(&scan, scan.work[--scan.workCount]);
+    }
+    for (u32 word=0; word<scan.words; ++word) {
+        if (scan.leader[word]) {
+            aotFindBlock(&scan, word);
+        }
+    }
+    *blockCount = scan.blockCount;
+    if (scan.blockCount == 0) {
+        free(scan.leader);
+        free(scan.work);
+        free(scan.blocks);
+        return EINVAL;
+    }
+
+    const AotFoundBlock *last = &scan.blocks[scan.blockCount - 1];
+    u32 textBase = scan.blocks[0].pc;
+    u32 textEnd = last->pc + (last->len << 2);
+    for (u32 i=0; i<scan.blockCount; ++i) {
+        u32 blockEnd = scan.blocks[i].pc + (scan.blocks[i].len << 2);
+        textEnd = (blockEnd > textEnd) ? blockEnd : textEnd;
+    }
+    fprintf(out, "// Generated by risa-aot - %u blocks translated from guest code at 0x%08x-0x%08x\n",
+        scan.blockCount, textBase, textEnd);
+    fprintf(out, "#include \"aot.h\"\n\n#define X (cpu->regFile)\n");
+    for (u32 i=0; i<scan.blockCount; ++i) {
+        aotEmitBlock(out, &scan, &scan.blocks[i]);
+    }
+    fprintf(out, "\nstatic const AotBlock g_blocks[] = {\n");
+    for (u32 i=0; i<scan.blockCount; ++i) {
+        const AotFoundBlock *block = &scan.blocks[i];
+        fprintf(out, "    { 0x%08xu, %uu, %uu, aotBlock_%08x },\n", block->pc, block->len, block->end, block->pc);
+    }
+    fprintf(out, "};\n\nDLLEXPORT const AotImageInfo %s = {\n", AOT_IMAGE_SYM);
+    fprintf(out, "    AOT_ABI_VERSION, sizeof(rv32iHart_t), 0x%08xu, 0x%08xu, 0x%016llxULL, %uu, g_blocks\n};\n",
+        textBase, textEnd, (unsigned long long)aotHash(AOT_HASH_SEED, image + textBase, textEnd - textBase),
+        scan.blockCount);
+    free(scan.leader);
+    free(scan.work);
+    free(scan.blocks);
+    return ferror(out) ? EIO : 0;
+}
+
+int aotOpen(rv32iHart_t *cpu, const char *path) {
+    LIB_HANDLE lib = LOAD_LIB(path);
+    if (lib == NULL) {
+        LOG_E("Could not load translation ( %s ).\n", path);
+        return ENOENT;
+    }
+    const AotImageInfo *info = (const AotImageInfo*)LOAD_SYM(lib, AOT_IMAGE_SYM);
+    if (info == NULL || info->abiVersion != AOT_ABI_VERSION || info->hartSize != sizeof(rv32iHart_t) ||
+        info->blockCount == 0 || info->textEnd <= info->textBase) {
+        LOG_E("( %s ) is not a translation for this build of rISA (AOT ABI v%d).\n", path, AOT_ABI_VERSION);
+        CLOSE_LIB(lib);
+        return EINVAL;
+    }
+    const u8 *text = memPeek(cpu, info->textBase, info->textEnd - info->textBase);
+    if (text == NULL || aotHash(AOT_HASH_SEED, text, info->textEnd - info->textBase) != info->textHash) {
+        LOG_E("( %s ) was translated from a different image.\n", path);
+        CLOSE_LIB(lib);
+        return EINVAL;
+    }
+    AotImage *aot = (AotImage*)calloc(1, sizeof(AotImage));
+    u32 slotCount = (info->textEnd - info->textBase) >> 2;
+    const AotBlock **slots = (const AotBlock**)calloc(slotCount, sizeof(AotBlock*));
+    if (aot == NULL || slots == NULL) {
+        free(aot);
+        free(slots);
+        CLOSE_LIB(lib);
+        return ENOMEM;
+    }
+    for (u32 i=0; i<info->blockCount; ++i) {
+        const AotBlock *block = &info->blocks[i];
+        u32 offset = block->pc - info->textBase;
+        if ((offset & 0x3) == 0 && (offset >> 2) < slotCount && block->len <= slotCount - (offset >> 2)) {
+            slots[offset >> 2] = block;
+        }
+    }
+    aot->lib = lib;
+    aot->info = info;
+    aot->slots = slots;
+    aot->slotCount = slotCount;
+    aot->textBase = info->textBase;
+    aot->textEnd = info->textEnd;
+    aot->enabled = 1;
+    // Traces, gdb and v1 MMIO procs (called on every store) need each instruction interpreted
+    if (cpu->opts.o_tracePrintEnable || cpu->opts.o_gdbEnabled || cpu->handlerProcs[RISA_MMIO_HANDLER_PROC] != NULL) {
+        LOG_W("Tracing, GDB-mode and v1 MMIO handlers interpret every instruction - ( %s ) not used.\n", path);
+        aot->enabled = 0;
+    }
+    aotFree(cpu);
+    cpu->aot = aot;
+    return 0;
+}
+
+// Split "text" in place on spaces/tabs (no shell quoting - $CC is just a command and its own flags) - returns the
+// number of arguments added to "argv"
+static u32 aotSplitArgs(char *text, char **argv, u32 max) {
+    u32 count = 0;
+    while (*text != '\0' && count < max) {
+        if (*text == ' ' || *text == '\t') {
+            *text++ = '\0';
+            continue;
+        }
+        argv[count++] = text;
+        while (*text != '\0' && *text != ' ' && *text != '\t') {
+            ++text;
+        }
+    }
+    return count;
+}
+
+// Run the compiler directly rather than through a shell, so nothing in $CC, $RISA_INCLUDE or the cache path is
+// ever interpreted - returns its exit status, -1 if it could not be run
+static int aotRunCompiler(char **argv) {
+#ifdef _WIN32
+    // _spawnvp() joins the arguments unquoted - paths with spaces are not supported here
+    return (int)_spawnvp(_P_WAIT, argv[0], (const char* const*)argv);
+#else
+    pid_t pid;
+    int status = 0;
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0) {
+        return -1;
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+// Translate the loaded image to "source" and build it as "lib" with "cc" (command and flags) against the headers in
+// "include" - returns 0, EINVAL (nothing translatable), ENOENT (could not write or build it) or ENOMEM
+static int aotBuild(rv32iHart_t *cpu, const u8 *image, u32 size, const char *cc, const char *include,
+    const char *source, const char *lib) {
+    FILE *out;
+    OPEN_FILE(out, source, "w");
+    if (out == NULL) {
+        LOG_E("Could not write translation ( %s ).\n", source);
+        return ENOENT;
+    }
+    u32 entries[2] = { 0, cpu->pc };
+    u32 blockCount = 0;
+    int err = aotTranslate(image, size, entries, 2, out, &blockCount);
+    err = (fclose(out) != 0 && !err) ? EIO : err;
+    if (!err) {
+        char ccArgs[FILENAME_MAX];
+        char flags[] = AOT_BUILD_FLAGS;
+        char includeArg[FILENAME_MAX + 2];
+        char output[] = "-o";
+        char *argv[AOT_MAX_BUILD_ARGS];
+        snprintf(ccArgs, sizeof(ccArgs), "%s", cc);
+        snprintf(includeArg, sizeof(includeArg), "-I%s", include);
+        u32 argc = aotSplitArgs(ccArgs, argv, AOT_MAX_BUILD_ARGS - 8);
+        argc += aotSplitArgs(flags, argv + argc, AOT_MAX_BUILD_ARGS - 5 - argc);
+        argv[argc++] = includeArg;
+        argv[argc++] = output;
+        argv[argc++] = (char*)lib;
+        argv[argc++] = (char*)source;
+        argv[argc] = NULL;
+        err = (argc < 5 || aotRunCompiler(argv) != 0) ? ENOENT : 0;
+        if (err) {
+            LOG_E("Could not build translation ( %s ) with ( %s ).\n", lib, cc);
+        }
+    }
+    remove(source);
+    return (err == EIO) ? ENOENT : err;
+}
+
+// Fold a header translations are compiled against into the cache key (a missing one just doesn't contribute)
+static u64 aotHashHeader(u64 key, const char *include, const char *name) {
+    char path[FILENAME_MAX];
+    u8 buf[4096];
+    FILE *header;
+    snprintf(path, sizeof(path), "%s%c%s", include, PATH_SEPARATOR, name);
+    OPEN_FILE(header, path, "rb");
+    if (header == NULL) {
+        return key;
+    }
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), header)) > 0) {
+        key = aotHash(key, buf, (u32)len);
+    }
+    fclose(header);
+    return key;
+}
+
+int aotOpenCached(rv32iHart_t *cpu, const char *dir) {
+    u32 size = 0;
+    const u8 *image = memLoadedImage(cpu, &size);
+    if (image == NULL) {
+        LOG_E("No image loaded at address 0 to translate.\n");
+        return EINVAL;
+    }
+    const char *cc = getenv("CC");
+    const char *include = getenv("RISA_INCLUDE");
+    cc = (cc != NULL && cc[0] != '\0') ? cc : "cc";
+    include = (include != NULL && include[0] != '\0') ? include : RISA_INCLUDE_DIR;
+
+    // Keyed by everything the library depends on - the code, where the hart starts, this build of rISA (ABI, hart
+    // layout and the headers the library is compiled against) and how it is compiled
+    char build[128];
+    snprintf(build, sizeof(build), "%d:%u:%s:%08x", AOT_ABI_VERSION, (u32)sizeof(rv32iHart_t), RISA_BUILD_ID,
+        cpu->pc);
+    u64 key = aotHash(AOT_HASH_SEED, image, size);
+    key = aotHash(key, (const u8*)build, (u32)strlen(build));
+    key = aotHash(key, (const u8*)cc, (u32)strlen(cc));
+    key = aotHash(key, (const u8*)AOT_BUILD_FLAGS, (u32)strlen(AOT_BUILD_FLAGS));
+    key = aotHash(key, (const u8*)include, (u32)strlen(include));
+    key = aotHashHeader(key, include, "risa.h");
+    key = aotHashHeader(key, include, "aot.h");
+    char lib[FILENAME_MAX];
+    snprintf(lib, sizeof(lib), "%s%crisa-aot-%016llx%s", dir, PATH_SEPARATOR, (unsigned long long)key,
+        HOST_LIB_SUFFIX);
+
+    FILE *cached;
+    OPEN_FILE(cached, lib, "rb");
+    if (cached != NULL) {
+        fclose(cached);
+        int err = aotOpen(cpu, lib);
+        if (err == 0) {
+            LOG_I("Translation cache hit ( %s ).\n", lib);
+        }
+        if (err == 0 || err == ENOMEM) {
+            return err;
+        }
+        LOG_W("Translation cache entry ( %s ) is unusable - building it again.\n", lib);
+    }
+    // Built under names of its own and renamed into place, so runs sharing the cache never load a partial library
+    LOG_I("Translation cache miss - building ( %s ).\n", lib);
+    char source[FILENAME_MAX + 32];
+    char partial[FILENAME_MAX + 32];
+    snprintf(source, sizeof(source), "%s.%d.c", lib, (int)HOST_GETPID());
+    snprintf(partial, sizeof(partial), "%s.%d%s", lib, (int)HOST_GETPID(), HOST_LIB_SUFFIX);
+    int err = aotBuild(cpu, image, size, cc, include, source, partial);
+    if (err == EINVAL) {
+        LOG_W("No translatable code reachable from the entry point - interpreting.\n");
+        return 0;
+    }
+    if (!err && rename(partial, lib) != 0) {
+        // Fine if another run's (identical) library got there first - rename() doesn't replace on every host
+        OPEN_FILE(cached, lib, "rb");
+        err = (cached != NULL) ? 0 : ENOENT;
+        if (cached != NULL) {
+            fclose(cached);
+        }
+    }
+    remove(partial);
+    return err ? err : aotOpen(cpu, lib);
+}
+
+void aotFree(rv32iHart_t *cpu) {
+    if (cpu->aot == NULL) {
+        return;
+    }
+    CLOSE_LIB(cpu->aot->lib);
+    free(cpu->aot->slots);
+    free(cpu->aot);
+    cpu->aot = NULL;
+}
+
+void aotCodeWritten(rv32iHart_t *cpu, u32 addr, u32 len) {
+    AotImage *aot = cpu->aot;
+    if (!aot->enabled || !AOT_CODE_HIT(aot, addr, len)) {
+        return;
+    }
+    LOG_W("Guest wrote to translated code at ( 0x%08x ) - interpreting from now on.\n", addr);
+    aot->enabled = 0;
+    EVENTS_RECHECK(cpu);
+}
+
+void aotReport(rv32iHart_t *cpu, FILE *out) {
+    AotImage *aot = cpu->aot;
+    if (aot == NULL) {
+        return;
+    }
+    double share = (cpu->cycleCounter != 0) ? (100.0 * (double)aot->instructionsRun / (double)cpu->cycleCounter) : 0.0;
+    fprintf(out, "Translated code (%u blocks at 0x%08x-0x%08x%s):\n", aot->info->blockCount, aot->textBase,
+        aot->textEnd, aot->enabled ? "" : ", disabled");
+    fprintf(out, "  %llu blocks run, %llu instructions (%.1f%% of the run)\n", (unsigned long long)aot->blocksRun,
+        (unsigned long long)aot->instructionsRun, share);
+}
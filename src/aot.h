@@ -0,0 +1,137 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdio.h>
+#include "risa.h"
+#include "memmap.h"
+
+// Ahead-of-time translation - risa-aot writes C for the basic blocks it finds in an image (one function per block),
+// the host compiler builds that into a shared library and the hart runs those blocks natively in place of the
+// interpreter. Generated sources include this header - bump AOT_ABI_VERSION whenever it changes.
+#define AOT_ABI_VERSION         1
+#define AOT_IMAGE_SYM           "risaAotImage"
+#define AOT_MAX_BLOCK           64      // Instructions per block (a longer run continues in the next one)
+#define AOT_MAX_ENTRIES         64
+#define AOT_BUILD_FLAGS         "-O2 -shared -fPIC"
+#ifndef RISA_INCLUDE_DIR
+#define RISA_INCLUDE_DIR        "."     // Where translations find this header (the build sets it to the sources)
+#endif
+#ifndef RISA_BUILD_ID
+#define RISA_BUILD_ID           __DATE__ " " __TIME__   // Part of the cache key - changes whenever aot.c is rebuilt
+#endif
+
+typedef enum {
+    AOT_END_FALLTHROUGH = 0,    // Runs into the next block or an instruction left to the interpreter
+    AOT_END_BRANCH,
+    AOT_END_JAL,
+    AOT_END_JALR                // Indirect - the interpreter takes over unless the target starts a block
+} AotBlockEnd;
+
+// Simulator side of translated code - device accesses, TLB misses/faults and guest writes to translated code
+typedef struct {
+    u32     (*load)(rv32iHart_t *cpu, u32 addr, u32 width);
+    void    (*store)(rv32iHart_t *cpu, u32 addr, u32 width, u32 value);
+    void    (*codeWritten)(rv32iHart_t *cpu, u32 addr, u32 len);
+} AotRuntime;
+
+// Runs a block from its first instruction - returns the next PC with cycleCounter advanced by the instructions it
+// executed. Leaves right after a load/store that stopped the hart or brought a device event due (a faulting access
+// returns its own PC).
+typedef u32 (*AotBlockFn)(rv32iHart_t *cpu, const AotRuntime *rt);
+
+typedef struct {
+    u32         pc;
+    u32         len;                // Instructions
+    u32         end;                // AotBlockEnd of its last instruction
+    AotBlockFn  fn;
+} AotBlock;
+
+// Exported by a translation as AOT_IMAGE_SYM
+typedef struct {
+    u32             abiVersion;     // AOT_ABI_VERSION
+    u32             hartSize;       // sizeof(rv32iHart_t) it was built against
+    u32             textBase;       // Guest code it was translated from - [textBase, textEnd)
+    u32             textEnd;
+    u64             textHash;       // FNV-1a of that code
+    u32             blockCount;
+    const AotBlock  *blocks;        // In PC order
+} AotImageInfo;
+
+// Translation loaded for a hart
+struct AotImage {
+    LIB_HANDLE          lib;
+    const AotImageInfo  *info;
+    const AotBlock      **slots;    // Block starting at each word of [textBase, textEnd) (NULL where none does)
+    u32                 slotCount;
+    u32                 textBase;
+    u32                 textEnd;
+    u32                 enabled;    // Cleared once the guest writes over translated code
+    u64                 blocksRun;
+    u64                 instructionsRun;
+};
+
+// Guest write of [addr, addr + len) overlapping the translated code
+#define AOT_CODE_HIT(aot, addr, len)        ((addr) < (aot)->textEnd && (u64)(addr) + (len) > (aot)->textBase)
+#define AOT_CODE_WRITTEN(cpu, addr, len)    do {                                                    \
+    if ((cpu)->aot != NULL && AOT_CODE_HIT((cpu)->aot, addr, len)) { aotCodeWritten(cpu, addr, len); }  \
+    } while (0)
+
+// Write C for the blocks reachable from "entries" in an image loaded at address 0 (build it with "cc -O2 -shared
+// -fPIC -I<rISA src>") - returns 0, EINVAL (nothing translatable) or ENOMEM
+int aotTranslate(const u8 *image, u32 size, const u32 *entries, u32 entryCount, FILE *out, u32 *blockCount);
+// Use a translation of the image in guest memory (the code it was translated from must match) - returns 0, ENOENT,
+// EINVAL (not a translation of this image for this build) or ENOMEM
+int aotOpen(rv32iHart_t *cpu, const char *path);
+// Same, from a cache directory of translations shared between runs - on a miss the loaded image is translated and
+// built with $CC (cc if unset, headers from $RISA_INCLUDE or RISA_INCLUDE_DIR). Libraries are keyed by the loaded
+// pages, the start PC, AOT ABI/hart layout and the build command, and are moved into place whole, so concurrent
+// runs never see a partial one. Returns 0 (also when nothing is translatable), ENOENT (could not build), EINVAL
+// or ENOMEM.
+int aotOpenCached(rv32iHart_t *cpu, const char *dir);
+void aotFree(rv32iHart_t *cpu);
+// Stop using the translation (the guest rewrote code it was made from) - a block running the store leaves after it
+void aotCodeWritten(rv32iHart_t *cpu, u32 addr, u32 len);
+void aotReport(rv32iHart_t *cpu, FILE *out);
+
+// --- Used by generated code ---
+#define AOT_EXIT(cpu, start, count, next)   do { (cpu)->cycleCounter = (start) + (count); return (next); } while (0)
+// After a load/store - leave if it stopped the hart or made a device event due (i.e. a CLINT write)
+#define AOT_CHECK(cpu, start, count, pc)    do {                                                    \
+    if ((cpu)->runStatus != RISA_RUN_LIMIT || (start) + (count) >= (cpu)->nextEventCycle) {         \
+        AOT_EXIT(cpu, start, count, ((cpu)->runStatus == RISA_RUN_ERROR) ? (pc) : (pc) + 4);        \
+    } } while (0)
+
+// RAM/ROM TLB hits inline, anything else goes through the simulator with the PC and cycle count of the instruction
+static inline u32 aotLoad(rv32iHart_t *cpu, const AotRuntime *rt, u32 addr, u32 width, u32 pc, u64 cycle) {
+    const MemTlbEntry *entry = &cpu->tlb.load[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_SIZE - 1)];
+    if (entry->tag == ((addr + width - 1) >> MEM_PAGE_SHIFT) && !MMIO_HIT(cpu, addr)) {
+        const u8 *host = entry->page + (addr & (MEM_PAGE_SIZE - 1));
+        return (width == 4) ? *(const u32*)host : ((width == 2) ? *(const u16*)host : *host);
+    }
+    cpu->pc = pc;
+    cpu->cycleCounter = cycle;
+    return rt->load(cpu, addr, width);
+}
+
+static inline void aotStore(rv32iHart_t *cpu, const AotRuntime *rt, u32 addr, u32 width, u32 value, u32 pc,
+    u64 cycle) {
+    const MemTlbEntry *entry = &cpu->tlb.store[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_SIZE - 1)];
+    if (entry->tag == ((addr + width - 1) >> MEM_PAGE_SHIFT) && !MMIO_HIT(cpu, addr)) {
+        u8 *host = entry->page + (addr & (MEM_PAGE_SIZE - 1));
+        if (width == 4)         { *(u32*)host = value;      }
+        else if (width == 2)    { *(u16*)host = (u16)value; }
+        else                    { *host = (u8)value;        }
+        if (!AOT_CODE_HIT(cpu->aot, addr, width)) {
+            return;
+        }
+        cpu->pc = pc;
+        cpu->cycleCounter = cycle;
+        rt->codeWritten(cpu, addr, width);
+        return;
+    }
+    cpu->pc = pc;
+    cpu->cycleCounter = cycle;
+    rt->store(cpu, addr, width, value);
+}
+
+#endif // AOT_H
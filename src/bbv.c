@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bbv.h"
+
+int bbvCreate(rv32iHart_t *cpu, const char *path, u64 interval) {
+    if (interval == 0) {
+        return EINVAL;
+    }
+    BbvSim *bbv = (BbvSim*)calloc(1, sizeof(BbvSim));
+    if (bbv == NULL) {
+        return ENOMEM;
+    }
+    bbv->capacity = BBV_INITIAL_CAPACITY;
+    bbv->table = (BbvEntry*)calloc(bbv->capacity, sizeof(BbvEntry));
+    if (bbv->table == NULL) {
+        free(bbv);
+        return ENOMEM;
+    }
+    bbv->out = fopen(path, "w");
+    if (bbv->out == NULL) {
+        LOG_E("Could not create BBV file ( %s ).\n", path);
+        free(bbv->table);
+        free(bbv);
+        return ENOENT;
+    }
+    // Intervals are counted from cycle 0 so their indices line up with SimPoint's output
+    bbv->interval = interval;
+    bbv->intervalEnd = ((cpu->cycleCounter / interval) + 1) * interval;
+    cpu->bbv = bbv;
+    return 0;
+}
+
+// One "T:<id>:<count> :<id>:<count> ..." line - an interval with no retired blocks is a bare "T"
+static void bbvEmit(BbvSim *bbv) {
+    fputc('T', bbv->out);
+    for (u32 i=0; i<bbv->capacity; ++i) {
+        BbvEntry *entry = &bbv->table[i];
+        if (entry->count != 0) {
+            fprintf(bbv->out, ":%u:%llu ", entry->id, (unsigned long long)entry->count);
+            entry->count = 0;
+        }
+    }
+    fputc('\n', bbv->out);
+    bbv->intervals++;
+}
+
+void bbvFree(rv32iHart_t *cpu) {
+    BbvSim *bbv = cpu->bbv;
+    if (bbv == NULL) {
+        return;
+    }
+    for (u32 i=0; i<bbv->capacity; ++i) {
+        if (bbv->table[i].count != 0) {
+            bbvEmit(bbv);
+            break;
+        }
+    }
+    fclose(bbv->out);
+    free(bbv->table);
+    free(bbv);
+    cpu->bbv = NULL;
+    cpu->retire.enabled = RETIRE_MODELS_ATTACHED(cpu);
+}
+
+static BbvEntry *bbvLookup(BbvEntry *table, u32 capacity, u32 key) {
+    u32 slot = (key * 0x9e3779b1u) & (capacity - 1);
+    while (table[slot].key != 0 && table[slot].key != key) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &table[slot];
+}
+
+// Double the table - returns 0 or ENOMEM (the old table is kept)
+static int bbvGrow(BbvSim *bbv) {
+    u32 capacity = bbv->capacity * 2;
+    BbvEntry *table = (BbvEntry*)calloc(capacity, sizeof(BbvEntry));
+    if (table == NULL) {
+        return ENOMEM;
+    }
+    for (u32 i=0; i<bbv->capacity; ++i) {
+        if (bbv->table[i].key != 0) {
+            *bbvLookup(table, capacity, bbv->table[i].key) = bbv->table[i];
+        }
+    }
+    free(bbv->table);
+    bbv->table = table;
+    bbv->capacity = capacity;
+    return 0;
+}
+
+// Instructions [startPc, endPc] just retired
+void bbvBlock(rv32iHart_t *cpu, u32 startPc, u32 endPc) {
+    BbvSim *bbv = cpu->bbv;
+    u32 key = startPc | 1;
+    BbvEntry *entry = bbvLookup(bbv->table, bbv->capacity, key);
+    if (entry->key == 0) {
+        if ((bbv->blockCount + 1) * 2 > bbv->capacity) {
+            // Out of memory with the table full - the block goes uncounted rather than probing forever
+            if (bbvGrow(bbv) != 0 && bbv->blockCount + 1 >= bbv->capacity) {
+                return;
+            }
+            entry = bbvLookup(bbv->table, bbv->capacity, key);
+        }
+        entry->key = key;
+        entry->id = ++bbv->blockCount;
+    }
+    entry->count += ((endPc - startPc) / 4) + 1;
+    // Intervals end on block boundaries - skipped cycles (i.e. accelerated syscalls) can cover several
+    while (cpu->cycleCounter >= bbv->intervalEnd) {
+        bbvEmit(bbv);
+        bbv->intervalEnd += bbv->interval;
+    }
+}
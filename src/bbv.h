@@ -0,0 +1,35 @@
+#ifndef BBV_H
+#define BBV_H
+
+#include <stdio.h>
+#include "risa.h"
+
+#define BBV_DEFAULT_INTERVAL    10000000
+#define BBV_INITIAL_CAPACITY    1024        // Hash table slots (power of two, doubled at half full)
+
+typedef struct {
+    u32 key;            // Block start PC | 1 (0 for an empty slot)
+    u32 id;             // SimPoint block ids start at 1
+    u64 count;          // Instructions retired in this block this interval
+} BbvEntry;
+
+// Basic-block vectors per fixed-size interval, in SimPoint's ".bb" format - blocks are the retire stream's
+// sequential runs (entered at a PC, ended by a taken branch/jump or trap)
+struct BbvSim {
+    FILE        *out;
+    u64         interval;
+    u64         intervalEnd;    // cycleCounter value the current interval ends at
+    u64         intervals;      // Lines written so far
+    BbvEntry    *table;         // [capacity] open addressing, keyed by block start PC
+    u32         capacity;
+    u32         blockCount;
+};
+
+// Start writing vectors for every "interval" cycles to "path" - returns 0, EINVAL (interval is 0), ENOENT (could
+// not create the file) or ENOMEM
+int bbvCreate(rv32iHart_t *cpu, const char *path, u64 interval);
+// Writes out the last (partial) interval and closes the file
+void bbvFree(rv32iHart_t *cpu);
+void bbvBlock(rv32iHart_t *cpu, u32 startPc, u32 endPc);
+
+#endif // BBV_H
@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+static const char *g_cacheLevelNames[CACHE_LEVEL_COUNT] = { "L1I", "L1D", "L2" };
+static const char *g_cachePolicyNames[] = { "lru", "fifo", "random" };
+
+static int isPowerOfTwo(u32 val) {
+    return (val != 0) && ((val & (val - 1)) == 0);
+}
+
+static u32 log2u(u32 val) {
+    u32 shift = 0;
+    while ((1u << shift) < val) {
+        ++shift;
+    }
+    return shift;
+}
+
+// Size with an optional k/m suffix - returns 0 if invalid
+static u32 parseSize(const char *str, char **end) {
+    unsigned long val = strtoul(str, end, 0);
+    if (**end == 'k' || **end == 'K')       { val *= KB_MULTIPLIER; ++*end; }
+    else if (**end == 'm' || **end == 'M')  { val *= MB_MULTIPLIER; ++*end; }
+    return (u32)val;
+}
+
+static int parsePolicy(const char *str, u32 len, u32 *policy) {
+    for (u32 i=0; i<sizeof(g_cachePolicyNames)/sizeof(g_cachePolicyNames[0]); ++i) {
+        if (len == strlen(g_cachePolicyNames[i]) && strncmp(str, g_cachePolicyNames[i], len) == 0) {
+            *policy = i;
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+// One "<level>:<size>:<ways>:<line>[:<policy>]" or "region:<size>" item - returns 0 or EINVAL
+static int parseItem(CacheSim *cache, const char *item, u32 len) {
+    const char *end = item + len;
+    const char *colon = memchr(item, ':', len);
+    if (colon == NULL) {
+        return EINVAL;
+    }
+    u32 nameLen = (u32)(colon - item);
+    char *pos;
+    if (nameLen == 6 && strncmp(item, "region", 6) == 0) {
+        u32 region = parseSize(colon + 1, &pos);
+        if (pos != end || !isPowerOfTwo(region)) {
+            return EINVAL;
+        }
+        cache->regionShift = log2u(region);
+        return 0;
+    }
+    CacheLevel *level = NULL;
+    for (u32 i=0; i<CACHE_LEVEL_COUNT; ++i) {
+        const char *name = g_cacheLevelNames[i];
+        u32 matched = 0;
+        while (matched < nameLen && name[matched] != '\0' && (item[matched] | 0x20) == (name[matched] | 0x20)) {
+            ++matched;
+        }
+        if (matched == nameLen && name[matched] == '\0') {
+            level = &cache->levels[i];
+        }
+    }
+    if (level == NULL) {
+        return EINVAL;
+    }
+    level->size = parseSize(colon + 1, &pos);
+    if (*pos != ':') { return EINVAL; }
+    level->ways = (u32)strtoul(pos + 1, &pos, 0);
+    if (*pos != ':') { return EINVAL; }
+    level->lineSize = parseSize(pos + 1, &pos);
+    level->policy = CACHE_POLICY_LRU;
+    if (pos < end && (*pos != ':' || parsePolicy(pos + 1, (u32)(end - pos - 1), &level->policy))) {
+        return EINVAL;
+    }
+    if (!isPowerOfTwo(level->size) || !isPowerOfTwo(level->lineSize) || level->lineSize < sizeof(u32) ||
+        level->ways == 0 || (level->size % (level->ways * level->lineSize)) != 0) {
+        return EINVAL;
+    }
+    level->sets = level->size / (level->ways * level->lineSize);
+    if (!isPowerOfTwo(level->sets)) {
+        return EINVAL;
+    }
+    level->lineShift = log2u(level->lineSize);
+    return 0;
+}
+
+int cacheCreate(rv32iHart_t *cpu, const char *spec) {
+    CacheSim *cache = (CacheSim*)calloc(1, sizeof(CacheSim));
+    if (cache == NULL) {
+        return ENOMEM;
+    }
+    cache->regionShift = log2u(CACHE_DEFAULT_REGION);
+    cache->rng = 0x2545f491;
+    for (const char *item = spec; *item != '\0';) {
+        const char *comma = strchr(item, ',');
+        u32 len = (comma != NULL) ? (u32)(comma - item) : (u32)strlen(item);
+        if (parseItem(cache, item, len)) {
+            LOG_E("Invalid cache config item ( %.*s ).\n", (int)len, item);
+            free(cache);
+            return EINVAL;
+        }
+        item += len + ((comma != NULL) ? 1 : 0);
+    }
+
+    cache->regionCount = (cpu->virtMemSize >> cache->regionShift) + 1;
+    cache->regions = (CacheCounters*)calloc((size_t)cache->regionCount * CACHE_LEVEL_COUNT, sizeof(CacheCounters));
+    int err = (cache->regions == NULL) ? ENOMEM : 0;
+    for (u32 i=0; i<CACHE_LEVEL_COUNT && !err; ++i) {
+        CacheLevel *level = &cache->levels[i];
+        if (level->size == 0) {
+            continue;
+        }
+        u32 lines = level->sets * level->ways;
+        level->tags = (u32*)calloc(lines, sizeof(u32));
+        level->stamps = (u32*)calloc(lines, sizeof(u32));
+        level->dirty = (u8*)calloc(lines, sizeof(u8));
+        if (level->tags == NULL || level->stamps == NULL || level->dirty == NULL) {
+            err = ENOMEM;
+        }
+    }
+    cpu->cache = cache;
+    if (err) {
+        LOG_E("Could not allocate cache model.\n");
+        cacheFree(cpu);
+    }
+    return err;
+}
+
+void cacheFree(rv32iHart_t *cpu) {
+    CacheSim *cache = cpu->cache;
+    if (cache == NULL) {
+        return;
+    }
+    for (u32 i=0; i<CACHE_LEVEL_COUNT; ++i) {
+        free(cache->levels[i].tags);
+        free(cache->levels[i].stamps);
+        free(cache->levels[i].dirty);
+    }
+    free(cache->regions);
+    free(cache);
+    cpu->cache = NULL;
+    cpu->retire.enabled = RETIRE_MODELS_ATTACHED(cpu);
+}
+
+static CacheCounters *regionCounters(CacheSim *cache, u32 pc, CacheLevelId id) {
+    u32 region = pc >> cache->regionShift;
+    if (region >= cache->regionCount) {
+        region = cache->regionCount - 1;
+    }
+    return &cache->regions[(region * CACHE_LEVEL_COUNT) + id];
+}
+
+// Look "addr" up in one level, filling on a miss - dirty victims are written back to L2
+static int cacheLookup(CacheSim *cache, CacheLevelId id, u32 pc, u32 addr, int isWrite) {
+    CacheLevel *level = &cache->levels[id];
+    CacheCounters *region = regionCounters(cache, pc, id);
+    u32 line = addr >> level->lineShift;
+    u32 base = (line & (level->sets - 1)) * level->ways;
+    u32 tag = line + 1;
+    level->clock++;
+    for (u32 way=0; way<level->ways; ++way) {
+        if (level->tags[base + way] == tag) {
+            if (level->policy == CACHE_POLICY_LRU) {
+                level->stamps[base + way] = level->clock;
+            }
+            level->dirty[base + way] |= (u8)isWrite;
+            level->total.hits++;
+            region->hits++;
+            return 1;
+        }
+    }
+    level->total.misses++;
+    region->misses++;
+
+    // Victim - an invalid way, else per the replacement policy
+    u32 victim = level->ways;
+    for (u32 way=0; way<level->ways; ++way) {
+        if (level->tags[base + way] == 0) {
+            victim = way;
+            break;
+        }
+    }
+    if (victim == level->ways && level->policy == CACHE_POLICY_RANDOM) {
+        cache->rng ^= cache->rng << 13;
+        cache->rng ^= cache->rng >> 17;
+        cache->rng ^= cache->rng << 5;
+        victim = cache->rng % level->ways;
+    }
+    else if (victim == level->ways) {
+        // Oldest stamp (wrap-safe)
+        victim = 0;
+        for (u32 way=1; way<level->ways; ++way) {
+            if ((level->clock - level->stamps[base + way]) > (level->clock - level->stamps[base + victim])) {
+                victim = way;
+            }
+        }
+    }
+    if (level->tags[base + victim] != 0) {
+        level->total.evictions++;
+        region->evictions++;
+        if (level->dirty[base + victim]) {
+            level->writebacks++;
+            if (id != CACHE_L2 && cache->levels[CACHE_L2].size != 0) {
+                cacheLookup(cache, CACHE_L2, pc, (level->tags[base + victim] - 1) << level->lineShift, 1);
+            }
+        }
+    }
+    level->tags[base + victim] = tag;
+    level->stamps[base + victim] = level->clock;
+    level->dirty[base + victim] = (u8)isWrite;
+    return 0;
+}
+
+// L1 (if modelled) then L2 on a miss
+static void cacheAccess(CacheSim *cache, CacheLevelId id, u32 pc, u32 addr, int isWrite) {
+    if (cache->levels[id].size != 0 && cacheLookup(cache, id, pc, addr, isWrite)) {
+        return;
+    }
+    if (cache->levels[CACHE_L2].size != 0) {
+        // The L1 fill is a read - its dirty bit is set there
+        cacheLookup(cache, CACHE_L2, pc, addr, (cache->levels[id].size != 0) ? 0 : isWrite);
+    }
+}
+
+// Sequential instructions [startPc, endPc] - one access per line touched
+void cacheFetch(rv32iHart_t *cpu, u32 startPc, u32 endPc) {
+    CacheSim *cache = cpu->cache;
+    const CacheLevel *level = &cache->levels[(cache->levels[CACHE_L1I].size != 0) ? CACHE_L1I : CACHE_L2];
+    if (level->size == 0) {
+        return;
+    }
+    u32 shift = level->lineShift;
+    for (u32 line=(startPc >> shift); line<=(endPc >> shift); ++line) {
+        u32 addr = (line << shift);
+        cacheAccess(cache, CACHE_L1I, (addr < startPc) ? startPc : addr, addr, 0);
+    }
+}
+
+void cacheData(rv32iHart_t *cpu, u32 pc, u32 addr, int isWrite) {
+    cacheAccess(cpu->cache, CACHE_L1D, pc, addr, isWrite);
+}
+
+static void printCounters(FILE *out, const CacheCounters *counters) {
+    u64 accesses = counters->hits + counters->misses;
+    fprintf(out, "%12llu %12llu %7.2f%% %12llu", (unsigned long long)counters->hits,
+        (unsigned long long)counters->misses, accesses ? (100.0 * (double)counters->misses / (double)accesses) : 0.0,
+        (unsigned long long)counters->evictions);
+}
+
+void cacheReport(rv32iHart_t *cpu, FILE *out) {
+    CacheSim *cache = cpu->cache;
+    if (cache == NULL) {
+        return;
+    }
+    fprintf(out, "Cache model:%10s %12s %12s %8s %12s %12s\n", "", "hits", "misses", "miss", "evictions",
+        "writebacks");
+    for (u32 i=0; i<CACHE_LEVEL_COUNT; ++i) {
+        CacheLevel *level = &cache->levels[i];
+        if (level->size == 0) {
+            continue;
+        }
+        fprintf(out, "  %-3s %6uKB %2u-way %4uB %-6s ", g_cacheLevelNames[i], level->size / KB_MULTIPLIER,
+            level->ways, level->lineSize, g_cachePolicyNames[level->policy]);
+        printCounters(out, &level->total);
+        fprintf(out, " %12llu\n", (unsigned long long)level->writebacks);
+    }
+    fprintf(out, "Per PC region:\n");
+    for (u32 region=0; region<cache->regionCount; ++region) {
+        for (u32 i=0; i<CACHE_LEVEL_COUNT; ++i) {
+            const CacheCounters *counters = &cache->regions[(region * CACHE_LEVEL_COUNT) + i];
+            if (counters->hits == 0 && counters->misses == 0) {
+                continue;
+            }
+            u32 start = region << cache->regionShift;
+            // The last region also collects any PC outside guest memory
+            u32 end = (region == cache->regionCount - 1) ? 0xffffffff : (start + (1u << cache->regionShift) - 1);
+            fprintf(out, "  0x%08x-0x%08x %-3s ", start, end, g_cacheLevelNames[i]);
+            printCounters(out, counters);
+            fprintf(out, "\n");
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include "risa.h"
+
+#define CACHE_DEFAULT_REGION    (KB_MULTIPLIER * 4)
+// Longest sequential run the fetch models take in one call (retireBlock() splits longer ones)
+#define CACHE_MAX_FETCH_RUN     (KB_MULTIPLIER * 64)
+
+typedef enum {
+    CACHE_L1I = 0,
+    CACHE_L1D,
+    CACHE_L2,           // Unified - backs both L1s
+    CACHE_LEVEL_COUNT
+} CacheLevelId;
+
+typedef enum {
+    CACHE_POLICY_LRU = 0,
+    CACHE_POLICY_FIFO,
+    CACHE_POLICY_RANDOM
+} CachePolicy;
+
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+} CacheCounters;
+
+typedef struct {
+    u32             size;           // 0 if this level isn't modelled
+    u32             ways;
+    u32             lineSize;
+    u32             policy;         // CachePolicy
+    u32             sets;
+    u32             lineShift;
+    u32             *tags;          // [sets * ways] line number + 1 (0 for an invalid way)
+    u32             *stamps;        // Last use (LRU) or fill (FIFO) time
+    u8              *dirty;
+    u32             clock;
+    u64             writebacks;     // Dirty evictions written to the next level
+    CacheCounters   total;
+} CacheLevel;
+
+// Write-back/write-allocate hierarchy - fetches are counted once per line per sequential run, not per instruction
+struct CacheSim {
+    CacheLevel      levels[CACHE_LEVEL_COUNT];
+    u32             regionShift;    // Stats are kept per (1 << regionShift) bytes of PC
+    u32             regionCount;
+    CacheCounters   *regions;       // [regionCount][CACHE_LEVEL_COUNT]
+    u32             rng;            // CACHE_POLICY_RANDOM victim selection
+};
+
+// Attach a hierarchy from "spec" (i.e. "l1i:32k:4:64:lru,l1d:32k:8:64,l2:256k:8:64:fifo,region:1k") - returns 0,
+// EINVAL (bad spec) or ENOMEM
+int cacheCreate(rv32iHart_t *cpu, const char *spec);
+void cacheFree(rv32iHart_t *cpu);
+void cacheFetch(rv32iHart_t *cpu, u32 startPc, u32 endPc);
+void cacheData(rv32iHart_t *cpu, u32 pc, u32 addr, int isWrite);
+void cacheReport(rv32iHart_t *cpu, FILE *out);
+
+#endif // CACHE_H
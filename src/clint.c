@@ -0,0 +1,97 @@
+#include "clint.h"
+#include "events.h"
+
+// mtime runs at one tick per cycle - nothing to do until mtimecmp is reached (see EVENT_CLINT_TIMER)
+u64 clintMtime(rv32iHart_t *cpu) {
+    return cpu->cycleCounter + cpu->clint.mtimeOffset;
+}
+
+void clintEnable(rv32iHart_t *cpu, u32 base) {
+    cpu->clint.base = base;
+    cpu->clint.size = CLINT_SIZE;
+    cpu->clint.msip = 0;
+    cpu->clint.mtimecmp = UINT64_MAX;
+    cpu->clint.mtimeOffset = 0;
+}
+
+void clintUpdateTimer(rv32iHart_t *cpu) {
+    if (cpu->clint.size == 0) {
+        return;
+    }
+    u64 mtime = clintMtime(cpu);
+    if (mtime >= cpu->clint.mtimecmp) {
+        eventCancel(cpu, EVENT_CLINT_TIMER);
+        if (!(cpu->trap.mip & MIP_MTIP)) {
+            cpu->trap.mip |= MIP_MTIP;
+            EVENTS_RECHECK(cpu);
+        }
+        return;
+    }
+    cpu->trap.mip &= ~MIP_MTIP;
+    // mtime set behind the cycle count can put mtimecmp past the end of the cycle count - never due then
+    u64 delta = cpu->clint.mtimecmp - mtime;
+    eventSchedule(cpu, EVENT_CLINT_TIMER, (delta > UINT64_MAX - cpu->cycleCounter) ? UINT64_MAX :
+        (cpu->cycleCounter + delta));
+}
+
+// 32-bit register containing "offset" (unmapped offsets read as zero)
+static u32 clintReadWord(rv32iHart_t *cpu, u32 offset) {
+    switch (offset) {
+        case CLINT_MSIP:            { return cpu->clint.msip;                           }
+        case CLINT_MTIMECMP:        { return (u32)cpu->clint.mtimecmp;                  }
+        case CLINT_MTIMECMP + 4:    { return (u32)(cpu->clint.mtimecmp >> 32);          }
+        case CLINT_MTIME:           { return (u32)clintMtime(cpu);                      }
+        case CLINT_MTIME + 4:       { return (u32)(clintMtime(cpu) >> 32);              }
+        default:                    { return 0;                                         }
+    }
+}
+
+static void clintWriteWord(rv32iHart_t *cpu, u32 offset, u32 value) {
+    switch (offset) {
+        case CLINT_MSIP: {
+            cpu->clint.msip = value & 0x1;
+            if (cpu->clint.msip) { cpu->trap.mip |= MIP_MSIP;  }
+            else                 { cpu->trap.mip &= ~MIP_MSIP; }
+            EVENTS_RECHECK(cpu);
+            return;
+        }
+        case CLINT_MTIMECMP: {
+            cpu->clint.mtimecmp = (cpu->clint.mtimecmp & 0xffffffff00000000ULL) | value;
+            break;
+        }
+        case CLINT_MTIMECMP + 4: {
+            cpu->clint.mtimecmp = (cpu->clint.mtimecmp & 0xffffffffULL) | ((u64)value << 32);
+            break;
+        }
+        case CLINT_MTIME: {
+            u64 mtime = (clintMtime(cpu) & 0xffffffff00000000ULL) | value;
+            cpu->clint.mtimeOffset = mtime - cpu->cycleCounter;
+            break;
+        }
+        case CLINT_MTIME + 4: {
+            u64 mtime = (clintMtime(cpu) & 0xffffffffULL) | ((u64)value << 32);
+            cpu->clint.mtimeOffset = mtime - cpu->cycleCounter;
+            break;
+        }
+        default: {
+            return;
+        }
+    }
+    clintUpdateTimer(cpu);
+}
+
+u32 clintLoad(rv32iHart_t *cpu, u32 addr, u32 width) {
+    u32 offset = addr - cpu->clint.base;
+    u32 shift = (offset & 0x3) * 8;
+    u32 word = clintReadWord(cpu, offset & ~0x3) >> shift;
+    return (width == 4) ? word : (word & ((1u << (width * 8)) - 1));
+}
+
+// Sub-word stores merge into the containing register
+void clintStore(rv32iHart_t *cpu, u32 addr, u32 width, u32 value) {
+    u32 offset = addr - cpu->clint.base;
+    u32 shift = (offset & 0x3) * 8;
+    u32 mask = ((width == 4) ? 0xffffffff : ((1u << (width * 8)) - 1)) << shift;
+    u32 word = clintReadWord(cpu, offset & ~0x3);
+    clintWriteWord(cpu, offset & ~0x3, (word & ~mask) | ((value << shift) & mask));
+}
@@ -0,0 +1,24 @@
+#ifndef CLINT_H
+#define CLINT_H
+
+#include "risa.h"
+
+// SiFive-compatible CLINT register layout (single hart)
+#define CLINT_MSIP              0x0000
+#define CLINT_MTIMECMP          0x4000
+#define CLINT_MTIME             0xbff8
+#define CLINT_SIZE              0x10000
+#define DEFAULT_CLINT_BASE      RISA_CLINT_DEFAULT_BASE
+
+// Guest address inside the CLINT (size is 0 while it's disabled)
+#define CLINT_HIT(cpu, addr)    ((u32)((addr) - (cpu)->clint.base) < (cpu)->clint.size)
+
+void clintEnable(rv32iHart_t *cpu, u32 base);
+u64 clintMtime(rv32iHart_t *cpu);
+// Accesses of "width" (1/2/4) bytes - loads return the zero-extended value
+u32 clintLoad(rv32iHart_t *cpu, u32 addr, u32 width);
+void clintStore(rv32iHart_t *cpu, u32 addr, u32 width, u32 value);
+// Update mip.MTIP and (re)schedule the timer event from mtime/mtimecmp
+void clintUpdateTimer(rv32iHart_t *cpu);
+
+#endif // CLINT_H
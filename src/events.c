@@ -0,0 +1,162 @@
+#include "events.h"
+#include "clint.h"
+#include "idle.h"
+#include "gdbserver.h"
+#include "replay.h"
+
+static void eventSwap(DeviceEvent *a, DeviceEvent *b) {
+    DeviceEvent tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void eventSiftUp(EventQueue *queue, u32 i) {
+    while (i > 0 && queue->heap[(i - 1) / 2].when > queue->heap[i].when) {
+        eventSwap(&queue->heap[(i - 1) / 2], &queue->heap[i]);
+        i = (i - 1) / 2;
+    }
+}
+
+static void eventSiftDown(EventQueue *queue, u32 i) {
+    for (;;) {
+        u32 smallest = i;
+        u32 left = (2 * i) + 1;
+        u32 right = left + 1;
+        if (left < queue->count && queue->heap[left].when < queue->heap[smallest].when)     { smallest = left;  }
+        if (right < queue->count && queue->heap[right].when < queue->heap[smallest].when)   { smallest = right; }
+        if (smallest == i) {
+            return;
+        }
+        eventSwap(&queue->heap[smallest], &queue->heap[i]);
+        i = smallest;
+    }
+}
+
+static void eventRemoveAt(EventQueue *queue, u32 i) {
+    queue->count--;
+    if (i == queue->count) {
+        return;
+    }
+    queue->heap[i] = queue->heap[queue->count];
+    eventSiftUp(queue, i);
+    eventSiftDown(queue, i);
+}
+
+static void eventsUpdateNext(rv32iHart_t *cpu) {
+    cpu->nextEventCycle = (cpu->events.count != 0) ? cpu->events.heap[0].when : UINT64_MAX;
+}
+
+// nextEventCycle is only ever lowered here (an early eventsProcess() is harmless, a late one isn't)
+void eventCancel(rv32iHart_t *cpu, EventSource source) {
+    EventQueue *queue = &cpu->events;
+    for (u32 i=0; i<queue->count; ++i) {
+        if (queue->heap[i].source == (u32)source) {
+            eventRemoveAt(queue, i);
+            break;
+        }
+    }
+}
+
+void eventSchedule(rv32iHart_t *cpu, EventSource source, u64 when) {
+    EventQueue *queue = &cpu->events;
+    eventCancel(cpu, source);
+    queue->heap[queue->count].when = when;
+    queue->heap[queue->count].source = source;
+    eventSiftUp(queue, queue->count++);
+    if (when < cpu->nextEventCycle) {
+        cpu->nextEventCycle = when;
+    }
+}
+
+// Next interrupt period boundary after the current cycle
+static u64 nextIntPeriod(rv32iHart_t *cpu) {
+    return ((cpu->cycleCounter / cpu->intPeriodVal) + 1) * cpu->intPeriodVal;
+}
+
+void eventsStart(rv32iHart_t *cpu) {
+    if (cpu->handlerProcs[RISA_INT_HANDLER_PROC] != NULL || cpu->handlers.interrupt != NULL) {
+        eventSchedule(cpu, EVENT_INT_HANDLER, nextIntPeriod(cpu));
+    }
+    else {
+        eventCancel(cpu, EVENT_INT_HANDLER);
+    }
+    if (cpu->opts.o_gdbEnabled) {
+        eventSchedule(cpu, EVENT_GDB_POLL, cpu->gdbFields.lastPollCycle + GDB_POLL_CYCLES);
+    }
+    clintUpdateTimer(cpu);
+    // Guest memory may have been reloaded between runs
+    cpu->idle.loopExit = 0;
+    // Pending interrupts may have been enabled between runs
+    EVENTS_RECHECK(cpu);
+}
+
+// Highest priority interrupt that is both pending and enabled (0 if none)
+static u32 pendingInterrupt(rv32iHart_t *cpu) {
+    if (!(cpu->trap.mstatus & MSTATUS_MIE)) {
+        return 0;
+    }
+    u32 pending = cpu->trap.mip & cpu->trap.mie;
+    if (pending & MIP_MEIP) { return IRQ_M_EXT;   }
+    if (pending & MIP_MSIP) { return IRQ_M_SOFT;  }
+    if (pending & MIP_MTIP) { return IRQ_M_TIMER; }
+    return 0;
+}
+
+void eventsProcess(rv32iHart_t *cpu) {
+    EventQueue *queue = &cpu->events;
+    IDLE_INVALIDATE(cpu);
+    while (queue->count != 0 && queue->heap[0].when <= cpu->cycleCounter) {
+        EventSource source = (EventSource)queue->heap[0].source;
+        eventRemoveAt(queue, 0);
+        switch (source) {
+            case EVENT_INT_HANDLER: {
+                // Played back callbacks come from the log (EVENT_REPLAY) - just keep the period going
+                if (cpu->replayMode != REPLAY_PLAYBACK) {
+                    replayHandlerBegin(cpu);
+                    if (cpu->handlerProcs[RISA_INT_HANDLER_PROC] != NULL) {
+                        cpu->handlerProcs[RISA_INT_HANDLER_PROC](cpu);
+                    }
+                    if (cpu->handlers.interrupt != NULL) {
+                        HANDLER_CALL(cpu, interrupt, risaHandlerInterrupt, cpu->cycleCounter);
+                    }
+                    replayHandlerEnd(cpu, REPLAY_REC_INTERRUPT, 1);
+                }
+                eventSchedule(cpu, EVENT_INT_HANDLER, nextIntPeriod(cpu));
+                break;
+            }
+            case EVENT_GDB_POLL: {
+                // Check for gdb attaching or sending Ctrl-C (stops before the next instruction)
+                if ((cpu->cycleCounter - cpu->gdbFields.lastPollCycle) >= GDB_POLL_CYCLES) {
+                    gdbserverPoll(cpu);
+                }
+                eventSchedule(cpu, EVENT_GDB_POLL, cpu->gdbFields.lastPollCycle + GDB_POLL_CYCLES);
+                break;
+            }
+            case EVENT_CLINT_TIMER: {
+                clintUpdateTimer(cpu);
+                break;
+            }
+            case EVENT_REPLAY: {
+                replayInterrupt(cpu);
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+    eventsUpdateNext(cpu);
+
+    // Take the interrupt before the next instruction (mepc is where execution resumes after MRET)
+    u32 code = pendingInterrupt(cpu);
+    if (code == 0) {
+        return;
+    }
+    u32 mie = (cpu->trap.mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0;
+    cpu->trap.mstatus = (cpu->trap.mstatus & ~(MSTATUS_MIE | MSTATUS_MPIE)) | mie | MSTATUS_MPP;
+    cpu->trap.mepc = cpu->pc;
+    cpu->trap.mcause = MCAUSE_INTERRUPT | code;
+    cpu->trap.mtval = 0;
+    cpu->pc = (cpu->trap.mtvec & ~0x3) + ((cpu->trap.mtvec & MTVEC_VECTORED) ? (4 * code) : 0);
+    RETIRE_BLOCK(cpu, cpu->trap.mepc - 4, cpu->pc);
+}
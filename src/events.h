@@ -0,0 +1,20 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include "risa.h"
+
+// Queue "source" to fire once cycleCounter reaches "when" (replaces any pending event from the same source)
+void eventSchedule(rv32iHart_t *cpu, EventSource source, u64 when);
+void eventCancel(rv32iHart_t *cpu, EventSource source);
+
+// (Re)schedule the periodic sources from the current options/handlers - call before running the hart
+void eventsStart(rv32iHart_t *cpu);
+
+// Fire due events and take any enabled pending interrupt (runHart() calls this once nextEventCycle is reached) - an
+// unmapped trap vector faults on its fetch
+void eventsProcess(rv32iHart_t *cpu);
+
+// Force an interrupt check after the current instruction (i.e. mstatus/mie/mip changed)
+#define EVENTS_RECHECK(cpu) ((cpu)->nextEventCycle = 0)
+
+#endif // EVENTS_H
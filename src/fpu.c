@@ -0,0 +1,444 @@
+#include <math.h>
+#include <fenv.h>
+#include "risa.h"
+#include "fpu.h"
+
+// RV32F is executed directly on the host FPU (i.e. SSE scalar ops on x86-64) in round-to-nearest-even, and
+// host exception flags are accumulated lazily into fflags (only read back on CSR access). The remaining
+// cases where host and RISC-V results differ are handled precisely here:
+//  - Static/dynamic rounding modes other than RNE (host rounding mode is switched around the op)
+//  - RMM (no host equivalent - computed in double precision then rounded ties-away)
+//  - NaN results (RISC-V always produces the canonical NaN)
+//  - Float to int conversions (RISC-V saturates instead of returning the x86 "integer indefinite" value)
+//  - FMIN/FMAX/compares (signed zero and signaling NaN rules)
+// NOTE: There is no D extension, so NaN-boxing of narrower values never applies.
+
+#define FP_CANONICAL_NAN    0x7fc00000
+#define FP_SIGN_BIT         0x80000000
+#define FP_QUIET_BIT        0x00400000
+#define FP_EXP_MASK         0x7f800000
+#define FP_MANT_MASK        0x007fffff
+
+typedef enum {
+    FPU_OP_ADD,
+    FPU_OP_SUB,
+    FPU_OP_MUL,
+    FPU_OP_DIV,
+    FPU_OP_SQRT,
+    FPU_OP_FMADD,
+    FPU_OP_FMSUB,
+    FPU_OP_FNMSUB,
+    FPU_OP_FNMADD
+} FpuOps;
+
+typedef union {
+    u32     u;
+    float   f;
+} FpBits;
+
+static inline float fpuGet(rv32iHart_t *cpu, u32 reg) {
+    FpBits bits;
+    bits.u = cpu->fregFile[reg];
+    return bits.f;
+}
+
+static inline void fpuSet(rv32iHart_t *cpu, u32 reg, float val) {
+    FpBits bits;
+    bits.f = val;
+    cpu->fregFile[reg] = (val != val) ? FP_CANONICAL_NAN : bits.u;
+}
+
+static inline int fpuIsNan(u32 bits) {
+    return ((bits & FP_EXP_MASK) == FP_EXP_MASK) && (bits & FP_MANT_MASK);
+}
+
+static inline int fpuIsSignalingNan(u32 bits) {
+    return fpuIsNan(bits) && !(bits & FP_QUIET_BIT);
+}
+
+// Resolve the instruction rounding mode (i.e. DYN reads fcsr.frm) - returns -1 if reserved
+static inline int fpuResolveRm(rv32iHart_t *cpu, u32 rm) {
+    if (rm == FRM_DYN) {
+        rm = (cpu->fcsr >> FCSR_FRM_SHIFT) & FCSR_FRM_MASK;
+    }
+    return (rm <= FRM_RMM) ? (int)rm : -1;
+}
+
+static u32 fpuHostFlags(void) {
+    int except = fetestexcept(FE_ALL_EXCEPT);
+    u32 fflags = 0;
+#ifdef FE_INEXACT
+    if (except & FE_INEXACT)    { fflags |= FFLAG_NX; }
+#endif
+#ifdef FE_UNDERFLOW
+    if (except & FE_UNDERFLOW)  { fflags |= FFLAG_UF; }
+#endif
+#ifdef FE_OVERFLOW
+    if (except & FE_OVERFLOW)   { fflags |= FFLAG_OF; }
+#endif
+#ifdef FE_DIVBYZERO
+    if (except & FE_DIVBYZERO)  { fflags |= FFLAG_DZ; }
+#endif
+#ifdef FE_INVALID
+    if (except & FE_INVALID)    { fflags |= FFLAG_NV; }
+#endif
+    return fflags;
+}
+
+static int fpuHostRounding(int rm) {
+    switch (rm) {
+        case FRM_RTZ: return FE_TOWARDZERO;
+        case FRM_RDN: return FE_DOWNWARD;
+        case FRM_RUP: return FE_UPWARD;
+        default:      return FE_TONEAREST;
+    }
+}
+
+// Volatile temporaries keep the compiler from moving the op across the host rounding mode switch
+static float fpuCompute(FpuOps op, float x, float y, float z) {
+    volatile float a = x, b = y, c = z;
+    volatile float res;
+    switch (op) {
+        case FPU_OP_ADD:    { res = a + b;              break; }
+        case FPU_OP_SUB:    { res = a - b;              break; }
+        case FPU_OP_MUL:    { res = a * b;              break; }
+        case FPU_OP_DIV:    { res = a / b;              break; }
+        case FPU_OP_SQRT:   { res = sqrtf(a);           break; }
+        case FPU_OP_FMADD:  { res = fmaf(a, b, c);      break; }
+        case FPU_OP_FMSUB:  { res = fmaf(a, b, -c);     break; }
+        case FPU_OP_FNMSUB: { res = fmaf(-a, b, c);     break; }
+        case FPU_OP_FNMADD: { res = fmaf(-a, b, -c);    break; }
+        default:            { res = NAN;                break; }
+    }
+    return res;
+}
+
+static double fpuComputeDouble(FpuOps op, double a, double b, double c) {
+    switch (op) {
+        case FPU_OP_ADD:    return a + b;
+        case FPU_OP_SUB:    return a - b;
+        case FPU_OP_MUL:    return a * b;
+        case FPU_OP_DIV:    return a / b;
+        case FPU_OP_SQRT:   return sqrt(a);
+        case FPU_OP_FMADD:  return fma(a, b, c);
+        case FPU_OP_FMSUB:  return fma(a, b, -c);
+        case FPU_OP_FNMSUB: return fma(-a, b, c);
+        case FPU_OP_FNMADD: return fma(-a, b, -c);
+        default:            return NAN;
+    }
+}
+
+// Round a double to single-precision with ties away from zero (RMM)
+static float fpuRoundRmm(double val) {
+    float nearest = (float)val;
+    if ((double)nearest == val || isinf(nearest) || isnan(val)) {
+        return nearest;
+    }
+    // Only an exact tie can differ from RNE - pick the neighbour with the larger magnitude
+    float other = nextafterf(nearest, (val > (double)nearest) ? INFINITY : -INFINITY);
+    if (fabs((double)other - val) == fabs((double)nearest - val)) {
+        return (fabsf(other) > fabsf(nearest)) ? other : nearest;
+    }
+    return nearest;
+}
+
+// Narrow an exactly-representable double to single-precision using a RISC-V rounding mode
+static float fpuNarrow(double val, int rm) {
+    switch (rm) {
+        case FRM_RNE: {
+            return (float)val;
+        }
+        case FRM_RMM: {
+            return fpuRoundRmm(val);
+        }
+        default: {
+            volatile double in = val;
+            volatile float res;
+            fesetround(fpuHostRounding(rm));
+            res = (float)in;
+            fesetround(FE_TONEAREST);
+            return res;
+        }
+    }
+}
+
+static int fpuArith(rv32iHart_t *cpu, const DecodedInst *d, FpuOps op, u32 rmField) {
+    int rm = fpuResolveRm(cpu, rmField);
+    float a = fpuGet(cpu, d->rs1);
+    float b = fpuGet(cpu, d->rs2);
+    float c = fpuGet(cpu, GET_RS3(d->inst));
+    float res;
+    switch (rm) {
+        case FRM_RNE: { // Common case - host already runs in RNE
+            switch (op) {
+                case FPU_OP_ADD:    { res = a + b;              break; }
+                case FPU_OP_SUB:    { res = a - b;              break; }
+                case FPU_OP_MUL:    { res = a * b;              break; }
+                case FPU_OP_DIV:    { res = a / b;              break; }
+                default:            { res = fpuCompute(op, a, b, c); break; }
+            }
+            break;
+        }
+        case FRM_RTZ:
+        case FRM_RDN:
+        case FRM_RUP: {
+            fesetround(fpuHostRounding(rm));
+            res = fpuCompute(op, a, b, c);
+            fesetround(FE_TONEAREST);
+            break;
+        }
+        case FRM_RMM: {
+            res = fpuRoundRmm(fpuComputeDouble(op, a, b, c));
+            break;
+        }
+        default: {
+            return EILSEQ;
+        }
+    }
+    fpuSet(cpu, d->rd, res);
+    return 0;
+}
+
+// Float to (unsigned) int with RISC-V saturation semantics
+static u32 fpuToInt(rv32iHart_t *cpu, float val, int rm, int isUnsigned) {
+    double in = (double)val;
+    double res;
+    if (val != val) {
+        cpu->fcsr |= FFLAG_NV;
+        return isUnsigned ? 0xffffffff : 0x7fffffff;
+    }
+    switch (rm) {
+        case FRM_RTZ: { res = trunc(in);        break; }
+        case FRM_RDN: { res = floor(in);        break; }
+        case FRM_RUP: { res = ceil(in);         break; }
+        case FRM_RMM: { res = round(in);        break; }
+        default:      { res = nearbyint(in);    break; }
+    }
+    if (isUnsigned) {
+        if (res < 0.0) {
+            cpu->fcsr |= FFLAG_NV;
+            return 0;
+        }
+        if (res > 4294967295.0) {
+            cpu->fcsr |= FFLAG_NV;
+            return 0xffffffff;
+        }
+        if (res != in) { cpu->fcsr |= FFLAG_NX; }
+        return (u32)res;
+    }
+    if (res < -2147483648.0) {
+        cpu->fcsr |= FFLAG_NV;
+        return 0x80000000;
+    }
+    if (res > 2147483647.0) {
+        cpu->fcsr |= FFLAG_NV;
+        return 0x7fffffff;
+    }
+    if (res != in) { cpu->fcsr |= FFLAG_NX; }
+    return (u32)(s32)res;
+}
+
+static u32 fpuClassify(u32 bits) {
+    u32 sign = bits & FP_SIGN_BIT;
+    u32 exp  = bits & FP_EXP_MASK;
+    u32 mant = bits & FP_MANT_MASK;
+    if (exp == FP_EXP_MASK) {
+        if (mant == 0) {
+            return sign ? (1 << 0) : (1 << 7);  // -inf / +inf
+        }
+        return (mant & FP_QUIET_BIT) ? (1 << 9) : (1 << 8); // qNaN / sNaN
+    }
+    if (exp == 0) {
+        if (mant == 0) {
+            return sign ? (1 << 3) : (1 << 4);  // -0 / +0
+        }
+        return sign ? (1 << 2) : (1 << 5);      // -subnormal / +subnormal
+    }
+    return sign ? (1 << 1) : (1 << 6);          // -normal / +normal
+}
+
+static void fpuMinMax(rv32iHart_t *cpu, const DecodedInst *d, int isMax) {
+    u32 aBits = cpu->fregFile[d->rs1];
+    u32 bBits = cpu->fregFile[d->rs2];
+    float a = fpuGet(cpu, d->rs1);
+    float b = fpuGet(cpu, d->rs2);
+    u32 res;
+    if (fpuIsSignalingNan(aBits) || fpuIsSignalingNan(bBits)) {
+        cpu->fcsr |= FFLAG_NV;
+    }
+    if (fpuIsNan(aBits) && fpuIsNan(bBits)) {
+        res = FP_CANONICAL_NAN;
+    }
+    else if (fpuIsNan(aBits)) {
+        res = bBits;
+    }
+    else if (fpuIsNan(bBits)) {
+        res = aBits;
+    }
+    else if (a == b) { // Equal magnitude - only the sign of zero can differ (-0.0 < +0.0)
+        res = isMax ? (aBits & bBits) : (aBits | bBits);
+    }
+    else {
+        res = ((a < b) != isMax) ? aBits : bBits;
+    }
+    cpu->fregFile[d->rd] = res;
+}
+
+static u32 fpuCompare(rv32iHart_t *cpu, const DecodedInst *d, u32 funct3) {
+    u32 aBits = cpu->fregFile[d->rs1];
+    u32 bBits = cpu->fregFile[d->rs2];
+    float a = fpuGet(cpu, d->rs1);
+    float b = fpuGet(cpu, d->rs2);
+    if (fpuIsNan(aBits) || fpuIsNan(bBits)) {
+        // FEQ is a quiet compare (only signaling NaNs are invalid), FLT/FLE signal on any NaN
+        if (funct3 != 0x2 || fpuIsSignalingNan(aBits) || fpuIsSignalingNan(bBits)) {
+            cpu->fcsr |= FFLAG_NV;
+        }
+        return 0;
+    }
+    switch (funct3) {
+        case 0x0: return (a <= b) ? 1 : 0;
+        case 0x1: return (a < b)  ? 1 : 0;
+        default:  return (a == b) ? 1 : 0;
+    }
+}
+
+int fpuExecuteOp(rv32iHart_t *cpu, DecodedInst d) {
+    const u32 rd     = d.rd;
+    const u32 rs1    = d.rs1;
+    const u32 rs2    = d.rs2;
+    const u32 funct3 = d.funct3;
+    switch ((FtypeInstructions)d.ID) {
+        case FADD_S:  { // Single-precision addition
+            TRACE_F((cpu), d, "fadd.s", g_fregfileAliasLookup, g_fregfileAliasLookup);
+            return fpuArith(cpu, &d, FPU_OP_ADD, funct3);
+        }
+        case FSUB_S:  { // Single-precision subtraction
+            TRACE_F((cpu), d, "fsub.s", g_fregfileAliasLookup, g_fregfileAliasLookup);
+            return fpuArith(cpu, &d, FPU_OP_SUB, funct3);
+        }
+        case FMUL_S:  { // Single-precision multiplication
+            TRACE_F((cpu), d, "fmul.s", g_fregfileAliasLookup, g_fregfileAliasLookup);
+            return fpuArith(cpu, &d, FPU_OP_MUL, funct3);
+        }
+        case FDIV_S:  { // Single-precision division
+            TRACE_F((cpu), d, "fdiv.s", g_fregfileAliasLookup, g_fregfileAliasLookup);
+            return fpuArith(cpu, &d, FPU_OP_DIV, funct3);
+        }
+        case FSQRT_S: { // Single-precision square root
+            if (rs2 != 0) { return EILSEQ; }
+            TRACE_F((cpu), d, "fsqrt.s", g_fregfileAliasLookup, g_fregfileAliasLookup);
+            return fpuArith(cpu, &d, FPU_OP_SQRT, funct3);
+        }
+        case FSGNJ_S: { // Sign injection
+            u32 mag  = cpu->fregFile[rs1] & ~FP_SIGN_BIT;
+            u32 sign = cpu->fregFile[rs2] & FP_SIGN_BIT;
+            switch (funct3) {
+                case 0x0: { TRACE_F((cpu), d, "fsgnj.s",  g_fregfileAliasLookup, g_fregfileAliasLookup); break; }
+                case 0x1: { TRACE_F((cpu), d, "fsgnjn.s", g_fregfileAliasLookup, g_fregfileAliasLookup);
+                            sign ^= FP_SIGN_BIT; break; }
+                case 0x2: { TRACE_F((cpu), d, "fsgnjx.s", g_fregfileAliasLookup, g_fregfileAliasLookup);
+                            sign ^= cpu->fregFile[rs1] & FP_SIGN_BIT; break; }
+                default:  { return EILSEQ; }
+            }
+            cpu->fregFile[rd] = mag | sign;
+            return 0;
+        }
+        case FMINMAX_S: { // Minimum/maximum
+            if (funct3 > 0x1) { return EILSEQ; }
+            TRACE_F((cpu), d, (funct3 ? "fmax.s" : "fmin.s"), g_fregfileAliasLookup, g_fregfileAliasLookup);
+            fpuMinMax(cpu, &d, funct3);
+            return 0;
+        }
+        case FCVT_W_S: { // Convert float to (unsigned) word
+            int rm = fpuResolveRm(cpu, funct3);
+            if (rs2 > 0x1 || rm < 0) { return EILSEQ; }
+            TRACE_F((cpu), d, (rs2 ? "fcvt.wu.s" : "fcvt.w.s"), g_regfileAliasLookup, g_fregfileAliasLookup);
+            cpu->regFile[rd] = fpuToInt(cpu, fpuGet(cpu, rs1), rm, rs2);
+            return 0;
+        }
+        case FCVT_S_W: { // Convert (unsigned) word to float
+            int rm = fpuResolveRm(cpu, funct3);
+            if (rs2 > 0x1 || rm < 0) { return EILSEQ; }
+            TRACE_F((cpu), d, (rs2 ? "fcvt.s.wu" : "fcvt.s.w"), g_fregfileAliasLookup, g_regfileAliasLookup);
+            double in = rs2 ? (double)cpu->regFile[rs1] : (double)(s32)cpu->regFile[rs1];
+            fpuSet(cpu, rd, fpuNarrow(in, rm));
+            return 0;
+        }
+        case FMV_X_W: { // Move float bits to integer register / classify
+            if (rs2 != 0) { return EILSEQ; }
+            switch (funct3) {
+                case 0x0: {
+                    TRACE_F((cpu), d, "fmv.x.w", g_regfileAliasLookup, g_fregfileAliasLookup);
+                    cpu->regFile[rd] = cpu->fregFile[rs1];
+                    return 0;
+                }
+                case 0x1: {
+                    TRACE_F((cpu), d, "fclass.s", g_regfileAliasLookup, g_fregfileAliasLookup);
+                    cpu->regFile[rd] = fpuClassify(cpu->fregFile[rs1]);
+                    return 0;
+                }
+                default: {
+                    return EILSEQ;
+                }
+            }
+        }
+        case FCMP_S: { // Compare
+            static const char *cmpNames[] = { "fle.s", "flt.s", "feq.s" };
+            if (funct3 > 0x2) { return EILSEQ; }
+            TRACE_F((cpu), d, cmpNames[funct3], g_regfileAliasLookup, g_fregfileAliasLookup);
+            cpu->regFile[rd] = fpuCompare(cpu, &d, funct3);
+            return 0;
+        }
+        case FMV_W_X: { // Move integer register bits to float register
+            if (funct3 != 0x0 || rs2 != 0) { return EILSEQ; }
+            TRACE_F((cpu), d, "fmv.w.x", g_fregfileAliasLookup, g_regfileAliasLookup);
+            cpu->fregFile[rd] = cpu->regFile[rs1];
+            return 0;
+        }
+        default: {
+            return EILSEQ;
+        }
+    }
+}
+
+int fpuExecuteR4(rv32iHart_t *cpu, DecodedInst d) {
+    switch ((R4typeInstructions)d.ID) {
+        case FMADD_S:  { // (rs1 * rs2) + rs3
+            TRACE_R4((cpu), d, "fmadd.s");
+            return fpuArith(cpu, &d, FPU_OP_FMADD, d.funct3);
+        }
+        case FMSUB_S:  { // (rs1 * rs2) - rs3
+            TRACE_R4((cpu), d, "fmsub.s");
+            return fpuArith(cpu, &d, FPU_OP_FMSUB, d.funct3);
+        }
+        case FNMSUB_S: { // -(rs1 * rs2) + rs3
+            TRACE_R4((cpu), d, "fnmsub.s");
+            return fpuArith(cpu, &d, FPU_OP_FNMSUB, d.funct3);
+        }
+        case FNMADD_S: { // -(rs1 * rs2) - rs3
+            TRACE_R4((cpu), d, "fnmadd.s");
+            return fpuArith(cpu, &d, FPU_OP_FNMADD, d.funct3);
+        }
+        default: {
+            return EILSEQ;
+        }
+    }
+}
+
+u32 fpuReadFflags(rv32iHart_t *cpu) {
+    cpu->fcsr |= fpuHostFlags();
+    feclearexcept(FE_ALL_EXCEPT);
+    return cpu->fcsr & FCSR_FFLAGS_MASK;
+}
+
+void fpuWriteFflags(rv32iHart_t *cpu, u32 fflags) {
+    feclearexcept(FE_ALL_EXCEPT);
+    cpu->fcsr = (cpu->fcsr & ~FCSR_FFLAGS_MASK) | (fflags & FCSR_FFLAGS_MASK);
+}
+
+void fpuReset(rv32iHart_t *cpu) {
+    // Host flags raised before the run started don't belong to the guest
+    fesetround(FE_TONEAREST);
+    feclearexcept(FE_ALL_EXCEPT);
+}
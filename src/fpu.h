@@ -0,0 +1,15 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "risa.h"
+
+// Execute a decoded OP-FP/FMADD-family instruction - returns 0 on success, EILSEQ if invalid
+int fpuExecuteOp(rv32iHart_t *cpu, DecodedInst d);
+int fpuExecuteR4(rv32iHart_t *cpu, DecodedInst d);
+
+// fcsr.fflags accessors (folds in any pending host FPU exception flags)
+u32 fpuReadFflags(rv32iHart_t *cpu);
+void fpuWriteFflags(rv32iHart_t *cpu, u32 fflags);
+void fpuReset(rv32iHart_t *cpu);
+
+#endif // FPU_H
@@ -1,9 +1,24 @@
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/mman.h>
+#endif
 #include "risa.h"
 #include "socket.h"
 #include "minigdbstub.h"
 #include "gdbserver.h"
+#include "fpu.h"
+#include "memmap.h"
 
-void gdbserverInit(rv32iHart_t *cpu) {
+static const char g_gdbHexChars[] = "0123456789abcdef";
+
+static void gdbserverSendPacket(rv32iHart_t *cpu, const char *body);
+static void gdbserverWatchInit(rv32iHart_t *cpu);
+static void gdbserverReverseInit(rv32iHart_t *cpu);
+
+// Returns 0 (also when falling back to regular execution) or -1 if the server/session couldn't be set up
+int gdbserverInit(rv32iHart_t *cpu) {
     cpu->gdbFields.serverPort = 3333;
 
     if ((cpu->gdbFields.socketFd > 0) || (cpu->gdbFields.connectFd > 0)) {
@@ -11,9 +26,7 @@ void gdbserverInit(rv32iHart_t *cpu) {
     }
 
     if (startServer(cpu) < 0) {
-        printf(LOG_LINE_BREAK);
-        cleanupSimulator(cpu);
-        exit(-1);
+        return -1;
     }
 
     if (cpu->gdbFields.socketFd > 0) {
@@ -22,24 +35,599 @@ void gdbserverInit(rv32iHart_t *cpu) {
     else {
         LOG_W("Could not start GDB server. Falling back to regular simulator execution.\n");
         cpu->opts.o_gdbEnabled = 0;
+        return 0;
     }
-    return;
+
+    cpu->gdbFields.breakBitmap = (u8*)calloc(GDB_BREAK_BITMAP_SIZE(cpu->virtMemSize), sizeof(u8));
+    cpu->gdbFields.transport = (GdbTransport*)calloc(1, sizeof(GdbTransport));
+    if (cpu->gdbFields.breakBitmap == NULL || cpu->gdbFields.transport == NULL) {
+        LOG_E("Could not allocate GDB server buffers.\n");
+        return -1;
+    }
+
+    gdbserverWatchInit(cpu);
+    if (cpu->opts.o_gdbReverse) {
+        gdbserverReverseInit(cpu);
+    }
+
+    cpu->gdbFields.stopReason = GDB_STOP_ATTACH;
+    if (cpu->opts.o_gdbAttach) {
+        // Run free - gdbserverPoll() picks up the connection whenever gdb attaches
+        LOG_I("Running until GDB attaches.\n");
+        cpu->gdbFields.gdbFlags.dbgContinue = 1;
+        cpu->gdbFields.gdbFlags.runFree = 1;
+        return 0;
+    }
+    return (acceptClient(cpu) < 0) ? -1 : 0;
 }
 
-void gdbserverCall(rv32iHart_t *cpu) {
-    // Check gdb flags
-    if (cpu->gdbFields.gdbFlags.dbgBreak && cpu->pc == cpu->gdbFields.breakAddr) {
-        cpu->gdbFields.gdbFlags.dbgBreak = 0;
-        cpu->gdbFields.gdbFlags.dbgContinue = 0;
-        cpu->gdbFields.gdbFlags.dbgStep = 0;
+static void gdbserverFlush(rv32iHart_t *cpu) {
+    GdbTransport *t = cpu->gdbFields.transport;
+    if (t->txLen > 0) {
+        writeSocket(cpu->gdbFields.connectFd, t->txBuf, t->txLen);
+        t->txLen = 0;
     }
-    else if (cpu->gdbFields.gdbFlags.dbgStep) {
+}
+
+#ifndef _WIN32
+// Hart whose guest memory faults are watchpoint hits (per thread - each thread runs its own hart). The signal
+// actions themselves are process-wide, so faults anywhere else go back to the actions installed before ours.
+static THREAD_LOCAL rv32iHart_t *g_watchCpu = NULL;
+static struct sigaction g_prevSegvAction;
+static struct sigaction g_prevBusAction;
+
+// Page not written since the latest reverse execution checkpoint (i.e. still needs its pre-image saved)
+static int gdbserverPageClean(rv32iHart_t *cpu, u32 page) {
+    GdbReverse *rev = cpu->gdbFields.reverse;
+    if (rev == NULL || rev->count == 0) {
+        return 0;
+    }
+    u32 index = page / cpu->gdbFields.watch.pageSize;
+    return !(rev->checkpoints[rev->count - 1].dirtyPages[index >> 3] & (1 << (index & 0x7)));
+}
+
+// Clean pages are read-only, write watches leave a page readable, read/access watches need every access to fault
+static int gdbserverPageProtection(rv32iHart_t *cpu, u32 page) {
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    int prot = gdbserverPageClean(cpu, page) ? PROT_READ : (PROT_READ | PROT_WRITE);
+    for (u32 i=0; i<watch->count; ++i) {
+        GdbWatchpoint *point = &watch->points[i];
+        if (point->addr >= (page + watch->pageSize) || (point->addr + point->len) <= page) {
+            continue;
+        }
+        prot &= (point->type == GDB_WATCH_WRITE) ? ~PROT_WRITE : ~(PROT_READ | PROT_WRITE);
+    }
+    return prot;
+}
+
+// Copy-on-write for the latest checkpoint (page must be readable)
+static void gdbserverSavePage(rv32iHart_t *cpu, u32 addr) {
+    u32 page = addr & ~(cpu->gdbFields.watch.pageSize - 1);
+    if (gdbserverPageClean(cpu, page)) {
+        GdbCheckpoint *latest = &cpu->gdbFields.reverse->checkpoints[cpu->gdbFields.reverse->count - 1];
+        u32 index = page / cpu->gdbFields.watch.pageSize;
+        memcpy(latest->undoMem + page, (u8*)cpu->virtMem + page, cpu->gdbFields.watch.pageSize);
+        latest->dirtyPages[index >> 3] |= (u8)(1 << (index & 0x7));
+    }
+}
+
+static void gdbserverWatchFault(int sig, siginfo_t *info, void *context) {
+    rv32iHart_t *cpu = g_watchCpu;
+    u8 *hostAddr = (u8*)info->si_addr;
+    u8 *memBase = (cpu != NULL) ? (u8*)cpu->virtMem : NULL;
+    if (cpu == NULL || hostAddr < memBase || hostAddr >= (memBase + cpu->virtMemSize)) {
+        // Not guest memory - restore the previous action so the access faults as it would without GDB-mode
+        sigaction(sig, (sig == SIGBUS) ? &g_prevBusAction : &g_prevSegvAction, NULL);
+        return;
+    }
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    u32 guestAddr = (u32)(hostAddr - memBase);
+    u32 page = guestAddr & ~(watch->pageSize - 1);
+
+    // First write since the last checkpoint - save the page and retry (faults again if it's also watched)
+    if (gdbserverPageClean(cpu, page)) {
+        mprotect(memBase + page, watch->pageSize, PROT_READ | PROT_WRITE);
+        gdbserverSavePage(cpu, page);
+        mprotect(memBase + page, watch->pageSize, gdbserverPageProtection(cpu, page));
+        return;
+    }
+    if (watch->count == 0) {
+        sigaction(sig, (sig == SIGBUS) ? &g_prevBusAction : &g_prevSegvAction, NULL);
+        return;
+    }
+    // Let the access through and leave the exact address check to the next gdbserverCall()
+    mprotect(memBase + page, watch->pageSize, PROT_READ | PROT_WRITE);
+    u32 index = page / watch->pageSize;
+    if (watch->faultPageCount == 0) {
+        watch->faultAddr = guestAddr;
+        watch->faultPc = cpu->pc;
+        watch->faultFirst = watch->faultLast = index;
         cpu->gdbFields.gdbFlags.dbgContinue = 0;
-        cpu->gdbFields.gdbFlags.dbgStep = 0;
     }
-    else if (cpu->gdbFields.gdbFlags.dbgContinue) {
+    watch->faultFirst = (index < watch->faultFirst) ? index : watch->faultFirst;
+    watch->faultLast = (index > watch->faultLast) ? index : watch->faultLast;
+    watch->faultBitmap[index >> 3] |= (u8)(1 << (index & 0x7));
+    watch->faultPageCount++;
+}
+
+static void gdbserverWatchInit(rv32iHart_t *cpu) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = gdbserverWatchFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    struct sigaction prevSegv;
+    struct sigaction prevBus;
+    if (!cpu->virtMemMapped || sigaction(SIGSEGV, &action, &prevSegv) != 0 ||
+        sigaction(SIGBUS, &action, &prevBus) != 0) {
+        LOG_W("Could not set up guest memory fault handling - GDB watchpoints/reverse execution disabled.\n");
+        return;
+    }
+    // Another GDB-mode hart may have installed ours already
+    if (!(prevSegv.sa_flags & SA_SIGINFO) || prevSegv.sa_sigaction != gdbserverWatchFault) {
+        g_prevSegvAction = prevSegv;
+    }
+    if (!(prevBus.sa_flags & SA_SIGINFO) || prevBus.sa_sigaction != gdbserverWatchFault) {
+        g_prevBusAction = prevBus;
+    }
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    watch->pageSize = (u32)sysconf(_SC_PAGESIZE);
+    watch->faultBitmap = (u8*)calloc(((cpu->virtMemSize / watch->pageSize) >> 3) + 1, sizeof(u8));
+    if (watch->faultBitmap == NULL) {
+        LOG_W("Could not allocate guest memory fault state - GDB watchpoints/reverse execution disabled.\n");
+        watch->pageSize = 0;
+        return;
+    }
+    g_watchCpu = cpu;
+}
+
+static void gdbserverProtectPage(rv32iHart_t *cpu, u32 page) {
+    mprotect((u8*)cpu->virtMem + page, cpu->gdbFields.watch.pageSize, gdbserverPageProtection(cpu, page));
+}
+
+// Re-protect every page the fault handler let through since the last call (one pass over the recorded span)
+static void gdbserverProtectFaulted(rv32iHart_t *cpu) {
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    for (u32 index=watch->faultFirst; index<=watch->faultLast; ++index) {
+        if (watch->faultBitmap[index >> 3] & (1 << (index & 0x7))) {
+            watch->faultBitmap[index >> 3] &= (u8)~(1 << (index & 0x7));
+            gdbserverProtectPage(cpu, index * watch->pageSize);
+        }
+    }
+}
+
+static void gdbserverProtectWatched(rv32iHart_t *cpu) {
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    for (u32 i=0; i<watch->count; ++i) {
+        u32 first = watch->points[i].addr & ~(watch->pageSize - 1);
+        u32 last = (watch->points[i].addr + watch->points[i].len - 1) & ~(watch->pageSize - 1);
+        for (u32 page=first; page<=last; page+=watch->pageSize) {
+            gdbserverProtectPage(cpu, page);
+        }
+    }
+}
+
+// Re-apply protection for running the guest (i.e. after the stub or a checkpoint restore)
+static void gdbserverProtectAll(rv32iHart_t *cpu) {
+    GdbReverse *rev = cpu->gdbFields.reverse;
+    if (rev != NULL && rev->count > 0) {
+        // Everything read-only except pages already saved since the latest checkpoint
+        GdbCheckpoint *latest = &rev->checkpoints[rev->count - 1];
+        mprotect(cpu->virtMem, cpu->virtMemSize, PROT_READ);
+        for (u32 i=0; i<rev->pageCount; ++i) {
+            if (latest->dirtyPages[i >> 3] & (1 << (i & 0x7))) {
+                mprotect((u8*)cpu->virtMem + (i * cpu->gdbFields.watch.pageSize), cpu->gdbFields.watch.pageSize,
+                    PROT_READ | PROT_WRITE);
+            }
+        }
+    }
+    gdbserverProtectWatched(cpu);
+}
+
+// Stub (and 'm'/'M'/'X' packets) work on plain guest memory
+static void gdbserverUnprotectAll(rv32iHart_t *cpu) {
+    if (cpu->gdbFields.watch.count > 0 || (cpu->gdbFields.reverse != NULL && cpu->gdbFields.reverse->count > 0)) {
+        mprotect(cpu->virtMem, cpu->virtMemSize, PROT_READ | PROT_WRITE);
+    }
+}
+
+static int gdbserverFaultsHandled(rv32iHart_t *cpu) {
+    return g_watchCpu == cpu;
+}
+#else // --- windows (no guest memory fault handling)
+static void gdbserverSavePage(rv32iHart_t *cpu, u32 addr)    { (void)cpu; (void)addr; }
+static void gdbserverWatchInit(rv32iHart_t *cpu)             { (void)cpu;             }
+static void gdbserverProtectPage(rv32iHart_t *cpu, u32 page) { (void)cpu; (void)page; }
+static void gdbserverProtectFaulted(rv32iHart_t *cpu)        { (void)cpu;             }
+static void gdbserverProtectAll(rv32iHart_t *cpu)            { (void)cpu;             }
+static void gdbserverUnprotectAll(rv32iHart_t *cpu)          { (void)cpu;             }
+static int gdbserverFaultsHandled(rv32iHart_t *cpu)          { (void)cpu; return 0;   }
+#endif
+
+// Returns 0 on success, -1 if the range is invalid or the table is full, 1 if watchpoints aren't available
+static int gdbserverSetWatchpoint(rv32iHart_t *cpu, u8 type, u32 addr, u32 len, int set) {
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    if (!gdbserverFaultsHandled(cpu)) {
+        return 1;
+    }
+    if (len == 0 || ((u64)addr + len) > cpu->virtMemSize) {
+        return -1;
+    }
+    for (u32 i=0; i<watch->count; ++i) {
+        GdbWatchpoint *point = &watch->points[i];
+        if (point->addr == addr && point->len == len && point->type == type) {
+            if (!set) {
+                *point = watch->points[--watch->count];
+            }
+            return 0;
+        }
+    }
+    if (!set) {
+        return 0;
+    }
+    if (watch->count == GDB_MAX_WATCHPOINTS) {
+        return -1;
+    }
+    GdbWatchpoint point = { addr, len, type };
+    watch->points[watch->count++] = point;
+    return 0;
+}
+
+// Guest memory writes from gdb (M/X packets) - keep the reverse execution undo log complete
+static void gdbserverWriteGuest(rv32iHart_t *cpu, u32 addr, u8 data) {
+    if (cpu->gdbFields.reverse != NULL) {
+        gdbserverSavePage(cpu, addr);
+        // Edited history - the recorded inputs past this point may no longer apply
+        replayHistoryResume(cpu);
+    }
+    ACCESS_MEM_B(cpu->virtMem, addr) = data;
+}
+
+// --- Reverse execution (checkpoints + copy-on-write undo pages, deterministic re-execution) ---
+static void gdbserverReverseInit(rv32iHart_t *cpu) {
+    if (!gdbserverFaultsHandled(cpu)) {
+        LOG_W("Reverse execution needs guest memory fault handling - disabled.\n");
+        return;
+    }
+    if (cpu->replayMode != REPLAY_OFF) {
+        // Its input log is the one a replay log file would use
+        LOG_W("Reverse execution can't be combined with recording/replaying a log - disabled.\n");
+        return;
+    }
+    GdbReverse *rev = (GdbReverse*)calloc(1, sizeof(GdbReverse));
+    if (rev == NULL) {
+        LOG_W("Could not allocate reverse execution state - disabled.\n");
+        return;
+    }
+    rev->interval = GDB_REVERSE_START_INTERVAL;
+    rev->pageCount = (cpu->virtMemSize + cpu->gdbFields.watch.pageSize - 1) / cpu->gdbFields.watch.pageSize;
+    cpu->gdbFields.reverse = rev;
+    LOG_I("GDB reverse execution enabled.\n");
+}
+
+static void gdbserverFreeCheckpoint(rv32iHart_t *cpu, GdbCheckpoint *checkpoint) {
+    if (checkpoint->dirtyPages != NULL) { free(checkpoint->dirtyPages);                                }
+    if (checkpoint->undoMem    != NULL) { UNMAP_GUEST_MEM(checkpoint->undoMem, cpu->virtMemSize);      }
+    memset(checkpoint, 0, sizeof(GdbCheckpoint));
+}
+
+static void gdbserverDropCheckpoints(rv32iHart_t *cpu) {
+    GdbReverse *rev = cpu->gdbFields.reverse;
+    if (rev != NULL) {
+        while (rev->count > 0) {
+            gdbserverFreeCheckpoint(cpu, &rev->checkpoints[--rev->count]);
+        }
+        rev->mode = GDB_REPLAY_NONE;
+        replayFree(cpu);
+        cpu->replayMode = REPLAY_OFF;
+    }
+}
+
+// Release the server, session and debug state (safe to call if gdbserverInit() never ran)
+void gdbserverCleanup(rv32iHart_t *cpu) {
+    GdbFields *gdb = &cpu->gdbFields;
+    if (gdb->connectFd > 0) { closeClient(cpu);                             }
+    if (gdb->socketFd  > 0) { stopServer(cpu); gdb->socketFd = 0;           }
+    gdbserverDropCheckpoints(cpu);
+    if (gdb->reverse           != NULL) { free(gdb->reverse);           gdb->reverse = NULL;           }
+    if (gdb->breakBitmap       != NULL) { free(gdb->breakBitmap);       gdb->breakBitmap = NULL;       }
+    if (gdb->transport         != NULL) { free(gdb->transport);         gdb->transport = NULL;         }
+    if (gdb->watch.faultBitmap != NULL) { free(gdb->watch.faultBitmap); gdb->watch.faultBitmap = NULL; }
+#ifndef _WIN32
+    if (g_watchCpu == cpu) {
+        g_watchCpu = NULL;
+    }
+#endif
+}
+
+// Must be taken at an instruction boundary (i.e. from gdbserverCall) - caller re-applies protection
+static void gdbserverTakeCheckpoint(rv32iHart_t *cpu) {
+    GdbReverse *rev = cpu->gdbFields.reverse;
+
+    // Size the interval so replaying one interval stays within a few ms - replays step through
+    // gdbserverCall() so are slower than running free (assume 4x until a replay has been measured)
+    clock_t now = clock();
+    if (now > rev->runClockMark && cpu->cycleCounter > rev->runCycleMark) {
+        double rate = (double)(cpu->cycleCounter - rev->runCycleMark) * CLOCKS_PER_SEC
+            / (double)(now - rev->runClockMark);
+        rate = (rev->replayRate > 0.0) ? rev->replayRate : (rate / 4.0);
+        double interval = (rate * GDB_REVERSE_REPLAY_MS / 1000.0) / 2.0;   // Scan + seek pass
+        rev->interval = (interval < GDB_POLL_CYCLES) ? GDB_POLL_CYCLES
+            : ((interval > GDB_REVERSE_MAX_INTERVAL) ? GDB_REVERSE_MAX_INTERVAL : (u32)interval);
+    }
+    rev->runCycleMark = cpu->cycleCounter;
+    rev->runClockMark = now;
+
+    if (cpu->replay == NULL && replayStartHistory(cpu) != 0) {
+        LOG_W("Could not allocate reverse execution input log.\n");
+        return;
+    }
+    if (rev->count == GDB_MAX_CHECKPOINTS) {
+        // Oldest undo pages (and inputs) are only needed to go back past the oldest checkpoint
+        gdbserverFreeCheckpoint(cpu, &rev->checkpoints[0]);
+        memmove(&rev->checkpoints[0], &rev->checkpoints[1], sizeof(GdbCheckpoint) * (GDB_MAX_CHECKPOINTS - 1));
+        memset(&rev->checkpoints[--rev->count], 0, sizeof(GdbCheckpoint));
+        replayHistoryTrim(cpu, &rev->checkpoints[0].history);
+    }
+    GdbCheckpoint *checkpoint = &rev->checkpoints[rev->count];
+    void *undoMem = MAP_GUEST_MEM(cpu->virtMemSize);
+    checkpoint->dirtyPages = (u8*)calloc((rev->pageCount >> 3) + 1, sizeof(u8));
+    if (undoMem == MAP_GUEST_MEM_FAILED || checkpoint->dirtyPages == NULL) {
+        LOG_W("Could not allocate reverse execution checkpoint.\n");
+        checkpoint->undoMem = (undoMem == MAP_GUEST_MEM_FAILED) ? NULL : (u8*)undoMem;
+        gdbserverFreeCheckpoint(cpu, checkpoint);
         return;
     }
+    checkpoint->undoMem = (u8*)undoMem;
+    checkpoint->pc = cpu->pc;
+    memcpy(checkpoint->regFile, cpu->regFile, sizeof(cpu->regFile));
+    memcpy(checkpoint->fregFile, cpu->fregFile, sizeof(cpu->fregFile));
+    checkpoint->fcsr = (cpu->fcsr & ~FCSR_FFLAGS_MASK) | fpuReadFflags(cpu);
+    checkpoint->heapBreak = cpu->envFields.heapBreak;
+    checkpoint->trap = cpu->trap;
+    checkpoint->clint = cpu->clint;
+    checkpoint->events = cpu->events;
+    checkpoint->cycleCounter = cpu->cycleCounter;
+    replayHistoryMark(cpu, &checkpoint->history);
+    rev->count++;
+}
+
+// Latest checkpoint at or before "pos" - returns 0 if there is none
+static int gdbserverFindCheckpoint(GdbReverse *rev, u64 pos, u32 *index) {
+    for (u32 i=rev->count; i>0; --i) {
+        if (rev->checkpoints[i - 1].cycleCounter <= pos) {
+            *index = i - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Roll guest memory and hart state back to a checkpoint (later checkpoints are dropped)
+static void gdbserverRestoreCheckpoint(rv32iHart_t *cpu, u32 index) {
+    GdbReverse *rev = cpu->gdbFields.reverse;
+    const u32 pageSize = cpu->gdbFields.watch.pageSize;
+    if (cpu->replayMode == REPLAY_RECORD) {
+        rev->liveCycle = cpu->cycleCounter;
+    }
+    gdbserverUnprotectAll(cpu);
+    for (u32 i=rev->count; i>index; --i) {
+        GdbCheckpoint *checkpoint = &rev->checkpoints[i - 1];
+        for (u32 page=0; page<rev->pageCount; ++page) {
+            if (checkpoint->dirtyPages[page >> 3] & (1 << (page & 0x7))) {
+                memcpy((u8*)cpu->virtMem + (page * pageSize), checkpoint->undoMem + (page * pageSize), pageSize);
+            }
+        }
+        if ((i - 1) > index) {
+            gdbserverFreeCheckpoint(cpu, checkpoint);
+        }
+    }
+    rev->count = index + 1;
+
+    // Memory matches the checkpoint again - start a fresh undo log for it
+    GdbCheckpoint *checkpoint = &rev->checkpoints[index];
+    memset(checkpoint->dirtyPages, 0, (rev->pageCount >> 3) + 1);
+#ifndef _WIN32
+    madvise(checkpoint->undoMem, cpu->virtMemSize, MADV_DONTNEED);
+#endif
+    cpu->pc = checkpoint->pc;
+    memcpy(cpu->regFile, checkpoint->regFile, sizeof(cpu->regFile));
+    memcpy(cpu->fregFile, checkpoint->fregFile, sizeof(cpu->fregFile));
+    fpuReset(cpu);
+    cpu->fcsr = checkpoint->fcsr;
+    cpu->envFields.heapBreak = checkpoint->heapBreak;
+    cpu->trap = checkpoint->trap;
+    cpu->clint = checkpoint->clint;
+    cpu->events = checkpoint->events;
+    cpu->nextEventCycle = 0;
+    cpu->cycleCounter = checkpoint->cycleCounter;
+    replayHistoryRewind(cpu, &checkpoint->history);
+    rev->runCycleMark = cpu->cycleCounter;
+    rev->runClockMark = clock();
+    gdbserverProtectAll(cpu);
+}
+
+static void gdbserverReplaySeek(rv32iHart_t *cpu, u64 pos) {
+    GdbReverse *rev = cpu->gdbFields.reverse;
+    u32 index = 0;
+    gdbserverFindCheckpoint(rev, pos, &index);
+    gdbserverRestoreCheckpoint(cpu, index);
+    rev->mode = GDB_REPLAY_SEEK;
+    rev->replayEnd = pos;
+}
+
+// Advance the current scan/seek (restoring earlier checkpoints as needed) - returns 0 once it's done
+static int gdbserverReplayPosition(rv32iHart_t *cpu) {
+    GdbReverse *rev = cpu->gdbFields.reverse;
+    for (;;) {
+        switch (rev->mode) {
+            case GDB_REPLAY_STEP_SCAN: {
+                if (cpu->cycleCounter < rev->replayEnd) {
+                    rev->replayMark = cpu->cycleCounter;
+                    return 1;
+                }
+                gdbserverReplaySeek(cpu, rev->replayMark);
+                break;
+            }
+            case GDB_REPLAY_CONTINUE_SCAN: {
+                if (cpu->cycleCounter < rev->replayEnd) {
+                    if (GDB_BREAK_BIT_SET(cpu->gdbFields.breakBitmap, cpu->virtMemSize, cpu->pc)) {
+                        rev->replayMark = cpu->cycleCounter;
+                        rev->replayFound = 1;
+                    }
+                    return 1;
+                }
+                if (rev->replayFound) {
+                    gdbserverReplaySeek(cpu, rev->replayMark);
+                    break;
+                }
+                if (rev->scanIndex == 0) {
+                    // No breakpoint hit anywhere in the recorded history
+                    gdbserverRestoreCheckpoint(cpu, 0);
+                    rev->mode = GDB_REPLAY_NONE;
+                    strcpy(cpu->gdbFields.stopReply, "T05replaylog:begin;");
+                    cpu->gdbFields.stopReason = GDB_STOP_REPLY;
+                    return 0;
+                }
+                // Nothing in this interval - scan the one before it
+                rev->replayEnd = rev->checkpoints[rev->scanIndex].cycleCounter;
+                gdbserverRestoreCheckpoint(cpu, --rev->scanIndex);
+                break;
+            }
+            case GDB_REPLAY_SEEK: {
+                if (cpu->cycleCounter < rev->replayEnd) {
+                    return 1;
+                }
+                rev->mode = GDB_REPLAY_NONE;
+                return 0;
+            }
+            default: {
+                return 0;
+            }
+        }
+    }
+}
+
+// Called before every instruction while replaying - returns non-zero to keep executing
+static int gdbserverReplayStep(rv32iHart_t *cpu) {
+    GdbReverse *rev = cpu->gdbFields.reverse;
+    if (gdbserverReplayPosition(cpu)) {
+        rev->replayCount++;
+        return 1;
+    }
+    // Replay done - remember how fast it went for sizing later checkpoint intervals
+    clock_t elapsed = clock() - rev->replayClockMark;
+    if (elapsed > 0 && rev->replayCount > 0) {
+        rev->replayRate = (double)rev->replayCount * CLOCKS_PER_SEC / (double)elapsed;
+    }
+    return 0;
+}
+
+// Fills in the stop reply if the access overlaps a watchpoint of a matching type
+static int gdbserverWatchMatch(rv32iHart_t *cpu, u32 addr, u32 len, int isRead, int isWrite) {
+    static const char *watchNames[] = { "watch", "rwatch", "awatch" };
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    for (u32 i=0; i<watch->count; ++i) {
+        GdbWatchpoint *point = &watch->points[i];
+        if ((u64)addr >= ((u64)point->addr + point->len) || ((u64)addr + len) <= point->addr) {
+            continue;
+        }
+        if ((point->type == GDB_WATCH_WRITE && !isWrite) || (point->type == GDB_WATCH_READ && !isRead)) {
+            continue;
+        }
+        snprintf(cpu->gdbFields.stopReply, sizeof(cpu->gdbFields.stopReply), "T05%s:%x;",
+            watchNames[point->type - GDB_WATCH_WRITE], point->addr);
+        return 1;
+    }
+    return 0;
+}
+
+// Exact check of the access that faulted on a watched page - fills in the stop reply on a hit
+static int gdbserverWatchHit(rv32iHart_t *cpu) {
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    // The instruction is decoded again here rather than kept on the hart (its page may be read-protected itself)
+    u32 pcIndex = watch->faultPc / watch->pageSize;
+    int pcReadable = (gdbserverPageProtection(cpu, pcIndex * watch->pageSize) & PROT_READ) ||
+        (watch->faultBitmap[pcIndex >> 3] & (1 << (pcIndex & 0x7)));
+    const u8 *fetch = pcReadable ? memPeek(cpu, watch->faultPc, 4) : NULL;
+    u32 inst = (fetch != NULL) ? *(const u32*)fetch : 0;
+    switch (GET_OPCODE(inst)) {
+        case 0x03:   // Loads (LB/LH/LW/LBU/LHU)
+        case 0x07: { // FLW
+            u32 width = 1 << (GET_FUNCT3(inst) & 0x3);
+            // An integer load may have overwritten its own base register - fall back to the faulting address
+            u32 addr = (GET_OPCODE(inst) == 0x07 || GET_RD(inst) != GET_RS1(inst)) ?
+                cpu->regFile[GET_RS1(inst)] + ((s32)inst >> 20) : (watch->faultAddr & ~(width - 1));
+            return gdbserverWatchMatch(cpu, addr, width, 1, 0);
+        }
+        case 0x23:   // Stores (SB/SH/SW)
+        case 0x27: { // FSW
+            u32 width = 1 << (GET_FUNCT3(inst) & 0x3);
+            u32 addr = cpu->regFile[GET_RS1(inst)] +
+                ((s32)((GET_IMM_4_0(inst) | (GET_IMM_11_5(inst) << 5)) << 20) >> 20);
+            return gdbserverWatchMatch(cpu, addr, width, 0, 1);
+        }
+    }
+    if (inst == 0x00000073 && watch->hostAccessCount > 0) {
+        // Host-side access on the guest's behalf (ECALL) - the whole buffer(s) the syscall/accel op worked on
+        for (u32 i=0; i<watch->hostAccessCount; ++i) {
+            GdbHostAccess *access = &watch->hostAccess[i];
+            if (gdbserverWatchMatch(cpu, access->addr, access->len, !access->isWrite, access->isWrite)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    // Anything else (direction unknown) - just the faulting byte
+    return gdbserverWatchMatch(cpu, watch->faultAddr, 1, 1, 1);
+}
+
+void gdbserverCall(rv32iHart_t *cpu) {
+    GdbFields *gdb = &cpu->gdbFields;
+    GdbReverse *rev = gdb->reverse;
+    const int replaying = (rev != NULL && rev->mode != GDB_REPLAY_NONE);
+    if (rev != NULL && cpu->replayMode == REPLAY_PLAYBACK && cpu->cycleCounter >= rev->liveCycle) {
+        // Re-execution caught up with the recorded history - back to live inputs
+        replayHistoryResume(cpu);
+    }
+    // Re-executing recorded history comes through here every instruction to catch the switch above
+    const int rerun = (rev != NULL && cpu->replayMode == REPLAY_PLAYBACK);
+    if (gdb->watch.faultPageCount > 0) {
+        // Guest touched a watched page - only stop if the access hit a watched range
+        if (!replaying && gdbserverWatchHit(cpu)) {
+            gdb->stopReason = GDB_STOP_REPLY;
+        }
+        gdbserverProtectFaulted(cpu);
+        gdb->watch.faultPageCount = 0;
+    }
+    if (rev != NULL && rev->checkpointDue) {
+        rev->checkpointDue = 0;
+        gdbserverTakeCheckpoint(cpu);
+        gdbserverProtectAll(cpu);
+    }
+    if (replaying) {
+        if (gdbserverReplayStep(cpu)) {
+            return;
+        }
+    }
+    else if (gdb->stopReason == GDB_STOP_TRAP) {
+        // Bookkeeping only (i.e. watch miss or checkpoint) - keep going unless stepping or on a breakpoint
+        gdb->gdbFlags.dbgContinue = gdb->gdbFlags.runFree;
+        if (!GDB_SHOULD_STOP(cpu)) {
+            gdb->gdbFlags.dbgContinue = !rerun;
+            return;
+        }
+    }
+
+    // Stopping (i.e. initial connection, completed step, breakpoint/watchpoint hit or end of a reverse step)
+    gdb->gdbFlags.dbgContinue = 0;
+    gdb->gdbFlags.runFree = 0;
+    gdb->gdbFlags.dbgStep = 0;
+    if (rev != NULL && rev->count == 0) {
+        // Start of the reverse execution history
+        gdbserverTakeCheckpoint(cpu);
+    }
+    gdbserverUnprotectAll(cpu);
 
     // Update regs
     u32 regs[REGISTER_COUNT+1];
@@ -54,20 +642,359 @@ void gdbserverCall(rv32iHart_t *cpu) {
     mgdbObj.regs = (char*)regs;
     mgdbObj.regsSize = sizeof(regs);
     mgdbObj.regsCount = REGISTER_COUNT;
-    if (cpu->cycleCounter > 0) {
-        mgdbObj.opts.o_signalOnEntry = 1;
+    switch (gdb->stopReason) {
+        case GDB_STOP_ATTACH: {
+            break;
+        }
+        case GDB_STOP_INTERRUPT:
+        case GDB_STOP_REPLY: {
+            // The stub itself only knows about plain SIGTRAP stops
+            gdbserverSendPacket(cpu, gdb->stopReply);
+            gdb->gdbFlags.swallowAck = 1;
+            break;
+        }
+        default: {
+            mgdbObj.opts.o_signalOnEntry = (cpu->cycleCounter > 0);
+            break;
+        }
     }
+    gdb->stopReason = GDB_STOP_TRAP;
     mgdbObj.opts.o_enableLogging = GDBLOG;
     mgdbObj.usrData = (void*)cpu;
 
     // Call into minigdbstub
     minigdbstubProcess(&mgdbObj);
+
+    // Push out anything still queued (e.g. the ack for the resuming c/s packet)
+    gdb->gdbFlags.muteOutput = 0;
+    gdbserverFlush(cpu);
+    if (rev != NULL) {
+        rev->runCycleMark = cpu->cycleCounter;
+        rev->runClockMark = clock();
+        if (rev->mode != GDB_REPLAY_NONE) {
+            // Replays run through gdbserverCall() one instruction at a time
+            gdb->gdbFlags.dbgContinue = 0;
+            gdb->gdbFlags.runFree = 0;
+        }
+        else if (cpu->replayMode == REPLAY_PLAYBACK) {
+            gdb->gdbFlags.dbgContinue = 0;
+        }
+    }
+    gdbserverProtectAll(cpu);
+}
+
+// Queue bytes for gdb - only hits the socket when the buffer fills or before blocking on a read
+static void gdbserverWrite(rv32iHart_t *cpu, const char *data, u32 len) {
+    GdbTransport *t = cpu->gdbFields.transport;
+    while (len > 0) {
+        if (t->txLen == GDB_SOCKET_BUF_SIZE) {
+            gdbserverFlush(cpu);
+        }
+        u32 chunk = GDB_SOCKET_BUF_SIZE - t->txLen;
+        chunk = (len < chunk) ? len : chunk;
+        memcpy(t->txBuf + t->txLen, data, chunk);
+        t->txLen += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+// Returns the next byte from gdb, or -1 if the connection went away
+static int gdbserverReadChar(rv32iHart_t *cpu) {
+    GdbTransport *t = cpu->gdbFields.transport;
+    if (t->rxHead == t->rxLen) {
+        // About to block on gdb - make sure it has everything it's waiting on first
+        gdbserverFlush(cpu);
+        size_t received = 0;
+        t->rxHead = t->rxLen = 0;
+        if (readSocket(cpu->gdbFields.connectFd, t->rxBuf, GDB_SOCKET_BUF_SIZE, &received) != READ_SOCKET_OK) {
+            return -1;
+        }
+        t->rxLen = (u32)received;
+    }
+    return (u8)t->rxBuf[t->rxHead++];
+}
+
+// Hand the stub a continue so it returns from minigdbstubProcess() without gdb seeing its replies
+static void gdbserverResumeStub(rv32iHart_t *cpu) {
+    static const char resume[] = "$c#63";
+    GdbTransport *t = cpu->gdbFields.transport;
+    memcpy(t->pktBuf, resume, sizeof(resume) - 1);
+    t->pktLen = sizeof(resume) - 1;
+    t->pktPos = 0;
+    cpu->gdbFields.gdbFlags.muteOutput = 1;
+}
+
+// Drop the connection and let the guest run free again (i.e. 'D' packet or gdb going away)
+static void gdbserverDetach(rv32iHart_t *cpu) {
+    GdbTransport *t = cpu->gdbFields.transport;
+    closeClient(cpu);
+    memset(cpu->gdbFields.breakBitmap, 0, GDB_BREAK_BITMAP_SIZE(cpu->virtMemSize));
+    gdbserverUnprotectAll(cpu);
+    cpu->gdbFields.watch.count = 0;
+    gdbserverDropCheckpoints(cpu);
+    t->rxHead = t->rxLen = t->txLen = 0;
+    cpu->gdbFields.gdbFlags.swallowAck = 0;
+    cpu->gdbFields.gdbFlags.dbgStep = 0;
+    cpu->gdbFields.lastPollCycle = cpu->cycleCounter;
+    gdbserverResumeStub(cpu);
+    LOG_I("GDB detached - continuing execution.\n");
+}
+
+void gdbserverPoll(rv32iHart_t *cpu) {
+    GdbFields *gdb = &cpu->gdbFields;
+    GdbTransport *t = gdb->transport;
+    gdb->lastPollCycle = cpu->cycleCounter;
+    GdbReverse *rev = gdb->reverse;
+    if (rev != NULL && rev->count > 0
+        && (cpu->cycleCounter - rev->checkpoints[rev->count - 1].cycleCounter) >= rev->interval) {
+        // Taken before the next instruction (see gdbserverCall)
+        rev->checkpointDue = 1;
+        gdb->gdbFlags.dbgContinue = 0;
+    }
+    if (gdb->connectFd <= 0) {
+        if (pollSocket(gdb->socketFd) && acceptClient(cpu) == 0) {
+            LOG_I("GDB attached.\n");
+            t->pktLen = t->pktPos = 0;
+            gdb->stopReason = GDB_STOP_ATTACH;
+            gdb->gdbFlags.dbgContinue = 0;
+        }
+        return;
+    }
+    // While running, gdb only sends late acks or an interrupt request
+    while (t->rxHead < t->rxLen || pollSocket(gdb->connectFd)) {
+        int c = gdbserverReadChar(cpu);
+        if (c < 0) {
+            gdbserverDetach(cpu);
+            t->pktLen = 0;  // Not inside the stub - nothing to resume
+            gdb->gdbFlags.muteOutput = 0;
+            return;
+        }
+        if (c == '+' || c == '-') {
+            gdb->gdbFlags.swallowAck = 0;
+            continue;
+        }
+        if (c != GDB_INTERRUPT_CHAR) {
+            // Anything else isn't valid while the target runs (all-stop mode) - drop it rather than stopping
+            if (c == '$') {
+                LOG_W("Ignoring packet from GDB while the target is running.\n");
+            }
+            continue;
+        }
+        strcpy(gdb->stopReply, "S02");
+        gdb->stopReason = GDB_STOP_INTERRUPT;
+        gdb->gdbFlags.dbgContinue = 0;
+        return;
+    }
+}
+
+// Reply packets are streamed into the tx buffer (i.e. no intermediate copy for large memory reads)
+static void gdbserverBeginPacket(rv32iHart_t *cpu) {
+    cpu->gdbFields.transport->txChecksum = 0;
+    gdbserverWrite(cpu, "$", 1);
+}
+
+static void gdbserverPacketData(rv32iHart_t *cpu, const char *data, u32 len) {
+    for (u32 i=0; i<len; ++i) {
+        cpu->gdbFields.transport->txChecksum += (u8)data[i];
+    }
+    gdbserverWrite(cpu, data, len);
+}
+
+static void gdbserverEndPacket(rv32iHart_t *cpu) {
+    u8 checksum = cpu->gdbFields.transport->txChecksum;
+    char trailer[3] = { '#', g_gdbHexChars[checksum >> 4], g_gdbHexChars[checksum & 0xf] };
+    gdbserverWrite(cpu, trailer, sizeof(trailer));
+}
+
+static void gdbserverSendPacket(rv32iHart_t *cpu, const char *body) {
+    gdbserverBeginPacket(cpu);
+    gdbserverPacketData(cpu, body, (u32)strlen(body));
+    gdbserverEndPacket(cpu);
+}
+
+// Set/clear a breakpoint bit - returns non-zero if the address isn't a valid instruction address (the bitmap only
+// covers guest memory)
+static int gdbserverSetBreakpoint(rv32iHart_t *cpu, u64 addr, int set) {
+    if ((addr & 0x3) || addr >= cpu->virtMemSize) {
+        return -1;
+    }
+    u8 mask = (u8)(1 << ((addr >> 2) & 0x7));
+    u8 *byte = &cpu->gdbFields.breakBitmap[addr >> 5];
+    *byte = set ? (*byte | mask) : (*byte & ~mask);
+    return 0;
+}
+
+// Parse "<addr>,<length>" followed by "sep" - returns a pointer past "sep", NULL if malformed/out of range
+static const char *gdbserverParseRange(rv32iHart_t *cpu, const char *args, char sep, u32 *addr, u32 *len) {
+    char *end = NULL;
+    *addr = (u32)strtoul(args, &end, 16);
+    if (end == args || *end != ',') {
+        return NULL;
+    }
+    args = end + 1;
+    *len = (u32)strtoul(args, &end, 16);
+    if (end == args || *end != sep) {
+        return NULL;
+    }
+    if (((u64)*addr + *len) > cpu->virtMemSize) {
+        return NULL;
+    }
+    return end + 1;
+}
+
+static int gdbserverHexNibble(char c) {
+    if (c >= '0' && c <= '9') { return c - '0';      }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+static void gdbserverReadMemory(rv32iHart_t *cpu, u32 addr, u32 len) {
+    // Don't reply with more than gdb's packet buffer holds (gdb splits larger reads itself)
+    const u32 maxLen = (GDB_PACKET_BUF_SIZE - 4) / 2;
+    char hex[512];
+    len = (len < maxLen) ? len : maxLen;
+    gdbserverBeginPacket(cpu);
+    while (len > 0) {
+        u32 chunk = (len < (sizeof(hex) / 2)) ? len : (sizeof(hex) / 2);
+        for (u32 i=0; i<chunk; ++i) {
+            u8 byte = ACCESS_MEM_B(cpu->virtMem, addr + i);
+            hex[(i * 2)]     = g_gdbHexChars[byte >> 4];
+            hex[(i * 2) + 1] = g_gdbHexChars[byte & 0xf];
+        }
+        gdbserverPacketData(cpu, hex, chunk * 2);
+        addr += chunk;
+        len -= chunk;
+    }
+    gdbserverEndPacket(cpu);
+}
+
+// Packets rISA serves itself rather than passing them through to minigdbstub
+static int gdbserverIsLocalPacket(const char *body, u32 len) {
+    switch (body[0]) {
+        case 'Z':
+        case 'z': return (body[1] >= '0' && body[1] <= '4');
+        case 'm':
+        case 'M':
+        case 'X':
+        case 'D': return 1;
+        case 'b': return (body[1] == 's' || body[1] == 'c');
+        case 'q': return (len >= 10 && strncmp(body, "qSupported", 10) == 0);
+        default:  return 0;
+    }
+}
+
+// Body is NUL-terminated, but 'X' packets can also carry NUL bytes so "len" is the real body length
+static void gdbserverHandlePacket(rv32iHart_t *cpu, char *body, u32 len) {
+    const char *data = NULL;
+    u32 addr = 0;
+    u32 size = 0;
+    switch (body[0]) {
+        case 'Z':   // Insert breakpoint/watchpoint (Z<type>,<addr>,<kind>)
+        case 'z': { // Remove breakpoint/watchpoint
+            char *end = NULL;
+            u8 type = (u8)(body[1] - '0');
+            unsigned long long fullAddr = strtoull(body + 3, &end, 16);
+            if (body[2] != ',' || end == body + 3 || *end != ',') {
+                gdbserverSendPacket(cpu, "E01");
+                break;
+            }
+            // Addresses past 32 bits are out of range rather than truncated
+            addr = (u32)fullAddr;
+            int res = (fullAddr > 0xffffffffULL) ? -1 : ((type <= 1)
+                ? gdbserverSetBreakpoint(cpu, fullAddr, body[0] == 'Z')
+                : gdbserverSetWatchpoint(cpu, type, addr, (u32)strtoul(end + 1, NULL, 16), body[0] == 'Z'));
+            gdbserverSendPacket(cpu, (res < 0) ? "E02" : ((res > 0) ? "" : "OK"));
+            break;
+        }
+        case 'm': { // Read memory (m<addr>,<length>)
+            if ((data = gdbserverParseRange(cpu, body + 1, '\0', &addr, &size)) == NULL) {
+                gdbserverSendPacket(cpu, "E01");
+                break;
+            }
+            gdbserverReadMemory(cpu, addr, size);
+            break;
+        }
+        case 'M': { // Write memory, hex encoded (M<addr>,<length>:<XX...>)
+            if ((data = gdbserverParseRange(cpu, body + 1, ':', &addr, &size)) == NULL
+                || (u32)((body + len) - data) != (size * 2)) {
+                gdbserverSendPacket(cpu, "E01");
+                break;
+            }
+            for (u32 i=0; i<size; ++i) {
+                int hi = gdbserverHexNibble(data[(i * 2)]);
+                int lo = gdbserverHexNibble(data[(i * 2) + 1]);
+                if (hi < 0 || lo < 0) {
+                    gdbserverSendPacket(cpu, "E01");
+                    return;
+                }
+                gdbserverWriteGuest(cpu, addr + i, (u8)((hi << 4) | lo));
+            }
+            gdbserverSendPacket(cpu, "OK");
+            break;
+        }
+        case 'X': { // Write memory, binary with '}' escapes (X<addr>,<length>:<data>)
+            if ((data = gdbserverParseRange(cpu, body + 1, ':', &addr, &size)) == NULL) {
+                gdbserverSendPacket(cpu, "E01");
+                break;
+            }
+            const char *bodyEnd = body + len;
+            u32 written = 0;
+            while (data < bodyEnd && written < size) {
+                u8 byte = (u8)*data++;
+                if (byte == '}' && data < bodyEnd) {
+                    byte = (u8)*data++ ^ 0x20;
+                }
+                gdbserverWriteGuest(cpu, addr + written++, byte);
+            }
+            // A zero-length write is gdb probing for 'X' support
+            gdbserverSendPacket(cpu, (written == size) ? "OK" : "E01");
+            break;
+        }
+        case 'D': { // Detach - guest keeps running, gdb can attach again later
+            gdbserverSendPacket(cpu, "OK");
+            gdbserverFlush(cpu);
+            gdbserverDetach(cpu);
+            break;
+        }
+        case 'b': { // Reverse step/continue (bs/bc)
+            GdbReverse *rev = cpu->gdbFields.reverse;
+            u32 index = 0;
+            if (rev == NULL) {
+                gdbserverSendPacket(cpu, "");
+                break;
+            }
+            if (cpu->cycleCounter == 0 || !gdbserverFindCheckpoint(rev, cpu->cycleCounter - 1, &index)) {
+                gdbserverSendPacket(cpu, "T05replaylog:begin;");
+                break;
+            }
+            // Go back to the nearest checkpoint and re-execute forward (see gdbserverReplayStep)
+            rev->mode = (body[1] == 's') ? GDB_REPLAY_STEP_SCAN : GDB_REPLAY_CONTINUE_SCAN;
+            rev->replayEnd = cpu->cycleCounter;
+            rev->replayFound = 0;
+            rev->scanIndex = index;
+            rev->replayCount = 0;
+            rev->replayClockMark = clock();
+            gdbserverRestoreCheckpoint(cpu, index);
+            rev->replayMark = cpu->cycleCounter;
+            gdbserverResumeStub(cpu);
+            break;
+        }
+        case 'q': { // qSupported - advertise the packet size the read-ahead buffer can take
+            char reply[64];
+            snprintf(reply, sizeof(reply), "PacketSize=%x%s", GDB_PACKET_BUF_SIZE - 4,
+                (cpu->gdbFields.reverse != NULL) ? ";ReverseStep+;ReverseContinue+" : "");
+            gdbserverSendPacket(cpu, reply);
+            break;
+        }
+    }
 }
 
 // User-defined minigdbstub handlers
 static void minigdbstubUsrWriteMem(size_t addr, unsigned char data, void *usrData) {
     rv32iHart_t *cpuHandle = (rv32iHart_t*)usrData;
-    ACCESS_MEM_W(cpuHandle->virtMem, addr) = data;
+    gdbserverWriteGuest(cpuHandle, (u32)addr, data);
     return;
 }
 
@@ -79,6 +1006,7 @@ static unsigned char minigdbstubUsrReadMem(size_t addr, void *usrData) {
 static void minigdbstubUsrContinue(void *usrData) {
     rv32iHart_t *cpuHandle = (rv32iHart_t*)usrData;
     cpuHandle->gdbFields.gdbFlags.dbgContinue = 1;
+    cpuHandle->gdbFields.gdbFlags.runFree = 1;
     return;
 }
 
@@ -91,31 +1019,82 @@ static void minigdbstubUsrStep(void *usrData) {
 static char minigdbstubUsrGetchar(void *usrData)
 {
     rv32iHart_t *cpuHandle = (rv32iHart_t*)usrData;
+    GdbFields *gdb = &cpuHandle->gdbFields;
+    GdbTransport *t = gdb->transport;
     while (1) {
-        char packet;
-        size_t len = sizeof(packet);
-        readSocket(cpuHandle->gdbFields.connectFd, &packet, len);
-        return packet;
+        // Hand out the rest of a read-ahead packet first
+        if (t->pktPos < t->pktLen) {
+            return t->pktBuf[t->pktPos++];
+        }
+        int c = gdbserverReadChar(cpuHandle);
+        if (c < 0) {
+            gdbserverDetach(cpuHandle);
+            continue;
+        }
+        if (c != '$') {
+            // Drop the ack gdb sends back for a reply rISA sent itself
+            if (gdb->gdbFlags.swallowAck && (c == '+' || c == '-')) {
+                gdb->gdbFlags.swallowAck = 0;
+                continue;
+            }
+            return (char)c;
+        }
+        // Read ahead the whole packet ("$<body>#<checksum>") to check if rISA serves it itself
+        u32 len = 0;
+        t->pktBuf[len++] = (char)c;
+        while (len < (GDB_PACKET_BUF_SIZE - 3) && c >= 0) {
+            c = gdbserverReadChar(cpuHandle);
+            t->pktBuf[len++] = (char)c;
+            if (c == '#') {
+                break;
+            }
+        }
+        if (c == '#') {
+            int sumHi = gdbserverReadChar(cpuHandle);
+            int sumLo = gdbserverReadChar(cpuHandle);
+            c = (sumHi < 0) ? sumHi : sumLo;
+            t->pktBuf[len++] = (char)sumHi;
+            t->pktBuf[len++] = (char)sumLo;
+        }
+        if (c < 0) {
+            gdbserverDetach(cpuHandle);
+            continue;
+        }
+        if (t->pktBuf[len - 3] == '#') {
+            t->pktBuf[len - 3] = '\0';
+            if (gdbserverIsLocalPacket(t->pktBuf + 1, len - 4)) {
+                gdbserverWrite(cpuHandle, "+", 1);
+                gdb->gdbFlags.swallowAck = 1;
+                t->pktLen = t->pktPos = 0;
+                gdbserverHandlePacket(cpuHandle, t->pktBuf + 1, len - 4);
+                continue;
+            }
+            t->pktBuf[len - 3] = '#';
+        }
+        t->pktLen = len;
+        t->pktPos = 0;
     }
 }
 
 static void minigdbstubUsrPutchar(char data, void *usrData)
 {
     rv32iHart_t *cpuHandle = (rv32iHart_t *)usrData;
-    writeSocket(cpuHandle->gdbFields.connectFd, (const char *)&data, sizeof(char));
+    if (!cpuHandle->gdbFields.gdbFlags.muteOutput) {
+        gdbserverWrite(cpuHandle, &data, sizeof(char));
+    }
 }
 
 static void minigdbstubUsrProcessBreakpoint(int type, size_t addr, void *usrData) {
+    // Z0/Z1/z0/z1 packets are handled before reaching the stub (see gdbserverHandlePacket)
     rv32iHart_t *cpuHandle = (rv32iHart_t *)usrData;
-    cpuHandle->gdbFields.breakAddr = addr;
-    cpuHandle->gdbFields.gdbFlags.dbgBreak = 1;
+    gdbserverSetBreakpoint(cpuHandle, (u64)addr, 1);
     return;
 }
 
 static void minigdbstubUsrKillSession(void *usrData) {
+    // Leave the stub and stop the run - the caller cleans up
     rv32iHart_t *cpuHandle = (rv32iHart_t *)usrData;
-    cpuHandle->endTime = clock();
-    printf(LOG_LINE_BREAK);
-    cleanupSimulator(cpuHandle);
-    exit(0);
+    gdbserverFlush(cpuHandle);
+    gdbserverResumeStub(cpuHandle);
+    cpuHandle->runStatus = RISA_RUN_HALT;
 }
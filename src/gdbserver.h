@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "risa.h"
+#include "replay.h"
 
 // GDB packet logging
 #ifdef GDBLOG
@@ -11,7 +12,75 @@
 #define GDBLOG 0
 #endif
 
+// Sent by gdb to interrupt a running target
+#define GDB_INTERRUPT_CHAR      0x03
+
+// Max packet size advertised to gdb (qSupported PacketSize) and socket buffer sizes
+#define GDB_PACKET_BUF_SIZE     (KB_MULTIPLIER * 16)
+#define GDB_SOCKET_BUF_SIZE     (KB_MULTIPLIER * 16)
+
+struct GdbTransport {
+    char    rxBuf[GDB_SOCKET_BUF_SIZE];
+    u32     rxHead;
+    u32     rxLen;
+    char    txBuf[GDB_SOCKET_BUF_SIZE];
+    u32     txLen;
+    u8      txChecksum;
+    char    pktBuf[GDB_PACKET_BUF_SIZE];    // Read-ahead packet (i.e. "$<body>#<checksum>")
+    u32     pktLen;
+    u32     pktPos;
+};
+
+// Reverse execution - checkpoint interval adapts so a reverse step/continue takes about GDB_REVERSE_REPLAY_MS
+#define GDB_MAX_CHECKPOINTS         32
+#define GDB_REVERSE_REPLAY_MS       20
+#define GDB_REVERSE_START_INTERVAL  (1u << 20)
+#define GDB_REVERSE_MAX_INTERVAL    (1u << 28)
+
+typedef enum {
+    GDB_REPLAY_NONE = 0,
+    GDB_REPLAY_STEP_SCAN,       // Find the instruction boundary before the stop point
+    GDB_REPLAY_CONTINUE_SCAN,   // Find the last breakpoint hit before the stop point
+    GDB_REPLAY_SEEK             // Run forward to a known position and stop
+} GdbReplayMode;
+
+typedef struct {
+    u32         pc;
+    u32         regFile[32];
+    u32         fregFile[32];
+    u32         fcsr;
+    u32         heapBreak;
+    TrapFields  trap;
+    ClintFields clint;
+    EventQueue  events;
+    u64         cycleCounter;       // Position in the run (re-execution is deterministic)
+    ReplayMark  history;            // Input log position - re-execution plays back the run's inputs from here
+    u8          *dirtyPages;        // Pages written since this checkpoint - their pre-images are in undoMem
+    u8          *undoMem;           // Guest memory sized mapping (only saved pages get committed)
+} GdbCheckpoint;
+
+struct GdbReverse {
+    GdbCheckpoint   checkpoints[GDB_MAX_CHECKPOINTS];   // Oldest first
+    u32             count;
+    u32             interval;
+    u32             pageCount;
+    u64             runCycleMark;       // Run rate sample (excludes time spent stopped in gdb)
+    clock_t         runClockMark;
+    double          replayRate;         // Instructions/second measured over the last reverse step/continue
+    u32             replayCount;
+    clock_t         replayClockMark;
+    u8              checkpointDue;
+    u8              mode;               // GdbReplayMode
+    u8              replayFound;
+    u32             scanIndex;          // Checkpoint the continue scan is replaying from
+    u64             replayEnd;          // Position the current scan/seek runs up to
+    u64             replayMark;         // Last boundary (step scan) or breakpoint hit (continue scan) seen
+    u64             liveCycle;          // End of the recorded history - inputs come from the log until here
+};
+
 void gdbserverCall(rv32iHart_t *cpu);
-void gdbserverInit(rv32iHart_t *cpu);
+int gdbserverInit(rv32iHart_t *cpu);
+void gdbserverPoll(rv32iHart_t *cpu);
+void gdbserverCleanup(rv32iHart_t *cpu);
 
 #endif // GDBSTUB_H
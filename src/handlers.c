@@ -1,42 +1,539 @@
 #include "stdlib.h"
 #include "stdio.h"
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 #include "risa.h"
+#include "replay.h"
+#include "memmap.h"
 
-// Syscalls
+// Syscalls (newlib/libgloss numbering)
 #define	syscall_exit    1
+#define	syscall_open    2
+#define	syscall_close   3
 #define	syscall_read    4
 #define	syscall_write   5
+#define	syscall_lseek   6
+#define	syscall_unlink  7
+#define	syscall_getpid  8
+#define	syscall_fstat   10
+#define	syscall_brk     11
 
-void defaultMmioHandler(rv32iHart_t *cpu)  { return; }
-void defaultIntHandler(rv32iHart_t *cpu)   { return; }
-void defaultExitHandler(rv32iHart_t *cpu)  { return; }
-void defaultInitHandler(rv32iHart_t *cpu)  { return; }
+// Host-accelerated string/memory intrinsics (rISA-specific, outside the newlib range)
+#define	syscall_memcpy  0x5200
+#define	syscall_memset  0x5201
+#define	syscall_memcmp  0x5202
+#define	syscall_strlen  0x5203
 
-// Provide a default simple/basic syscall handler
+// Guest (newlib) open flags
+#define GUEST_O_ACCMODE 0x0003
+#define GUEST_O_RDONLY  0x0000
+#define GUEST_O_WRONLY  0x0001
+#define GUEST_O_RDWR    0x0002
+#define GUEST_O_APPEND  0x0008
+#define GUEST_O_CREAT   0x0200
+#define GUEST_O_TRUNC   0x0400
+#define GUEST_O_EXCL    0x0800
+
+// Layout of the stat record syscall_fstat writes to guest memory (see examples/hello_world/syscalls.c)
+typedef struct {
+    u32 mode;
+    u32 size;
+    u32 blksize;
+    u32 blocks;
+} GuestStat;
+
+// Guest standard streams (host fds are used as-is)
+#define GUEST_STDOUT    1
+#define GUEST_STDERR    2
+
+// Write a staged host buffer followed by a chunk of guest memory (without copying it) - returns total or -errno
+static long writeAll(int fd, const char *head, u32 headLen, const char *tail, u32 tailLen) {
+    const u32 total = headLen + tailLen;
+    u32 done = 0;
+    while (done < total) {
+        long res;
+#ifdef _WIN32
+        if (done < headLen) {
+            res = HOST_WRITE(fd, head + done, headLen - done);
+        }
+        else {
+            res = HOST_WRITE(fd, tail + (done - headLen), total - done);
+        }
+#else
+        struct iovec iov[2];
+        int iovCount = 0;
+        if (done < headLen) {
+            iov[iovCount].iov_base = (void*)(head + done);
+            iov[iovCount].iov_len  = headLen - done;
+            ++iovCount;
+        }
+        iov[iovCount].iov_base = (void*)(tail + ((done > headLen) ? (done - headLen) : 0));
+        iov[iovCount].iov_len  = total - ((done > headLen) ? done : headLen);
+        ++iovCount;
+        res = writev(fd, iov, iovCount);
+#endif
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += (u32)res;
+    }
+    return (long)total;
+}
+
+// Stage small writes without a newline - anything else goes out together with the staged bytes in one call
+static long bufferedWrite(rv32iHart_t *cpu, const char *data, u32 len) {
+    WriteBuffer *wb = &cpu->writeBuf;
+    if (wb->buf == NULL) {
+        if (wb->threshold == 0) {
+            wb->threshold = DEFAULT_WRITE_BUF_SIZE;
+        }
+        wb->buf = (char*)malloc(wb->threshold);
+        if (wb->buf == NULL) {
+            cpu->opts.o_bufferedWrite = 0;
+            return writeAll(GUEST_STDOUT, NULL, 0, data, len);
+        }
+    }
+    if ((wb->len + len) < wb->threshold && memchr(data, '\n', len) == NULL) {
+        memcpy(wb->buf + wb->len, data, len);
+        wb->len += len;
+        return (long)len;
+    }
+    long res = writeAll(GUEST_STDOUT, wb->buf, wb->len, data, len);
+    wb->len = 0;
+    return (res < 0) ? res : (long)len;
+}
+
+void flushGuestOutput(rv32iHart_t *cpu) {
+    if (cpu->writeBuf.len > 0) {
+        writeAll(GUEST_STDOUT, cpu->writeBuf.buf, cpu->writeBuf.len, NULL, 0);
+        cpu->writeBuf.len = 0;
+    }
+}
+
+void closeGuestFiles(rv32iHart_t *cpu) {
+    for (int i=GUEST_STDERR+1; i<MAX_GUEST_FILES; ++i) {
+        if (cpu->envFields.hostFds[i] > 0) {
+            HOST_CLOSE(cpu->envFields.hostFds[i]);
+            cpu->envFields.hostFds[i] = 0;
+        }
+    }
+}
+
+// Record a guest buffer an ECALL works on host-side, so a GDB watchpoint anywhere in it is reported rather than
+// just the first byte that faulted (no-op outside GDB-mode)
+static inline void guestAccess(rv32iHart_t *cpu, u32 base, u32 len, int isWrite) {
+    GdbWatchFields *watch = &cpu->gdbFields.watch;
+    if (cpu->opts.o_gdbEnabled && len > 0 && watch->hostAccessCount < GDB_MAX_HOST_ACCESSES) {
+        GdbHostAccess access = { base, len, (u8)isWrite };
+        watch->hostAccess[watch->hostAccessCount++] = access;
+    }
+}
+
+// Host syscalls fail with EFAULT on protected guest pages instead of faulting - touch each page first so
+// the GDB watchpoint/reverse execution fault handler sees the access (no-op outside GDB-mode)
+static inline void guestTouchPages(rv32iHart_t *cpu, u8 *buf, u32 base, u32 len, int forWrite) {
+    // Same page size the fault handler protects with (0 if it isn't set up)
+    const u32 pageSize = cpu->gdbFields.watch.pageSize;
+    guestAccess(cpu, base, len, forWrite);
+    if (!cpu->opts.o_gdbEnabled || len == 0 || pageSize == 0) {
+        return;
+    }
+    volatile u8 *mem = (volatile u8*)buf - base;
+    for (u32 addr=base; addr<(base + len); addr=(addr | (pageSize - 1)) + 1) {
+        if (forWrite) { mem[addr] = mem[addr]; }
+        else          { (void)mem[addr];       }
+    }
+}
+
+// Charge the configured cost for an intrinsic that touched "len" bytes (rounded up to words)
+static inline void chargeAccelCycles(rv32iHart_t *cpu, u32 len) {
+    cpu->cycleCounter += ((len + (sizeof(u32) - 1)) / sizeof(u32)) * cpu->envFields.accelCyclesPerWord;
+}
+
+// Map a guest fd to its host fd - returns -1 if not open
+static inline int guestToHostFd(rv32iHart_t *cpu, u32 fd) {
+    if (fd <= GUEST_STDERR) {
+        return (int)fd;
+    }
+    if (fd >= MAX_GUEST_FILES || cpu->envFields.hostFds[fd] <= 0) {
+        return -1;
+    }
+    return cpu->envFields.hostFds[fd];
+}
+
+// Symlinks must not lead out of the sandbox either - the path (or the directory it would be created in) has to
+// resolve to somewhere inside the sandbox directory. With "canonical" set, hostPath is replaced by the resolved path
+// (no symlinks left to follow between the check and the open). Returns 0 or -errno.
+static int sandboxResolved(rv32iHart_t *cpu, char *hostPath, size_t hostPathLen, int canonical) {
+    char root[HOST_PATH_MAX];
+    char resolved[HOST_PATH_MAX];
+    if (HOST_REALPATH(cpu->envFields.sandboxDir, root) == NULL) {
+        return -ENOENT;
+    }
+    char name[HOST_PATH_MAX];
+    name[0] = '\0';
+    if (HOST_REALPATH(hostPath, resolved) == NULL) {
+        // Something there that doesn't resolve (i.e. a dangling symlink) - creating it would follow the link
+        HOST_STAT_T info;
+        if (HOST_LSTAT(hostPath, &info) == 0) {
+            return -EACCES;
+        }
+        // Doesn't exist (yet) - check the directory it would be in
+        char parent[HOST_PATH_MAX];
+        snprintf(parent, sizeof(parent), "%s", hostPath);
+        char *last = strrchr(parent, PATH_SEPARATOR);
+        *last = '\0';     // Always has one (the sandbox directory is prefixed)
+        if (HOST_REALPATH(parent, resolved) == NULL) {
+            return -ENOENT;
+        }
+        snprintf(name, sizeof(name), "%s", last + 1);
+    }
+    size_t rootLen = strlen(root);
+    if (rootLen > 0 && root[rootLen - 1] == PATH_SEPARATOR) {
+        --rootLen;  // Filesystem root
+    }
+    if (strncmp(resolved, root, rootLen) != 0 || (resolved[rootLen] != '\0' && resolved[rootLen] != PATH_SEPARATOR)) {
+        return -EACCES;
+    }
+    if (canonical) {
+        int len = (name[0] != '\0') ? snprintf(hostPath, hostPathLen, "%s%c%s", resolved, PATH_SEPARATOR, name) :
+            snprintf(hostPath, hostPathLen, "%s", resolved);
+        if (len < 0 || (size_t)len >= hostPathLen) {
+            return -ENAMETOOLONG;
+        }
+    }
+    return 0;
+}
+
+// Resolve a guest path (NUL-terminated in guest memory) inside the sandbox directory (see sandboxResolved for
+// "canonical") - returns -errno on failure
+static int sandboxPath(rv32iHart_t *cpu, u32 guestAddr, char *hostPath, size_t hostPathLen, int canonical) {
+    if (cpu->envFields.sandboxDir == NULL) {
+        return -EACCES;
+    }
+    u32 pathLen;
+    const char *path = memString(cpu, guestAddr, &pathLen);
+    if (path == NULL) {
+        return -EFAULT;
+    }
+    guestAccess(cpu, guestAddr, pathLen + 1, 0);
+    const char *end = path + pathLen;
+    // Only relative paths that stay inside the sandbox (no ".." components)
+    if (path[0] == '/' || path[0] == '\\' || (path[0] != '\0' && path[1] == ':')) {
+        return -EACCES;
+    }
+    for (const char *c = path; c < end; ) {
+        const char *next = c;
+        while (next < end && *next != '/' && *next != '\\') {
+            ++next;
+        }
+        if ((next - c) == 2 && c[0] == '.' && c[1] == '.') {
+            return -EACCES;
+        }
+        c = next + 1;
+    }
+    int len = snprintf(hostPath, hostPathLen, "%s%c%s", cpu->envFields.sandboxDir, PATH_SEPARATOR, path);
+    if (len < 0 || (size_t)len >= hostPathLen) {
+        return -ENAMETOOLONG;
+    }
+    return sandboxResolved(cpu, hostPath, hostPathLen, canonical);
+}
+
+static int guestToHostOpenFlags(u32 guestFlags) {
+    int flags;
+    switch (guestFlags & GUEST_O_ACCMODE) {
+        case GUEST_O_WRONLY: { flags = O_WRONLY;    break; }
+        case GUEST_O_RDWR:   { flags = O_RDWR;      break; }
+        default:             { flags = O_RDONLY;    break; }
+    }
+    if (guestFlags & GUEST_O_APPEND)    { flags |= O_APPEND;    }
+    if (guestFlags & GUEST_O_CREAT)     { flags |= O_CREAT;     }
+    if (guestFlags & GUEST_O_TRUNC)     { flags |= O_TRUNC;     }
+    if (guestFlags & GUEST_O_EXCL)      { flags |= O_EXCL;      }
+    return flags;
+}
+
+// Syscalls whose results depend on the host (recorded/replayed)
+static inline int isHostIoSyscall(u32 num) {
+    return (num >= syscall_open && num <= syscall_unlink) || num == syscall_fstat;
+}
+
+// Playback - guest output is still shown (unless re-executing this run's own history), everything else comes from
+// the log
+static void replayHostIoSyscall(rv32iHart_t *cpu) {
+    u32 fd = cpu->regFile[A0];
+    u32 base = cpu->regFile[A1];
+    u32 len = cpu->regFile[A2];
+    const char *guestBuf = (cpu->regFile[A7] == syscall_write && (fd == GUEST_STDOUT || fd == GUEST_STDERR) &&
+        !cpu->replay->history) ? (const char*)memSpan(cpu, base, len, 0) : NULL;
+    if (guestBuf != NULL) {
+        fflush(stdout);
+        if (fd == GUEST_STDOUT && cpu->opts.o_bufferedWrite) {
+            bufferedWrite(cpu, guestBuf, len);
+        }
+        else {
+            flushGuestOutput(cpu);
+            writeAll((int)fd, NULL, 0, guestBuf, len);
+        }
+    }
+    replaySyscall(cpu);
+}
+
+// Accelerated op on guest memory nothing backs - an access fault like a load/store there would be (no in-band error
+// result: any a0 value is a valid memcmp result or dst pointer)
+static void accelFault(rv32iHart_t *cpu, u32 addr) {
+    LOG_E("Guest access fault at ( 0x%08x ) in accelerated syscall ( 0x%x ), pc ( 0x%08x ).\n", addr,
+        cpu->regFile[A7], cpu->pc);
+    cpu->runStatus = RISA_RUN_ERROR;
+    cpu->exitCode = EFAULT;
+}
+
+// Provide a default newlib-compatible syscall handler (args in a0-a2, syscall number in a7, result/-errno in a0)
 void defaultEnvHandler(rv32iHart_t *cpu) {
-    switch(cpu->regFile[A7]) {
+    u32 num = cpu->regFile[A7];
+    cpu->gdbFields.watch.hostAccessCount = 0;
+    if (cpu->replayMode == REPLAY_PLAYBACK && isHostIoSyscall(num)) {
+        replayHostIoSyscall(cpu);
+        return;
+    }
+    // Guest memory the syscall read host data into (recorded with the result)
+    u32 readAddr = 0;
+    u32 readLen = 0;
+    switch(num) {
         default:
             break;
         // Detect what syscall we encountered
         case syscall_exit: {
-            cpu->endTime = clock();
-            // Print out return error code (if there is an error)
-            printf(LOG_LINE_BREAK);
-            int err = (int)cpu->regFile[A0];
+            // Stop before the next instruction - the caller reports the exit code and cleans up
+            cpu->exitCode = (int)cpu->regFile[A0];
+            cpu->runStatus = RISA_RUN_EXIT;
+            break;
+        }
+        case syscall_write: {
+            u32 fd = cpu->regFile[A0];
+            u32 base = cpu->regFile[A1];
+            u32 len = cpu->regFile[A2];
+            int hostFd = guestToHostFd(cpu, fd);
+            const char *guestBuf = (const char*)memSpan(cpu, base, len, 0);
+            if (guestBuf == NULL) {
+                cpu->regFile[A0] = (u32)-EFAULT;
+                break;
+            }
+            if (hostFd < 0) {
+                cpu->regFile[A0] = (u32)-EBADF;
+                break;
+            }
+            guestTouchPages(cpu, (u8*)guestBuf, base, len, 0);
+            // Keep ordering with anything the simulator printed through stdio
+            fflush(stdout);
+            if (fd == GUEST_STDOUT && cpu->opts.o_bufferedWrite) {
+                cpu->regFile[A0] = (u32)bufferedWrite(cpu, guestBuf, len);
+            }
+            else {
+                flushGuestOutput(cpu);
+                cpu->regFile[A0] = (u32)writeAll(hostFd, NULL, 0, guestBuf, len);
+            }
+            break;
+        }
+        case syscall_read: { // Bulk read straight into guest memory
+            u32 base = cpu->regFile[A1];
+            u32 len = cpu->regFile[A2];
+            int hostFd = guestToHostFd(cpu, cpu->regFile[A0]);
+            u8 *guestBuf = memSpan(cpu, base, len, 1);
+            if (guestBuf == NULL) {
+                cpu->regFile[A0] = (u32)-EFAULT;
+                break;
+            }
+            if (hostFd < 0) {
+                cpu->regFile[A0] = (u32)-EBADF;
+                break;
+            }
+            guestTouchPages(cpu, guestBuf, base, len, 1);
+            long res;
+            do {
+                res = (long)HOST_READ(hostFd, guestBuf, len);
+            } while (res < 0 && errno == EINTR);
+            cpu->regFile[A0] = (res < 0) ? (u32)-errno : (u32)res;
+            readAddr = base;
+            readLen = (res > 0) ? (u32)res : 0;
+            break;
+        }
+        case syscall_open: {
+            char hostPath[HOST_PATH_MAX];
+            int err = sandboxPath(cpu, cpu->regFile[A0], hostPath, sizeof(hostPath), 1);
             if (err) {
-                LOG_I("Program code on simulator has returned error code: [ %d ]\n", err);
+                cpu->regFile[A0] = (u32)err;
+                break;
+            }
+            u32 fd;
+            for (fd=GUEST_STDERR+1; fd<MAX_GUEST_FILES; ++fd) {
+                if (cpu->envFields.hostFds[fd] <= 0) {
+                    break;
+                }
+            }
+            if (fd == MAX_GUEST_FILES) {
+                cpu->regFile[A0] = (u32)-EMFILE;
+                break;
             }
-            cpu->cleanupSimulator(cpu);
-            exit(0);
+            // A symlink swapped in after the check isn't followed
+            int hostFd = HOST_OPEN(hostPath, guestToHostOpenFlags(cpu->regFile[A1]) | HOST_O_NOFOLLOW,
+                (int)cpu->regFile[A2]);
+            if (hostFd < 0) {
+                cpu->regFile[A0] = (u32)-errno;
+                break;
+            }
+            cpu->envFields.hostFds[fd] = hostFd;
+            cpu->regFile[A0] = fd;
+            break;
         }
-        case syscall_write: {
-            int base = cpu->regFile[A1];
+        case syscall_close: {
+            u32 fd = cpu->regFile[A0];
+            int hostFd = guestToHostFd(cpu, fd);
+            if (hostFd < 0) {
+                cpu->regFile[A0] = (u32)-EBADF;
+                break;
+            }
+            // Host stdio stays open for the simulator
+            if (fd > GUEST_STDERR) {
+                HOST_CLOSE(hostFd);
+                cpu->envFields.hostFds[fd] = 0;
+            }
+            cpu->regFile[A0] = 0;
+            break;
+        }
+        case syscall_lseek: {
+            int hostFd = guestToHostFd(cpu, cpu->regFile[A0]);
+            if (hostFd < 0) {
+                cpu->regFile[A0] = (u32)-EBADF;
+                break;
+            }
+            long res = (long)HOST_LSEEK(hostFd, (s32)cpu->regFile[A1], (int)cpu->regFile[A2]);
+            cpu->regFile[A0] = (res < 0) ? (u32)-errno : (u32)res;
+            break;
+        }
+        case syscall_fstat: {
+            u32 base = cpu->regFile[A1];
+            int hostFd = guestToHostFd(cpu, cpu->regFile[A0]);
+            HOST_STAT_T hostStat;
+            u8 *guestBuf = memSpan(cpu, base, sizeof(GuestStat), 1);
+            if (guestBuf == NULL) {
+                cpu->regFile[A0] = (u32)-EFAULT;
+                break;
+            }
+            if (hostFd < 0) {
+                cpu->regFile[A0] = (u32)-EBADF;
+                break;
+            }
+            if (HOST_FSTAT(hostFd, &hostStat) != 0) {
+                cpu->regFile[A0] = (u32)-errno;
+                break;
+            }
+            guestAccess(cpu, base, sizeof(GuestStat), 1);
+            GuestStat guestStat = {0};
+            guestStat.mode = (u32)hostStat.st_mode;
+            guestStat.size = (u32)hostStat.st_size;
+#ifndef _WIN32
+            guestStat.blksize = (u32)hostStat.st_blksize;
+            guestStat.blocks = (u32)hostStat.st_blocks;
+#endif
+            memcpy(guestBuf, &guestStat, sizeof(guestStat));
+            cpu->regFile[A0] = 0;
+            readAddr = base;
+            readLen = sizeof(guestStat);
+            break;
+        }
+        case syscall_unlink: {
+            char hostPath[HOST_PATH_MAX];
+            int err = sandboxPath(cpu, cpu->regFile[A0], hostPath, sizeof(hostPath), 0);
+            if (err) {
+                cpu->regFile[A0] = (u32)err;
+                break;
+            }
+            cpu->regFile[A0] = (HOST_UNLINK(hostPath) != 0) ? (u32)-errno : 0;
+            break;
+        }
+        case syscall_getpid: {
+            cpu->regFile[A0] = 1;
+            break;
+        }
+        case syscall_memcpy: { // memmove semantics (overlap-safe), returns dst
+            u32 dst = cpu->regFile[A0];
+            u32 src = cpu->regFile[A1];
+            u32 len = cpu->regFile[A2];
+            u8 *dstBuf = memSpan(cpu, dst, len, 1);
+            const u8 *srcBuf = memSpan(cpu, src, len, 0);
+            if (dstBuf == NULL || srcBuf == NULL) {
+                accelFault(cpu, (dstBuf == NULL) ? dst : src);
+                break;
+            }
+            guestAccess(cpu, dst, len, 1);
+            guestAccess(cpu, src, len, 0);
+            memmove(dstBuf, srcBuf, len);
+            chargeAccelCycles(cpu, len);
+            break;
+        }
+        case syscall_memset: { // Returns dst
+            u32 dst = cpu->regFile[A0];
+            u32 len = cpu->regFile[A2];
+            u8 *dstBuf = memSpan(cpu, dst, len, 1);
+            if (dstBuf == NULL) {
+                accelFault(cpu, dst);
+                break;
+            }
+            guestAccess(cpu, dst, len, 1);
+            memset(dstBuf, (int)(u8)cpu->regFile[A1], len);
+            chargeAccelCycles(cpu, len);
+            break;
+        }
+        case syscall_memcmp: { // Returns difference of the first mismatching bytes (0 if equal)
+            u32 lhs = cpu->regFile[A0];
+            u32 rhs = cpu->regFile[A1];
             u32 len = cpu->regFile[A2];
-            for (int i=0; i<len; ++i) {
-                printf("%c", ACCESS_MEM_B(cpu->virtMem, base + i));
-                fflush(stdout);
+            const u8 *lhsBuf = memSpan(cpu, lhs, len, 0);
+            const u8 *rhsBuf = memSpan(cpu, rhs, len, 0);
+            if (lhsBuf == NULL || rhsBuf == NULL) {
+                accelFault(cpu, (lhsBuf == NULL) ? lhs : rhs);
+                break;
+            }
+            guestAccess(cpu, lhs, len, 0);
+            guestAccess(cpu, rhs, len, 0);
+            s32 res = 0;
+            if (memcmp(lhsBuf, rhsBuf, len) != 0) {
+                u32 i = 0;
+                while (lhsBuf[i] == rhsBuf[i]) {
+                    ++i;
+                }
+                res = (s32)lhsBuf[i] - (s32)rhsBuf[i];
             }
+            cpu->regFile[A0] = (u32)res;
+            chargeAccelCycles(cpu, len);
             break;
         }
+        case syscall_strlen: {
+            u32 strLen;
+            if (memString(cpu, cpu->regFile[A0], &strLen) == NULL) {
+                accelFault(cpu, cpu->regFile[A0]);
+                break;
+            }
+            guestAccess(cpu, cpu->regFile[A0], strLen + 1, 0);
+            cpu->regFile[A0] = strLen;
+            chargeAccelCycles(cpu, cpu->regFile[A0] + 1);
+            break;
+        }
+        case syscall_brk: { // Set the program break (0 queries it) - bounded by memory size and the stack pointer
+            u32 newBreak = cpu->regFile[A0];
+            if (newBreak != 0 && memPeek(cpu, newBreak - 1, 1) != NULL && newBreak <= cpu->regFile[SP]) {
+                cpu->envFields.heapBreak = newBreak;
+            }
+            cpu->regFile[A0] = cpu->envFields.heapBreak;
+            break;
+        }
+    }
+    if (cpu->replayMode == REPLAY_RECORD && isHostIoSyscall(num)) {
+        replaySyscallDone(cpu, readLen, readAddr);
     }
 }
@@ -0,0 +1,101 @@
+#include "idle.h"
+#include "memmap.h"
+
+// Registers an instruction reads/writes (as bitmasks) if it's allowed in an idle loop - returns 0 if not.
+// Only loads/ALU ops, plus the closing branch/jump, so an iteration can't change memory or device state.
+static int idleDecode(u32 inst, int isBackEdge, u32 *reads, u32 *writes) {
+    u32 rd = 1u << GET_RD(inst);
+    u32 rs1 = 1u << GET_RS1(inst);
+    u32 rs2 = 1u << GET_RS2(inst);
+    u32 funct3 = GET_FUNCT3(inst);
+    if (isBackEdge) {
+        switch (GET_OPCODE(inst)) {
+            case 0x63: { *reads = rs1 | rs2;    *writes = 0;    return 1; } // Branches
+            case 0x6f: { *reads = 0;            *writes = rd;   return 1; } // JAL
+            default:   { return 0; }
+        }
+    }
+    switch (GET_OPCODE(inst)) {
+        case 0x03: { // Loads (MMIO loads are caught at run time)
+            if (funct3 == 0x3 || funct3 > 0x5) {
+                return 0;
+            }
+            *reads = rs1;
+            *writes = rd;
+            return 1;
+        }
+        case 0x13: { *reads = rs1;          *writes = rd;   return 1; } // OP-IMM
+        case 0x33: { *reads = rs1 | rs2;    *writes = rd;   return 1; } // OP
+        case 0x37:                                                      // LUI
+        case 0x17: { *reads = 0;            *writes = rd;   return 1; } // AUIPC
+        default:   { return 0; }
+    }
+}
+
+// Instruction count of the loop if every iteration is identical until memory/device state changes - 0 otherwise.
+// That's the case when the loop is straight-line and every register it writes is written before it's read (so
+// each iteration only depends on registers/memory the loop itself can't change).
+static u32 idleAnalyze(rv32iHart_t *cpu, u32 branchPc, u32 loopStart) {
+    // Single-stepping, breakpoints, reverse replay, traces and the analysis models need every iteration
+    if (cpu->opts.o_gdbEnabled || cpu->opts.o_tracePrintEnable || cpu->retire.enabled || loopStart > branchPc) {
+        return 0;
+    }
+    u32 len = ((branchPc - loopStart) / 4) + 1;
+    if (len > IDLE_MAX_LOOP) {
+        return 0;
+    }
+    u32 reads, writes;
+    u32 loopWrites = 0;
+    const u32 *loop = (const u32*)memPeek(cpu, loopStart, len * 4);
+    if (loop == NULL) {
+        return 0;
+    }
+    for (u32 i=0; i<len; ++i) {
+        if (!idleDecode(loop[i], i == (len - 1), &reads, &writes)) {
+            return 0;
+        }
+        loopWrites |= writes;
+    }
+    loopWrites &= ~1u;
+    u32 written = 0;
+    for (u32 i=0; i<len; ++i) {
+        idleDecode(loop[i], i == (len - 1), &reads, &writes);
+        if (reads & loopWrites & ~written) {
+            return 0;
+        }
+        written |= writes;
+    }
+    return len;
+}
+
+// Advance whole "period"-cycle idle iterations up to the next device event (or the end of the run) - the
+// interpreter then runs the last partial iteration so events fire exactly when they would have
+static void idleSkip(rv32iHart_t *cpu, u32 period) {
+    u64 until = (cpu->nextEventCycle < cpu->runLimit) ? cpu->nextEventCycle : cpu->runLimit;
+    // Nothing will ever wake it up - keep interpreting (i.e. until SIGINT/risaHalt())
+    if (until == UINT64_MAX || until <= cpu->cycleCounter) {
+        return;
+    }
+    u64 skipped = ((until - cpu->cycleCounter) / period) * period;
+    cpu->cycleCounter += skipped;
+    cpu->idle.skippedCycles += skipped;
+}
+
+void idleBackEdge(rv32iHart_t *cpu, u32 branchPc, u32 loopStart) {
+    if (cpu->idle.loopExit != branchPc + 4) {
+        cpu->idle.loopExit = branchPc + 4;
+        cpu->idle.loopLen = idleAnalyze(cpu, branchPc, loopStart);
+    }
+    // A whole iteration since the last back-edge without device reads/events - the rest will be identical
+    else if ((cpu->cycleCounter - cpu->idle.mark) == cpu->idle.loopLen) {
+        idleSkip(cpu, cpu->idle.loopLen);
+    }
+    cpu->idle.mark = cpu->cycleCounter;
+}
+
+void idleWaitForInterrupt(rv32iHart_t *cpu) {
+    if ((cpu->trap.mip & cpu->trap.mie) || cpu->opts.o_gdbEnabled) {
+        return;
+    }
+    idleSkip(cpu, 1);
+}
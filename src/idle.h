@@ -0,0 +1,23 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include "risa.h"
+
+// Longest loop (in instructions) checked for being idle
+#define IDLE_MAX_LOOP           8
+
+// Taken backward branch/jump at "branchPc" to "loopStart" - only leaves the interpreter for loops it hasn't
+// analyzed yet or that were found to be idle
+#define IDLE_BACK_EDGE(cpu, branchPc, loopStart) do {                                                       \
+    if ((cpu)->idle.loopExit != (branchPc) + 4 || (cpu)->idle.loopLen != 0) {                               \
+        idleBackEdge(cpu, branchPc, loopStart);                                                             \
+    } } while(0)
+
+// Device reads/events can change what an idle loop sees - the next iteration can't be used as proof
+#define IDLE_INVALIDATE(cpu)    ((cpu)->idle.mark = (cpu)->cycleCounter)
+
+void idleBackEdge(rv32iHart_t *cpu, u32 branchPc, u32 loopStart);
+// WFI - skip ahead to the next device event unless an interrupt is already pending
+void idleWaitForInterrupt(rv32iHart_t *cpu);
+
+#endif // IDLE_H
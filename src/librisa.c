@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "risa.h"
+#include "fpu.h"
+#include "events.h"
+#include "clint.h"
+#include "cache.h"
+#include "timing.h"
+#include "bbv.h"
+#include "sample.h"
+#include "replay.h"
+#include "memmap.h"
+#include "aot.h"
+#include "predecode.h"
+
+risaSim *risaCreate(uint32_t memSize, const char *handlerLibrary) {
+    rv32iHart_t *cpu = (rv32iHart_t*)ALLOC_ALIGNED(sizeof(rv32iHart_t));
+    if (cpu == NULL) {
+        return NULL;
+    }
+    memset(cpu, 0, sizeof(rv32iHart_t));
+    cpu->virtMemSize = (memSize != 0) ? memSize : DEFAULT_VIRT_MEM_SIZE;
+    cpu->intPeriodVal = DEFAULT_INT_PERIOD;
+    cpu->envFields.accelCyclesPerWord = DEFAULT_ACCEL_COST;
+    if (allocGuestMemory(cpu)) {
+        FREE_ALIGNED(cpu);
+        return NULL;
+    }
+    loadHandlers(cpu, handlerLibrary);
+    if (cpu->handlerProcs[RISA_INIT_HANDLER_PROC] != NULL) {
+        cpu->handlerProcs[RISA_INIT_HANDLER_PROC](cpu);
+    }
+    return cpu;
+}
+
+void risaDestroy(risaSim *sim) {
+    if (sim == NULL) {
+        return;
+    }
+    cleanupSimulator(sim);
+    FREE_ALIGNED(sim);
+}
+
+int risaSetMemoryMap(risaSim *sim, const char *spec) {
+    int err = memMapCreate(sim, spec);
+    if (!err && sim->replay != NULL) {
+        LOG_W("Guest memory replaced after replayStart() - the replay log no longer matches.\n");
+    }
+    return err;
+}
+
+int risaSetMemoryBacking(risaSim *sim, const char *spec) {
+    int err = memMapSetBacking(sim, spec);
+    err = err ? err : memMapRebuild(sim);
+    if (!err && sim->replay != NULL) {
+        LOG_W("Guest memory replaced after replayStart() - the replay log no longer matches.\n");
+    }
+    return err;
+}
+
+void risaMemoryReport(risaSim *sim, FILE *out) {
+    memMapReport(sim, out);
+}
+
+int risaLoadImage(risaSim *sim, const void *image, size_t len, uint32_t addr) {
+    u8 *dest = (len <= 0xffffffffULL) ? memSpan(sim, addr, (u32)len, 0) : NULL;
+    if (dest == NULL) {
+        return ENOMEM;
+    }
+    memcpy(dest, image, len);
+    AOT_CODE_WRITTEN(sim, addr, (u32)len);
+    return 0;
+}
+
+int risaLoadFile(risaSim *sim, const char *path, uint32_t addr) {
+    FILE *binFile;
+    OPEN_FILE(binFile, path, "rb");
+    if (binFile == NULL) {
+        return EIO;
+    }
+    fseek(binFile, 0, SEEK_END);
+    long size = ftell(binFile);
+    fseek(binFile, 0, SEEK_SET);
+    u8 *dest = (size < 0 || (u64)size > 0xffffffffULL) ? NULL : memSpan(sim, addr, (u32)size, 0);
+    if (dest == NULL) {
+        fclose(binFile);
+        return ENOMEM;
+    }
+    size_t len = fread(dest, 1, (size_t)size, binFile);
+    fclose(binFile);
+    AOT_CODE_WRITTEN(sim, addr, (u32)size);
+    return (len == (size_t)size) ? 0 : EIO;
+}
+
+int risaRun(risaSim *sim, uint64_t maxInstructions) {
+    if (sim->runStatus == RISA_RUN_EXIT || sim->runStatus == RISA_RUN_ERROR) {
+        return sim->runStatus;
+    }
+    sim->runStatus = RISA_RUN_LIMIT;
+    // A halt requested before (or while) the status was reset above still stops this run
+    if (sim->haltRequested) {
+        sim->haltRequested = 0;
+        sim->runStatus = RISA_RUN_HALT;
+    }
+    sim->runLimit = (maxInstructions > (RISA_RUN_UNLIMITED - sim->cycleCounter)) ?
+        RISA_RUN_UNLIMITED : (sim->cycleCounter + maxInstructions);
+    // Host FPU flags are per thread - don't let other work (or other harts) on this thread leak into the guest's
+    fpuReset(sim);
+    eventsStart(sim);
+    if (sim->sample != NULL) {
+        sampleRun(sim);
+    }
+    else {
+        retireStart(sim);
+        runHart(sim);
+        retireStop(sim);
+    }
+    if (sim->runStatus == RISA_RUN_HALT) {
+        // Consumed by this run
+        sim->haltRequested = 0;
+    }
+    fpuReadFflags(sim);
+    flushGuestOutput(sim);
+    replayFlush(sim);
+    return sim->runStatus;
+}
+
+void risaHalt(risaSim *sim) {
+    sim->haltRequested = 1;
+    sim->runStatus = RISA_RUN_HALT;
+}
+
+int risaExitCode(const risaSim *sim) {
+    return sim->exitCode;
+}
+
+uint64_t risaCycleCount(const risaSim *sim) {
+    return sim->cycleCounter;
+}
+
+uint32_t risaReadPc(const risaSim *sim) {
+    return sim->pc;
+}
+
+void risaWritePc(risaSim *sim, uint32_t pc) {
+    sim->pc = pc;
+}
+
+uint32_t risaReadInstruction(const risaSim *sim) {
+    const u8 *inst = memPeek(sim, sim->pc, 4);
+    return (inst != NULL) ? *(const u32*)inst : 0;
+}
+
+int risaReadReg(const risaSim *sim, unsigned reg, uint32_t *value) {
+    if (reg >= REGISTER_COUNT) {
+        return EINVAL;
+    }
+    *value = sim->regFile[reg];
+    return 0;
+}
+
+int risaWriteReg(risaSim *sim, unsigned reg, uint32_t value) {
+    if (reg >= REGISTER_COUNT) {
+        return EINVAL;
+    }
+    // x0 stays hardwired to zero
+    if (reg != ZERO) {
+        sim->regFile[reg] = value;
+    }
+    return 0;
+}
+
+int risaReadFreg(const risaSim *sim, unsigned reg, uint32_t *bits) {
+    if (reg >= REGISTER_COUNT) {
+        return EINVAL;
+    }
+    *bits = sim->fregFile[reg];
+    return 0;
+}
+
+int risaWriteFreg(risaSim *sim, unsigned reg, uint32_t bits) {
+    if (reg >= REGISTER_COUNT) {
+        return EINVAL;
+    }
+    sim->fregFile[reg] = bits;
+    return 0;
+}
+
+int risaSetHandlers(risaSim *sim, const risaHandlers *handlers) {
+    if (handlers->abiVersion != RISA_HANDLER_ABI_VERSION) {
+        return EINVAL;
+    }
+    // Drop anything not subscribed to - the interpreter only checks for NULL callbacks/an empty MMIO range
+    sim->handlers = *handlers;
+    if (!(handlers->events & RISA_EVENT_MMIO) || handlers->mmio == NULL) {
+        sim->handlers.mmio = NULL;
+        sim->handlers.mmioSize = 0;
+    }
+    if (!(handlers->events & RISA_EVENT_ENV))       { sim->handlers.env = NULL;          }
+    if (!(handlers->events & RISA_EVENT_INTERRUPT)) { sim->handlers.interrupt = NULL;    }
+    if (!(handlers->events & RISA_EVENT_EXIT))      { sim->handlers.exit = NULL;         }
+    return 0;
+}
+
+void risaEnableClint(risaSim *sim, uint32_t base) {
+    clintEnable(sim, base);
+}
+
+int risaEnableCache(risaSim *sim, const char *spec) {
+    cacheFree(sim);
+    return cacheCreate(sim, spec);
+}
+
+void risaCacheReport(risaSim *sim, FILE *out) {
+    cacheReport(sim, out);
+}
+
+int risaEnableTiming(risaSim *sim, const char *spec) {
+    timingFree(sim);
+    return timingCreate(sim, spec);
+}
+
+uint64_t risaTimingCycles(const risaSim *sim) {
+    return timingCycles(sim);
+}
+
+void risaTimingReport(risaSim *sim, FILE *out) {
+    timingReport(sim, out);
+}
+
+int risaEnableBbv(risaSim *sim, const char *path, uint64_t interval) {
+    bbvFree(sim);
+    return bbvCreate(sim, path, interval);
+}
+
+int risaEnableSampling(risaSim *sim, uint64_t interval, uint64_t warmup, const uint64_t *points,
+    const double *weights, unsigned count) {
+    return sampleCreate(sim, interval, warmup, points, weights, count);
+}
+
+int risaLoadSimpoints(risaSim *sim, uint64_t interval, uint64_t warmup, const char *simpointsPath,
+    const char *weightsPath) {
+    return sampleLoad(sim, interval, warmup, simpointsPath, weightsPath);
+}
+
+void risaSampleReport(risaSim *sim, FILE *out) {
+    sampleReport(sim, out);
+}
+
+int risaRecord(risaSim *sim, const char *path) {
+    sim->replayMode = REPLAY_RECORD;
+    sim->replayFile = path;
+    return replayStart(sim);
+}
+
+int risaReplay(risaSim *sim, const char *path) {
+    sim->replayMode = REPLAY_PLAYBACK;
+    sim->replayFile = path;
+    return replayStart(sim);
+}
+
+int risaLoadTranslation(risaSim *sim, const char *path) {
+    return aotOpen(sim, path);
+}
+
+int risaLoadCachedTranslation(risaSim *sim, const char *dir) {
+    return aotOpenCached(sim, dir);
+}
+
+void risaTranslationReport(risaSim *sim, FILE *out) {
+    aotReport(sim, out);
+}
+
+int risaPredecode(risaSim *sim) {
+    return predecodeStart(sim);
+}
+
+int risaReadMem(const risaSim *sim, uint32_t addr, void *buf, size_t len) {
+    const u8 *src = (len <= 0xffffffffULL) ? memPeek(sim, addr, (u32)len) : NULL;
+    if (src == NULL) {
+        return EFAULT;
+    }
+    memcpy(buf, src, len);
+    return 0;
+}
+
+int risaWriteMem(risaSim *sim, uint32_t addr, const void *buf, size_t len) {
+    u8 *dest = (len <= 0xffffffffULL) ? memSpan(sim, addr, (u32)len, 0) : NULL;
+    if (dest == NULL) {
+        return EFAULT;
+    }
+    memcpy(dest, buf, len);
+    AOT_CODE_WRITTEN(sim, addr, (u32)len);
+    if (sim->replayMode == REPLAY_RECORD) {
+        replayMemWritten(sim, addr, (u32)len);
+    }
+    return 0;
+}
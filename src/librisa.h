@@ -0,0 +1,207 @@
+#ifndef LIBRISA_H
+#define LIBRISA_H
+
+// Embeddable rISA - every handle owns its own hart, guest memory, guest files and handler library (no
+// process-global state), so any number of simulations can run concurrently in one process. A handle must
+// only be used by one thread at a time. The exception is GDB-mode watchpoints/reverse execution: they install
+// process-wide SIGSEGV/SIGBUS handlers (only the thread running the GDB-mode hart has its faults taken as
+// watch hits - other faults go to whatever handler was installed before), so don't use them in a process that
+// installs its own handlers for those signals afterwards.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rv32iHart risaSim;
+
+// Why risaRun() returned
+typedef enum {
+    RISA_RUN_LIMIT = 0,     // Instruction budget used up (also: no stop requested yet)
+    RISA_RUN_EXIT,          // Guest called exit - code from risaExitCode()
+    RISA_RUN_HALT,          // risaHalt() (or SIGINT/GDB kill when run from the risa executable)
+    RISA_RUN_ERROR          // Invalid instruction or PC out of range - errno from risaExitCode()
+} RisaRunStatus;
+
+#define RISA_RUN_UNLIMITED  UINT64_MAX
+
+// Create a simulation with "memSize" bytes of guest memory (0 for the default) and optional handler library
+// (NULL for the default stubs) - returns NULL if guest memory couldn't be allocated
+risaSim *risaCreate(uint32_t memSize, const char *handlerLibrary);
+void risaDestroy(risaSim *sim);
+// Replace guest memory with regions from "<kind>:<base>:<size>[,...]" (kind ram, rom or mmio, i.e.
+// "rom:0x0:64k,ram:0x20000000:256k,mmio:0x40000000:1m") - host pages are only allocated once the guest touches
+// them and mmio regions go to the handler MMIO callback. Call before loading the image. Returns 0, EINVAL or ENOMEM.
+int risaSetMemoryMap(risaSim *sim, const char *spec);
+// Back guest memory (the current map, and any later one) with "<pages>[,node:<n>|node:local]" - pages 4k, thp
+// (transparent huge pages) or hugetlb (explicit huge pages, thp if the host has none reserved), node:local prefers
+// the NUMA node of the calling thread (so create the sim on the thread that runs it). Anything the host can't give
+// falls back to 4 KB pages/no placement. Call before loading the image. Returns 0, EINVAL or ENOMEM.
+int risaSetMemoryBacking(risaSim *sim, const char *spec);
+// Print per-region touched memory and the backing each region got
+void risaMemoryReport(risaSim *sim, FILE *out);
+
+// Copy a program image into guest memory at "addr" - returns 0, EIO or ENOMEM (doesn't fit)
+int risaLoadImage(risaSim *sim, const void *image, size_t len, uint32_t addr);
+int risaLoadFile(risaSim *sim, const char *path, uint32_t addr);
+
+// Run up to "maxInstructions" more instructions (or RISA_RUN_UNLIMITED) - returns a RisaRunStatus.
+// Runs can be resumed after RISA_RUN_LIMIT and RISA_RUN_HALT.
+int risaRun(risaSim *sim, uint64_t maxInstructions);
+// Stop risaRun() before the next instruction (safe to call from another thread or a signal handler) - a halt
+// requested while no run is in progress stops the next risaRun() before its first instruction
+void risaHalt(risaSim *sim);
+int risaExitCode(const risaSim *sim);
+uint64_t risaCycleCount(const risaSim *sim);
+
+// Register/memory access between runs - return 0 or EINVAL (bad register index) / EFAULT (bad range)
+uint32_t risaReadPc(const risaSim *sim);
+void risaWritePc(risaSim *sim, uint32_t pc);
+// Instruction word at the PC (i.e. the one a handler callback was called for) - 0 if the PC isn't in guest memory.
+// Handler ABI v1 libraries can still read IF/targetAddress off the hart, filled in right before each v1 call.
+uint32_t risaReadInstruction(const risaSim *sim);
+int risaReadReg(const risaSim *sim, unsigned reg, uint32_t *value);
+int risaWriteReg(risaSim *sim, unsigned reg, uint32_t value);
+int risaReadFreg(const risaSim *sim, unsigned reg, uint32_t *bits);
+int risaWriteFreg(risaSim *sim, unsigned reg, uint32_t bits);
+int risaReadMem(const risaSim *sim, uint32_t addr, void *buf, size_t len);
+int risaWriteMem(risaSim *sim, uint32_t addr, const void *buf, size_t len);
+
+// Map the built-in CLINT (msip/mtimecmp/mtime, mtime counts cycles) at "base" - its timer and software
+// interrupts are taken through mtvec once enabled in mie/mstatus
+#define RISA_CLINT_DEFAULT_BASE     0x02000000
+void risaEnableClint(risaSim *sim, uint32_t base);
+
+// Model an L1I/L1D/L2 hierarchy fed by every fetch/load/store from now on (replaces any previous one) - spec is
+// "<l1i|l1d|l2>:<size>:<ways>:<lineSize>[:<lru|fifo|random>]" items (plus "region:<size>" for the per-PC-region
+// stats granularity) separated by commas. Returns 0, EINVAL (bad spec) or ENOMEM.
+int risaEnableCache(risaSim *sim, const char *spec);
+// Print totals and per-PC-region hits/misses/evictions (nothing if no cache is modelled)
+void risaCacheReport(risaSim *sim, FILE *out);
+
+// Estimate cycles with an in-order pipeline model (per-class latencies, load-use/multi-cycle stalls, static/
+// bimodal/gshare predictor with BTB and RAS) fed by every retired instruction from now on - spec is "default"
+// or comma separated "bp:<static|bimodal|gshare>[:<bits>]", "btb:<n>", "ras:<n>", "<alu|load|mul|div|fp|fdiv>:<n>",
+// "mispredict:<n>" and "redirect:<n>" items. Returns 0, EINVAL (bad spec) or ENOMEM.
+int risaEnableTiming(risaSim *sim, const char *spec);
+// Estimated cycles so far (0 if no timing model is attached)
+uint64_t risaTimingCycles(const risaSim *sim);
+// Print cycles, CPI breakdown and predictor accuracy (nothing if no timing model is attached)
+void risaTimingReport(risaSim *sim, FILE *out);
+
+// Write SimPoint basic-block vectors to "path" - one "T:<id>:<count> ..." line per "interval" cycles, counting
+// instructions per block (a run entered at a PC and ended by a taken branch/jump or trap). The file is completed
+// and closed by risaDestroy(). Returns 0, EINVAL (zero interval), ENOENT or ENOMEM.
+int risaEnableBbv(risaSim *sim, const char *path, uint64_t interval);
+// Sampled runs - risaRun() fast-forwards functionally to "warmup" cycles before each point (interval index), feeds
+// the cache/timing models through the warmup and the point's interval, then runs the rest functionally. "weights"
+// may be NULL for equal weights. Give the whole budget to one risaRun() call. Returns 0, EINVAL or ENOMEM.
+int risaEnableSampling(risaSim *sim, uint64_t interval, uint64_t warmup, const uint64_t *points,
+    const double *weights, unsigned count);
+// Same from SimPoint's .simpoints/.weights output ("weightsPath" may be NULL) - also ENOENT if a file is missing
+int risaLoadSimpoints(risaSim *sim, uint64_t interval, uint64_t warmup, const char *simpointsPath,
+    const char *weightsPath);
+// Per-point instructions/CPI/MPKI and their weighted estimate (nothing if sampling isn't enabled)
+void risaSampleReport(risaSim *sim, FILE *out);
+
+// Deterministic record/replay - call once the image is loaded (before the first risaRun()). Recording logs
+// every external input to "path": handler MMIO load values, the state changes (registers/PC/mip and guest memory
+// written through risaWriteMem()) made by interrupt and env callbacks with the cycle they ran at, and the
+// results of host I/O syscalls (open/close/read/write/lseek/fstat/unlink). Playback checks the image matches,
+// detaches every handler and feeds the log back instead - guest output is still printed, host files are never
+// touched. A playback run that stops matching the log halts with an error. Returns 0, ENOENT, EINVAL (not a
+// log for this image) or ENOMEM. "path" must stay valid until risaDestroy().
+int risaRecord(risaSim *sim, const char *path);
+int risaReplay(risaSim *sim, const char *path);
+
+// Run the basic blocks of a risa-aot translation of the loaded image natively (a shared library built from the C
+// risa-aot writes) - blocks stand in for the interpreter only where nothing needs to see each instruction (no
+// cache/timing/BBV model attached, no tracing, GDB or v1 MMIO handler), so results and cycle counts are the same.
+// Call once the image is loaded. Returns 0, ENOENT, EINVAL (not a translation of this image for this build of
+// rISA) or ENOMEM.
+int risaLoadTranslation(risaSim *sim, const char *path);
+// Same, from a cache directory shared between runs - the loaded image is translated and built with $CC (cc if unset,
+// rISA headers from $RISA_INCLUDE) into it the first time and loaded from there after that. Returns 0 (also if
+// nothing is translatable), ENOENT (could not build it), EINVAL or ENOMEM.
+int risaLoadCachedTranslation(risaSim *sim, const char *dir);
+// Blocks/instructions run translated (nothing if no translation is loaded)
+void risaTranslationReport(risaSim *sim, FILE *out);
+// Decode the loaded image up front (SIMD kernels where the host has them) - the interpreter takes fields from the
+// table while the code is unchanged. Returns 0, EINVAL (nothing loaded) or ENOMEM.
+int risaPredecode(risaSim *sim);
+
+// --- Handler ABI v2 ---
+// Handlers get explicit arguments and the hart as an opaque token (use the accessors above on it) instead of
+// the whole rv32iHart_t. Only subscribed events are ever dispatched.
+#define RISA_HANDLER_ABI_VERSION    2
+
+typedef enum {
+    RISA_EVENT_MMIO         = (1 << 0),     // Loads/stores inside [mmioBase, mmioBase + mmioSize)
+    RISA_EVENT_ENV          = (1 << 1),     // ECALL/EBREAK/FENCE
+    RISA_EVENT_INTERRUPT    = (1 << 2),     // Every interrupt period
+    RISA_EVENT_EXIT         = (1 << 3)      // Simulation teardown
+} RisaEvent;
+
+typedef enum {
+    RISA_ENV_ECALL = 0,
+    RISA_ENV_EBREAK,
+    RISA_ENV_FENCE
+} RisaEnvKind;
+
+typedef struct {
+    uint32_t    abiVersion;     // RISA_HANDLER_ABI_VERSION (preset by rISA before risaHandlerRegister())
+    uint32_t    events;         // RisaEvent bits subscribed to
+    uint32_t    mmioBase;       // Guest address range routed to mmio() instead of guest memory
+    uint32_t    mmioSize;
+    void        *ctx;           // Handler state - passed back to every callback
+    // Access of "width" (1/2/4) bytes - loads return the (zero-extended) value, stores get "value"
+    uint32_t    (*mmio)(void *ctx, risaSim *hart, uint32_t addr, uint32_t width, uint32_t value, int isWrite);
+    // Return non-zero if handled - otherwise the default handler (newlib syscalls) runs
+    int         (*env)(void *ctx, risaSim *hart, RisaEnvKind kind);
+    void        (*interrupt)(void *ctx, risaSim *hart, uint64_t cycle);
+    void        (*exit)(void *ctx, risaSim *hart);
+} risaHandlers;
+
+// Exported by v2 handler libraries - fill in "handlers" and return 0 (otherwise the default handlers are used)
+#define RISA_HANDLER_REGISTER_SYM   "risaHandlerRegister"
+typedef int (*risaHandlerRegisterFn)(risaSim *hart, risaHandlers *handlers);
+
+// Fixed names for v2 callbacks - a handler source linked in at build time (RISA_STATIC_HANDLER) must define all
+// of them (unsubscribed ones can be stubs) so the interpreter calls them directly and LTO can inline them
+#ifdef RISA_STATIC_HANDLER
+// Linked in, they're renamed with RISA_STATIC_HANDLER_PREFIX and kept out of the dynamic symbol table - otherwise
+// they'd clash with (and get bound by) the same names in a dlopen'd handler library
+#ifndef RISA_STATIC_HANDLER_PREFIX
+#define RISA_STATIC_HANDLER_PREFIX  risaStatic
+#endif
+#define RISA_STATIC_PASTE(prefix, name)     prefix##name
+#define RISA_STATIC_NAME(prefix, name)      RISA_STATIC_PASTE(prefix, name)
+#define risaHandlerMmio             RISA_STATIC_NAME(RISA_STATIC_HANDLER_PREFIX, HandlerMmio)
+#define risaHandlerEnv              RISA_STATIC_NAME(RISA_STATIC_HANDLER_PREFIX, HandlerEnv)
+#define risaHandlerInterrupt        RISA_STATIC_NAME(RISA_STATIC_HANDLER_PREFIX, HandlerInterrupt)
+#define risaHandlerExit             RISA_STATIC_NAME(RISA_STATIC_HANDLER_PREFIX, HandlerExit)
+#define risaHandlerRegister         RISA_STATIC_NAME(RISA_STATIC_HANDLER_PREFIX, HandlerRegister)
+#if defined(__GNUC__) && !defined(_WIN32)
+#pragma GCC visibility push(hidden)
+#endif
+#endif
+uint32_t risaHandlerMmio(void *ctx, risaSim *hart, uint32_t addr, uint32_t width, uint32_t value, int isWrite);
+int risaHandlerEnv(void *ctx, risaSim *hart, RisaEnvKind kind);
+void risaHandlerInterrupt(void *ctx, risaSim *hart, uint64_t cycle);
+void risaHandlerExit(void *ctx, risaSim *hart);
+int risaHandlerRegister(risaSim *hart, risaHandlers *handlers);
+#if defined(RISA_STATIC_HANDLER) && defined(__GNUC__) && !defined(_WIN32)
+#pragma GCC visibility pop
+#endif
+
+// Attach v2 handlers directly (i.e. callbacks in the embedding program) - returns 0 or EINVAL (ABI mismatch)
+int risaSetHandlers(risaSim *sim, const risaHandlers *handlers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBRISA_H
@@ -8,7 +8,7 @@ const char *toolBanner =
 " \\ \\   _  _\\ \\  \\ \\_____  \\ \\   __  \\  \n"
 "  \\ \\  \\\\  \\\\ \\  \\|____|\\  \\ \\  \\ \\  \\ \n"
 "   \\ \\__\\\\ _\\\\ \\__\\____\\_\\  \\ \\__\\ \\__\\\n"
-"    \\|__|\\|__|\\|__|\\_________\\|__|\\|__| - RISCV (RV32I) ISA simulator\n"
+"    \\|__|\\|__|\\|__|\\_________\\|__|\\|__| - RISCV (RV32IF) ISA simulator\n"
 "                  \\|_________|         \n\n";
 
 int main(int argc, char** argv) {
@@ -17,7 +17,9 @@ int main(int argc, char** argv) {
     rv32iHart_t cpu = {0};
     int err = setupSimulator(argc, argv, &cpu);
     if (err) { return err; }
-    cpu.handlerProcs[RISA_INIT_HANDLER_PROC](&cpu);
+    if (cpu.handlerProcs[RISA_INIT_HANDLER_PROC] != NULL) {
+        cpu.handlerProcs[RISA_INIT_HANDLER_PROC](&cpu);
+    }
     // Run
     err = executionLoop(&cpu);
     return err;
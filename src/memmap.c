@@ -0,0 +1,467 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memmap.h"
+#include "aot.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+static const char *g_memKindNames[] = { "ram", "rom", "mmio" };
+static const char *g_memPageNames[] = { "4k", "thp", "hugetlb" };
+
+// Linux mbind() modes (numaif.h is libnuma's)
+#define MEM_MPOL_PREFERRED      1
+#define MEM_MPOL_BIND           2
+
+#define MEM_PAGE_COUNT(size)    (((u64)(size) + MEM_PAGE_SIZE - 1) >> MEM_PAGE_SHIFT)
+
+// Size with an optional k/m suffix - returns 0 if invalid
+static u32 parseSize(const char *str, char **end) {
+    unsigned long val = strtoul(str, end, 0);
+    if (**end == 'k' || **end == 'K')       { val *= KB_MULTIPLIER; ++*end; }
+    else if (**end == 'm' || **end == 'M')  { val *= MB_MULTIPLIER; ++*end; }
+    return (u32)val;
+}
+
+// One "<kind>:<base>:<size>" item - returns 0 or EINVAL
+static int parseItem(MemRegion *region, const char *item, u32 len) {
+    const char *end = item + len;
+    const char *colon = memchr(item, ':', len);
+    if (colon == NULL) {
+        return EINVAL;
+    }
+    u32 nameLen = (u32)(colon - item);
+    u32 kind = 0;
+    while (kind < sizeof(g_memKindNames)/sizeof(g_memKindNames[0]) &&
+        (nameLen != strlen(g_memKindNames[kind]) || strncmp(item, g_memKindNames[kind], nameLen) != 0)) {
+        ++kind;
+    }
+    if (kind == sizeof(g_memKindNames)/sizeof(g_memKindNames[0])) {
+        return EINVAL;
+    }
+    char *pos;
+    unsigned long base = strtoul(colon + 1, &pos, 0);
+    if (*pos != ':') {
+        return EINVAL;
+    }
+    u32 size = parseSize(pos + 1, &pos);
+    if (pos != end || size == 0 || base > 0xffffffffUL || ((u64)base + size) > 0x100000000ULL ||
+        (base & (MEM_PAGE_SIZE - 1)) || (size & (MEM_PAGE_SIZE - 1))) {
+        return EINVAL;
+    }
+    region->base = (u32)base;
+    region->size = size;
+    region->kind = kind;
+    return 0;
+}
+
+static int compareRegions(const void *a, const void *b) {
+    u32 left = ((const MemRegion*)a)->base;
+    u32 right = ((const MemRegion*)b)->base;
+    return (left > right) - (left < right);
+}
+
+static void freeRegions(MemMap *map) {
+    for (u32 i=0; i<map->regionCount; ++i) {
+        MemRegion *region = &map->regions[i];
+        if (region->owned && region->host != NULL) {
+            UNMAP_GUEST_MEM(region->host, region->hostSize);
+        }
+        free(region->touched);
+    }
+}
+
+#ifdef MADV_HUGEPAGE
+// Anonymous mapping of "size" starting on an "align" boundary (so THP can back it from its first byte)
+static void *mapAligned(u64 size, u64 align) {
+    u8 *mem = (u8*)MAP_GUEST_MEM(size + align);
+    if ((void*)mem == MAP_GUEST_MEM_FAILED) {
+        return MAP_GUEST_MEM_FAILED;
+    }
+    u64 lead = (align - ((uintptr_t)mem & (align - 1))) & (align - 1);
+    if (lead != 0) {
+        UNMAP_GUEST_MEM(mem, lead);
+    }
+    UNMAP_GUEST_MEM(mem + lead + size, align - lead);
+    return mem + lead;
+}
+#endif
+
+// Bind/prefer the region's pages to a NUMA node - before any is touched, so they're all placed there
+static void placeRegion(const MemBacking *backing, MemRegion *region) {
+    if (backing->numaPolicy == MEM_NUMA_ANY) {
+        return;
+    }
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+    unsigned hostCpu = 0;
+    unsigned node = backing->numaNode;
+    int mode = MEM_MPOL_BIND;
+    if (backing->numaPolicy == MEM_NUMA_LOCAL) {
+        // Preferred rather than bound - the hart can still run if its node fills up
+        mode = MEM_MPOL_PREFERRED;
+        if (syscall(SYS_getcpu, &hostCpu, &node, NULL) != 0) {
+            LOG_W("Could not get the NUMA node of this thread - guest memory not placed.\n");
+            return;
+        }
+    }
+    // The kernel reads "maxnode - 1" bits
+    unsigned long mask[(MEM_NUMA_MAX_NODES / (8 * sizeof(unsigned long))) + 1] = { 0 };
+    if (node < MEM_NUMA_MAX_NODES) {
+        mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    }
+    if (node >= MEM_NUMA_MAX_NODES ||
+        syscall(SYS_mbind, region->host, region->hostSize, mode, mask, MEM_NUMA_MAX_NODES + 1, 0) != 0) {
+        LOG_W("Could not bind guest memory region ( 0x%08x ) to NUMA node ( %u ).\n", region->base, node);
+        return;
+    }
+    region->numaNode = (int)node;
+#else
+    LOG_W("NUMA placement is not supported on this host - guest memory not placed.\n");
+#endif
+}
+
+// Reserve one RAM/ROM region with the pages asked for, falling back to what the host has - returns 0 or ENOMEM
+static int reserveRegion(const MemBacking *backing, MemRegion *region) {
+    void *mem = MAP_GUEST_MEM_FAILED;
+    region->hostSize = region->size;
+    region->pages = MEM_PAGES_DEFAULT;
+#ifdef MAP_HUGETLB
+    if (backing->pages == MEM_PAGES_HUGETLB) {
+        u64 hostSize = ((u64)region->size + MEM_HUGE_PAGE_SIZE - 1) & ~(u64)(MEM_HUGE_PAGE_SIZE - 1);
+        // Reserved from the host's pool up front (MAP_NORESERVE would SIGBUS on touch once the pool runs dry)
+        mem = mmap(NULL, hostSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            region->hostSize = hostSize;
+            region->pages = MEM_PAGES_HUGETLB;
+        }
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if (mem == MAP_GUEST_MEM_FAILED && backing->pages != MEM_PAGES_DEFAULT && region->size >= MEM_HUGE_PAGE_SIZE) {
+        mem = mapAligned(region->size, MEM_HUGE_PAGE_SIZE);
+        if (mem != MAP_GUEST_MEM_FAILED && madvise(mem, region->size, MADV_HUGEPAGE) == 0) {
+            region->pages = MEM_PAGES_THP;
+        }
+    }
+#endif
+    if (mem == MAP_GUEST_MEM_FAILED) {
+        mem = MAP_GUEST_MEM(region->size);
+    }
+    if (mem == MAP_GUEST_MEM_FAILED) {
+        LOG_E("Could not reserve guest memory region ( 0x%08x, %u bytes ).\n", region->base, region->size);
+        return ENOMEM;
+    }
+    if (region->pages != backing->pages && region->size >= MEM_HUGE_PAGE_SIZE) {
+        LOG_W("No %s pages for guest memory region ( 0x%08x ) - using %s.\n", g_memPageNames[backing->pages],
+            region->base, g_memPageNames[region->pages]);
+    }
+    region->host = (u8*)mem;
+    region->owned = 1;
+    placeRegion(backing, region);
+    return 0;
+}
+
+// Reserve the backing and page bitmap of every region - returns 0 or ENOMEM
+static int reserveRegions(const MemBacking *backing, MemMap *map) {
+    for (u32 i=0; i<map->regionCount; ++i) {
+        MemRegion *region = &map->regions[i];
+        region->numaNode = MEM_NUMA_NONE;
+        region->touched = (u8*)calloc((size_t)(MEM_PAGE_COUNT(region->size) / 8) + 1, sizeof(u8));
+        if (region->touched == NULL) {
+            return ENOMEM;
+        }
+        if (region->kind != MEM_MMIO && reserveRegion(backing, region)) {
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+// Point virtMem/virtMemSize at the region holding address 0 (what the v1 handler ABI and GDB-mode work on)
+static void setAddressZero(rv32iHart_t *cpu) {
+    MemMap *map = cpu->memMap;
+    cpu->virtMem = NULL;
+    cpu->virtMemSize = 0;
+    if (map->regionCount > 0 && map->regions[0].base == 0 && map->regions[0].host != NULL) {
+        cpu->virtMem = (u32*)map->regions[0].host;
+        cpu->virtMemSize = map->regions[0].size;
+    }
+    cpu->virtMemMapped = 1;
+}
+
+// Check and reserve a parsed "map" and swap it in for the hart's (frees it on failure)
+static int installMap(rv32iHart_t *cpu, MemMap *map) {
+    qsort(map->regions, map->regionCount, sizeof(MemRegion), compareRegions);
+    for (u32 i=1; i<map->regionCount; ++i) {
+        const MemRegion *prev = &map->regions[i - 1];
+        if (((u64)prev->base + prev->size) > map->regions[i].base) {
+            LOG_E("Memory map regions overlap at ( 0x%08x ).\n", map->regions[i].base);
+            free(map);
+            return EINVAL;
+        }
+    }
+    int err = (map->regionCount == 0) ? EINVAL : reserveRegions(&cpu->memBacking, map);
+    if (err) {
+        freeRegions(map);
+        free(map);
+        return err;
+    }
+    memMapFree(cpu);
+    cpu->memMap = map;
+    setAddressZero(cpu);
+    memTlbFlush(cpu);
+    return 0;
+}
+
+int memMapCreate(rv32iHart_t *cpu, const char *spec) {
+    MemMap *map = (MemMap*)calloc(1, sizeof(MemMap));
+    if (map == NULL) {
+        return ENOMEM;
+    }
+    if (spec == NULL) {
+        map->regions[0].size = cpu->virtMemSize;
+        map->regions[0].kind = MEM_RAM;
+        map->regionCount = 1;
+    }
+    for (const char *item = spec; item != NULL && *item != '\0';) {
+        const char *comma = strchr(item, ',');
+        u32 len = (comma != NULL) ? (u32)(comma - item) : (u32)strlen(item);
+        if (map->regionCount == MEM_MAX_REGIONS || parseItem(&map->regions[map->regionCount], item, len)) {
+            LOG_E("Invalid memory map item ( %.*s ).\n", (int)len, item);
+            free(map);
+            return EINVAL;
+        }
+        map->regionCount++;
+        item += len + ((comma != NULL) ? 1 : 0);
+    }
+    return installMap(cpu, map);
+}
+
+int memMapSetBacking(rv32iHart_t *cpu, const char *spec) {
+    MemBacking backing = { 0 };
+    for (const char *item = spec; *item != '\0';) {
+        const char *comma = strchr(item, ',');
+        u32 len = (comma != NULL) ? (u32)(comma - item) : (u32)strlen(item);
+        u32 pages = 0;
+        while (pages < sizeof(g_memPageNames)/sizeof(g_memPageNames[0]) &&
+            (len != strlen(g_memPageNames[pages]) || strncmp(item, g_memPageNames[pages], len) != 0)) {
+            ++pages;
+        }
+        char *end = NULL;
+        if (pages < sizeof(g_memPageNames)/sizeof(g_memPageNames[0])) {
+            backing.pages = pages;
+        }
+        else if (len == strlen("node:local") && strncmp(item, "node:local", len) == 0) {
+            backing.numaPolicy = MEM_NUMA_LOCAL;
+        }
+        else if (len > strlen("node:") && strncmp(item, "node:", strlen("node:")) == 0 &&
+            (backing.numaNode = (u32)strtoul(item + strlen("node:"), &end, 10)) < MEM_NUMA_MAX_NODES &&
+            end == item + len) {
+            backing.numaPolicy = MEM_NUMA_NODE;
+        }
+        else {
+            LOG_E("Invalid memory backing item ( %.*s ).\n", (int)len, item);
+            return EINVAL;
+        }
+        item += len + ((comma != NULL) ? 1 : 0);
+    }
+    cpu->memBacking = backing;
+    return 0;
+}
+
+int memMapRebuild(rv32iHart_t *cpu) {
+    if (cpu->memMap == NULL) {
+        return 0;
+    }
+    MemMap *map = (MemMap*)calloc(1, sizeof(MemMap));
+    if (map == NULL) {
+        return ENOMEM;
+    }
+    // Same layout, new backing (a hart's own virtMem at address 0 becomes a reserved region like any other)
+    map->regionCount = cpu->memMap->regionCount;
+    for (u32 i=0; i<map->regionCount; ++i) {
+        map->regions[i].base = cpu->memMap->regions[i].base;
+        map->regions[i].size = cpu->memMap->regions[i].size;
+        map->regions[i].kind = cpu->memMap->regions[i].kind;
+    }
+    return installMap(cpu, map);
+}
+
+int memMapStart(rv32iHart_t *cpu) {
+    if (cpu->memMap != NULL) {
+        return 0;
+    }
+    MemMap *map = (MemMap*)calloc(1, sizeof(MemMap));
+    u8 *touched = (u8*)calloc((size_t)(MEM_PAGE_COUNT(cpu->virtMemSize) / 8) + 1, sizeof(u8));
+    if (map == NULL || touched == NULL) {
+        free(map);
+        free(touched);
+        return ENOMEM;
+    }
+    map->regions[0].size = cpu->virtMemSize;
+    map->regions[0].kind = MEM_RAM;
+    map->regions[0].host = (u8*)cpu->virtMem;
+    map->regions[0].touched = touched;
+    map->regions[0].numaNode = MEM_NUMA_NONE;
+    map->regionCount = (cpu->virtMem != NULL) ? 1 : 0;
+    cpu->memMap = map;
+    memTlbFlush(cpu);
+    return 0;
+}
+
+void memMapFree(rv32iHart_t *cpu) {
+    MemMap *map = cpu->memMap;
+    if (map == NULL) {
+        return;
+    }
+    // virtMem is only left to cleanupSimulator() if it's the hart's own
+    if (map->regionCount > 0 && map->regions[0].owned && (u8*)cpu->virtMem == map->regions[0].host) {
+        cpu->virtMem = NULL;
+        cpu->virtMemSize = 0;
+    }
+    freeRegions(map);
+    free(map);
+    cpu->memMap = NULL;
+    memTlbFlush(cpu);
+}
+
+void memTlbFlush(rv32iHart_t *cpu) {
+    for (u32 i=0; i<MEM_TLB_SIZE; ++i) {
+        cpu->tlb.load[i].tag = MEM_TLB_EMPTY;
+        cpu->tlb.store[i].tag = MEM_TLB_EMPTY;
+    }
+}
+
+// Region holding all of guest [addr, addr + len) - NULL if none does
+static MemRegion *findRegion(const MemMap *map, u32 addr, u32 len) {
+    if (map == NULL) {
+        return NULL;
+    }
+    for (u32 i=0; i<map->regionCount; ++i) {
+        const MemRegion *region = &map->regions[i];
+        if (addr >= region->base && ((u64)(addr - region->base) + len) <= region->size) {
+            return (MemRegion*)region;
+        }
+    }
+    return NULL;
+}
+
+static void markTouched(MemMap *map, MemRegion *region, u32 offset, u32 len) {
+    if (len == 0) {
+        return;
+    }
+    u32 last = (u32)(((u64)offset + len - 1) >> MEM_PAGE_SHIFT);
+    for (u32 page=(offset >> MEM_PAGE_SHIFT); page<=last; ++page) {
+        if (!(region->touched[page >> 3] & (1 << (page & 0x7)))) {
+            region->touched[page >> 3] |= (u8)(1 << (page & 0x7));
+            map->pagesTouched++;
+        }
+    }
+}
+
+u8 *memSpan(rv32iHart_t *cpu, u32 addr, u32 len, int store) {
+    MemRegion *region = findRegion(cpu->memMap, addr, len);
+    if (region == NULL || region->host == NULL || (store && region->kind == MEM_ROM)) {
+        return NULL;
+    }
+    markTouched(cpu->memMap, region, addr - region->base, len);
+    if (store) {
+        AOT_CODE_WRITTEN(cpu, addr, len);
+    }
+    return region->host + (addr - region->base);
+}
+
+const u8 *memPeek(const rv32iHart_t *cpu, u32 addr, u32 len) {
+    const MemRegion *region = findRegion(cpu->memMap, addr, len);
+    return (region != NULL && region->host != NULL) ? region->host + (addr - region->base) : NULL;
+}
+
+const u8 *memLoadedImage(const rv32iHart_t *cpu, u32 *size) {
+    const MemMap *map = cpu->memMap;
+    const MemRegion *region = (map != NULL && map->regionCount != 0) ? &map->regions[0] : NULL;
+    if (region == NULL || region->base != 0 || region->host == NULL) {
+        return NULL;
+    }
+    u32 end = 0;
+    for (u32 page=0; page<((region->size + MEM_PAGE_SIZE - 1) >> MEM_PAGE_SHIFT); ++page) {
+        end = (region->touched[page >> 3] & (1 << (page & 0x7))) ? ((page + 1) << MEM_PAGE_SHIFT) : end;
+    }
+    *size = (end < region->size) ? end : region->size;
+    return (*size != 0) ? region->host : NULL;
+}
+
+u8 *memMiss(rv32iHart_t *cpu, u32 addr, u32 width, int store) {
+    MemMap *map = cpu->memMap;
+    MemRegion *region = findRegion(map, addr, width);
+    if (region == NULL || region->host == NULL || (store && region->kind == MEM_ROM)) {
+        return NULL;
+    }
+    map->tlbMisses++;
+    u32 offset = addr - region->base;
+    markTouched(map, region, offset, width);
+    u8 *host = region->host + offset;
+    // Only whole host pages go in the TLB (a hart's own malloc'd virtMem needn't end on a page boundary)
+    u32 pageOffset = offset & ~(MEM_PAGE_SIZE - 1);
+    if (((offset + width - 1) >> MEM_PAGE_SHIFT) == (offset >> MEM_PAGE_SHIFT) &&
+        (region->owned || ((u64)pageOffset + MEM_PAGE_SIZE) <= region->size)) {
+        MemTlbEntry *entry = store ? &cpu->tlb.store[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_SIZE - 1)] :
+            &cpu->tlb.load[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_SIZE - 1)];
+        entry->tag = addr >> MEM_PAGE_SHIFT;
+        entry->page = region->host + pageOffset;
+    }
+    return host;
+}
+
+const char *memString(rv32iHart_t *cpu, u32 addr, u32 *len) {
+    MemRegion *region = findRegion(cpu->memMap, addr, 1);
+    if (region == NULL || region->host == NULL) {
+        return NULL;
+    }
+    // A page at a time so only the pages the string is in count as touched
+    u32 start = addr - region->base;
+    for (u32 offset=start; offset<region->size;) {
+        u64 pageEnd = ((u64)offset | (MEM_PAGE_SIZE - 1)) + 1;
+        u32 chunk = (u32)(((pageEnd < region->size) ? pageEnd : region->size) - offset);
+        markTouched(cpu->memMap, region, offset, chunk);
+        const u8 *nul = (const u8*)memchr(region->host + offset, '\0', chunk);
+        if (nul != NULL) {
+            *len = (u32)(nul - (region->host + start));
+            return (const char*)(region->host + start);
+        }
+        offset += chunk;
+    }
+    return NULL;
+}
+
+int memIsMmio(const rv32iHart_t *cpu, u32 addr) {
+    const MemRegion *region = findRegion(cpu->memMap, addr, 1);
+    return (region != NULL) && (region->kind == MEM_MMIO);
+}
+
+void memMapReport(rv32iHart_t *cpu, FILE *out) {
+    MemMap *map = cpu->memMap;
+    if (map == NULL) {
+        return;
+    }
+    fprintf(out, "Memory map: %lluKB touched, %llu TLB misses\n",
+        (unsigned long long)(map->pagesTouched * (MEM_PAGE_SIZE / KB_MULTIPLIER)),
+        (unsigned long long)map->tlbMisses);
+    for (u32 i=0; i<map->regionCount; ++i) {
+        const MemRegion *region = &map->regions[i];
+        u64 touched = 0;
+        for (u64 page=0; page<MEM_PAGE_COUNT(region->size); ++page) {
+            touched += (region->touched[page >> 3] >> (page & 0x7)) & 1;
+        }
+        fprintf(out, "  %-4s 0x%08x-0x%08x %10uKB", g_memKindNames[region->kind], region->base,
+            (u32)(region->base + region->size - 1), region->size / KB_MULTIPLIER);
+        if (region->kind != MEM_MMIO) {
+            fprintf(out, " %10lluKB touched, %s pages",
+                (unsigned long long)(touched * (MEM_PAGE_SIZE / KB_MULTIPLIER)), g_memPageNames[region->pages]);
+        }
+        if (region->numaNode != MEM_NUMA_NONE) {
+            fprintf(out, ", NUMA node %d", region->numaNode);
+        }
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#include <stdio.h>
+#include "risa.h"
+#include "clint.h"
+
+#define MEM_MAX_REGIONS         16
+#define MEM_HUGE_PAGE_SIZE      (MB_MULTIPLIER * 2)
+#define MEM_NUMA_MAX_NODES      64
+#define MEM_NUMA_NONE           -1
+
+typedef enum {
+    MEM_RAM = 0,
+    MEM_ROM,                // Read-only to the guest (loaders, handlers and replay can still write it)
+    MEM_MMIO                // No backing - loads/stores go to the handler MMIO callback
+} MemRegionKind;
+
+typedef enum {
+    MEM_PAGES_DEFAULT = 0,  // Host base pages
+    MEM_PAGES_THP,          // Transparent huge pages - huge-page aligned and madvise(MADV_HUGEPAGE)'d
+    MEM_PAGES_HUGETLB       // Explicit huge pages (MAP_HUGETLB) - THP if the host has none reserved
+} MemPageKind;
+
+typedef enum {
+    MEM_NUMA_ANY = 0,       // Host default (first touch)
+    MEM_NUMA_NODE,          // Bound to MemBacking.numaNode
+    MEM_NUMA_LOCAL          // Preferring the node of the thread creating the map (i.e. the one running the hart)
+} MemNumaPolicy;
+
+typedef struct {
+    u32     base;
+    u32     size;
+    u32     kind;                           // MemRegionKind
+    u8      *host;                          // Reserved host address space (NULL for MMIO)
+    u8      *touched;                       // Page bitmap - pages the guest (or a loader) has accessed
+    u8      owned;                          // Reserved by memMapCreate() rather than a hart's own virtMem
+    u8      pages;                          // MemPageKind the host actually gave it
+    u64     hostSize;                       // Reserved length (size rounded up to whole huge pages for hugetlb)
+    int     numaNode;                       // Node it is bound to/prefers (MEM_NUMA_NONE if not placed)
+} MemRegion;
+
+// Guest address space - regions are reserved up front but the host only commits a 4 KB page once it's touched,
+// so memory use follows the pages the guest uses rather than the size of the map
+struct MemMap {
+    u32         regionCount;
+    MemRegion   regions[MEM_MAX_REGIONS];   // In address order, non-overlapping
+    u64         pagesTouched;
+    u64         tlbMisses;
+};
+
+// Regions from "<kind>:<base>:<size>[,...]" (kind ram, rom or mmio, sizes with an optional k/m suffix, bases and
+// sizes 4 KB aligned) - a NULL "spec" is one RAM region of cpu->virtMemSize at address 0. Replaces any existing
+// map (and its contents). Returns 0, EINVAL or ENOMEM.
+int memMapCreate(rv32iHart_t *cpu, const char *spec);
+// Backing for memMapCreate() from "<pages>[,node:<n>|node:local]" (pages 4k, thp or hugetlb) - returns 0 or EINVAL
+int memMapSetBacking(rv32iHart_t *cpu, const char *spec);
+// Reserve the current regions again with cpu->memBacking (their contents are lost) - returns 0 or ENOMEM
+int memMapRebuild(rv32iHart_t *cpu);
+// Wrap a hart's own virtMem as its map if it has none yet (i.e. a hart set up by hand) - returns 0 or ENOMEM
+int memMapStart(rv32iHart_t *cpu);
+void memMapFree(rv32iHart_t *cpu);
+void memTlbFlush(rv32iHart_t *cpu);
+// TLB miss - walk the regions, fill the TLB if the access sits in one whole page, return its host address
+u8 *memMiss(rv32iHart_t *cpu, u32 addr, u32 width, int store);
+// Host address of guest [addr, addr + len) if it is RAM/ROM in one region (NULL otherwise, or for a "store" to
+// ROM) - marks its pages touched (a "store" over translated code stops its use, see aot.h)
+u8 *memSpan(rv32iHart_t *cpu, u32 addr, u32 len, int store);
+// Same without marking pages (i.e. reading state out)
+const u8 *memPeek(const rv32iHart_t *cpu, u32 addr, u32 len);
+// Bytes at address 0 up to the last page touched - before a run, the image the loader wrote (NULL if none)
+const u8 *memLoadedImage(const rv32iHart_t *cpu, u32 *size);
+// NUL-terminated guest string at "addr" (within one region, "len" excludes the NUL) - NULL if unmapped/unterminated
+const char *memString(rv32iHart_t *cpu, u32 addr, u32 *len);
+// Non-zero if "addr" is in an mmio region of the map
+int memIsMmio(const rv32iHart_t *cpu, u32 addr);
+void memMapReport(rv32iHart_t *cpu, FILE *out);
+
+// Handler ABI v2 MMIO or the built-in CLINT - an unsigned compare each (sizes are 0 unless in use). Device ranges
+// take precedence over the map.
+#define MMIO_HIT(cpu, addr) (((u32)((addr) - (cpu)->handlers.mmioBase) < (cpu)->handlers.mmioSize) || \
+    CLINT_HIT(cpu, addr))
+
+// Host address of the "width" guest bytes at "addr" - a TLB hit is one compare and one load. An access that
+// straddles two pages never hits (the tag is checked against its last byte's page).
+static inline u8 *memLoadPtr(rv32iHart_t *cpu, u32 addr, u32 width) {
+    const MemTlbEntry *entry = &cpu->tlb.load[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_SIZE - 1)];
+    if (entry->tag == ((addr + width - 1) >> MEM_PAGE_SHIFT)) {
+        return entry->page + (addr & (MEM_PAGE_SIZE - 1));
+    }
+    return memMiss(cpu, addr, width, 0);
+}
+
+static inline u8 *memStorePtr(rv32iHart_t *cpu, u32 addr, u32 width) {
+    const MemTlbEntry *entry = &cpu->tlb.store[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_SIZE - 1)];
+    if (entry->tag == ((addr + width - 1) >> MEM_PAGE_SHIFT)) {
+        return entry->page + (addr & (MEM_PAGE_SIZE - 1));
+    }
+    return memMiss(cpu, addr, width, 1);
+}
+
+#endif // MEMMAP_H
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "predecode.h"
+#include "memmap.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define PREDECODE_X86
+#if defined(__GNUC__)
+#define PREDECODE_AVX2_FN       __attribute__((target("avx2")))
+#define PREDECODE_HAS_AVX2()    __builtin_cpu_supports("avx2")
+#else
+#define PREDECODE_AVX2_FN
+#define PREDECODE_HAS_AVX2()    0   // No portable runtime check - SSE2 only
+#endif
+#endif
+
+// Same extraction runHart() does - the reference the SIMD kernels must match bit for bit
+static void predecodeScalar(Predecode *pre, const u8 *text, u32 first, u32 count) {
+    for (u32 i=first; i<first+count; ++i) {
+        u32 inst;
+        memcpy(&inst, text + ((size_t)i << 2), sizeof(inst));
+        u32 opcode = GET_OPCODE(inst);
+        s32 imm;
+        switch (g_opcodeToFormat[opcode]) {
+            case S: {
+                imm = (s32)((GET_IMM_4_0(inst) | (GET_IMM_11_5(inst) << 5)) << 20) >> 20;
+                break;
+            }
+            case B: {
+                u32 immPartial = GET_IMM_4_1(inst) | (GET_IMM_10_5(inst) << 4) | (GET_IMM_11_B(inst) << 10) |
+                    (GET_IMM_12(inst) << 11);
+                imm = (s32)(immPartial << 20) >> 19;
+                break;
+            }
+            case U: {
+                imm = (s32)(inst & 0xfffff000);
+                break;
+            }
+            case J: {
+                u32 immPartial = GET_IMM_10_1(inst) | (GET_IMM_11_J(inst) << 10) | (GET_IMM_19_12(inst) << 11) |
+                    (GET_IMM_20(inst) << 19);
+                imm = (s32)(immPartial << 12) >> 11;
+                break;
+            }
+            default: {
+                imm = (s32)inst >> 20;
+                break;
+            }
+        }
+        pre->inst[i]   = inst;
+        pre->imm[i]    = imm;
+        pre->opcode[i] = (u8)opcode;
+        pre->rd[i]     = (u8)GET_RD(inst);
+        pre->rs1[i]    = (u8)GET_RS1(inst);
+        pre->rs2[i]    = (u8)GET_RS2(inst);
+        pre->funct3[i] = (u8)GET_FUNCT3(inst);
+    }
+}
+
+#ifdef PREDECODE_X86
+// Low byte of each 32-bit lane (all fields fit in 7 bits)
+static inline void predecodeStoreBytes4(u8 *dst, __m128i v) {
+    __m128i words = _mm_packs_epi32(v, _mm_setzero_si128());
+    int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, _mm_setzero_si128()));
+    memcpy(dst, &bytes, sizeof(bytes));
+}
+
+#define PREDECODE_SELECT_SSE2(mask, a, b)   _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+
+// Formats are told apart by opcode - S is 0x23/0x27, B 0x63, U 0x17/0x37, J 0x6f (see g_opcodeToFormat), anything
+// else takes the I immediate
+static void predecodeSse2(Predecode *pre, const u8 *text, u32 count) {
+    const __m128i mask5 = _mm_set1_epi32(0x1f);
+    for (u32 i=0; i+4<=count; i+=4) {
+        __m128i w = _mm_loadu_si128((const __m128i*)(text + ((size_t)i << 2)));
+        __m128i opcode = _mm_and_si128(w, _mm_set1_epi32(0x7f));
+        __m128i immI = _mm_srai_epi32(w, 20);
+        __m128i immS = _mm_or_si128(_mm_andnot_si128(mask5, immI), _mm_and_si128(_mm_srli_epi32(w, 7), mask5));
+        __m128i immB = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(_mm_srai_epi32(w, 19), _mm_set1_epi32((int)0xfffff000)),
+                _mm_and_si128(_mm_srli_epi32(w, 20), _mm_set1_epi32(0x7e0))),
+            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(w, 7), _mm_set1_epi32(0x1e)),
+                _mm_and_si128(_mm_slli_epi32(w, 4), _mm_set1_epi32(0x800))));
+        __m128i immU = _mm_and_si128(w, _mm_set1_epi32((int)0xfffff000));
+        __m128i immJ = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(_mm_srai_epi32(w, 11), _mm_set1_epi32((int)0xfff00000)),
+                _mm_and_si128(w, _mm_set1_epi32(0x000ff000))),
+            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(w, 9), _mm_set1_epi32(0x800)),
+                _mm_and_si128(_mm_srli_epi32(w, 20), _mm_set1_epi32(0x7fe))));
+        __m128i isS = _mm_cmpeq_epi32(_mm_and_si128(opcode, _mm_set1_epi32(0x7b)), _mm_set1_epi32(0x23));
+        __m128i isB = _mm_cmpeq_epi32(opcode, _mm_set1_epi32(0x63));
+        __m128i isU = _mm_cmpeq_epi32(_mm_and_si128(opcode, _mm_set1_epi32(0x5f)), _mm_set1_epi32(0x17));
+        __m128i isJ = _mm_cmpeq_epi32(opcode, _mm_set1_epi32(0x6f));
+        __m128i imm = PREDECODE_SELECT_SSE2(isS, immS, immI);
+        imm = PREDECODE_SELECT_SSE2(isB, immB, imm);
+        imm = PREDECODE_SELECT_SSE2(isU, immU, imm);
+        imm = PREDECODE_SELECT_SSE2(isJ, immJ, imm);
+        _mm_storeu_si128((__m128i*)&pre->inst[i], w);
+        _mm_storeu_si128((__m128i*)&pre->imm[i], imm);
+        predecodeStoreBytes4(&pre->opcode[i], opcode);
+        predecodeStoreBytes4(&pre->rd[i], _mm_and_si128(_mm_srli_epi32(w, 7), mask5));
+        predecodeStoreBytes4(&pre->rs1[i], _mm_and_si128(_mm_srli_epi32(w, 15), mask5));
+        predecodeStoreBytes4(&pre->rs2[i], _mm_and_si128(_mm_srli_epi32(w, 20), mask5));
+        predecodeStoreBytes4(&pre->funct3[i], _mm_and_si128(_mm_srli_epi32(w, 12), _mm_set1_epi32(0x7)));
+    }
+}
+
+PREDECODE_AVX2_FN static inline void predecodeStoreBytes8(u8 *dst, __m256i v) {
+    __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    __m128i bytes = _mm_packus_epi16(words, _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)dst, bytes);
+}
+
+// Same as predecodeSse2(), 8 at a time
+PREDECODE_AVX2_FN static void predecodeAvx2(Predecode *pre, const u8 *text, u32 count) {
+    const __m256i mask5 = _mm256_set1_epi32(0x1f);
+    for (u32 i=0; i+8<=count; i+=8) {
+        __m256i w = _mm256_loadu_si256((const __m256i*)(text + ((size_t)i << 2)));
+        __m256i opcode = _mm256_and_si256(w, _mm256_set1_epi32(0x7f));
+        __m256i immI = _mm256_srai_epi32(w, 20);
+        __m256i immS = _mm256_or_si256(_mm256_andnot_si256(mask5, immI),
+            _mm256_and_si256(_mm256_srli_epi32(w, 7), mask5));
+        __m256i immB = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(_mm256_srai_epi32(w, 19), _mm256_set1_epi32((int)0xfffff000)),
+                _mm256_and_si256(_mm256_srli_epi32(w, 20), _mm256_set1_epi32(0x7e0))),
+            _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(w, 7), _mm256_set1_epi32(0x1e)),
+                _mm256_and_si256(_mm256_slli_epi32(w, 4), _mm256_set1_epi32(0x800))));
+        __m256i immU = _mm256_and_si256(w, _mm256_set1_epi32((int)0xfffff000));
+        __m256i immJ = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(_mm256_srai_epi32(w, 11), _mm256_set1_epi32((int)0xfff00000)),
+                _mm256_and_si256(w, _mm256_set1_epi32(0x000ff000))),
+            _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(w, 9), _mm256_set1_epi32(0x800)),
+                _mm256_and_si256(_mm256_srli_epi32(w, 20), _mm256_set1_epi32(0x7fe))));
+        __m256i isS = _mm256_cmpeq_epi32(_mm256_and_si256(opcode, _mm256_set1_epi32(0x7b)), _mm256_set1_epi32(0x23));
+        __m256i isB = _mm256_cmpeq_epi32(opcode, _mm256_set1_epi32(0x63));
+        __m256i isU = _mm256_cmpeq_epi32(_mm256_and_si256(opcode, _mm256_set1_epi32(0x5f)), _mm256_set1_epi32(0x17));
+        __m256i isJ = _mm256_cmpeq_epi32(opcode, _mm256_set1_epi32(0x6f));
+        __m256i imm = _mm256_blendv_epi8(immI, immS, isS);
+        imm = _mm256_blendv_epi8(imm, immB, isB);
+        imm = _mm256_blendv_epi8(imm, immU, isU);
+        imm = _mm256_blendv_epi8(imm, immJ, isJ);
+        _mm256_storeu_si256((__m256i*)&pre->inst[i], w);
+        _mm256_storeu_si256((__m256i*)&pre->imm[i], imm);
+        predecodeStoreBytes8(&pre->opcode[i], opcode);
+        predecodeStoreBytes8(&pre->rd[i], _mm256_and_si256(_mm256_srli_epi32(w, 7), mask5));
+        predecodeStoreBytes8(&pre->rs1[i], _mm256_and_si256(_mm256_srli_epi32(w, 15), mask5));
+        predecodeStoreBytes8(&pre->rs2[i], _mm256_and_si256(_mm256_srli_epi32(w, 20), mask5));
+        predecodeStoreBytes8(&pre->funct3[i], _mm256_and_si256(_mm256_srli_epi32(w, 12), _mm256_set1_epi32(0x7)));
+    }
+}
+#endif
+
+// Second instruction reads the first one's result - "rd" is the first one's (non-zero) destination
+static u32 predecodeFusePair(const Predecode *pre, u32 i) {
+    u32 first = pre->inst[i];
+    u32 second = pre->inst[i + 1];
+    u32 rd = pre->rd[i];
+    u32 op = pre->opcode[i + 1];
+    u32 funct3 = pre->funct3[i + 1];
+    u32 readsRd = (pre->rs1[i + 1] == rd);
+    if (rd == 0) {
+        return PREDECODE_FUSE_NONE;
+    }
+    switch (pre->opcode[i]) {
+        case 0x37: { // LUI
+            return (op == 0x13 && funct3 == 0x0 && readsRd && pre->rd[i + 1] == rd) ?
+                PREDECODE_FUSE_LUI_ADDI : PREDECODE_FUSE_NONE;
+        }
+        case 0x17: { // AUIPC
+            if (op == 0x67 && funct3 == 0x0 && readsRd) {
+                return PREDECODE_FUSE_AUIPC_JALR;
+            }
+            return (op == 0x03 && funct3 == 0x2 && readsRd) ? PREDECODE_FUSE_AUIPC_LW : PREDECODE_FUSE_NONE;
+        }
+        case 0x13: { // SLLI/SRLI (funct7 0) or SLTI/SLTIU
+            if (pre->funct3[i] == 0x1 && GET_FUNCT7(first) == 0) {
+                return (op == 0x13 && funct3 == 0x5 && GET_FUNCT7(second) == 0 && readsRd && pre->rd[i + 1] == rd) ?
+                    PREDECODE_FUSE_SLLI_SRLI : PREDECODE_FUSE_NONE;
+            }
+            break;
+        }
+        case 0x33: { // SLT/SLTU
+            if (GET_FUNCT7(first) != 0) {
+                return PREDECODE_FUSE_NONE;
+            }
+            break;
+        }
+        default: {
+            return PREDECODE_FUSE_NONE;
+        }
+    }
+    // Compare then branch on it being zero/non-zero
+    u32 isCompare = (pre->funct3[i] == 0x2 || pre->funct3[i] == 0x3);
+    u32 comparesRd = (pre->rs1[i + 1] == rd && pre->rs2[i + 1] == 0) ||
+        (pre->rs1[i + 1] == 0 && pre->rs2[i + 1] == rd);
+    return (isCompare && op == 0x63 && funct3 <= 0x1 && comparesRd) ? PREDECODE_FUSE_CMP_BRANCH :
+        PREDECODE_FUSE_NONE;
+}
+
+static u32 predecodeKernelFor(u32 kernel) {
+#ifdef PREDECODE_X86
+    if (kernel == PREDECODE_AUTO || kernel == PREDECODE_AVX2) {
+        return PREDECODE_HAS_AVX2() ? PREDECODE_AVX2 : PREDECODE_SSE2;
+    }
+    return kernel;
+#else
+    (void)kernel;
+    return PREDECODE_SCALAR;
+#endif
+}
+
+Predecode *predecodeBuild(const u8 *text, u32 base, u32 count, u32 kernel) {
+    Predecode *pre = (Predecode*)calloc(1, sizeof(Predecode));
+    if (pre == NULL) {
+        return NULL;
+    }
+    pre->base = base;
+    pre->count = count;
+    pre->kernel = predecodeKernelFor(kernel);
+    pre->inst = (u32*)malloc(((size_t)count + 1) * sizeof(u32));
+    pre->imm = (s32*)malloc(((size_t)count + 1) * sizeof(s32));
+    // One allocation for the byte fields
+    pre->opcode = (u8*)malloc(((size_t)count + 1) * 6);
+    if (pre->inst == NULL || pre->imm == NULL || pre->opcode == NULL) {
+        predecodeTableFree(pre);
+        return NULL;
+    }
+    pre->rd = pre->opcode + count + 1;
+    pre->rs1 = pre->rd + count + 1;
+    pre->rs2 = pre->rs1 + count + 1;
+    pre->funct3 = pre->rs2 + count + 1;
+    pre->fuse = pre->funct3 + count + 1;
+
+    // Vector kernels do whole steps, the scalar one the rest
+    u32 done = 0;
+#ifdef PREDECODE_X86
+    if (pre->kernel == PREDECODE_AVX2) {
+        predecodeAvx2(pre, text, count);
+        done = count & ~0x7u;
+    }
+    else if (pre->kernel == PREDECODE_SSE2) {
+        predecodeSse2(pre, text, count);
+        done = count & ~0x3u;
+    }
+#endif
+    predecodeScalar(pre, text, done, count - done);
+    for (u32 i=0; i<count; ++i) {
+        pre->fuse[i] = (u8)((i + 1 < count) ? predecodeFusePair(pre, i) : PREDECODE_FUSE_NONE);
+    }
+    return pre;
+}
+
+void predecodeTableFree(Predecode *pre) {
+    if (pre == NULL) {
+        return;
+    }
+    free(pre->inst);
+    free(pre->imm);
+    free(pre->opcode);
+    free(pre);
+}
+
+int predecodeStart(rv32iHart_t *cpu) {
+    u32 size = 0;
+    const u8 *image = memLoadedImage(cpu, &size);
+    if (image == NULL || (size >> 2) == 0) {
+        LOG_E("No image loaded at address 0 to predecode.\n");
+        return EINVAL;
+    }
+    Predecode *pre = predecodeBuild(image, 0, size >> 2, PREDECODE_AUTO);
+    if (pre == NULL) {
+        return ENOMEM;
+    }
+    predecodeFree(cpu);
+    cpu->predecode = pre;
+    LOG_I("Predecoded %u instructions (%s).\n", pre->count, predecodeKernelName(pre->kernel));
+    return 0;
+}
+
+void predecodeFree(rv32iHart_t *cpu) {
+    predecodeTableFree(cpu->predecode);
+    cpu->predecode = NULL;
+}
+
+void predecodeReport(rv32iHart_t *cpu, FILE *out) {
+    const Predecode *pre = cpu->predecode;
+    if (pre == NULL) {
+        return;
+    }
+    u32 pairs = 0;
+    for (u32 i=0; i<pre->count; ++i) {
+        pairs += (pre->fuse[i] != PREDECODE_FUSE_NONE);
+    }
+    double share = (cpu->cycleCounter != 0) ? (100.0 * (double)pre->fusedPairs / (double)cpu->cycleCounter) : 0.0;
+    fprintf(out, "Predecoded text (%u instructions, %s, %u fusible pairs):\n", pre->count,
+        predecodeKernelName(pre->kernel), pairs);
+    fprintf(out, "  %llu pairs run fused (%.1f%% fewer dispatches)\n", (unsigned long long)pre->fusedPairs, share);
+}
+
+const char *predecodeKernelName(u32 kernel) {
+    switch (kernel) {
+        case PREDECODE_SSE2:    { return "sse2";    }
+        case PREDECODE_AVX2:    { return "avx2";    }
+        default:                { return "scalar";  }
+    }
+}
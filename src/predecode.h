@@ -0,0 +1,54 @@
+#ifndef PREDECODE_H
+#define PREDECODE_H
+
+#include <stdio.h>
+#include "risa.h"
+
+typedef enum {
+    PREDECODE_AUTO = 0,     // Best kernel the host has
+    PREDECODE_SCALAR,
+    PREDECODE_SSE2,         // 4 instructions a step (any x86-64)
+    PREDECODE_AVX2          // 8 instructions a step (picked at runtime)
+} PredecodeKernel;
+
+// Pairs compilers emit back to back that runHart() runs as one dispatch - the first instruction's rd (never x0) is
+// the second one's source
+typedef enum {
+    PREDECODE_FUSE_NONE = 0,
+    PREDECODE_FUSE_LUI_ADDI,        // 32-bit constant
+    PREDECODE_FUSE_AUIPC_JALR,      // Far call/jump
+    PREDECODE_FUSE_AUIPC_LW,        // PC-relative load
+    PREDECODE_FUSE_SLLI_SRLI,       // Zero-extension (bit-field extract)
+    PREDECODE_FUSE_CMP_BRANCH       // slt/sltu/slti/sltiu then beq/bne against x0
+} PredecodeFuse;
+
+// Fields of every word of the program text, decoded up front as a struct of arrays - runHart() reads an
+// instruction's fields from here (one sequential stream per field) rather than extracting them, as long as the word
+// it fetched is still the one the entry was decoded from. Fields only depend on the word, so a stale entry (i.e.
+// self-modifying code) just decodes as usual.
+struct Predecode {
+    u32     base;           // Guest address of entry 0
+    u32     count;          // Entries (words)
+    u32     kernel;         // PredecodeKernel that built it
+    u32     *inst;          // Word each entry was decoded from
+    s32     *imm;           // Sign-extended immediate of the opcode's format (B/J: the offset, I for R/F/R4)
+    u8      *opcode;
+    u8      *rd;
+    u8      *rs1;
+    u8      *rs2;
+    u8      *funct3;
+    u8      *fuse;          // PredecodeFuse of the pair starting at each entry
+    u64     fusedPairs;     // Run as one dispatch so far
+};
+
+// Table for the "count" words of "text" (guest address "base") - a kernel the host lacks falls back to the next
+// best one. NULL if out of memory.
+Predecode *predecodeBuild(const u8 *text, u32 base, u32 count, u32 kernel);
+void predecodeTableFree(Predecode *pre);
+// Predecode the loaded image for runHart() (see memLoadedImage) - returns 0, EINVAL (nothing loaded) or ENOMEM
+int predecodeStart(rv32iHart_t *cpu);
+void predecodeFree(rv32iHart_t *cpu);
+void predecodeReport(rv32iHart_t *cpu, FILE *out);
+const char *predecodeKernelName(u32 kernel);
+
+#endif // PREDECODE_H
@@ -0,0 +1,553 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+#include "events.h"
+#include "clint.h"
+#include "memmap.h"
+
+// Recording - to the log file, or appended to the in-memory history (gdb reverse execution)
+static void putBytes(ReplayLog *log, const void *buf, u32 len) {
+    if (len == 0) {
+        return;
+    }
+    if (log->out != NULL) {
+        fwrite(buf, 1, len, log->out);
+        return;
+    }
+    if (log->size + len > log->capacity) {
+        u32 cap = (log->capacity != 0) ? log->capacity : (KB_MULTIPLIER * 4);
+        while (cap < log->size + len && cap < (UINT32_MAX >> 1)) {
+            cap *= 2;
+        }
+        u8 *grown = (cap >= log->size + len) ? (u8*)realloc(log->data, cap) : NULL;
+        if (grown == NULL) {
+            if (!log->truncated) {
+                LOG_E("Could not grow the replay history - re-executing past this point may diverge.\n");
+            }
+            log->truncated = 1;
+            return;
+        }
+        log->data = grown;
+        log->capacity = cap;
+    }
+    memcpy(log->data + log->size, buf, len);
+    log->size += len;
+    log->pos = log->size;
+}
+
+static void putByte(ReplayLog *log, u8 byte) {
+    putBytes(log, &byte, 1);
+}
+
+static void putVarint(ReplayLog *log, u64 val) {
+    u8 buf[10];
+    u32 len = 0;
+    while (val >= 0x80) {
+        buf[len++] = (u8)((val & 0x7f) | 0x80);
+        val >>= 7;
+    }
+    buf[len++] = (u8)val;
+    putBytes(log, buf, len);
+}
+
+// Returns 0 or EINVAL (truncated/overlong)
+static int getVarint(ReplayLog *log, u64 *val) {
+    *val = 0;
+    for (u32 shift=0; shift<64; shift+=7) {
+        if (log->pos >= log->size) {
+            return EINVAL;
+        }
+        u8 byte = log->data[log->pos++];
+        *val |= (u64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+static int getVarint32(ReplayLog *log, u32 *val) {
+    u64 wide;
+    int err = getVarint(log, &wide);
+    *val = (u32)wide;
+    return (err || wide > UINT32_MAX) ? EINVAL : 0;
+}
+
+// Append to the pending handler memory writes (recording)
+static int putWrite(ReplayLog *log, const void *buf, u32 len) {
+    if (log->writesLen + len > log->writesCap) {
+        u32 cap = (log->writesCap != 0) ? log->writesCap : 256;
+        while (cap < log->writesLen + len) {
+            cap *= 2;
+        }
+        u8 *grown = (u8*)realloc(log->writes, cap);
+        if (grown == NULL) {
+            return ENOMEM;
+        }
+        log->writes = grown;
+        log->writesCap = cap;
+    }
+    memcpy(log->writes + log->writesLen, buf, len);
+    log->writesLen += len;
+    return 0;
+}
+
+static int putWriteVarint(ReplayLog *log, u64 val) {
+    u8 buf[10];
+    u32 len = 0;
+    while (val >= 0x80) {
+        buf[len++] = (u8)((val & 0x7f) | 0x80);
+        val >>= 7;
+    }
+    buf[len++] = (u8)val;
+    return putWrite(log, buf, len);
+}
+
+static void captureState(rv32iHart_t *cpu, u32 *words) {
+    memcpy(words, cpu->regFile, sizeof(cpu->regFile));
+    memcpy(words + 32, cpu->fregFile, sizeof(cpu->fregFile));
+    words[REPLAY_STATE_PC] = cpu->pc;
+    words[REPLAY_STATE_FCSR] = cpu->fcsr;
+    words[REPLAY_STATE_MIP] = cpu->trap.mip;
+    words[REPLAY_STATE_RUN_STATUS] = cpu->runStatus;
+    words[REPLAY_STATE_EXIT_CODE] = (u32)cpu->exitCode;
+}
+
+static void applyStateWord(rv32iHart_t *cpu, u32 index, u32 val) {
+    if (index < 32)                             { cpu->regFile[index] = val;            }
+    else if (index < REPLAY_STATE_PC)           { cpu->fregFile[index - 32] = val;      }
+    else if (index == REPLAY_STATE_PC)          { cpu->pc = val;                        }
+    else if (index == REPLAY_STATE_FCSR)        { cpu->fcsr = val;                      }
+    else if (index == REPLAY_STATE_MIP)         { cpu->trap.mip = val;                  }
+    else if (index == REPLAY_STATE_RUN_STATUS)  { cpu->runStatus = (RisaRunStatus)val;  }
+    else                                        { cpu->exitCode = (int)val;             }
+    EVENTS_RECHECK(cpu);
+}
+
+static u64 fnv1a(u64 hash, const u8 *data, u32 len) {
+    for (u32 i=0; i<len; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Memory map layout and every non-zero page (untouched pages are all zero - no need to read them)
+static u64 imageHash(rv32iHart_t *cpu) {
+    static const u8 zeroPage[MEM_PAGE_SIZE];
+    u64 hash = 0xcbf29ce484222325ULL;
+    const MemMap *map = cpu->memMap;
+    for (u32 i=0; i<map->regionCount; ++i) {
+        const MemRegion *region = &map->regions[i];
+        u32 layout[3] = { region->base, region->size, region->kind };
+        hash = fnv1a(hash, (const u8*)layout, sizeof(layout));
+        for (u32 offset=0; region->host != NULL && offset<region->size; offset+=MEM_PAGE_SIZE) {
+            u32 page = offset >> MEM_PAGE_SHIFT;
+            u32 len = ((region->size - offset) < MEM_PAGE_SIZE) ? (region->size - offset) : MEM_PAGE_SIZE;
+            if ((region->touched[page >> 3] & (1 << (page & 0x7))) && memcmp(region->host + offset, zeroPage, len)) {
+                hash = fnv1a(hash, (const u8*)&offset, sizeof(offset));
+                hash = fnv1a(hash, region->host + offset, len);
+            }
+        }
+    }
+    return hash;
+}
+
+static void startRecord(ReplayLog *log, rv32iHart_t *cpu, ReplayRecordKind kind) {
+    putByte(log, (u8)kind);
+    putVarint(log, cpu->cycleCounter - log->lastCycle);
+    log->lastCycle = cpu->cycleCounter;
+    log->records++;
+}
+
+// Playback stops before the next instruction once the run no longer matches the log
+static int diverged(rv32iHart_t *cpu, const char *what) {
+    LOG_E("Replay diverged from the recording at cycle %llu (record %llu: %s).\n",
+        (unsigned long long)cpu->cycleCounter, (unsigned long long)cpu->replay->records, what);
+    cpu->replay->pos = cpu->replay->size;
+    cpu->runStatus = RISA_RUN_HALT;
+    return EILSEQ;
+}
+
+// Kind and cycle of the next record without consuming it - returns 0 if there is none
+static u32 peekRecord(ReplayLog *log, u64 *cycle) {
+    u32 pos = log->pos;
+    u64 delta;
+    if (pos >= log->size) {
+        return 0;
+    }
+    u32 kind = log->data[log->pos++];
+    int err = getVarint(log, &delta);
+    log->pos = pos;
+    *cycle = log->lastCycle + delta;
+    return err ? 0 : kind;
+}
+
+// Consume the next record's header - returns 0 or EILSEQ if it isn't "kind" at the current cycle
+static int takeRecord(rv32iHart_t *cpu, ReplayRecordKind kind) {
+    ReplayLog *log = cpu->replay;
+    u64 cycle;
+    if (peekRecord(log, &cycle) != (u32)kind || cycle != cpu->cycleCounter) {
+        return diverged(cpu, "unexpected input");
+    }
+    u64 delta;
+    log->pos++;
+    getVarint(log, &delta);
+    log->lastCycle = cycle;
+    log->records++;
+    return 0;
+}
+
+// An interrupt callback is always the next record's cycle away
+static void scheduleInterrupt(rv32iHart_t *cpu) {
+    u64 cycle;
+    if (peekRecord(cpu->replay, &cycle) == REPLAY_REC_INTERRUPT) {
+        eventSchedule(cpu, EVENT_REPLAY, cycle);
+    }
+}
+
+static int readHeader(rv32iHart_t *cpu, ReplayLog *log) {
+    u64 version, memSize, mmioBase, mmioSize, clintBase, clintSize, hash, cycle;
+    if (log->size < sizeof(REPLAY_MAGIC) || memcmp(log->data, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0) {
+        LOG_E("Not a replay log ( %s ).\n", cpu->replayFile);
+        return EINVAL;
+    }
+    log->pos = sizeof(REPLAY_MAGIC);
+    if (getVarint(log, &version) || getVarint(log, &memSize) || getVarint(log, &mmioBase) ||
+        getVarint(log, &mmioSize) || getVarint(log, &clintBase) || getVarint(log, &clintSize) ||
+        getVarint(log, &hash) || getVarint(log, &cycle) || version != REPLAY_VERSION) {
+        LOG_E("Unsupported or truncated replay log ( %s ).\n", cpu->replayFile);
+        return EINVAL;
+    }
+    if (memSize != cpu->virtMemSize || hash != imageHash(cpu)) {
+        LOG_E("Replay log ( %s ) was recorded with a different program image or memory size.\n", cpu->replayFile);
+        return EINVAL;
+    }
+    u32 state[REPLAY_STATE_WORDS];
+    for (u32 i=0; i<REPLAY_STATE_WORDS; ++i) {
+        if (getVarint32(log, &state[i])) {
+            return EINVAL;
+        }
+    }
+    for (u32 i=0; i<REPLAY_STATE_WORDS; ++i) {
+        applyStateWord(cpu, i, state[i]);
+    }
+    cpu->cycleCounter = cycle;
+    log->lastCycle = cycle;
+
+    // Devices are replaced by the log - keep the MMIO range so its loads still come from there
+    memset(&cpu->handlers, 0, sizeof(cpu->handlers));
+    cpu->handlers.mmioBase = (u32)mmioBase;
+    cpu->handlers.mmioSize = (u32)mmioSize;
+    for (int i=0; i<RISA_HANDLER_PROC_COUNT; ++i) {
+        if (i != RISA_ENV_HANDLER_PROC) {
+            cpu->handlerProcs[i] = NULL;
+        }
+    }
+    cpu->handlerProcs[RISA_ENV_HANDLER_PROC] = defaultEnvHandler;
+    if (clintSize != 0) {
+        clintEnable(cpu, (u32)clintBase);
+    }
+    scheduleInterrupt(cpu);
+    return 0;
+}
+
+static int startPlayback(rv32iHart_t *cpu, ReplayLog *log) {
+    FILE *file;
+    OPEN_FILE(file, cpu->replayFile, "rb");
+    if (file == NULL) {
+        LOG_E("Could not open replay log ( %s ).\n", cpu->replayFile);
+        return ENOENT;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    log->data = (u8*)malloc((size > 0) ? (size_t)size : 1);
+    if (log->data == NULL) {
+        fclose(file);
+        return ENOMEM;
+    }
+    log->size = (size > 0) ? (u32)fread(log->data, 1, (size_t)size, file) : 0;
+    fclose(file);
+    return readHeader(cpu, log);
+}
+
+static int startRecording(rv32iHart_t *cpu, ReplayLog *log) {
+    OPEN_FILE(log->out, cpu->replayFile, "wb");
+    if (log->out == NULL) {
+        LOG_E("Could not create replay log ( %s ).\n", cpu->replayFile);
+        return ENOENT;
+    }
+    putBytes(log, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+    putVarint(log, REPLAY_VERSION);
+    putVarint(log, cpu->virtMemSize);
+    putVarint(log, cpu->handlers.mmioBase);
+    putVarint(log, cpu->handlers.mmioSize);
+    putVarint(log, cpu->clint.base);
+    putVarint(log, cpu->clint.size);
+    putVarint(log, imageHash(cpu));
+    putVarint(log, cpu->cycleCounter);
+    u32 state[REPLAY_STATE_WORDS];
+    captureState(cpu, state);
+    for (u32 i=0; i<REPLAY_STATE_WORDS; ++i) {
+        putVarint(log, state[i]);
+    }
+    log->lastCycle = cpu->cycleCounter;
+    return 0;
+}
+
+int replayStart(rv32iHart_t *cpu) {
+    if (cpu->replayMode == REPLAY_OFF) {
+        return 0;
+    }
+    replayFree(cpu);
+    ReplayLog *log = (ReplayLog*)calloc(1, sizeof(ReplayLog));
+    if (log == NULL) {
+        return ENOMEM;
+    }
+    cpu->replay = log;
+    int err = (cpu->replayMode == REPLAY_RECORD) ? startRecording(cpu, log) : startPlayback(cpu, log);
+    if (err) {
+        replayFree(cpu);
+        cpu->replayMode = REPLAY_OFF;
+    }
+    return err;
+}
+
+void replayFree(rv32iHart_t *cpu) {
+    ReplayLog *log = cpu->replay;
+    if (log == NULL) {
+        return;
+    }
+    if (log->out != NULL) {
+        if (ferror(log->out)) {
+            LOG_E("Could not write replay log ( %s ).\n", cpu->replayFile);
+        }
+        fclose(log->out);
+    }
+    free(log->data);
+    free(log->writes);
+    free(log);
+    cpu->replay = NULL;
+}
+
+void replayFlush(rv32iHart_t *cpu) {
+    if (cpu->replay != NULL && cpu->replay->out != NULL) {
+        fflush(cpu->replay->out);
+    }
+}
+
+int replayStartHistory(rv32iHart_t *cpu) {
+    replayFree(cpu);
+    ReplayLog *log = (ReplayLog*)calloc(1, sizeof(ReplayLog));
+    if (log == NULL) {
+        return ENOMEM;
+    }
+    log->history = 1;
+    log->lastCycle = cpu->cycleCounter;
+    cpu->replay = log;
+    cpu->replayMode = REPLAY_RECORD;
+    return 0;
+}
+
+void replayHistoryMark(rv32iHart_t *cpu, ReplayMark *mark) {
+    ReplayLog *log = cpu->replay;
+    mark->pos = log->trimmed + log->pos;
+    mark->lastCycle = log->lastCycle;
+    mark->records = log->records;
+}
+
+void replayHistoryRewind(rv32iHart_t *cpu, const ReplayMark *mark) {
+    ReplayLog *log = cpu->replay;
+    log->pos = (u32)(mark->pos - log->trimmed);
+    log->lastCycle = mark->lastCycle;
+    log->records = mark->records;
+    log->inHandler = 0;
+    cpu->replayMode = REPLAY_PLAYBACK;
+    // Restored event queue may hold one scheduled from a later point
+    eventCancel(cpu, EVENT_REPLAY);
+    scheduleInterrupt(cpu);
+}
+
+void replayHistoryResume(rv32iHart_t *cpu) {
+    if (cpu->replayMode != REPLAY_PLAYBACK) {
+        return;
+    }
+    cpu->replay->size = cpu->replay->pos;
+    cpu->replayMode = REPLAY_RECORD;
+    eventCancel(cpu, EVENT_REPLAY);
+}
+
+void replayHistoryTrim(rv32iHart_t *cpu, const ReplayMark *mark) {
+    ReplayLog *log = cpu->replay;
+    u32 drop = (u32)(mark->pos - log->trimmed);
+    memmove(log->data, log->data + drop, log->size - drop);
+    log->size -= drop;
+    log->pos -= drop;
+    log->trimmed += drop;
+}
+
+u32 replayMmio(rv32iHart_t *cpu, u32 addr, u32 width, u32 value) {
+    ReplayLog *log = cpu->replay;
+    if (cpu->replayMode == REPLAY_RECORD) {
+        startRecord(log, cpu, REPLAY_REC_MMIO);
+        putVarint(log, addr);
+        putVarint(log, width);
+        putVarint(log, value);
+        return value;
+    }
+    u32 recAddr, recWidth;
+    if (takeRecord(cpu, REPLAY_REC_MMIO)) {
+        return 0;
+    }
+    if (getVarint32(log, &recAddr) || getVarint32(log, &recWidth) || getVarint32(log, &value) ||
+        recAddr != addr || recWidth != width) {
+        diverged(cpu, "MMIO load");
+        return 0;
+    }
+    scheduleInterrupt(cpu);
+    return value;
+}
+
+void replaySyscallDone(rv32iHart_t *cpu, u32 len, u32 addr) {
+    ReplayLog *log = cpu->replay;
+    startRecord(log, cpu, REPLAY_REC_SYSCALL);
+    putVarint(log, cpu->regFile[A7]);
+    putVarint(log, cpu->regFile[A0]);
+    putVarint(log, (len != 0) ? 1 : 0);
+    if (len != 0) {
+        putVarint(log, addr);
+        putVarint(log, len);
+        putBytes(log, memPeek(cpu, addr, len), len);
+    }
+}
+
+// "<addr> <len> <bytes>" into guest memory - returns 0 or EINVAL
+static int applyWrite(rv32iHart_t *cpu, ReplayLog *log) {
+    u32 addr, len;
+    u8 *dest = NULL;
+    if (getVarint32(log, &addr) || getVarint32(log, &len) || len > (log->size - log->pos) ||
+        (dest = memSpan(cpu, addr, len, 0)) == NULL) {
+        return EINVAL;
+    }
+    memcpy(dest, log->data + log->pos, len);
+    log->pos += len;
+    return 0;
+}
+
+int replaySyscall(rv32iHart_t *cpu) {
+    ReplayLog *log = cpu->replay;
+    u32 num, result, count;
+    if (takeRecord(cpu, REPLAY_REC_SYSCALL)) {
+        return EILSEQ;
+    }
+    if (getVarint32(log, &num) || getVarint32(log, &result) || getVarint32(log, &count) ||
+        num != cpu->regFile[A7] || (count != 0 && applyWrite(cpu, log))) {
+        return diverged(cpu, "syscall");
+    }
+    cpu->regFile[A0] = result;
+    scheduleInterrupt(cpu);
+    return 0;
+}
+
+void replayHandlerBegin(rv32iHart_t *cpu) {
+    if (cpu->replayMode != REPLAY_RECORD) {
+        return;
+    }
+    captureState(cpu, cpu->replay->before);
+    cpu->replay->inHandler = 1;
+    cpu->replay->writesLen = 0;
+    cpu->replay->writeCount = 0;
+}
+
+void replayHandlerEnd(rv32iHart_t *cpu, ReplayRecordKind kind, int handled) {
+    if (cpu->replayMode != REPLAY_RECORD) {
+        return;
+    }
+    ReplayLog *log = cpu->replay;
+    u32 after[REPLAY_STATE_WORDS];
+    u32 changed = 0;
+    captureState(cpu, after);
+    log->inHandler = 0;
+    for (u32 i=0; i<REPLAY_STATE_WORDS; ++i) {
+        changed += (after[i] != log->before[i]);
+    }
+    // A callback that did nothing needs no record (an unhandled env event falls through to the default handler)
+    if (changed == 0 && log->writeCount == 0 && (kind == REPLAY_REC_INTERRUPT || !handled)) {
+        return;
+    }
+    startRecord(log, cpu, kind);
+    if (kind == REPLAY_REC_ENV) {
+        putByte(log, handled ? 1 : 0);
+    }
+    putVarint(log, changed);
+    for (u32 i=0; i<REPLAY_STATE_WORDS; ++i) {
+        if (after[i] != log->before[i]) {
+            putVarint(log, i);
+            putVarint(log, after[i]);
+        }
+    }
+    putVarint(log, log->writeCount);
+    putBytes(log, log->writes, log->writesLen);
+}
+
+void replayMemWritten(rv32iHart_t *cpu, u32 addr, u32 len) {
+    ReplayLog *log = cpu->replay;
+    if (cpu->replayMode != REPLAY_RECORD || !log->inHandler || len == 0) {
+        return;
+    }
+    if (putWriteVarint(log, addr) || putWriteVarint(log, len) ||
+        putWrite(log, memPeek(cpu, addr, len), len)) {
+        LOG_E("Could not record handler memory write - the replay log will be incomplete.\n");
+        return;
+    }
+    log->writeCount++;
+}
+
+// State diff and memory writes of a handler callback record - returns 0 or EINVAL
+static int applyHandler(rv32iHart_t *cpu, ReplayLog *log) {
+    u32 changed, count;
+    if (getVarint32(log, &changed)) {
+        return EINVAL;
+    }
+    for (u32 i=0; i<changed; ++i) {
+        u32 index, val;
+        if (getVarint32(log, &index) || getVarint32(log, &val) || index >= REPLAY_STATE_WORDS) {
+            return EINVAL;
+        }
+        applyStateWord(cpu, index, val);
+    }
+    if (getVarint32(log, &count)) {
+        return EINVAL;
+    }
+    for (u32 i=0; i<count; ++i) {
+        if (applyWrite(cpu, log)) {
+            return EINVAL;
+        }
+    }
+    return 0;
+}
+
+int replayEnv(rv32iHart_t *cpu) {
+    ReplayLog *log = cpu->replay;
+    u64 cycle;
+    if (peekRecord(log, &cycle) != REPLAY_REC_ENV || cycle != cpu->cycleCounter) {
+        return 0;
+    }
+    takeRecord(cpu, REPLAY_REC_ENV);
+    int handled = (log->pos < log->size) ? log->data[log->pos++] : 0;
+    if (applyHandler(cpu, log)) {
+        diverged(cpu, "env callback");
+        return 1;
+    }
+    scheduleInterrupt(cpu);
+    return handled;
+}
+
+void replayInterrupt(rv32iHart_t *cpu) {
+    if (takeRecord(cpu, REPLAY_REC_INTERRUPT) == 0 && applyHandler(cpu, cpu->replay)) {
+        diverged(cpu, "interrupt callback");
+        return;
+    }
+    scheduleInterrupt(cpu);
+}
@@ -0,0 +1,92 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "risa.h"
+
+#define REPLAY_MAGIC            "rISArec"
+#define REPLAY_VERSION          1
+
+// Architectural state a handler callback can change (diffed around each call while recording)
+#define REPLAY_STATE_PC         64  // After x0-x31 and f0-f31
+#define REPLAY_STATE_FCSR       65
+#define REPLAY_STATE_MIP        66
+#define REPLAY_STATE_RUN_STATUS 67
+#define REPLAY_STATE_EXIT_CODE  68
+#define REPLAY_STATE_WORDS      69
+
+// Log records - "<kind:u8> <cycle delta> <payload>", all integers LEB128 varints. A state diff is "<count>
+// (<state word index> <value>)...", memory writes "<count> (<addr> <len> <bytes>)..."
+typedef enum {
+    REPLAY_REC_MMIO = 1,        // <addr> <width> <value> - handler MMIO load result
+    REPLAY_REC_SYSCALL,         // <a7> <a0 result> <0|1> [<memory write>] - host I/O syscall (+ what it read in)
+    REPLAY_REC_INTERRUPT,       // <state diff> <memory writes> - interrupt (or v1 MMIO store) callback
+    REPLAY_REC_ENV              // <handled:u8> <state diff> <memory writes> - handler ECALL/EBREAK/FENCE callback
+} ReplayRecordKind;
+
+struct ReplayLog {
+    FILE    *out;                           // Recording
+    u8      *data;                          // Playback - the whole log (recording too for a history log)
+    u32     size;
+    u32     pos;
+    u32     capacity;                       // History log - bytes allocated for data
+    u64     trimmed;                        // History log - bytes dropped from the front (see replayHistoryTrim)
+    u8      history;                        // In-memory log of this run (gdb reverse execution) - see below
+    u8      truncated;                      // History log ran out of memory
+    u64     lastCycle;                      // Cycle of the previous record
+    u64     records;
+    // Handler callback in progress (recording)
+    u32     before[REPLAY_STATE_WORDS];
+    u32     inHandler;
+    u8      *writes;                        // Encoded "<addr> <len> <bytes>" guest memory writes
+    u32     writesLen;
+    u32     writesCap;
+    u32     writeCount;
+};
+
+// Position in a history log (see replayHistoryMark)
+typedef struct {
+    u64     pos;
+    u64     lastCycle;
+    u64     records;
+} ReplayMark;
+
+// Start recording to/playing back from cpu->replayFile (per cpu->replayMode) - call once the program is loaded
+// and the init handler has run. Playback checks the guest image and memory size match the recording, restores
+// the recorded registers and detaches all handlers (their MMIO range is kept). Returns 0, ENOENT, EINVAL
+// (not a matching log) or ENOMEM.
+int replayStart(rv32iHart_t *cpu);
+// Finishes the log file (recording)
+void replayFree(rv32iHart_t *cpu);
+// Push what was recorded so far out to the file (the log is readable once a run returns)
+void replayFlush(rv32iHart_t *cpu);
+
+// History log for gdb reverse execution - the same records as a log file, kept in memory with no header. Re-executing
+// from a checkpoint plays back what the run saw the first time (guest output isn't repeated), recording picks up
+// again once re-execution has caught up. Returns 0 or ENOMEM (recording starts now).
+int replayStartHistory(rv32iHart_t *cpu);
+// Position to rewind to (taken along with each checkpoint)
+void replayHistoryMark(rv32iHart_t *cpu, ReplayMark *mark);
+// Guest state is back at "mark" - play back from there (what was recorded after it is kept)
+void replayHistoryRewind(rv32iHart_t *cpu, const ReplayMark *mark);
+// Record again from the current position - anything recorded past it is dropped
+void replayHistoryResume(rv32iHart_t *cpu);
+// Nothing before "mark" will be played back again - free it
+void replayHistoryTrim(rv32iHart_t *cpu, const ReplayMark *mark);
+
+// Handler MMIO load - records "value" or returns the recorded one
+u32 replayMmio(rv32iHart_t *cpu, u32 addr, u32 width, u32 value);
+// Host I/O syscall just done by defaultEnvHandler() ("len" bytes at "addr" were read into guest memory)
+void replaySyscallDone(rv32iHart_t *cpu, u32 len, u32 addr);
+// Apply the recorded result of the host I/O syscall about to run - returns 0 or EILSEQ (log diverged)
+int replaySyscall(rv32iHart_t *cpu);
+// Around interrupt/env handler callbacks while recording
+void replayHandlerBegin(rv32iHart_t *cpu);
+void replayHandlerEnd(rv32iHart_t *cpu, ReplayRecordKind kind, int handled);
+// Guest memory written through risaWriteMem() (only logged inside a handler callback)
+void replayMemWritten(rv32iHart_t *cpu, u32 addr, u32 len);
+// Playback - apply the next record if it is an env callback at this cycle (returns non-zero if it was)
+int replayEnv(rv32iHart_t *cpu);
+// Playback - EVENT_REPLAY fired, apply the interrupt callback record it was scheduled for
+void replayInterrupt(rv32iHart_t *cpu);
+
+#endif // REPLAY_H
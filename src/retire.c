@@ -0,0 +1,61 @@
+#include "risa.h"
+#include "cache.h"
+#include "timing.h"
+#include "bbv.h"
+
+// Hand buffered memory accesses to the models
+void retireFlush(rv32iHart_t *cpu) {
+    for (u32 i=0; i<cpu->retire.count; ++i) {
+        RetireAccess *access = &cpu->retire.accesses[i];
+        if (cpu->cache != NULL) {
+            cacheData(cpu, access->pc, access->addr, access->isWrite);
+        }
+    }
+    cpu->retire.count = 0;
+}
+
+// Instructions [blockStart, endPc] retired in order, then control moved to "nextPc"
+void retireBlock(rv32iHart_t *cpu, u32 endPc, u32 nextPc) {
+    u32 startPc = cpu->retire.blockStart;
+    // Control moved without a hook (i.e. a handler or the embedder wrote the PC) - only the last one is known
+    if (startPc > endPc) {
+        startPc = endPc;
+    }
+    // Straight-line runs longer than the fetch models take at once go in chunks (falling through between them)
+    for (u32 chunkStart=startPc;;) {
+        u32 chunkEnd = ((endPc - chunkStart) >= CACHE_MAX_FETCH_RUN) ? (chunkStart + CACHE_MAX_FETCH_RUN - 4) : endPc;
+        if (cpu->cache != NULL) {
+            cacheFetch(cpu, chunkStart, chunkEnd);
+        }
+        if (cpu->timing != NULL) {
+            timingBlock(cpu, chunkStart, chunkEnd, (chunkEnd == endPc) ? nextPc : (chunkEnd + 4));
+        }
+        if (chunkEnd == endPc) {
+            break;
+        }
+        chunkStart = chunkEnd + 4;
+    }
+    if (cpu->bbv != NULL) {
+        bbvBlock(cpu, startPc, endPc);
+    }
+    retireFlush(cpu);
+    cpu->retire.blockStart = nextPc;
+}
+
+// Called around runHart() - the stream restarts wherever the PC is now
+void retireStart(rv32iHart_t *cpu) {
+    cpu->retire.enabled = RETIRE_MODELS_ATTACHED(cpu);
+    cpu->retire.blockStart = cpu->pc;
+    cpu->retire.count = 0;
+}
+
+void retireStop(rv32iHart_t *cpu) {
+    if (!cpu->retire.enabled) {
+        return;
+    }
+    // The PC has already moved past the last retired instruction (unless the run stopped before it)
+    if (cpu->pc != cpu->retire.blockStart) {
+        retireBlock(cpu, cpu->pc - 4, cpu->pc);
+    }
+    retireFlush(cpu);
+}
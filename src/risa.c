@@ -5,25 +5,36 @@
 
 #include "risa.h"
 #include "gdbserver.h"
+#include "fpu.h"
+#include "events.h"
+#include "clint.h"
+#include "idle.h"
+#include "cache.h"
+#include "timing.h"
+#include "bbv.h"
+#include "sample.h"
+#include "replay.h"
+#include "memmap.h"
+#include "aot.h"
+#include "predecode.h"
 #include "miniargparse.h"
 
-static volatile int g_sigIntDet = 0;
+// Hart the risa executable stops on SIGINT (library users stop their own harts via risaHalt())
+static rv32iHart_t *volatile g_sigIntCpu = NULL;
 static SIGINT_RET_TYPE sigintHandler(SIGINT_PARAM sig) {
-    g_sigIntDet = 1;
+    if (g_sigIntCpu != NULL) {
+        g_sigIntCpu->runStatus = RISA_RUN_HALT;
+    }
     SIGINT_RET;
 }
 
-void defaultMmioHandler(rv32iHart_t *cpu);
-void defaultIntHandler(rv32iHart_t *cpu);
-void defaultEnvHandler(rv32iHart_t *cpu);
-void defaultExitHandler(rv32iHart_t *cpu);
-void defaultInitHandler(rv32iHart_t *cpu);
+// Only the syscall handler has a default - NULL procs are never called
 const void *g_defaultHandlerTable[RISA_HANDLER_PROC_COUNT] = {
-    defaultMmioHandler,
-    defaultIntHandler,
+    NULL,
+    NULL,
     defaultEnvHandler,
-    defaultExitHandler,
-    defaultInitHandler
+    NULL,
+    NULL
 };
 const char *g_handlerProcNames[RISA_HANDLER_PROC_COUNT] = {
     "risaMmioHandler",
@@ -47,12 +58,362 @@ void cleanupSimulator(rv32iHart_t *cpu) {
     if (cpu->handlerProcs[RISA_EXIT_HANDLER_PROC] != NULL) {
         cpu->handlerProcs[RISA_EXIT_HANDLER_PROC](cpu);
     }
-    if (cpu->virtMem        != NULL)    { free(cpu->virtMem);          }
+    if (cpu->handlers.exit != NULL) {
+        cpu->handlers.exit(cpu->handlers.ctx, cpu);
+    }
+    flushGuestOutput(cpu);
+    closeGuestFiles(cpu);
+    if (cpu->writeBuf.buf   != NULL)    { free(cpu->writeBuf.buf);     }
+    memMapFree(cpu);
+    if (cpu->virtMem        != NULL)    {
+        if (cpu->virtMemMapped) { UNMAP_GUEST_MEM(cpu->virtMem, cpu->virtMemSize); }
+        else                    { free(cpu->virtMem);                              }
+    }
     if (cpu->handlerData    != NULL)    { free(cpu->handlerData);      }
     if (cpu->handlerLib     != NULL)    { CLOSE_LIB(cpu->handlerLib);  }
-    LOG_I("Simulation stopping, time elapsed: %f seconds.\n\n",
-        ((double)(cpu->endTime - cpu->startTime)) / CLOCKS_PER_SEC
-    );
+    cacheFree(cpu);
+    timingFree(cpu);
+    bbvFree(cpu);
+    sampleFree(cpu);
+    replayFree(cpu);
+    aotFree(cpu);
+    predecodeFree(cpu);
+    gdbserverCleanup(cpu);
+}
+
+// Zicsr read/modify/write - returns the old CSR value through "old", non-zero if the CSR doesn't exist
+static int accessCsr(rv32iHart_t *cpu, u32 csr, u32 funct3, u32 src, int doWrite, u32 *old) {
+    u32 val;
+    switch (csr) {
+        case CSR_FFLAGS:    { val = fpuReadFflags(cpu);                                      break; }
+        case CSR_FRM:       { val = (cpu->fcsr >> FCSR_FRM_SHIFT) & FCSR_FRM_MASK;           break; }
+        case CSR_FCSR:      { val = fpuReadFflags(cpu) | (cpu->fcsr & ~FCSR_FFLAGS_MASK);    break; }
+        case CSR_MSTATUS:   { val = cpu->trap.mstatus | MSTATUS_MPP;                         break; }
+        case CSR_MISA:      { val = MISA_RV32IF;                                             break; }
+        case CSR_MIE:       { val = cpu->trap.mie;                                           break; }
+        case CSR_MTVEC:     { val = cpu->trap.mtvec;                                         break; }
+        case CSR_MSCRATCH:  { val = cpu->trap.mscratch;                                      break; }
+        case CSR_MEPC:      { val = cpu->trap.mepc;                                          break; }
+        case CSR_MCAUSE:    { val = cpu->trap.mcause;                                        break; }
+        case CSR_MTVAL:     { val = cpu->trap.mtval;                                         break; }
+        case CSR_MIP:       { val = cpu->trap.mip;                                           break; }
+        case CSR_MHARTID:   { val = 0;                                                       break; }
+        // Every instruction retires in one cycle - time is the CLINT's mtime (the cycle count without it)
+        case CSR_MCYCLE:
+        case CSR_MINSTRET:
+        case CSR_CYCLE:
+        case CSR_INSTRET:   { val = (u32)cpu->cycleCounter;                                  break; }
+        case CSR_MCYCLEH:
+        case CSR_MINSTRETH:
+        case CSR_CYCLEH:
+        case CSR_INSTRETH:  { val = (u32)(cpu->cycleCounter >> 32);                          break; }
+        case CSR_TIME:      { val = (u32)clintMtime(cpu);                                    break; }
+        case CSR_TIMEH:     { val = (u32)(clintMtime(cpu) >> 32);                            break; }
+        default:            { return -1; }
+    }
+    *old = val;
+    if (!doWrite) {
+        return 0;
+    }
+    switch (funct3 & 0x3) {
+        case 0x1: { val = src;          break; } // CSRRW(I)
+        case 0x2: { val |= src;         break; } // CSRRS(I)
+        case 0x3: { val &= ~src;        break; } // CSRRC(I)
+    }
+    switch (csr) {
+        case CSR_FFLAGS: {
+            fpuWriteFflags(cpu, val);
+            break;
+        }
+        case CSR_FRM: {
+            cpu->fcsr = (cpu->fcsr & FCSR_FFLAGS_MASK) | ((val & FCSR_FRM_MASK) << FCSR_FRM_SHIFT);
+            break;
+        }
+        case CSR_FCSR: {
+            cpu->fcsr = val & ((FCSR_FRM_MASK << FCSR_FRM_SHIFT) | FCSR_FFLAGS_MASK);
+            fpuWriteFflags(cpu, val);
+            break;
+        }
+        case CSR_MSTATUS: {
+            cpu->trap.mstatus = val & MSTATUS_WRITE_MASK;
+            EVENTS_RECHECK(cpu);
+            break;
+        }
+        case CSR_MIE: {
+            cpu->trap.mie = val & MIE_WRITE_MASK;
+            EVENTS_RECHECK(cpu);
+            break;
+        }
+        case CSR_MTVEC:     { cpu->trap.mtvec = val & ~0x2;     break; }
+        case CSR_MSCRATCH:  { cpu->trap.mscratch = val;         break; }
+        case CSR_MEPC:      { cpu->trap.mepc = val & ~0x3;      break; }
+        case CSR_MCAUSE:    { cpu->trap.mcause = val;           break; }
+        case CSR_MTVAL:     { cpu->trap.mtval = val;            break; }
+        // mip bits are driven by the CLINT, the rest are read-only counters/IDs
+        default:            { break; }
+    }
+    return 0;
+}
+
+// Use the handler library (NULL for none) - a v2 library's risaHandlerRegister() takes precedence over v1 procs,
+// anything missing falls back to the defaults
+void loadHandlers(rv32iHart_t *cpu, const char *handlerLibrary) {
+    for (int i=0; i<RISA_HANDLER_PROC_COUNT; ++i) {
+        cpu->handlerProcs[i] = g_defaultHandlerTable[i];
+    }
+    cpu->cleanupSimulator = cleanupSimulator;
+    if (handlerLibrary == NULL) {
+#ifdef RISA_STATIC_HANDLER
+        // No library given - use the handler linked in at build time
+        risaHandlers handlers;
+        memset(&handlers, 0, sizeof(handlers));
+        handlers.abiVersion = RISA_HANDLER_ABI_VERSION;
+        if (risaHandlerRegister(cpu, &handlers) != 0 || risaSetHandlers(cpu, &handlers) != 0) {
+            LOG_W("Linked-in handler rejected handler ABI v%d - using defaults.\n", RISA_HANDLER_ABI_VERSION);
+        }
+#endif
+        return;
+    }
+    cpu->handlerLib = LOAD_LIB(handlerLibrary);
+    if (cpu->handlerLib == NULL) {
+        LOG_W("Could not load dynamic library ( %s ).\n", handlerLibrary);
+        return;
+    }
+
+    // Handler ABI v2
+    risaHandlerRegisterFn registerHandlers = (risaHandlerRegisterFn)LOAD_SYM(cpu->handlerLib,
+        RISA_HANDLER_REGISTER_SYM);
+    if (registerHandlers != NULL) {
+        risaHandlers handlers;
+        memset(&handlers, 0, sizeof(handlers));
+        handlers.abiVersion = RISA_HANDLER_ABI_VERSION;
+        if (registerHandlers(cpu, &handlers) != 0 || risaSetHandlers(cpu, &handlers) != 0) {
+            LOG_W("Handler library ( %s ) rejected handler ABI v%d - using defaults.\n", handlerLibrary,
+                RISA_HANDLER_ABI_VERSION);
+        }
+        return;
+    }
+
+    // Handler ABI v1 (whole hart passed to every proc)
+    for (int i=0; i<RISA_HANDLER_PROC_COUNT; ++i) {
+        void (*proc)(rv32iHart_t *) = LOAD_SYM(cpu->handlerLib, g_handlerProcNames[i]);
+        if (proc != NULL) {
+            cpu->handlerProcs[i] = proc;
+        }
+        else if (g_defaultHandlerTable[i] != NULL) {
+            LOG_W("Could not load %s - using default instead.\n", g_handlerProcNames[i]);
+        }
+    }
+}
+
+// Page-mapped so pages can be protected (i.e. GDB watchpoints) and only touched pages use host memory
+int allocGuestMemory(rv32iHart_t *cpu) {
+    int err = memMapCreate(cpu, cpu->memMapSpec);
+    if (err == ENOMEM) {
+        LOG_E("Could not allocate virtual memory.\n");
+    }
+    return err;
+}
+
+static inline u32 mmioLoad(rv32iHart_t *cpu, u32 addr, u32 width) {
+    IDLE_INVALIDATE(cpu);
+    if (CLINT_HIT(cpu, addr)) {
+        return clintLoad(cpu, addr, width);
+    }
+    if (cpu->replayMode == REPLAY_PLAYBACK) {
+        return replayMmio(cpu, addr, width, 0);
+    }
+    u32 value = HANDLER_CALL(cpu, mmio, risaHandlerMmio, addr, width, 0, 0);
+    return (cpu->replayMode == REPLAY_RECORD) ? replayMmio(cpu, addr, width, value) : value;
+}
+
+static inline void mmioStore(rv32iHart_t *cpu, u32 addr, u32 width, u32 value) {
+    if (CLINT_HIT(cpu, addr)) {
+        clintStore(cpu, addr, width, value);
+        return;
+    }
+    // No device behind the range while replaying
+    if (cpu->replayMode == REPLAY_PLAYBACK) {
+        return;
+    }
+    HANDLER_CALL(cpu, mmio, risaHandlerMmio, addr, width, value, 1);
+}
+
+// Load/store nothing in the memory map backs (or a store to ROM) - stops the hart after this instruction
+static void guestAccessFault(rv32iHart_t *cpu, u32 addr, int isStore) {
+    LOG_E("Guest %s access fault at ( 0x%08x ), pc ( 0x%08x ).\n", isStore ? "store" : "load", addr, cpu->pc);
+    cpu->runStatus = RISA_RUN_ERROR;
+    cpu->exitCode = EFAULT;
+}
+
+// TLB missed and the walk found no RAM/ROM - an mmio region of the map, or a fault
+static u32 unbackedLoad(rv32iHart_t *cpu, u32 addr, u32 width) {
+    if (memIsMmio(cpu, addr)) {
+        return mmioLoad(cpu, addr, width);
+    }
+    guestAccessFault(cpu, addr, 0);
+    return 0;
+}
+
+static void unbackedStore(rv32iHart_t *cpu, u32 addr, u32 width, u32 value) {
+    if (memIsMmio(cpu, addr)) {
+        mmioStore(cpu, addr, width, value);
+        return;
+    }
+    guestAccessFault(cpu, addr, 1);
+}
+
+// Data loads/stores - handler/CLINT device ranges, then guest memory through the software TLB
+static inline u32 guestLoad(rv32iHart_t *cpu, u32 addr, u32 width) {
+    if (MMIO_HIT(cpu, addr)) {
+        return mmioLoad(cpu, addr, width);
+    }
+    const u8 *host = memLoadPtr(cpu, addr, width);
+    if (host == NULL) {
+        return unbackedLoad(cpu, addr, width);
+    }
+    return (width == 4) ? *(const u32*)host : ((width == 2) ? *(const u16*)host : *host);
+}
+
+static inline void guestStore(rv32iHart_t *cpu, u32 addr, u32 width, u32 value) {
+    if (MMIO_HIT(cpu, addr)) {
+        mmioStore(cpu, addr, width, value);
+        return;
+    }
+    u8 *host = memStorePtr(cpu, addr, width);
+    if (host == NULL) {
+        unbackedStore(cpu, addr, width, value);
+        return;
+    }
+    if (width == 4)         { *(u32*)host = value;      }
+    else if (width == 2)    { *(u16*)host = (u16)value; }
+    else                    { *host = (u8)value;        }
+    AOT_CODE_WRITTEN(cpu, addr, width);
+}
+
+// Simulator side of translated blocks (see aot.h)
+static u32 aotGuestLoad(rv32iHart_t *cpu, u32 addr, u32 width) {
+    return guestLoad(cpu, addr, width);
+}
+
+static void aotGuestStore(rv32iHart_t *cpu, u32 addr, u32 width, u32 value) {
+    guestStore(cpu, addr, width, value);
+}
+
+static const AotRuntime g_aotRuntime = { aotGuestLoad, aotGuestStore, aotCodeWritten };
+
+// Translated block starting at the PC in place of the next instruction - not while the retire stream needs every
+// instruction, or if it could run past the next device event/the run limit (events and limits land on the same
+// instruction as when interpreting). Returns non-zero if one ran.
+static inline int aotRun(rv32iHart_t *cpu) {
+    AotImage *aot = cpu->aot;
+    u32 offset = cpu->pc - aot->textBase;
+    if ((offset & 0x3) || (offset >> 2) >= aot->slotCount || !aot->enabled || cpu->retire.enabled) {
+        return 0;
+    }
+    const AotBlock *block = aot->slots[offset >> 2];
+    u64 start = cpu->cycleCounter;
+    if (block == NULL || start + block->len > cpu->nextEventCycle || start + block->len > cpu->runLimit) {
+        return 0;
+    }
+    cpu->pc = block->fn(cpu, &g_aotRuntime);
+    aot->blocksRun++;
+    aot->instructionsRun += cpu->cycleCounter - start;
+    // Taken backward branch/jump ending the block - possibly an idle loop (same as interpreting it)
+    if (cpu->cycleCounter - start == block->len && cpu->runStatus == RISA_RUN_LIMIT) {
+        u32 endPc = block->pc + ((block->len - 1) << 2);
+        if ((block->end == AOT_END_BRANCH && cpu->pc < endPc) || (block->end == AOT_END_JAL && cpu->pc <= endPc)) {
+            IDLE_BACK_EDGE(cpu, endPc, cpu->pc);
+        }
+    }
+    return 1;
+}
+
+// Fused pair from the predecode table (see PredecodeFuse) in one dispatch, the first instruction already counted -
+// under the same conditions as aotRun() and only while the second word is still the one predecoded. Returns non-zero
+// if it ran (with the PC on the next instruction, or on the lw of a faulting auipc/lw).
+static inline int fuseRun(rv32iHart_t *cpu, Predecode *pre, u32 slot, const u8 *fetch) {
+    if (cpu->retire.enabled || cpu->opts.o_tracePrintEnable || cpu->opts.o_gdbEnabled ||
+        cpu->cycleCounter >= cpu->nextEventCycle || cpu->cycleCounter >= cpu->runLimit ||
+        ((cpu->pc + 4) & (MEM_PAGE_SIZE - 1)) == 0 || *(const u32*)(fetch + 4) != pre->inst[slot + 1]) {
+        return 0;
+    }
+    const u32 pc = cpu->pc;
+    const u32 rd = pre->rd[slot];
+    u32 next = pc + 8;
+    cpu->cycleCounter++;
+    switch ((PredecodeFuse)pre->fuse[slot]) {
+        case PREDECODE_FUSE_LUI_ADDI: {
+            cpu->regFile[rd] = (u32)pre->imm[slot] + (u32)pre->imm[slot + 1];
+            break;
+        }
+        case PREDECODE_FUSE_AUIPC_JALR: {
+            cpu->regFile[rd] = pc + (u32)pre->imm[slot];
+            next = (cpu->regFile[rd] + (u32)pre->imm[slot + 1]) & 0xfffffffe;
+            cpu->regFile[pre->rd[slot + 1]] = pc + 8;
+            break;
+        }
+        case PREDECODE_FUSE_AUIPC_LW: {
+            cpu->regFile[rd] = pc + (u32)pre->imm[slot];
+            cpu->pc = pc + 4;
+            cpu->regFile[pre->rd[slot + 1]] = guestLoad(cpu, cpu->regFile[rd] + (u32)pre->imm[slot + 1], 4);
+            break;
+        }
+        case PREDECODE_FUSE_SLLI_SRLI: {
+            cpu->regFile[rd] = (cpu->regFile[pre->rs1[slot]] << pre->rs2[slot]) >> pre->rs2[slot + 1];
+            break;
+        }
+        case PREDECODE_FUSE_CMP_BRANCH: {
+            u32 lhs = cpu->regFile[pre->rs1[slot]];
+            u32 rhs = (pre->opcode[slot] == 0x33) ? cpu->regFile[pre->rs2[slot]] : (u32)pre->imm[slot];
+            cpu->regFile[rd] = (pre->funct3[slot] == 0x2) ? ((s32)lhs < (s32)rhs) : (lhs < rhs);
+            // bne is taken on a set result, beq on a clear one
+            if (cpu->regFile[rd] == pre->funct3[slot + 1]) {
+                next = pc + 4 + (u32)pre->imm[slot + 1];
+                if (pre->imm[slot + 1] <= 0) {
+                    IDLE_BACK_EDGE(cpu, pc + 4, next);
+                }
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+    if (cpu->runStatus != RISA_RUN_ERROR) {
+        cpu->pc = next;
+    }
+    pre->fusedPairs++;
+    return 1;
+}
+
+// ECALL/EBREAK/FENCE - a v2 handler gets first pick, the v1/default handler takes the rest
+static inline void envEvent(rv32iHart_t *cpu, DecodedInst d, RisaEnvKind kind) {
+    // Replayed handler callbacks come from the log (the default handler replays host syscall results itself)
+    if (cpu->replayMode == REPLAY_PLAYBACK) {
+        if (!replayEnv(cpu)) {
+            defaultEnvHandler(cpu);
+        }
+        return;
+    }
+    if (cpu->handlers.env != NULL) {
+        replayHandlerBegin(cpu);
+        int handled = HANDLER_CALL(cpu, env, risaHandlerEnv, kind);
+        replayHandlerEnd(cpu, REPLAY_REC_ENV, handled);
+        if (handled) {
+            return;
+        }
+    }
+    void (*proc)(rv32iHart_t *) = cpu->handlerProcs[RISA_ENV_HANDLER_PROC];
+    if (proc == defaultEnvHandler) {
+        proc(cpu);
+    }
+    else if (proc != NULL) {
+        V1_HANDLER_VIEW(cpu, d);
+        replayHandlerBegin(cpu);
+        proc(cpu);
+        replayHandlerEnd(cpu, REPLAY_REC_ENV, 1);
+    }
 }
 
 int loadProgram(rv32iHart_t *cpu) {
@@ -64,22 +425,30 @@ int loadProgram(rv32iHart_t *cpu) {
         return EIO;
     }
     // Alloc vmem and load program
-    cpu->virtMem = (u32*)malloc(cpu->virtMemSize);
-    if (cpu->virtMem == NULL) {
-        LOG_E("Could not allocate virtual memory.\n");
-        return ENOMEM;
+    int err = allocGuestMemory(cpu);
+    if (err) {
+        fclose(binFile);
+        return err;
     }
-    for (int i=0; feof(binFile) == 0; ++i) {
-        if (i >= (cpu->virtMemSize / sizeof(u32))) {
-            LOG_E("Could not fit ( %s ) in simulator's virtual memory (use larger value for -m <size>).\n",
-                cpu->programFile);
-            fclose(binFile);
-            cleanupSimulator(cpu);
-            return ENOMEM;
-        }
-        fread(cpu->virtMem+i, sizeof(u32), 1, binFile);
+    // The image goes at address 0 (RAM or ROM)
+    fseek(binFile, 0, SEEK_END);
+    long size = ftell(binFile);
+    fseek(binFile, 0, SEEK_SET);
+    u8 *image = (size < 0 || (u64)size > 0xffffffffULL) ? NULL : memSpan(cpu, 0, (u32)size, 0);
+    if (image == NULL) {
+        LOG_E("Could not fit ( %s ) in simulator's virtual memory (use larger value for -m <size>).\n",
+            cpu->programFile);
+        fclose(binFile);
+        cleanupSimulator(cpu);
+        return ENOMEM;
     }
+    size_t len = fread(image, 1, (size_t)size, binFile);
     fclose(binFile);
+    if (len != (size_t)size) {
+        LOG_E("Could not read file ( %s ).\n", cpu->programFile);
+        cleanupSimulator(cpu);
+        return EIO;
+    }
     return 0;
 }
 
@@ -95,6 +464,51 @@ int setupSimulator(int argc, char **argv, rv32iHart_t *cpu) {
     MINIARGPARSE_OPT(interrupt, "i", "interruptPeriod", 1,
         "Simulator interrupt-check timeout value [DEFAULT=500].");
     MINIARGPARSE_OPT(gdb, "g", "gdb", 0, "Run the simulator in GDB-mode.");
+    MINIARGPARSE_OPT(gdbAttach, "a", "gdbAttach", 0,
+        "GDB-mode without waiting for a connection - GDB can attach/detach while the simulator runs.");
+    MINIARGPARSE_OPT(gdbReverse, "r", "gdbReverse", 0,
+        "GDB-mode with reverse execution (reverse-step/reverse-continue) via periodic checkpoints.");
+    MINIARGPARSE_OPT(bufferedWrite, "b", "bufferedWrite", 1,
+        "Buffer guest stdout writes - flush on newline, exit or this many bytes (0 for default) [DEFAULT=off].");
+    MINIARGPARSE_OPT(sandbox, "s", "sandbox", 1,
+        "Host directory guest file syscalls (open/unlink) are restricted to [DEFAULT=file access disabled].");
+    MINIARGPARSE_OPT(accelCost, "c", "accelCost", 1,
+        "Cycles charged per word for host-accelerated memcpy/memset/memcmp/strlen syscalls [DEFAULT=1].");
+    MINIARGPARSE_OPT(cache, "", "cache", 1,
+        "Model caches, i.e. \"l1i:32k:4:64:lru,l1d:32k:8:64:fifo,l2:256k:8:64:random,region:4k\" [DEFAULT=off].");
+    MINIARGPARSE_OPT(timing, "", "timing", 1,
+        "Estimate cycles with a pipeline/branch predictor model, i.e. \"bp:gshare:12,btb:512,ras:16,load:2,div:20\" "
+        "or \"default\" [DEFAULT=off].");
+    MINIARGPARSE_OPT(bbv, "", "bbv", 1,
+        "Write SimPoint basic-block vectors (one line per --interval cycles) to this file [DEFAULT=off].");
+    MINIARGPARSE_OPT(interval, "", "interval", 1,
+        "BBV/simulation point interval size in cycles [DEFAULT=10000000].");
+    MINIARGPARSE_OPT(sample, "", "sample", 1,
+        "Sampled run - only simulate the intervals in this SimPoint .simpoints file in detail [DEFAULT=off].");
+    MINIARGPARSE_OPT(sampleWeights, "", "sampleWeights", 1,
+        "SimPoint .weights file for --sample [DEFAULT=equal weights].");
+    MINIARGPARSE_OPT(warmup, "", "warmup", 1,
+        "Cycles of cache/predictor warmup before each --sample interval [DEFAULT=1000000].");
+    MINIARGPARSE_OPT(record, "", "record", 1,
+        "Record MMIO loads, handler callbacks and host syscall results to this replay log [DEFAULT=off].");
+    MINIARGPARSE_OPT(replay, "", "replay", 1,
+        "Replay a --record log (bit-exact, handler library not loaded) [DEFAULT=off].");
+    MINIARGPARSE_OPT(memMap, "", "memMap", 1,
+        "Guest memory regions in place of -m, i.e. \"rom:0x0:64k,ram:0x20000000:256k,mmio:0x40000000:1m\" "
+        "(pages allocated on first touch) [DEFAULT=off].");
+    MINIARGPARSE_OPT(memBacking, "", "memBacking", 1,
+        "Host pages (4k, thp or hugetlb) and NUMA node (node:<n> or node:local) for guest memory, i.e. "
+        "\"hugetlb,node:local\" [DEFAULT=4k].");
+    MINIARGPARSE_OPT(aot, "", "aot", 1,
+        "Run the basic blocks of this risa-aot translation (shared library built from its C output) natively "
+        "[DEFAULT=off].");
+    MINIARGPARSE_OPT(aotCache, "", "aotCache", 1,
+        "Translate the program once into this cache directory (built with $CC) and run its basic blocks natively - "
+        "later runs of the same image load it from there [DEFAULT=off].");
+    MINIARGPARSE_OPT(predecode, "", "predecode", 0,
+        "Decode the whole program image up front (SIMD where the host has it) [DEFAULT=off].");
+    MINIARGPARSE_OPT(clint, "", "clint", 1,
+        "Enable the CLINT timer/software-interrupt device at this base address (0 for default) [DEFAULT=off].");
 
     // Parse the args
     int unknownOpt = miniargparseParse(argc, argv);
@@ -140,131 +554,328 @@ int setupSimulator(int argc, char **argv, rv32iHart_t *cpu) {
     cpu->intPeriodVal = (u32)atoi(interrupt.value);
     cpu->opts.o_timeout = timeout.infoBits.used;
     cpu->opts.o_tracePrintEnable = tracing.infoBits.used;
-    cpu->opts.o_gdbEnabled = gdb.infoBits.used;
+    cpu->opts.o_gdbEnabled = gdb.infoBits.used | gdbAttach.infoBits.used | gdbReverse.infoBits.used;
+    cpu->opts.o_gdbReverse = gdbReverse.infoBits.used;
+    cpu->opts.o_gdbAttach = gdbAttach.infoBits.used;
+    cpu->opts.o_bufferedWrite = bufferedWrite.infoBits.used;
+    cpu->writeBuf.threshold = (u32)atoi(bufferedWrite.value);
+    cpu->envFields.accelCyclesPerWord = accelCost.infoBits.used ? (u32)atoi(accelCost.value) : DEFAULT_ACCEL_COST;
+    cpu->opts.o_predecode = predecode.infoBits.used;
+    cpu->opts.o_clint = clint.infoBits.used;
+    if (cpu->opts.o_clint) {
+        u32 clintBase = (u32)strtoul(clint.value, NULL, 0);
+        clintEnable(cpu, (clintBase != 0) ? clintBase : DEFAULT_CLINT_BASE);
+        LOG_I("CLINT mapped at: 0x%08x\n", cpu->clint.base);
+    }
+    if (aot.infoBits.used) {
+        cpu->aotFile = aot.value;
+        LOG_I("Translated code from: %s\n", cpu->aotFile);
+    }
+    if (aotCache.infoBits.used) {
+        cpu->aotCacheDir = aotCache.value;
+        LOG_I("Translation cache: %s\n", cpu->aotCacheDir);
+    }
+    if (sandbox.infoBits.used) {
+        cpu->envFields.sandboxDir = sandbox.value;
+        LOG_I("Guest file access sandboxed to: %s\n", cpu->envFields.sandboxDir);
+    }
 
-    // Load handler lib and syms (if given)
-    cpu->handlerLib = LOAD_LIB(handlerLib.value);
-    if (handlerLib.infoBits.used && cpu->handlerLib == NULL) {
-        LOG_W("Could not load dynamic library ( %s ).\n", handlerLib.value);
+    if (record.infoBits.used && replay.infoBits.used) {
+        LOG_E("Cannot record and replay at the same time.\n");
+        printHelp();
+        return EINVAL;
     }
-    for (int i=0; i<RISA_HANDLER_PROC_COUNT; ++i) {
-        cpu->handlerProcs[i] = LOAD_SYM(cpu->handlerLib, g_handlerProcNames[i]);
-        if (cpu->handlerProcs[i] == NULL) {
-            cpu->handlerProcs[i] = g_defaultHandlerTable[i];
-            if (handlerLib.infoBits.used) {
-                LOG_W("Could not load %s - using default stub instead.\n", g_handlerProcNames[i]);
-            }
+    if (record.infoBits.used) {
+        cpu->replayMode = REPLAY_RECORD;
+        cpu->replayFile = record.value;
+    }
+    if (replay.infoBits.used) {
+        cpu->replayMode = REPLAY_PLAYBACK;
+        cpu->replayFile = replay.value;
+        if (handlerLib.infoBits.used) {
+            LOG_W("Replaying ( %s ) - handler library not loaded.\n", cpu->replayFile);
         }
     }
-    cpu->cleanupSimulator = cleanupSimulator;
+
+    // Load handler lib and syms (if given)
+    loadHandlers(cpu, (handlerLib.infoBits.used && !replay.infoBits.used) ? handlerLib.value : NULL);
 
     // Interrupt period and virtual memory config
     if (cpu->intPeriodVal == 0) { cpu->intPeriodVal = DEFAULT_INT_PERIOD;   }
     if (cpu->virtMemSize == 0)  { cpu->virtMemSize = DEFAULT_VIRT_MEM_SIZE; }
+    if (cpu->opts.o_bufferedWrite && cpu->writeBuf.threshold == 0) {
+        cpu->writeBuf.threshold = DEFAULT_WRITE_BUF_SIZE;
+    }
     LOG_I("Interrupt period set to: %d cycles.\n", cpu->intPeriodVal);
-    LOG_I("Virtual memory size set to: %f MB.\n", (float)cpu->virtMemSize / (float)(1024*1024));
+    if (memMap.infoBits.used) {
+        // GDB-mode (breakpoint bitmap, watchpoint/checkpoint page protection) covers one region at address 0
+        if (cpu->opts.o_gdbEnabled) {
+            LOG_E("GDB-mode needs the default memory layout (no --memMap).\n");
+            printHelp();
+            return EINVAL;
+        }
+        cpu->memMapSpec = memMap.value;
+        LOG_I("Memory map set to: %s\n", cpu->memMapSpec);
+    }
+    else {
+        LOG_I("Virtual memory size set to: %f MB.\n", (float)cpu->virtMemSize / (float)(1024*1024));
+    }
+    if (memBacking.infoBits.used) {
+        int err = memMapSetBacking(cpu, memBacking.value);
+        if (err) {
+            printHelp();
+            return err;
+        }
+        // Watchpoints/checkpoints protect single 4 KB pages
+        if (cpu->opts.o_gdbEnabled && cpu->memBacking.pages == MEM_PAGES_HUGETLB) {
+            LOG_E("GDB-mode cannot use hugetlb guest memory.\n");
+            printHelp();
+            return EINVAL;
+        }
+        LOG_I("Guest memory backing set to: %s\n", memBacking.value);
+    }
+    if (cache.infoBits.used) {
+        int err = cacheCreate(cpu, cache.value);
+        if (err) {
+            printHelp();
+            return err;
+        }
+    }
+    if (timing.infoBits.used) {
+        int err = timingCreate(cpu, timing.value);
+        if (err) {
+            printHelp();
+            return err;
+        }
+    }
+    u64 intervalVal = interval.infoBits.used ? strtoull(interval.value, NULL, 0) : BBV_DEFAULT_INTERVAL;
+    if (bbv.infoBits.used) {
+        int err = bbvCreate(cpu, bbv.value, intervalVal);
+        if (err) {
+            printHelp();
+            return err;
+        }
+    }
+    if (sample.infoBits.used) {
+        u64 warmupVal = warmup.infoBits.used ? strtoull(warmup.value, NULL, 0) : SAMPLE_DEFAULT_WARMUP;
+        int err = sampleLoad(cpu, intervalVal, warmupVal, sample.value,
+            sampleWeights.infoBits.used ? sampleWeights.value : NULL);
+        if (err) {
+            printHelp();
+            return err;
+        }
+        if (cpu->cache == NULL && cpu->timing == NULL) {
+            LOG_W("Sampled run without --cache or --timing - only instruction counts are reported.\n");
+        }
+    }
 
     // Alloc vmem and load program binary
     return loadProgram(cpu);
 }
 
+// Command line run - reports why the run stopped and cleans up (returns 0 or errno)
 int executionLoop(rv32iHart_t *cpu) {
     cpu->startTime = clock();
-    if (cpu->opts.o_gdbEnabled) {
-        gdbserverInit(cpu);
+    int err = memMapStart(cpu);
+    err = err ? err : replayStart(cpu);
+    err = (err || cpu->aotFile == NULL) ? err : aotOpen(cpu, cpu->aotFile);
+    err = (err || cpu->aotFile != NULL || cpu->aotCacheDir == NULL) ? err : aotOpenCached(cpu, cpu->aotCacheDir);
+    err = (err || !cpu->opts.o_predecode) ? err : predecodeStart(cpu);
+    if (err) {
+        printf(LOG_LINE_BREAK);
+        cleanupSimulator(cpu);
+        return err;
     }
+    if (cpu->opts.o_gdbEnabled && gdbserverInit(cpu) != 0) {
+        printf(LOG_LINE_BREAK);
+        cleanupSimulator(cpu);
+        return ECANCELED;
+    }
+    g_sigIntCpu = cpu;
     SIGINT_REGISTER(cpu, sigintHandler);
+    fpuReset(cpu);
+    eventsStart(cpu);
+    cpu->runLimit = cpu->opts.o_timeout ? cpu->timeoutVal : RISA_RUN_UNLIMITED;
 
     LOG_I("Running simulator...\n" LOG_LINE_BREAK);
-    for (;;) {
-        // Sim timeout value or sigint detected - normal cleanup/exit
-        if (g_sigIntDet || (cpu->opts.o_timeout && cpu->cycleCounter == cpu->timeoutVal)) {
-            cpu->endTime = clock();
-            printf(LOG_LINE_BREAK);
-            if (cpu->opts.o_timeout) {
-                LOG_I("Timeout value reached - ( %d cycles ).\n", cpu->timeoutVal);
+    if (cpu->sample != NULL) {
+        err = sampleRun(cpu);
+    }
+    else {
+        retireStart(cpu);
+        err = runHart(cpu);
+        retireStop(cpu);
+    }
+    cpu->endTime = clock();
+    g_sigIntCpu = NULL;
+    flushGuestOutput(cpu);
+    printf(LOG_LINE_BREAK);
+    switch (cpu->runStatus) {
+        case RISA_RUN_LIMIT: {
+            LOG_I("Timeout value reached - ( %d cycles ).\n", cpu->timeoutVal);
+            break;
+        }
+        case RISA_RUN_EXIT: {
+            // Print out return error code (if there is an error)
+            if (cpu->exitCode) {
+                LOG_I("Program code on simulator has returned error code: [ %d ]\n", cpu->exitCode);
+            }
+            break;
+        }
+        case RISA_RUN_ERROR: {
+            const u8 *inst = memPeek(cpu, cpu->pc, 4);
+            if (err == EILSEQ && inst != NULL) {
+                LOG_E("( 0x%08x ) is an invalid instruction.\n", *(const u32*)inst);
+            }
+            else if (inst == NULL) {
+                LOG_E("Program counter is out of range.\n");
             }
-            cleanupSimulator(cpu);
+            break;
+        }
+    }
+    cacheReport(cpu, stdout);
+    timingReport(cpu, stdout);
+    sampleReport(cpu, stdout);
+    aotReport(cpu, stdout);
+    predecodeReport(cpu, stdout);
+    if (cpu->memMapSpec != NULL || cpu->memBacking.pages != MEM_PAGES_DEFAULT ||
+        cpu->memBacking.numaPolicy != MEM_NUMA_ANY) {
+        memMapReport(cpu, stdout);
+    }
+    if (cpu->idle.skippedCycles != 0) {
+        LOG_I("Idle cycles fast-forwarded: %llu\n", (unsigned long long)cpu->idle.skippedCycles);
+    }
+    LOG_I("Simulation stopping, time elapsed: %f seconds.\n\n",
+        ((double)(cpu->endTime - cpu->startTime)) / CLOCKS_PER_SEC
+    );
+    cleanupSimulator(cpu);
+    return err;
+}
+
+// Interpreter - runs until cpu->runLimit or cpu->runStatus is set (returns 0 or errno on a simulator error)
+int runHart(rv32iHart_t *cpu) {
+    for (;;) {
+        // Budget used up or stop requested (guest exit, halt/sigint, gdb kill)
+        if (cpu->cycleCounter >= cpu->runLimit || cpu->runStatus != RISA_RUN_LIMIT) {
             return 0;
         }
         // Process GDB commands
-        if (cpu->opts.o_gdbEnabled) {
+        if (cpu->opts.o_gdbEnabled && GDB_SHOULD_STOP(cpu)) {
             gdbserverCall(cpu);
+            if (cpu->runStatus != RISA_RUN_LIMIT) {
+                return 0;
+            }
+        }
+
+        // Translated code - a whole block in place of the next instruction
+        if (cpu->aot != NULL && aotRun(cpu)) {
+            if (cpu->runStatus == RISA_RUN_ERROR) {
+                return cpu->exitCode;
+            }
+            if (cpu->cycleCounter >= cpu->nextEventCycle) {
+                eventsProcess(cpu);
+            }
+            continue;
         }
 
         // Fetch
+        const u8 *fetch = memLoadPtr(cpu, cpu->pc, 4);
+        if (fetch == NULL) {
+            cpu->runStatus = RISA_RUN_ERROR;
+            cpu->exitCode = EFAULT;
+            return EFAULT;
+        }
         cpu->cycleCounter++;
-        cpu->IF = ACCESS_MEM_W(cpu->virtMem, cpu->pc);
-        cpu->instFields.opcode = GET_OPCODE(cpu->IF);
-        switch (g_opcodeToFormat[cpu->instFields.opcode]) {
+        // Decode into locals (kept in host registers rather than written back to the hart every instruction)
+        DecodedInst d;
+        d.inst = *(const u32*)fetch;
+        u32 opcode;
+        // Predecoded fields while the word is the one they were decoded from
+        Predecode *pre = cpu->predecode;
+        const u32 slot = (pre != NULL) ? ((cpu->pc - pre->base) >> 2) : 0;
+        const int predecoded = (pre != NULL) && slot < pre->count && pre->inst[slot] == d.inst;
+        if (predecoded) {
+            opcode   = pre->opcode[slot];
+            d.rd     = pre->rd[slot];
+            d.rs1    = pre->rs1[slot];
+            d.rs2    = pre->rs2[slot];
+            d.funct3 = pre->funct3[slot];
+            d.imm    = pre->imm[slot];
+        }
+        else {
+            opcode   = GET_OPCODE(d.inst);
+        }
+        // Fused pair - both instructions in this dispatch
+        if (predecoded && pre->fuse[slot] != PREDECODE_FUSE_NONE && fuseRun(cpu, pre, slot, fetch)) {
+            if (cpu->runStatus == RISA_RUN_ERROR) {
+                return cpu->exitCode;
+            }
+            cpu->regFile[ZERO] = 0;
+            if (cpu->cycleCounter >= cpu->nextEventCycle) {
+                eventsProcess(cpu);
+            }
+            continue;
+        }
+        switch (g_opcodeToFormat[opcode]) {
             case R: {
                 // Decode
-                cpu->instFields.rd     = GET_RD(cpu->IF);
-                cpu->instFields.rs1    = GET_RS1(cpu->IF);
-                cpu->instFields.rs2    = GET_RS2(cpu->IF);
-                cpu->instFields.funct3 = GET_FUNCT3(cpu->IF);
-                cpu->instFields.funct7 = GET_FUNCT7(cpu->IF);
-                cpu->ID = (cpu->instFields.funct7 << 10) | (cpu->instFields.funct3 << 7) | cpu->instFields.opcode;
+                if (!predecoded) {
+                    d.rd     = GET_RD(d.inst);
+                    d.rs1    = GET_RS1(d.inst);
+                    d.rs2    = GET_RS2(d.inst);
+                    d.funct3 = GET_FUNCT3(d.inst);
+                }
+                d.ID = (GET_FUNCT7(d.inst) << 10) | (d.funct3 << 7) | opcode;
                 // Execute
-                switch ((RtypeInstructions)cpu->ID) {
+                switch ((RtypeInstructions)d.ID) {
                     case ADD:  { // Addition
-                        TRACE_R((cpu), "add");
-                        cpu->regFile[cpu->instFields.rd] =
-                            cpu->regFile[cpu->instFields.rs1] + cpu->regFile[cpu->instFields.rs2];
+                        TRACE_R((cpu), d, "add");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] + cpu->regFile[d.rs2];
                         break;
                     }
                     case SUB:  { // Subtraction
-                        TRACE_R((cpu), "sub");
-                        cpu->regFile[cpu->instFields.rd] =
-                            cpu->regFile[cpu->instFields.rs1] - cpu->regFile[cpu->instFields.rs2];
+                        TRACE_R((cpu), d, "sub");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] - cpu->regFile[d.rs2];
                         break;
                     }
                     case SLL:  { // Shift left logical
-                        TRACE_R((cpu), "sll");
-                        cpu->regFile[cpu->instFields.rd] =
-                            cpu->regFile[cpu->instFields.rs1] << cpu->regFile[cpu->instFields.rs2];
+                        TRACE_R((cpu), d, "sll");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] << (cpu->regFile[d.rs2] & 0x1f);
                         break;
                     }
                     case SLT:  { // Set if less than (signed)
-                        TRACE_R((cpu), "slt");
-                        cpu->regFile[cpu->instFields.rd] =
-                            ((s32)cpu->regFile[cpu->instFields.rs1] < (s32)cpu->regFile[cpu->instFields.rs2]) ? 1 : 0;
+                        TRACE_R((cpu), d, "slt");
+                        cpu->regFile[d.rd] = ((s32)cpu->regFile[d.rs1] < (s32)cpu->regFile[d.rs2]) ? 1 : 0;
                         break;
                     }
                     case SLTU: { // Set if less than (unsigned)
-                        TRACE_R((cpu), "sltu");
-                        cpu->regFile[cpu->instFields.rd] =
-                            (cpu->regFile[cpu->instFields.rs1] < cpu->regFile[cpu->instFields.rs2]) ? 1 : 0;
+                        TRACE_R((cpu), d, "sltu");
+                        cpu->regFile[d.rd] = (cpu->regFile[d.rs1] < cpu->regFile[d.rs2]) ? 1 : 0;
                         break;
                     }
                     case XOR:  { // Bitwise xor
-                        TRACE_R((cpu), "xor");
-                        cpu->regFile[cpu->instFields.rd] =
-                            cpu->regFile[cpu->instFields.rs1] ^ cpu->regFile[cpu->instFields.rs2];
+                        TRACE_R((cpu), d, "xor");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] ^ cpu->regFile[d.rs2];
                         break;
                     }
                     case SRL:  { // Shift right logical
-                        TRACE_R((cpu), "srl");
-                        cpu->regFile[cpu->instFields.rd] =
-                            cpu->regFile[cpu->instFields.rs1] >> cpu->regFile[cpu->instFields.rs2];
+                        TRACE_R((cpu), d, "srl");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] >> (cpu->regFile[d.rs2] & 0x1f);
                         break;
                     }
                     case SRA:  { // Shift right arithmetic
-                        TRACE_R((cpu), "sra");
-                        cpu->regFile[cpu->instFields.rd] =
-                            (u32)((s32)cpu->regFile[cpu->instFields.rs1] >> cpu->regFile[cpu->instFields.rs2]);
+                        TRACE_R((cpu), d, "sra");
+                        cpu->regFile[d.rd] = (u32)((s32)cpu->regFile[d.rs1] >> (cpu->regFile[d.rs2] & 0x1f));
                         break;
                     }
                     case OR:   { // Bitwise or
-                        TRACE_R((cpu), "or");
-                        cpu->regFile[cpu->instFields.rd] =
-                            cpu->regFile[cpu->instFields.rs1] | cpu->regFile[cpu->instFields.rs2];
+                        TRACE_R((cpu), d, "or");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] | cpu->regFile[d.rs2];
                         break;
                     }
                     case AND:  { // Bitwise and
-                        TRACE_R((cpu), "and");
-                        cpu->regFile[cpu->instFields.rd] =
-                            cpu->regFile[cpu->instFields.rs1] & cpu->regFile[cpu->instFields.rs2];
+                        TRACE_R((cpu), d, "and");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] & cpu->regFile[d.rs2];
                         break;
                     }
                 }
@@ -272,126 +883,169 @@ int executionLoop(rv32iHart_t *cpu) {
             }
             case I: {
                 // Decode
-                cpu->instFields.rd     = GET_RD(cpu->IF);
-                cpu->instFields.rs1    = GET_RS1(cpu->IF);
-                cpu->instFields.funct3 = GET_FUNCT3(cpu->IF);
-                cpu->immFields.imm11_0 = GET_IMM_11_0(cpu->IF);
-                cpu->immFields.succ    = GET_SUCC(cpu->IF);
-                cpu->immFields.pred    = GET_PRED(cpu->IF);
-                cpu->immFields.fm      = GET_FM(cpu->IF);
-                cpu->immFinal = (((s32)cpu->immFields.imm11_0 << 20) >> 20);
-                cpu->ID = (cpu->instFields.funct3 << 7) | cpu->instFields.opcode;
-                cpu->targetAddress = cpu->regFile[cpu->instFields.rs1] + cpu->immFinal;
+                if (!predecoded) {
+                    d.rd     = GET_RD(d.inst);
+                    d.rs1    = GET_RS1(d.inst);
+                    d.funct3 = GET_FUNCT3(d.inst);
+                    d.imm    = (s32)d.inst >> 20;
+                }
+                d.ID = (d.funct3 << 7) | opcode;
+                // Shifts by immediate - imm[11:5] picks SRLI/SRAI, imm[4:0] is shamt
+                if ((d.ID & ~(0x4 << 7)) == SLLI) {
+                    d.ID |= GET_FUNCT7(d.inst) << 10;
+                    d.imm = GET_RS2(d.inst);
+                }
+                d.addr = cpu->regFile[d.rs1] + d.imm;
                 // Execute
-                switch ((ItypeInstructions)cpu->ID) {
+                switch ((ItypeInstructions)d.ID) {
                     case SLLI: { // Shift left logical by immediate (i.e. rs2 is shamt)
-                        TRACE_I((cpu), "slli");
-                        cpu->regFile[cpu->instFields.rd] = cpu->regFile[cpu->instFields.rs1] << cpu->immFinal;
+                        TRACE_I((cpu), d, "slli");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] << d.imm;
                         break;
                     }
                     case SRLI: { // Shift right logical by immediate (i.e. rs2 is shamt)
-                        TRACE_I((cpu), "srli");
-                        cpu->regFile[cpu->instFields.rd] = cpu->regFile[cpu->instFields.rs1] >> cpu->immFinal;
+                        TRACE_I((cpu), d, "srli");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] >> d.imm;
                         break;
                     }
                     case SRAI: { // Shift right arithmetic by immediate (i.e. rs2 is shamt)
-                        TRACE_I((cpu), "srai");
-                        cpu->regFile[cpu->instFields.rd] =
-                            (u32)((s32)cpu->regFile[cpu->instFields.rs1] >> cpu->immFinal);
+                        TRACE_I((cpu), d, "srai");
+                        cpu->regFile[d.rd] = (u32)((s32)cpu->regFile[d.rs1] >> d.imm);
                         break;
                     }
                     case JALR:  { // Jump and link register
-                        TRACE_I((cpu), "jalr");
-                        cpu->regFile[cpu->instFields.rd] = cpu->pc + 4;
-                        cpu->pc = ((cpu->targetAddress) & 0xfffffffe) - 4;
+                        TRACE_I((cpu), d, "jalr");
+                        cpu->regFile[d.rd] = cpu->pc + 4;
+                        RETIRE_BLOCK(cpu, cpu->pc, d.addr & 0xfffffffe);
+                        cpu->pc = (d.addr & 0xfffffffe) - 4;
                         break;
                     }
                     case LB:    { // Load byte (signed)
-                        TRACE_L((cpu), "lb");
-                        u32 loadByte = (u32)ACCESS_MEM_B(cpu->virtMem, cpu->targetAddress);
-                        cpu->regFile[cpu->instFields.rd] = (u32)((s32)(loadByte << 24) >> 24);
+                        TRACE_L((cpu), d, "lb");
+                        RETIRE_MEM(cpu, d.addr, 0);
+                        u32 loadByte = guestLoad(cpu, d.addr, 1);
+                        cpu->regFile[d.rd] = (u32)((s32)(loadByte << 24) >> 24);
                         break;
                     }
                     case LH:    { // Load halfword (signed)
-                        TRACE_L((cpu), "lh");
-                        u32 loadHalfword = (u32)ACCESS_MEM_H(cpu->virtMem, cpu->targetAddress);
-                        cpu->regFile[cpu->instFields.rd] = (u32)((s32)(loadHalfword << 16) >> 16);
+                        TRACE_L((cpu), d, "lh");
+                        RETIRE_MEM(cpu, d.addr, 0);
+                        u32 loadHalfword = guestLoad(cpu, d.addr, 2);
+                        cpu->regFile[d.rd] = (u32)((s32)(loadHalfword << 16) >> 16);
                         break;
                     }
                     case LW:    { // Load word
-                        TRACE_L((cpu), "lw");
-                        cpu->regFile[cpu->instFields.rd] = ACCESS_MEM_W(cpu->virtMem, cpu->targetAddress);
+                        TRACE_L((cpu), d, "lw");
+                        RETIRE_MEM(cpu, d.addr, 0);
+                        cpu->regFile[d.rd] = guestLoad(cpu, d.addr, 4);
                         break;
                     }
                     case LBU:   { // Load byte (unsigned)
-                        TRACE_L((cpu), "lbu");
-                        cpu->regFile[cpu->instFields.rd] =
-                            (u32)ACCESS_MEM_B(cpu->virtMem, cpu->targetAddress);
+                        TRACE_L((cpu), d, "lbu");
+                        RETIRE_MEM(cpu, d.addr, 0);
+                        cpu->regFile[d.rd] = guestLoad(cpu, d.addr, 1);
                         break;
                     }
                     case LHU:   { // Load halfword (unsigned)
-                        TRACE_L((cpu), "lhu");
-                        cpu->regFile[cpu->instFields.rd] =
-                            (u32)ACCESS_MEM_H(cpu->virtMem, cpu->targetAddress);
+                        TRACE_L((cpu), d, "lhu");
+                        RETIRE_MEM(cpu, d.addr, 0);
+                        cpu->regFile[d.rd] = guestLoad(cpu, d.addr, 2);
                         break;
                     }
                     case ADDI:  { // Add immediate
-                        TRACE_I((cpu), "addi");
-                        cpu->regFile[cpu->instFields.rd] = cpu->regFile[cpu->instFields.rs1] + cpu->immFinal;
+                        TRACE_I((cpu), d, "addi");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] + d.imm;
                         break;
                     }
                     case SLTI:  { // Set if less than immediate (signed)
-                        TRACE_I((cpu), "slti");
-                        cpu->regFile[cpu->instFields.rd] =
-                            ((s32)cpu->regFile[cpu->instFields.rs1] < cpu->immFinal) ? 1 : 0;
+                        TRACE_I((cpu), d, "slti");
+                        cpu->regFile[d.rd] = ((s32)cpu->regFile[d.rs1] < d.imm) ? 1 : 0;
                         break;
                     }
                     case SLTIU: { // Set if less than immediate (unsigned)
-                        TRACE_I((cpu), "sltiu");
-                        cpu->regFile[cpu->instFields.rd] =
-                            (cpu->regFile[cpu->instFields.rs1] < (u32)cpu->immFinal) ? 1 : 0;
+                        TRACE_I((cpu), d, "sltiu");
+                        cpu->regFile[d.rd] = (cpu->regFile[d.rs1] < (u32)d.imm) ? 1 : 0;
                         break;
                     }
                     case XORI:  { // Bitwise exclusive or immediate
-                        TRACE_I((cpu), "xori");
-                        cpu->regFile[cpu->instFields.rd] = cpu->regFile[cpu->instFields.rs1] ^ cpu->immFinal;
+                        TRACE_I((cpu), d, "xori");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] ^ d.imm;
                         break;
                     }
                     case ORI:   { // Bitwise or immediate
-                        TRACE_I((cpu), "ori");
-                        cpu->regFile[cpu->instFields.rd] = cpu->regFile[cpu->instFields.rs1] | cpu->immFinal;
+                        TRACE_I((cpu), d, "ori");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] | d.imm;
                         break;
                     }
                     case ANDI:  { // Bitwise and immediate
-                        TRACE_I((cpu), "andi");
-                        cpu->regFile[cpu->instFields.rd] = cpu->regFile[cpu->instFields.rs1] & cpu->immFinal;
+                        TRACE_I((cpu), d, "andi");
+                        cpu->regFile[d.rd] = cpu->regFile[d.rs1] & d.imm;
+                        break;
+                    }
+                    case FLW:   { // Load word (single-precision float)
+                        TRACE_FLS((cpu), d, "flw", d.rd);
+                        RETIRE_MEM(cpu, d.addr, 0);
+                        cpu->fregFile[d.rd] = guestLoad(cpu, d.addr, 4);
+                        break;
+                    }
+                    case CSRRW:
+                    case CSRRS:
+                    case CSRRC:
+                    case CSRRWI:
+                    case CSRRSI:
+                    case CSRRCI: { // Atomic read/write, set or clear CSR bits (register or 5-bit immediate source)
+                        static const char *csrNames[] = {
+                            "", "csrrw", "csrrs", "csrrc", "", "csrrwi", "csrrsi", "csrrci"
+                        };
+                        TRACE_CSR((cpu), d, csrNames[d.funct3]);
+                        u32 src = (d.funct3 & 0x4) ? d.rs1 : cpu->regFile[d.rs1];
+                        // CSRRS/CSRRC with a zero source don't write (i.e. pure reads)
+                        int doWrite = ((d.funct3 & 0x3) == 0x1) || (d.rs1 != 0);
+                        u32 oldVal;
+                        if (accessCsr(cpu, GET_IMM_11_0(d.inst), d.funct3, src, doWrite, &oldVal)) {
+                            cpu->runStatus = RISA_RUN_ERROR;
+                            cpu->exitCode = EILSEQ;
+                            return EILSEQ;
+                        }
+                        cpu->regFile[d.rd] = oldVal;
                         break;
                     }
                     case FENCE: { // FENCE - order device I/O and memory accesses
-                        TRACE_FEN((cpu), "fence");
-                        cpu->handlerProcs[RISA_ENV_HANDLER_PROC](cpu);
+                        TRACE_FEN((cpu), d, "fence");
+                        envEvent(cpu, d, RISA_ENV_FENCE);
                         break;
                     }
                     // Catch environment-type instructions
                     default: {
-                        cpu->ID = (cpu->immFields.imm11_0 << 20) |
-                            (cpu->instFields.funct3 << 7) | cpu->instFields.opcode;
-                        switch ((ItypeInstructions)cpu->ID) {
+                        d.ID = (GET_IMM_11_0(d.inst) << 20) | (d.funct3 << 7) | opcode;
+                        switch ((ItypeInstructions)d.ID) {
                             case ECALL:  { // ECALL - request a syscall
-                                TRACE_E((cpu), "ecall");
-                                cpu->handlerProcs[RISA_ENV_HANDLER_PROC](cpu);
+                                TRACE_E((cpu), d, "ecall");
+                                envEvent(cpu, d, RISA_ENV_ECALL);
                                 break;
                             }
                             case EBREAK: { // EBREAK - halt processor execution, transfer control to debugger
-                                TRACE_E((cpu), "ebreak");
-                                cpu->handlerProcs[RISA_ENV_HANDLER_PROC](cpu);
+                                TRACE_E((cpu), d, "ebreak");
+                                envEvent(cpu, d, RISA_ENV_EBREAK);
+                                break;
+                            }
+                            case WFI:    { // WFI - stall until an interrupt is pending
+                                TRACE_E((cpu), d, "wfi");
+                                idleWaitForInterrupt(cpu);
+                                break;
+                            }
+                            case MRET:   { // MRET - return from a machine-mode trap
+                                TRACE_E((cpu), d, "mret");
+                                u32 mpie = (cpu->trap.mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0;
+                                cpu->trap.mstatus = (cpu->trap.mstatus & ~MSTATUS_MIE) | mpie | MSTATUS_MPIE;
+                                RETIRE_BLOCK(cpu, cpu->pc, cpu->trap.mepc);
+                                cpu->pc = cpu->trap.mepc - 4;
+                                EVENTS_RECHECK(cpu);
                                 break;
                             }
                             default: { // Invalid instruction
-                                cpu->endTime = clock();
-                                printf(LOG_LINE_BREAK);
-                                LOG_E("(0x%08x) is an invalid instruction.\n", cpu->IF);
-                                cleanupSimulator(cpu);
+                                cpu->runStatus = RISA_RUN_ERROR;
+                                cpu->exitCode = EILSEQ;
                                 return EILSEQ;
                             }
                         }
@@ -401,113 +1055,130 @@ int executionLoop(rv32iHart_t *cpu) {
             }
             case S: {
                 // Decode
-                cpu->instFields.funct3 = GET_FUNCT3(cpu->IF);
-                cpu->immFields.imm4_0  = GET_IMM_4_0(cpu->IF);
-                cpu->instFields.rs1    = GET_RS1(cpu->IF);
-                cpu->instFields.rs2    = GET_RS2(cpu->IF);
-                cpu->immFields.imm11_5 = GET_IMM_11_5(cpu->IF);
-                cpu->immPartial = cpu->immFields.imm4_0 | (cpu->immFields.imm11_5 << 5);
-                cpu->immFinal = (((s32)cpu->immPartial << 20) >> 20);
-                cpu->ID = (cpu->instFields.funct3 << 7) | cpu->instFields.opcode;
-                cpu->targetAddress = cpu->regFile[cpu->instFields.rs1] + cpu->immFinal;
+                if (!predecoded) {
+                    d.funct3 = GET_FUNCT3(d.inst);
+                    d.rs1    = GET_RS1(d.inst);
+                    d.rs2    = GET_RS2(d.inst);
+                    d.imm    = (s32)((GET_IMM_4_0(d.inst) | (GET_IMM_11_5(d.inst) << 5)) << 20) >> 20;
+                }
+                d.ID = (d.funct3 << 7) | opcode;
+                d.addr = cpu->regFile[d.rs1] + d.imm;
                 // Execute
-                switch ((StypeInstructions)cpu->ID) {
+                switch ((StypeInstructions)d.ID) {
                     case SB: { // Store byte
-                        TRACE_S((cpu), "sb");
-                        ACCESS_MEM_B(cpu->virtMem, cpu->targetAddress) =
-                            (u8)cpu->regFile[cpu->instFields.rs2];
+                        TRACE_S((cpu), d, "sb");
+                        guestStore(cpu, d.addr, 1, cpu->regFile[d.rs2]);
                         break;
                     }
                     case SH: { // Store halfword
-                        TRACE_S((cpu), "sh");
-                        ACCESS_MEM_H(cpu->virtMem, cpu->targetAddress) =
-                            (u16)cpu->regFile[cpu->instFields.rs2];
+                        TRACE_S((cpu), d, "sh");
+                        guestStore(cpu, d.addr, 2, cpu->regFile[d.rs2]);
                         break;
                     }
                     case SW: { // Store word
-                        TRACE_S((cpu), "sw");
-                        ACCESS_MEM_W(cpu->virtMem, cpu->targetAddress) = cpu->regFile[cpu->instFields.rs2];
+                        TRACE_S((cpu), d, "sw");
+                        guestStore(cpu, d.addr, 4, cpu->regFile[d.rs2]);
+                        break;
+                    }
+                    case FSW: { // Store word (single-precision float)
+                        TRACE_FLS((cpu), d, "fsw", d.rs2);
+                        guestStore(cpu, d.addr, 4, cpu->fregFile[d.rs2]);
                         break;
                     }
                 }
-                cpu->handlerProcs[RISA_MMIO_HANDLER_PROC](cpu);
+                RETIRE_MEM(cpu, d.addr, 1);
+                // v1 MMIO handler sees every store (i.e. works out what happened from targetAddress) - what it
+                // changes is logged like an interrupt callback's
+                if (cpu->handlerProcs[RISA_MMIO_HANDLER_PROC] != NULL && cpu->replayMode != REPLAY_PLAYBACK) {
+                    V1_HANDLER_VIEW(cpu, d);
+                    replayHandlerBegin(cpu);
+                    cpu->handlerProcs[RISA_MMIO_HANDLER_PROC](cpu);
+                    replayHandlerEnd(cpu, REPLAY_REC_INTERRUPT, 1);
+                }
                 break;
             }
             case B: {
                 // Decode
-                cpu->instFields.rs1    = GET_RS1(cpu->IF);
-                cpu->instFields.rs2    = GET_RS2(cpu->IF);
-                cpu->instFields.funct3 = GET_FUNCT3(cpu->IF);
-                cpu->immFields.imm11   = GET_IMM_11_B(cpu->IF);
-                cpu->immFields.imm4_1  = GET_IMM_4_1(cpu->IF);
-                cpu->immFields.imm10_5 = GET_IMM_10_5(cpu->IF);
-                cpu->immFields.imm12   = GET_IMM_12(cpu->IF);
-                cpu->immPartial = cpu->immFields.imm4_1 | (cpu->immFields.imm10_5 << 4) |
-                    (cpu->immFields.imm11 << 10) | (cpu->immFields.imm12 << 11);
-                cpu->targetAddress = (s32)(cpu->immPartial << 20) >> 19;
-                cpu->ID = (cpu->instFields.funct3 << 7) | cpu->instFields.opcode;
+                if (!predecoded) {
+                    d.rs1    = GET_RS1(d.inst);
+                    d.rs2    = GET_RS2(d.inst);
+                    d.funct3 = GET_FUNCT3(d.inst);
+                    u32 immPartial = GET_IMM_4_1(d.inst) | (GET_IMM_10_5(d.inst) << 4) |
+                        (GET_IMM_11_B(d.inst) << 10) | (GET_IMM_12(d.inst) << 11);
+                    d.imm = (s32)(immPartial << 20) >> 19;
+                }
+                d.ID = (d.funct3 << 7) | opcode;
+                u32 branchPc = cpu->pc;
                 // Execute
-                switch ((BtypeInstructions)cpu->ID) {
+                switch ((BtypeInstructions)d.ID) {
                     case BEQ:  { // Branch if Equal
-                        TRACE_B((cpu), "beq");
-                        if ((s32)cpu->regFile[cpu->instFields.rs1] == (s32)cpu->regFile[cpu->instFields.rs2]) {
-                            cpu->pc += cpu->targetAddress - 4;
+                        TRACE_B((cpu), d, "beq");
+                        if ((s32)cpu->regFile[d.rs1] == (s32)cpu->regFile[d.rs2]) {
+                            cpu->pc += d.imm - 4;
                         }
                         break;
                     }
                     case BNE:  { // Branch if Not Equal
-                        TRACE_B((cpu), "bne");
-                        if ((s32)cpu->regFile[cpu->instFields.rs1] != (s32)cpu->regFile[cpu->instFields.rs2]) {
-                            cpu->pc += cpu->targetAddress - 4;
+                        TRACE_B((cpu), d, "bne");
+                        if ((s32)cpu->regFile[d.rs1] != (s32)cpu->regFile[d.rs2]) {
+                            cpu->pc += d.imm - 4;
                         }
                         break;
                     }
                     case BLT:  { // Branch if Less Than
-                        TRACE_B((cpu), "blt");
-                        if ((s32)cpu->regFile[cpu->instFields.rs1] < (s32)cpu->regFile[cpu->instFields.rs2]) {
-                            cpu->pc += cpu->targetAddress - 4;
+                        TRACE_B((cpu), d, "blt");
+                        if ((s32)cpu->regFile[d.rs1] < (s32)cpu->regFile[d.rs2]) {
+                            cpu->pc += d.imm - 4;
                         }
                         break;
                     }
                     case BGE:  { // Branch if Greater Than or Equal
-                        TRACE_B((cpu), "bge");
-                        if ((s32)cpu->regFile[cpu->instFields.rs1] >= (s32)cpu->regFile[cpu->instFields.rs2]) {
-                            cpu->pc += cpu->targetAddress - 4;
+                        TRACE_B((cpu), d, "bge");
+                        if ((s32)cpu->regFile[d.rs1] >= (s32)cpu->regFile[d.rs2]) {
+                            cpu->pc += d.imm - 4;
                         }
                         break;
                     }
                     case BLTU: { // Branch if Less Than (unsigned)
-                        TRACE_B((cpu), "bltu");
-                        if (cpu->regFile[cpu->instFields.rs1] < cpu->regFile[cpu->instFields.rs2]) {
-                            cpu->pc += cpu->targetAddress - 4;
+                        TRACE_B((cpu), d, "bltu");
+                        if (cpu->regFile[d.rs1] < cpu->regFile[d.rs2]) {
+                            cpu->pc += d.imm - 4;
                         }
                         break;
                     }
                     case BGEU: { // Branch if Greater Than or Equal (unsigned)
-                        TRACE_B((cpu), "bgeu");
-                        if (cpu->regFile[cpu->instFields.rs1] >= cpu->regFile[cpu->instFields.rs2]) {
-                            cpu->pc += cpu->targetAddress - 4;
+                        TRACE_B((cpu), d, "bgeu");
+                        if (cpu->regFile[d.rs1] >= cpu->regFile[d.rs2]) {
+                            cpu->pc += d.imm - 4;
                         }
                         break;
                     }
                 }
+                if (cpu->pc != branchPc) {
+                    RETIRE_BLOCK(cpu, branchPc, cpu->pc + 4);
+                    // Taken backward branch - possibly an idle loop
+                    if (d.imm <= 0) {
+                        IDLE_BACK_EDGE(cpu, branchPc, cpu->pc + 4);
+                    }
+                }
                 break;
             }
             case U: {
                 // Decode
-                cpu->instFields.rd      = GET_RD(cpu->IF);
-                cpu->immFields.imm31_12 = GET_IMM_31_12(cpu->IF);
-                cpu->immFinal = cpu->immFields.imm31_12 << 12;
+                if (!predecoded) {
+                    d.rd  = GET_RD(d.inst);
+                    d.imm = (s32)(d.inst & 0xfffff000);
+                }
                 // Execute
-                switch ((UtypeInstructions)cpu->instFields.opcode) {
+                switch ((UtypeInstructions)opcode) {
                     case LUI:   { // Load Upper Immediate
-                        TRACE_U((cpu), "lui");
-                        cpu->regFile[cpu->instFields.rd] = cpu->immFinal;
+                        TRACE_U((cpu), d, "lui");
+                        cpu->regFile[d.rd] = d.imm;
                         break;
                     }
                     case AUIPC: { // Add Upper Immediate to cpu->pc
-                        TRACE_U((cpu), "auipc");
-                        cpu->regFile[cpu->instFields.rd] = cpu->pc + cpu->immFinal;
+                        TRACE_U((cpu), d, "auipc");
+                        cpu->regFile[d.rd] = cpu->pc + d.imm;
                         break;
                     }
                 }
@@ -515,42 +1186,74 @@ int executionLoop(rv32iHart_t *cpu) {
             }
             case J: { // Jump and link
                 // Decode
-                cpu->instFields.rd      = GET_RD(cpu->IF);
-                cpu->immFields.imm19_12 = GET_IMM_19_12(cpu->IF);
-                cpu->immFields.imm11    = GET_IMM_11_J(cpu->IF);
-                cpu->immFields.imm10_1  = GET_IMM_10_1(cpu->IF);
-                cpu->immFields.imm20    = GET_IMM_20(cpu->IF);
-                cpu->immPartial = cpu->immFields.imm10_1 | (cpu->immFields.imm11 << 10) |
-                    (cpu->immFields.imm19_12 << 11) | (cpu->immFields.imm20 << 19);
-                cpu->targetAddress = (s32)(cpu->immPartial << 12) >> 11;
-                TRACE_J((cpu), "jal");
+                if (!predecoded) {
+                    d.rd = GET_RD(d.inst);
+                    u32 immPartial = GET_IMM_10_1(d.inst) | (GET_IMM_11_J(d.inst) << 10) |
+                        (GET_IMM_19_12(d.inst) << 11) | (GET_IMM_20(d.inst) << 19);
+                    d.imm = (s32)(immPartial << 12) >> 11;
+                }
+                TRACE_J((cpu), d, "jal");
+                // Execute
+                cpu->regFile[d.rd] = cpu->pc + 4;
+                RETIRE_BLOCK(cpu, cpu->pc, cpu->pc + d.imm);
+                cpu->pc += d.imm - 4;
+                if (d.imm <= 0) {
+                    IDLE_BACK_EDGE(cpu, cpu->pc + 4 - d.imm, cpu->pc + 4);
+                }
+                break;
+            }
+            case F: { // Floating-point (OP-FP)
+                // Decode
+                if (!predecoded) {
+                    d.rd     = GET_RD(d.inst);
+                    d.rs1    = GET_RS1(d.inst);
+                    d.rs2    = GET_RS2(d.inst);
+                    d.funct3 = GET_FUNCT3(d.inst);
+                }
+                d.ID = (GET_FUNCT7(d.inst) << 10) | opcode;
+                // Execute
+                if (fpuExecuteOp(cpu, d)) {
+                    cpu->runStatus = RISA_RUN_ERROR;
+                    cpu->exitCode = EILSEQ;
+                    return EILSEQ;
+                }
+                break;
+            }
+            case R4: { // Floating-point fused multiply-add
+                // Decode
+                if (!predecoded) {
+                    d.rd     = GET_RD(d.inst);
+                    d.rs1    = GET_RS1(d.inst);
+                    d.rs2    = GET_RS2(d.inst);
+                    d.funct3 = GET_FUNCT3(d.inst);
+                }
+                d.ID = (GET_FUNCT2(d.inst) << 7) | opcode;
                 // Execute
-                cpu->regFile[cpu->instFields.rd] = cpu->pc + 4;
-                cpu->pc += cpu->targetAddress - 4;
+                if (fpuExecuteR4(cpu, d)) {
+                    cpu->runStatus = RISA_RUN_ERROR;
+                    cpu->exitCode = EILSEQ;
+                    return EILSEQ;
+                }
                 break;
             }
             default: { // Invalid instruction
-                cpu->endTime = clock();
-                printf(LOG_LINE_BREAK);
-                LOG_E("( 0x%08x ) is an invalid instruction.\n", cpu->IF);
-                cleanupSimulator(cpu);
+                cpu->runStatus = RISA_RUN_ERROR;
+                cpu->exitCode = EILSEQ;
                 return EILSEQ;
             }
         }
-        // If PC is out-of-bounds
-        if (cpu->pc > cpu->virtMemSize) {
-            cpu->endTime = clock();
-            printf(LOG_LINE_BREAK);
-            LOG_E("Program counter is out of range.\n");
-            cleanupSimulator(cpu);
-            return EFAULT;
+        // Load/store access fault (the faulting instruction stays at pc)
+        if (cpu->runStatus == RISA_RUN_ERROR) {
+            return cpu->exitCode;
         }
 
-        if ((cpu->cycleCounter % cpu->intPeriodVal) == 0) {
-            cpu->handlerProcs[RISA_INT_HANDLER_PROC](cpu);
-        }
         cpu->pc += 4;
         cpu->regFile[ZERO] = 0;
+
+        // Device events (interrupt handlers, gdb polling, CLINT timer) - a single compare until the next one is due
+        if (cpu->cycleCounter >= cpu->nextEventCycle) {
+            eventsProcess(cpu);
+        }
     }
 }
 
@@ -568,6 +1271,15 @@ const char *g_regfileAliasLookup[] = {
     "t3", "t4", "t5", "t6"
 };
 
+const char *g_fregfileAliasLookup[] = {
+    "ft0", "ft1", "ft2", "ft3", "ft4", "ft5", "ft6", "ft7",
+    "fs0", "fs1",
+    "fa0", "fa1",
+    "fa2", "fa3", "fa4", "fa5", "fa6", "fa7",
+    "fs2", "fs3", "fs4", "fs5", "fs6", "fs7", "fs8", "fs9", "fs10", "fs11",
+    "ft8", "ft9", "ft10", "ft11"
+};
+
 const InstFormats g_opcodeToFormat[128] = {
     /* 0b0000000 */ Undefined,
     /* 0b0000001 */ Undefined,
@@ -576,7 +1288,7 @@ const InstFormats g_opcodeToFormat[128] = {
     /* 0b0000100 */ Undefined,
     /* 0b0000101 */ Undefined,
     /* 0b0000110 */ Undefined,
-    /* 0b0000111 */ Undefined,
+    /* 0b0000111 */ I,
     /* 0b0001000 */ Undefined,
     /* 0b0001001 */ Undefined,
     /* 0b0001010 */ Undefined,
@@ -608,7 +1320,7 @@ const InstFormats g_opcodeToFormat[128] = {
     /* 0b0100100 */ Undefined,
     /* 0b0100101 */ Undefined,
     /* 0b0100110 */ Undefined,
-    /* 0b0100111 */ Undefined,
+    /* 0b0100111 */ S,
     /* 0b0101000 */ Undefined,
     /* 0b0101001 */ Undefined,
     /* 0b0101010 */ Undefined,
@@ -636,23 +1348,23 @@ const InstFormats g_opcodeToFormat[128] = {
     /* 0b1000000 */ Undefined,
     /* 0b1000001 */ Undefined,
     /* 0b1000010 */ Undefined,
-    /* 0b1000011 */ Undefined,
+    /* 0b1000011 */ R4,
     /* 0b1000100 */ Undefined,
     /* 0b1000101 */ Undefined,
     /* 0b1000110 */ Undefined,
-    /* 0b1000111 */ Undefined,
+    /* 0b1000111 */ R4,
     /* 0b1001000 */ Undefined,
     /* 0b1001001 */ Undefined,
     /* 0b1001010 */ Undefined,
-    /* 0b1001011 */ Undefined,
+    /* 0b1001011 */ R4,
     /* 0b1001100 */ Undefined,
     /* 0b1001101 */ Undefined,
     /* 0b1001110 */ Undefined,
-    /* 0b1001111 */ Undefined,
+    /* 0b1001111 */ R4,
     /* 0b1010000 */ Undefined,
     /* 0b1010001 */ Undefined,
     /* 0b1010010 */ Undefined,
-    /* 0b1010011 */ Undefined,
+    /* 0b1010011 */ F,
     /* 0b1010100 */ Undefined,
     /* 0b1010101 */ Undefined,
     /* 0b1010110 */ Undefined,
@@ -6,12 +6,23 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "librisa.h"
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#include <process.h>
 #else
+#include <stdlib.h>
 #include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #endif
 
+#define CACHE_LINE_SIZE                 64
+#define HOST_PATH_MAX                   4096    // Host path buffers (at least PATH_MAX for HOST_REALPATH)
+
 #ifdef _WIN32 // --- windows
 #define LOAD_LIB(libpath)               LoadLibrary(libpath)
 #define CLOSE_LIB(handle)               FreeLibrary(handle)
@@ -23,6 +34,27 @@
                                             }                                           \
                                         } while (0)
 #define DLLEXPORT                       __declspec(dllexport)
+#define HOST_WRITE(fd, buf, len)        _write(fd, buf, (unsigned int)(len))
+#define HOST_READ(fd, buf, len)         _read(fd, buf, (unsigned int)(len))
+#define HOST_OPEN(path, flags, mode)    _open(path, (flags) | _O_BINARY, mode)
+#define HOST_CLOSE(fd)                  _close(fd)
+#define HOST_LSEEK(fd, offset, whence)  _lseek(fd, offset, whence)
+#define HOST_FSTAT(fd, st)              _fstat(fd, st)
+#define HOST_UNLINK(path)               _unlink(path)
+#define HOST_STAT_T                     struct _stat
+#define HOST_GETPID()                   _getpid()
+#define HOST_REALPATH(path, resolved)   _fullpath(resolved, path, HOST_PATH_MAX)
+#define HOST_LSTAT(path, st)            _stat(path, st)
+#define HOST_O_NOFOLLOW                 0
+#define HOST_LIB_SUFFIX                 ".dll"
+#define PATH_SEPARATOR                  '\\'
+#define MAP_GUEST_MEM(size)             VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)
+#define UNMAP_GUEST_MEM(ptr, size)      VirtualFree(ptr, 0, MEM_RELEASE)
+#define MAP_GUEST_MEM_FAILED            NULL
+#define THREAD_LOCAL                    __declspec(thread)
+#define CACHE_ALIGNED                   __declspec(align(CACHE_LINE_SIZE))
+#define ALLOC_ALIGNED(size)             _aligned_malloc(size, CACHE_LINE_SIZE)
+#define FREE_ALIGNED(ptr)               _aligned_free(ptr)
 #define SIGINT_RET_TYPE                 BOOL WINAPI
 #define SIGINT_PARAM                    DWORD
 #define SIGINT_RET                      return TRUE
@@ -42,6 +74,27 @@
                                             fp = fopen(filename, mode);                 \
                                         } while (0)
 #define DLLEXPORT
+#define HOST_WRITE(fd, buf, len)        write(fd, buf, len)
+#define HOST_READ(fd, buf, len)         read(fd, buf, len)
+#define HOST_OPEN(path, flags, mode)    open(path, flags, mode)
+#define HOST_CLOSE(fd)                  close(fd)
+#define HOST_LSEEK(fd, offset, whence)  lseek(fd, offset, whence)
+#define HOST_FSTAT(fd, st)              fstat(fd, st)
+#define HOST_UNLINK(path)               unlink(path)
+#define HOST_STAT_T                     struct stat
+#define HOST_GETPID()                   getpid()
+#define HOST_REALPATH(path, resolved)   realpath(path, resolved)
+#define HOST_LSTAT(path, st)            lstat(path, st)
+#define HOST_O_NOFOLLOW                 O_NOFOLLOW
+#define HOST_LIB_SUFFIX                 ".so"
+#define PATH_SEPARATOR                  '/'
+#define MAP_GUEST_MEM(size)             mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+#define UNMAP_GUEST_MEM(ptr, size)      munmap(ptr, size)
+#define MAP_GUEST_MEM_FAILED            MAP_FAILED
+#define THREAD_LOCAL                    __thread
+#define CACHE_ALIGNED                   __attribute__((aligned(CACHE_LINE_SIZE)))
+#define ALLOC_ALIGNED(size)             hostAlignedAlloc(size, CACHE_LINE_SIZE)
+#define FREE_ALIGNED(ptr)               free(ptr)
 #define SIGINT_RET_TYPE                 void
 #define SIGINT_PARAM                    int
 #define SIGINT_RET                      do {} while(0)
@@ -54,10 +107,20 @@
                                         } while (0)
 #endif
 
+#ifndef _WIN32
+static inline void *hostAlignedAlloc(size_t size, size_t align) {
+    void *ptr = NULL;
+    return (posix_memalign(&ptr, align, size) == 0) ? ptr : NULL;
+}
+#endif
+
 #define KB_MULTIPLIER           (1024)
 #define MB_MULTIPLIER           (1024*1024)
 #define DEFAULT_VIRT_MEM_SIZE   (MB_MULTIPLIER * 1) // Default to 1 MB
 #define DEFAULT_INT_PERIOD      500
+#define DEFAULT_WRITE_BUF_SIZE  (KB_MULTIPLIER * 4)
+#define MAX_GUEST_FILES         32
+#define DEFAULT_ACCEL_COST      1
 
 #define ACCESS_MEM_W(virtMem, offset) (*(u32*)((u8*)virtMem + offset))
 #define ACCESS_MEM_H(virtMem, offset) (*(u16*)((u8*)virtMem + offset))
@@ -85,6 +148,8 @@
 #define GET_SUCC(instr)             GET_BITS(instr, 20, 4)
 #define GET_PRED(instr)             GET_BITS(instr, 24, 4)
 #define GET_FM(instr)               GET_BITS(instr, 28, 4)
+#define GET_RS3(instr)              GET_BITS(instr, 27, 5)
+#define GET_FUNCT2(instr)           GET_BITS(instr, 25, 2)
 
 typedef uint8_t     u8;
 typedef uint16_t    u16;
@@ -94,31 +159,17 @@ typedef int8_t      s8;
 typedef int16_t     s16;
 typedef int32_t     s32;
 
+// One decoded instruction - a local of runHart() (so the compiler can keep it in host registers), not hart state
 typedef struct {
-    u32 imm11_0  : 12;
-    u32 imm4_0   : 5;
-    u32 imm11_5  : 7;
-    u32 imm11    : 1;
-    u32 imm4_1   : 4;
-    u32 imm10_5  : 6;
-    u32 imm12    : 1;
-    u32 imm31_12 : 20;
-    u32 imm19_12 : 8;
-    u32 imm10_1  : 10;
-    u32 imm20    : 1;
-    u32 succ     : 4;
-    u32 pred     : 4;
-    u32 fm       : 4;
-} ImmediateFields;
-
-typedef struct {
-    u32 opcode : 7;
-    u32 rd     : 5;
-    u32 rs1    : 5;
-    u32 rs2    : 5;
-    u32 funct3 : 3;
-    u32 funct7 : 7;
-} InstructionFields;
+    u32 inst;               // Raw instruction word
+    u32 ID;                 // Opcode plus function fields (the instruction enums below)
+    u32 rd;
+    u32 rs1;
+    u32 rs2;
+    u32 funct3;
+    s32 imm;                // Sign-extended immediate (B/J: the branch/jump offset)
+    u32 addr;               // Load/store address
+} DecodedInst;
 
 typedef struct {
     u32 o_tracePrintEnable  : 1;
@@ -127,22 +178,214 @@ typedef struct {
     u32 o_timeout           : 1;
     u32 o_intPeriod         : 1;
     u32 o_gdbEnabled        : 1;
+    u32 o_bufferedWrite     : 1;
+    u32 o_gdbAttach         : 1;
+    u32 o_gdbReverse        : 1;
+    u32 o_clint             : 1;
+    u32 o_predecode         : 1;
 } optFlags;
 
 typedef struct {
-    u32 dbgContinue : 1;
+    char    *buf;
+    u32     len;
+    u32     threshold;
+} WriteBuffer;
+
+typedef struct {
+    int         hostFds[MAX_GUEST_FILES]; // Guest fd -> host fd (0 is closed, guest fds 0-2 are host stdio)
+    const char  *sandboxDir;
+    u32         heapBreak;
+    u32         accelCyclesPerWord;       // Cycles charged per word processed by the memory/string intrinsics
+} EnvFields;
+
+typedef struct {
+    u32 dbgContinue : 1;    // Fast-path flag checked every instruction (cleared to route the next one to gdbserver)
     u32 dbgStep     : 1;
-    u32 dbgBreak    : 1;
+    u32 runFree     : 1;    // gdb asked to continue (restores dbgContinue after gdbserver-internal stops)
+    u32 swallowAck  : 1;
+    u32 muteOutput  : 1;    // Drop stub output (i.e. replies to packets rISA injected itself)
 } GdbFlags;
 
+// Why the simulator last stopped into the GDB stub (decides the stop reply sent on entry)
+typedef enum {
+    GDB_STOP_TRAP = 0,      // Breakpoint or completed step
+    GDB_STOP_ATTACH,        // New connection - gdb starts the conversation itself
+    GDB_STOP_INTERRUPT,     // Ctrl-C (0x03) received while running
+    GDB_STOP_REPLY          // rISA sends stopReply itself (i.e. watchpoint hit, start of reverse history)
+} GdbStopReason;
+
+typedef enum {
+    GDB_WATCH_WRITE = 2,    // Same numbering as the Z2/Z3/Z4 packet types
+    GDB_WATCH_READ,
+    GDB_WATCH_ACCESS
+} GdbWatchType;
+
+typedef struct {
+    u32 addr;
+    u32 len;
+    u8  type;   // GdbWatchType
+} GdbWatchpoint;
+
+#define GDB_MAX_WATCHPOINTS     16
+
+// Guest buffer a host-side access (syscall or accel ECALL) works on - checked against every watchpoint
+typedef struct {
+    u32 addr;
+    u32 len;
+    u8  isWrite;
+} GdbHostAccess;
+
+// Most buffers a single ECALL touches (i.e. memcpy source and destination)
+#define GDB_MAX_HOST_ACCESSES   2
+
+// Watched guest pages are protected - the fault handler unprotects the page and records it here
 typedef struct {
-    u16         serverPort;
-    int         socketFd;
-    int         connectFd;
-    u32         breakAddr;
-    GdbFlags    gdbFlags;
+    GdbWatchpoint   points[GDB_MAX_WATCHPOINTS];
+    u32             count;
+    u32             pageSize;
+    u32             faultAddr;          // First faulting guest address of the last instruction
+    u32             faultPc;            // That instruction (decoded again by gdbserverWatchHit())
+    u8              *faultBitmap;       // Pages to re-protect, one bit per page (a host-side access can touch any)
+    u32             faultFirst;         // Lowest/highest page index set in faultBitmap
+    u32             faultLast;
+    u32             faultPageCount;
+    GdbHostAccess   hostAccess[GDB_MAX_HOST_ACCESSES];  // Buffers of the last ECALL (see defaultEnvHandler)
+    u32             hostAccessCount;
+} GdbWatchFields;
+
+// Cycles between checks for gdb attaching/interrupting while running free
+#define GDB_POLL_CYCLES         (1 << 16)
+
+typedef struct GdbTransport GdbTransport;
+typedef struct GdbReverse GdbReverse;
+
+typedef struct {
+    u16             serverPort;
+    int             socketFd;
+    int             connectFd;
+    u8              *breakBitmap;           // One bit per instruction word
+    GdbTransport    *transport;             // Buffered socket/packet state (see gdbserver.h)
+    u64             lastPollCycle;
+    u8              stopReason;             // GdbStopReason
+    char            stopReply[32];          // Stop reply rISA sends itself (i.e. watchpoint hits)
+    GdbWatchFields  watch;
+    GdbReverse      *reverse;               // Checkpoints for reverse execution (NULL if disabled)
+    GdbFlags        gdbFlags;
 } GdbFields;
 
+// Breakpoint bitmap lookup (PC is word-aligned) - the bitmap only covers guest memory, so a PC past it (i.e. a
+// wild jump, faulted on fetch) is never a hit
+#define GDB_BREAK_BIT_SET(bitmap, memSize, addr)    (((addr) < (memSize)) &&    \
+                                                    ((bitmap)[(addr) >> 5] & (1 << (((addr) >> 2) & 0x7))))
+#define GDB_BREAK_BITMAP_SIZE(memSize)              (((memSize) >> 5) + 1)
+
+// Only enter the GDB stub when stopped/stepping or on a breakpoint hit (i.e. one bitmap load while running)
+#define GDB_SHOULD_STOP(cpu)    (!(cpu)->gdbFields.gdbFlags.dbgContinue ||  \
+                                GDB_BREAK_BIT_SET((cpu)->gdbFields.breakBitmap, (cpu)->virtMemSize, (cpu)->pc))
+
+// M-mode trap CSRs (see events.c for interrupt entry, MRET in executionLoop)
+typedef struct {
+    u32 mstatus;
+    u32 mie;
+    u32 mip;
+    u32 mtvec;
+    u32 mscratch;
+    u32 mepc;
+    u32 mcause;
+    u32 mtval;
+} TrapFields;
+
+// Built-in CLINT timer/software-interrupt device (see clint.c) - size is 0 while disabled
+typedef struct {
+    u32 base;
+    u32 size;
+    u32 msip;
+    u64 mtimecmp;
+    u64 mtimeOffset;        // mtime = cycleCounter + mtimeOffset
+} ClintFields;
+
+// Device event sources - at most one pending event each
+typedef enum {
+    EVENT_INT_HANDLER = 0,  // Periodic v1 risaIntHandler/v2 interrupt callback
+    EVENT_GDB_POLL,         // Check for gdb attaching/interrupting while running free
+    EVENT_CLINT_TIMER,      // mtime reaching mtimecmp
+    EVENT_REPLAY,           // Next recorded interrupt callback (replay playback)
+    EVENT_SOURCE_COUNT
+} EventSource;
+
+typedef struct {
+    u64 when;               // cycleCounter value the event fires at
+    u32 source;             // EventSource
+} DeviceEvent;
+
+// Min-heap on "when" (see events.c)
+typedef struct {
+    DeviceEvent heap[EVENT_SOURCE_COUNT];
+    u32         count;
+} EventQueue;
+
+// Idle-loop fast-forward (see idle.c)
+typedef struct {
+    u32 loopExit;           // Address after the backward branch/jump last analyzed (0 for none)
+    u32 loopLen;            // Its loop's instruction count - 0 if an iteration can change hart state
+    u64 mark;               // Last back-edge (or MMIO load/device event) cycle
+    u64 skippedCycles;      // Cycles fast-forwarded by WFI/idle loops
+} IdleFields;
+
+// Retired-instruction stream for the analysis models (see retire.c) - runs of sequential instructions ended by a
+// taken branch/jump/trap, plus the memory accesses made in them
+#define RETIRE_BUF_SIZE         64
+typedef struct {
+    u32 pc;
+    u32 addr;
+    u32 isWrite;
+} RetireAccess;
+
+typedef struct {
+    u32             enabled;        // Non-zero while a model (cache, timing or BBV) is attached
+    u32             blockStart;     // First instruction of the current sequential run
+    u32             count;
+    RetireAccess    accesses[RETIRE_BUF_SIZE];
+} RetireFields;
+
+// Software TLB over the guest memory map (see memmap.h) - guest page number to host page, separate for loads and
+// stores so ROM pages never take a store
+#define MEM_PAGE_SHIFT          12
+#define MEM_PAGE_SIZE           (1u << MEM_PAGE_SHIFT)
+#define MEM_TLB_SIZE            64
+#define MEM_TLB_EMPTY           0xffffffff
+typedef struct {
+    u32 tag;                // Guest page number (MEM_TLB_EMPTY if unused)
+    u8  *page;              // Host address of the page
+} MemTlbEntry;
+
+typedef struct CACHE_ALIGNED {
+    MemTlbEntry load[MEM_TLB_SIZE];
+    MemTlbEntry store[MEM_TLB_SIZE];
+} MemTlb;
+
+// Host backing asked for guest memory (see MemPageKind/MemNumaPolicy in memmap.h) - zero is 4 KB pages, any node
+typedef struct {
+    u32 pages;              // MemPageKind
+    u32 numaPolicy;         // MemNumaPolicy
+    u32 numaNode;           // MEM_NUMA_NODE only
+} MemBacking;
+
+typedef struct MemMap MemMap;
+typedef struct CacheSim CacheSim;
+typedef struct TimingSim TimingSim;
+typedef struct BbvSim BbvSim;
+typedef struct SamplePlan SamplePlan;
+typedef struct ReplayLog ReplayLog;
+typedef struct AotImage AotImage;
+typedef struct Predecode Predecode;
+
+typedef enum {
+    REPLAY_OFF = 0,
+    REPLAY_RECORD,          // Log every external input
+    REPLAY_PLAYBACK         // Feed them back from the log (handlers detached)
+} ReplayMode;
+
 typedef enum {
     RISA_MMIO_HANDLER_PROC = 0,
     RISA_INT_HANDLER_PROC,
@@ -152,33 +395,67 @@ typedef enum {
     RISA_HANDLER_PROC_COUNT
 } HandlerProcNames;
 
+// Hot core first (what runHart() touches every instruction, from the hart's first cache line), then the TLB, then
+// the cold context (setup, handlers, GDB, models) - harts are cache-line aligned (see ALLOC_ALIGNED)
 typedef struct rv32iHart rv32iHart_t;
-struct rv32iHart{
+struct CACHE_ALIGNED rv32iHart {
+    // --- Hot core
     u32                 pc;
+    volatile u8         runStatus;      // RisaRunStatus - set to stop runHart() before the next instruction
+    optFlags            opts;
+    u64                 cycleCounter;
+    u64                 nextEventCycle; // Earliest queued device event (0 forces an interrupt check)
+    u64                 runLimit;       // runHart() returns once cycleCounter reaches this
+    AotImage            *aot;           // Translated blocks run in place of the interpreter (NULL if none)
+    Predecode           *predecode;     // Program text decoded at load time (NULL if not predecoded)
     u32                 regFile[32];
-    u32                 IF;
-    u32                 ID;
-    s32                 immFinal;
-    s32                 immPartial;
-    ImmediateFields     immFields;
-    InstructionFields   instFields;
-    u32                 targetAddress;
-    u32                 cycleCounter;
+    void                (*handlerProcs[RISA_HANDLER_PROC_COUNT])(rv32iHart_t *);  // v1 handlers (NULL if none)
+    u32                 fregFile[32];
+    u32                 fcsr;
+    IdleFields          idle;
+    MemTlb              tlb;
+    RetireFields        retire;
+    // --- Cold context
+    int                 exitCode;       // Guest exit code (RISA_RUN_EXIT) or errno (RISA_RUN_ERROR)
+    volatile u8         haltRequested;  // risaHalt() latch - risaRun() resets runStatus, so it checks this too
+    TrapFields          trap;
+    ClintFields         clint;
+    EventQueue          events;
+    CacheSim            *cache;         // Cache hierarchy model (NULL if disabled)
+    TimingSim           *timing;        // Pipeline/branch predictor timing model (NULL if disabled)
+    BbvSim              *bbv;           // Basic-block vector profile (NULL if disabled)
+    SamplePlan          *sample;        // Simulation points for sampled runs (NULL for a full run)
+    ReplayLog           *replay;        // External input log being recorded/played back (NULL if neither)
+    u32                 replayMode;     // ReplayMode
+    const char          *replayFile;
+    const char          *aotFile;       // risa-aot translation executionLoop() loads (NULL for none)
+    const char          *aotCacheDir;   // Translation cache executionLoop() loads from/builds into (NULL for none)
+    u32                 IF;             // Handler ABI v1 view of the current instruction and its load/store address -
+    u32                 targetAddress;  // only filled in right before a v1 handler is called (see V1_HANDLER_VIEW)
     char                *programFile;
     u32                 *virtMem;
     u32                 virtMemSize;
+    u8                  virtMemMapped;  // Page-mapped by loadProgram() (i.e. protectable) rather than malloc'd
+    MemMap              *memMap;        // Guest memory regions (virtMem/virtMemSize are the one at address 0)
+    const char          *memMapSpec;    // Region list for allocGuestMemory() (NULL for one RAM region of virtMemSize)
+    MemBacking          memBacking;     // Huge pages/NUMA placement memMapCreate() reserves regions with
     u32                 intPeriodVal;
     u32                 timeoutVal;
     clock_t             startTime;
     clock_t             endTime;
-    optFlags            opts;
+    WriteBuffer         writeBuf;
+    EnvFields           envFields;
     GdbFields           gdbFields;
     LIB_HANDLE          handlerLib;
-    void                (*handlerProcs[RISA_HANDLER_PROC_COUNT])(rv32iHart_t *);
+    risaHandlers        handlers;       // v2 handlers (see librisa.h)
     void                (*cleanupSimulator)(rv32iHart_t *);
     void                *handlerData;
 };
 
+// Fill in the v1 handler view of the instruction being executed (v1 handlers read it off the hart)
+#define V1_HANDLER_VIEW(cpu, d) do { (cpu)->IF = (d).inst; (cpu)->targetAddress = (d).addr; } while (0)
+
+
 // --- RV32I Instructions ---
 typedef enum {
     //     funct7         funct3       op
@@ -210,18 +487,28 @@ typedef enum {
     ANDI   = (0x7 << 7) | (0x13),
     FENCE  = (0x0 << 7) | (0xf),
     ECALL  = (0x0 << 7) | (0x73),
+    CSRRW  = (0x1 << 7) | (0x73),
+    CSRRS  = (0x2 << 7) | (0x73),
+    CSRRC  = (0x3 << 7) | (0x73),
+    CSRRWI = (0x5 << 7) | (0x73),
+    CSRRSI = (0x6 << 7) | (0x73),
+    CSRRCI = (0x7 << 7) | (0x73),
+    FLW    = (0x2 << 7) | (0x7),
     //        imm             funct3       op
     SLLI    = (0x0  << 10)  | (0x1 << 7) | (0x13),
     SRLI    = (0x0  << 10)  | (0x5 << 7) | (0x13),
     SRAI    = (0x20 << 10)  | (0x5 << 7) | (0x13),
-    EBREAK  = (0x1 << 20)   | (0x0 << 7) | (0x73)
+    EBREAK  = (0x1 << 20)   | (0x0 << 7) | (0x73),
+    MRET    = (0x302 << 20) | (0x0 << 7) | (0x73),
+    WFI     = (0x105 << 20) | (0x0 << 7) | (0x73)
 } ItypeInstructions;
 
 typedef enum {
     //   funct3       op
     SB = (0x0 << 7) | (0x23),
     SH = (0x1 << 7) | (0x23),
-    SW = (0x2 << 7) | (0x23)
+    SW  = (0x2 << 7) | (0x23),
+    FSW = (0x2 << 7) | (0x27)
 } StypeInstructions;
 
 typedef enum {
@@ -246,8 +533,93 @@ typedef enum {
 } JtypeInstructions;
 // --- RV32I Instructions ---
 
+// --- RV32F Instructions ---
+typedef enum {
+    //          funct7         op
+    FADD_S    = (0x0  << 10) | (0x53),
+    FSUB_S    = (0x4  << 10) | (0x53),
+    FMUL_S    = (0x8  << 10) | (0x53),
+    FDIV_S    = (0xc  << 10) | (0x53),
+    FSQRT_S   = (0x2c << 10) | (0x53),
+    FSGNJ_S   = (0x10 << 10) | (0x53), // funct3 selects FSGNJ/FSGNJN/FSGNJX
+    FMINMAX_S = (0x14 << 10) | (0x53), // funct3 selects FMIN/FMAX
+    FCVT_W_S  = (0x60 << 10) | (0x53), // rs2 selects FCVT.W.S/FCVT.WU.S
+    FMV_X_W   = (0x70 << 10) | (0x53), // funct3 selects FMV.X.W/FCLASS.S
+    FCMP_S    = (0x50 << 10) | (0x53), // funct3 selects FLE/FLT/FEQ
+    FCVT_S_W  = (0x68 << 10) | (0x53), // rs2 selects FCVT.S.W/FCVT.S.WU
+    FMV_W_X   = (0x78 << 10) | (0x53)
+} FtypeInstructions;
+
+typedef enum {
+    //         funct2       op
+    FMADD_S  = (0x0 << 7) | (0x43),
+    FMSUB_S  = (0x0 << 7) | (0x47),
+    FNMSUB_S = (0x0 << 7) | (0x4b),
+    FNMADD_S = (0x0 << 7) | (0x4f)
+} R4typeInstructions;
+// --- RV32F Instructions ---
+
+// Floating-point CSRs and fcsr fields
+#define CSR_FFLAGS          0x001
+#define CSR_FRM             0x002
+#define CSR_FCSR            0x003
+#define FCSR_FFLAGS_MASK    0x1f
+#define FCSR_FRM_SHIFT      5
+#define FCSR_FRM_MASK       0x7
+#define FFLAG_NX            (1 << 0) // Inexact
+#define FFLAG_UF            (1 << 1) // Underflow
+#define FFLAG_OF            (1 << 2) // Overflow
+#define FFLAG_DZ            (1 << 3) // Divide by zero
+#define FFLAG_NV            (1 << 4) // Invalid operation
+
+// Machine-mode CSRs and fields
+#define CSR_MSTATUS         0x300
+#define CSR_MISA            0x301
+#define CSR_MIE             0x304
+#define CSR_MTVEC           0x305
+#define CSR_MSCRATCH        0x340
+#define CSR_MEPC            0x341
+#define CSR_MCAUSE          0x342
+#define CSR_MTVAL           0x343
+#define CSR_MIP             0x344
+#define CSR_MCYCLE          0xb00
+#define CSR_MINSTRET        0xb02
+#define CSR_MCYCLEH         0xb80
+#define CSR_MINSTRETH       0xb82
+#define CSR_CYCLE           0xc00
+#define CSR_TIME            0xc01
+#define CSR_INSTRET         0xc02
+#define CSR_CYCLEH          0xc80
+#define CSR_TIMEH           0xc81
+#define CSR_INSTRETH        0xc82
+#define CSR_MHARTID         0xf14
+#define MISA_RV32IF         ((1u << 30) | (1 << ('I' - 'A')) | (1 << ('F' - 'A')))
+#define MSTATUS_MIE         (1 << 3)
+#define MSTATUS_MPIE        (1 << 7)
+#define MSTATUS_MPP         (0x3 << 11)     // Always M-mode
+#define MSTATUS_WRITE_MASK  (MSTATUS_MIE | MSTATUS_MPIE)
+#define IRQ_M_SOFT          3
+#define IRQ_M_TIMER         7
+#define IRQ_M_EXT           11
+#define MIP_MSIP            (1 << IRQ_M_SOFT)
+#define MIP_MTIP            (1 << IRQ_M_TIMER)
+#define MIP_MEIP            (1 << IRQ_M_EXT)
+#define MIE_WRITE_MASK      (MIP_MSIP | MIP_MTIP | MIP_MEIP)
+#define MCAUSE_INTERRUPT    (1u << 31)
+#define MTVEC_VECTORED      0x1
+
+// Floating-point rounding modes
+typedef enum {
+    FRM_RNE = 0, // Round to nearest, ties to even
+    FRM_RTZ = 1, // Round towards zero
+    FRM_RDN = 2, // Round down (towards -inf)
+    FRM_RUP = 3, // Round up (towards +inf)
+    FRM_RMM = 4, // Round to nearest, ties to max magnitude
+    FRM_DYN = 7  // Use fcsr.frm
+} FpRoundingModes;
+
 // Opcode to instruction-format mappings
-typedef enum { R, I, S, B, U, J, Undefined } InstFormats;
+typedef enum { R, I, S, B, U, J, R4, F, Undefined } InstFormats;
 extern const InstFormats g_opcodeToFormat[128];
 
 // Regfile aliases
@@ -287,6 +659,7 @@ typedef enum {
     REGISTER_COUNT
 } regfileAliases;
 extern const char *g_regfileAliasLookup[];
+extern const char *g_fregfileAliasLookup[];
 
 // Log/trace macros
 #define LOG_LINE_BREAK "============================================================================================\n"
@@ -299,117 +672,196 @@ extern const char *g_regfileAliasLookup[];
     printf("[rISA]:[ERROR]:[%12s]:[%6d]:[%20s] - " msg, __FILENAME__, __LINE__, __func__, ##__VA_ARGS__)
 
 // Tracing macro with Register type syntax
-#define TRACE_R(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {                     \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s %s, %s, %s\n",            \
-        cpu->cycleCounter,                                                              \
+#define TRACE_R(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {                  \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %s, %s\n",          \
+        (unsigned long long)cpu->cycleCounter,                                          \
         cpu->pc,                                                                        \
-        cpu->virtMem[cpu->pc/4],                                                        \
+        (d).inst,                                                                       \
         name,                                                                           \
-        g_regfileAliasLookup[cpu->instFields.rd],                                       \
-        g_regfileAliasLookup[cpu->instFields.rs1],                                      \
-        g_regfileAliasLookup[cpu->instFields.rs2]);                                     \
+        g_regfileAliasLookup[(d).rd],                                                   \
+        g_regfileAliasLookup[(d).rs1],                                                  \
+        g_regfileAliasLookup[(d).rs2]);                                                 \
     } } while(0)
 
 // Tracing macro with Immediate type syntax
-#define TRACE_I(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {                     \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s %s, %s, %d\n",            \
-        cpu->cycleCounter,                                                              \
+#define TRACE_I(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {                  \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %s, %d\n",          \
+        (unsigned long long)cpu->cycleCounter,                                          \
         cpu->pc,                                                                        \
-        cpu->virtMem[cpu->pc/4],                                                        \
+        (d).inst,                                                                       \
         name,                                                                           \
-        g_regfileAliasLookup[cpu->instFields.rd],                                       \
-        g_regfileAliasLookup[cpu->instFields.rs1],                                      \
-        cpu->immFinal);                                                                 \
+        g_regfileAliasLookup[(d).rd],                                                   \
+        g_regfileAliasLookup[(d).rs1],                                                  \
+        (d).imm);                                                                       \
     } } while(0)
 
 // Tracing macro with Load type syntax
-#define TRACE_L(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {                     \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s %s, %d(%s)\n",            \
-        cpu->cycleCounter,                                                              \
+#define TRACE_L(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {                  \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %d(%s)\n",          \
+        (unsigned long long)cpu->cycleCounter,                                          \
         cpu->pc,                                                                        \
-        cpu->virtMem[cpu->pc/4],                                                        \
+        (d).inst,                                                                       \
         name,                                                                           \
-        g_regfileAliasLookup[cpu->instFields.rd],                                       \
-        cpu->immFinal,                                                                  \
-        g_regfileAliasLookup[cpu->instFields.rs1]);                                     \
+        g_regfileAliasLookup[(d).rd],                                                   \
+        (d).imm,                                                                        \
+        g_regfileAliasLookup[(d).rs1]);                                                 \
     } } while(0)
 
 // Tracing macro with Store type syntax
-#define TRACE_S(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {                     \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s %s, %d(%s)\n",            \
-        cpu->cycleCounter,                                                              \
+#define TRACE_S(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {                  \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %d(%s)\n",          \
+        (unsigned long long)cpu->cycleCounter,                                          \
         cpu->pc,                                                                        \
-        cpu->virtMem[cpu->pc/4],                                                        \
+        (d).inst,                                                                       \
         name,                                                                           \
-        g_regfileAliasLookup[cpu->instFields.rs2],                                      \
-        cpu->immFinal,                                                                  \
-        g_regfileAliasLookup[cpu->instFields.rs1]);                                     \
+        g_regfileAliasLookup[(d).rs2],                                                  \
+        (d).imm,                                                                        \
+        g_regfileAliasLookup[(d).rs1]);                                                 \
     } } while(0)
 
 // Tracing macro with Upper type syntax
-#define TRACE_U(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {                     \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s %s, 0x%08x\n",            \
-        cpu->cycleCounter,                                                              \
+#define TRACE_U(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {                  \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, 0x%08x\n",          \
+        (unsigned long long)cpu->cycleCounter,                                          \
         cpu->pc,                                                                        \
-        cpu->virtMem[cpu->pc/4],                                                        \
+        (d).inst,                                                                       \
         name,                                                                           \
-        g_regfileAliasLookup[cpu->instFields.rd],                                       \
-        cpu->immFinal);                                                                 \
+        g_regfileAliasLookup[(d).rd],                                                   \
+        (d).imm);                                                                       \
     } } while(0)
 
 // Tracing macro with Jump type syntax
-#define TRACE_J(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {                 \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s %s, %d\n",            \
-        cpu->cycleCounter,                                                          \
+#define TRACE_J(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {              \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %d\n",          \
+        (unsigned long long)cpu->cycleCounter,                                      \
         cpu->pc,                                                                    \
-        cpu->virtMem[cpu->pc/4],                                                    \
+        (d).inst,                                                                   \
         name,                                                                       \
-        g_regfileAliasLookup[cpu->instFields.rd],                                   \
-        cpu->targetAddress);                                                        \
+        g_regfileAliasLookup[(d).rd],                                               \
+        (d).imm);                                                                   \
     } } while(0)
 
 // Tracing macro with Branch type syntax
-#define TRACE_B(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {                     \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s %s, %s, %d\n",            \
-        cpu->cycleCounter,                                                              \
+#define TRACE_B(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {                  \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %s, %d\n",          \
+        (unsigned long long)cpu->cycleCounter,                                          \
         cpu->pc,                                                                        \
-        cpu->virtMem[cpu->pc/4],                                                        \
+        (d).inst,                                                                       \
         name,                                                                           \
-        g_regfileAliasLookup[cpu->instFields.rs1],                                      \
-        g_regfileAliasLookup[cpu->instFields.rs2],                                      \
-        cpu->targetAddress);                                                            \
+        g_regfileAliasLookup[(d).rs1],                                                  \
+        g_regfileAliasLookup[(d).rs2],                                                  \
+        (d).imm);                                                                       \
     } } while(0)
 
 // Tracing macro for FENCE
-#define TRACE_FEN(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {                               \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s fm:%d, pred:%d, succ:%d\n",           \
-        cpu->cycleCounter,                                                                          \
+#define TRACE_FEN(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {                            \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s fm:%d, pred:%d, succ:%d\n",         \
+        (unsigned long long)cpu->cycleCounter,                                                      \
         cpu->pc,                                                                                    \
-        cpu->virtMem[cpu->pc/4],                                                                    \
+        (d).inst,                                                                                   \
         name,                                                                                       \
-        cpu->immFields.fm,                                                                          \
-        cpu->immFields.pred,                                                                        \
-        cpu->immFields.succ);                                                                       \
+        GET_FM((d).inst),                                                                           \
+        GET_PRED((d).inst),                                                                         \
+        GET_SUCC((d).inst));                                                                        \
     } } while(0)
 
 // Tracing macro for Environment type syntax
-#define TRACE_E(cpu, name) do { if (cpu->opts.o_tracePrintEnable) {         \
-    printf("[rISA] TRACE:[ %12d cycles ]:  %8x:  0x%08x    %s\n",           \
-        cpu->cycleCounter,                                                  \
+#define TRACE_E(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {      \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s\n",         \
+        (unsigned long long)cpu->cycleCounter,                              \
         cpu->pc,                                                            \
-        cpu->virtMem[cpu->pc/4],                                            \
+        (d).inst,                                                           \
         name);                                                              \
     } } while(0)
 
-void defaultMmioHandler(rv32iHart_t *cpu);
-void defaultIntHandler(rv32iHart_t *cpu);
+// Tracing macro for CSR type syntax
+#define TRACE_CSR(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {               \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, 0x%03x, %s\n",      \
+        (unsigned long long)cpu->cycleCounter,                                          \
+        cpu->pc,                                                                        \
+        (d).inst,                                                                       \
+        name,                                                                           \
+        g_regfileAliasLookup[(d).rd],                                                   \
+        GET_IMM_11_0((d).inst),                                                         \
+        g_regfileAliasLookup[(d).rs1]);                                                 \
+    } } while(0)
+
+// Tracing macro with floating-point Register type syntax (rd/rs1 alias tables vary per instruction)
+#define TRACE_F(cpu, d, name, rdAliases, rs1Aliases) do { if (cpu->opts.o_tracePrintEnable) { \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %s, %s\n",          \
+        (unsigned long long)cpu->cycleCounter,                                          \
+        cpu->pc,                                                                        \
+        (d).inst,                                                                       \
+        name,                                                                           \
+        rdAliases[(d).rd],                                                              \
+        rs1Aliases[(d).rs1],                                                            \
+        g_fregfileAliasLookup[(d).rs2]);                                                \
+    } } while(0)
+
+// Tracing macro with floating-point fused multiply-add syntax
+#define TRACE_R4(cpu, d, name) do { if (cpu->opts.o_tracePrintEnable) {                 \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %s, %s, %s\n",      \
+        (unsigned long long)cpu->cycleCounter,                                          \
+        cpu->pc,                                                                        \
+        (d).inst,                                                                       \
+        name,                                                                           \
+        g_fregfileAliasLookup[(d).rd],                                                  \
+        g_fregfileAliasLookup[(d).rs1],                                                 \
+        g_fregfileAliasLookup[(d).rs2],                                                 \
+        g_fregfileAliasLookup[GET_RS3((d).inst)]);                                      \
+    } } while(0)
+
+// Tracing macro with floating-point Load/Store type syntax
+#define TRACE_FLS(cpu, d, name, reg) do { if (cpu->opts.o_tracePrintEnable) {           \
+    printf("[rISA] TRACE:[ %12llu cycles ]:  %8x:  0x%08x    %s %s, %d(%s)\n",          \
+        (unsigned long long)cpu->cycleCounter,                                          \
+        cpu->pc,                                                                        \
+        (d).inst,                                                                       \
+        name,                                                                           \
+        g_fregfileAliasLookup[reg],                                                     \
+        (d).imm,                                                                        \
+        g_regfileAliasLookup[(d).rs1]);                                                 \
+    } } while(0)
+
+#ifdef RISA_STATIC_HANDLER
+// Handler linked in at build time - direct calls (inlined with LTO) while its callbacks are the registered ones
+#define HANDLER_CALL(cpu, callback, staticCallback, ...)                                    \
+    (((cpu)->handlers.callback == staticCallback) ?                                         \
+        staticCallback((cpu)->handlers.ctx, cpu, __VA_ARGS__) :                             \
+        (cpu)->handlers.callback((cpu)->handlers.ctx, cpu, __VA_ARGS__))
+#else
+#define HANDLER_CALL(cpu, callback, staticCallback, ...)                                    \
+    ((cpu)->handlers.callback((cpu)->handlers.ctx, cpu, __VA_ARGS__))
+#endif
+
+// Analysis model hooks - a single (predictable) flag test while no model is attached
+#define RETIRE_MEM(cpu, address, write) do { if ((cpu)->retire.enabled) {                                 \
+    RetireAccess *access = &(cpu)->retire.accesses[(cpu)->retire.count];                                \
+    access->pc = (cpu)->pc;                                                                             \
+    access->addr = (address);                                                                           \
+    access->isWrite = (write);                                                                          \
+    if (++(cpu)->retire.count == RETIRE_BUF_SIZE) { retireFlush(cpu); }                                 \
+    } } while(0)
+#define RETIRE_BLOCK(cpu, endPc, nextPc) do { if ((cpu)->retire.enabled) {                                \
+    retireBlock(cpu, endPc, nextPc);                                                                    \
+    } } while(0)
+#define RETIRE_MODELS_ATTACHED(cpu) ((cpu)->cache != NULL || (cpu)->timing != NULL || (cpu)->bbv != NULL)
+
+void retireFlush(rv32iHart_t *cpu);
+void retireBlock(rv32iHart_t *cpu, u32 endPc, u32 nextPc);
+void retireStart(rv32iHart_t *cpu);
+void retireStop(rv32iHart_t *cpu);
+
 void defaultEnvHandler(rv32iHart_t *cpu);
-void defaultInitHandler(rv32iHart_t *cpu);
-void defaultExitHandler(rv32iHart_t *cpu);
+void flushGuestOutput(rv32iHart_t *cpu);
+void closeGuestFiles(rv32iHart_t *cpu);
 void printHelp(void);
 void cleanupSimulator(rv32iHart_t *cpu);
+void loadHandlers(rv32iHart_t *cpu, const char *handlerLibrary);
+int allocGuestMemory(rv32iHart_t *cpu);
 int loadProgram(rv32iHart_t *cpu);
 int setupSimulator(int argc, char **argv, rv32iHart_t *cpu);
+int runHart(rv32iHart_t *cpu);
 int executionLoop(rv32iHart_t *cpu);
 
 #endif // RISA_H
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "risa.h"
+#include "aot.h"
+#include "miniargparse.h"
+
+// risa-aot - writes C for the basic blocks of a program binary, to build into a shared library for risa --aot
+static void printUsage(void) {
+    printf("\n"
+        "[Usage  ]: risa-aot [OPTIONS] <program_binary>\n"
+        "[Example]: risa-aot -o prog_aot.c prog.bin && cc -O2 -shared -fPIC -I<rISA src> prog_aot.c -o prog_aot.so"
+        " && risa --aot ./prog_aot.so prog.bin"
+        "\n\n"
+        "OPTIONS:\n"
+    );
+    miniargparsePrint();
+}
+
+// "addr[,addr...]" - returns the count, 0 if malformed
+static u32 parseEntries(const char *list, u32 *entries) {
+    u32 count = 0;
+    while (*list != '\0' && count < AOT_MAX_ENTRIES) {
+        char *end;
+        entries[count++] = (u32)strtoul(list, &end, 0);
+        if (end == list || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return (*list == '\0') ? count : 0;
+}
+
+int main(int argc, char **argv) {
+    MINIARGPARSE_OPT(output, "o", "output", 1, "C file to write [DEFAULT=<program_binary>.aot.c].");
+    MINIARGPARSE_OPT(entry, "e", "entry", 1,
+        "Entry points besides address 0 (i.e. trap vectors), comma separated [DEFAULT=none].");
+    MINIARGPARSE_OPT(help, "h", "help", 0, "Print help and exit.");
+
+    int unknownOpt = miniargparseParse(argc, argv);
+    if (unknownOpt > 0) {
+        LOG_E("Unknown option ( %s ) used.\n", argv[unknownOpt]);
+        printUsage();
+        return EINVAL;
+    }
+    if (help.infoBits.used) {
+        printUsage();
+        return 0;
+    }
+    int programIndex = miniargparseGetPositionalArg(argc, argv, 0);
+    if (programIndex == 0) {
+        LOG_E("No program binary given.\n");
+        printUsage();
+        return EINVAL;
+    }
+    const char *programFile = argv[programIndex];
+    u32 entries[AOT_MAX_ENTRIES + 1] = { 0 };
+    u32 entryCount = 1;
+    if (entry.infoBits.used) {
+        u32 extra = parseEntries(entry.value, entries + 1);
+        if (extra == 0) {
+            LOG_E("Malformed entry point list ( %s ).\n", entry.value);
+            printUsage();
+            return EINVAL;
+        }
+        entryCount += extra;
+    }
+
+    // Same image the simulator loads at address 0
+    FILE *binFile;
+    OPEN_FILE(binFile, programFile, "rb");
+    if (binFile == NULL) {
+        LOG_E("Could not open file ( %s ).\n", programFile);
+        return EIO;
+    }
+    fseek(binFile, 0, SEEK_END);
+    long size = ftell(binFile);
+    fseek(binFile, 0, SEEK_SET);
+    u8 *image = (size < 0 || (u64)size > 0xffffffffULL) ? NULL : (u8*)malloc((size_t)size + 1);
+    if (image == NULL || fread(image, 1, (size_t)size, binFile) != (size_t)size) {
+        LOG_E("Could not read file ( %s ).\n", programFile);
+        fclose(binFile);
+        free(image);
+        return EIO;
+    }
+    fclose(binFile);
+
+    char defaultOutput[FILENAME_MAX];
+    const char *outputFile = output.value;
+    if (!output.infoBits.used) {
+        snprintf(defaultOutput, sizeof(defaultOutput), "%s.aot.c", programFile);
+        outputFile = defaultOutput;
+    }
+    FILE *out;
+    OPEN_FILE(out, outputFile, "w");
+    if (out == NULL) {
+        LOG_E("Could not open file ( %s ).\n", outputFile);
+        free(image);
+        return EIO;
+    }
+    u32 blockCount = 0;
+    int err = aotTranslate(image, (u32)size, entries, entryCount, out, &blockCount);
+    fclose(out);
+    free(image);
+    if (err) {
+        LOG_E("Could not translate ( %s ) - %s.\n", programFile,
+            (err == EINVAL) ? "no translatable code reachable from the entry points" : strerror(err));
+        remove(outputFile);
+        return err;
+    }
+    LOG_I("Translated %u blocks of ( %s ) to ( %s ).\n", blockCount, programFile, outputFile);
+    return 0;
+}
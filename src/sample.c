@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sample.h"
+#include "timing.h"
+
+static int comparePoints(const void *a, const void *b) {
+    u64 left = ((const SamplePoint*)a)->index;
+    u64 right = ((const SamplePoint*)b)->index;
+    return (left > right) - (left < right);
+}
+
+int sampleCreate(rv32iHart_t *cpu, u64 interval, u64 warmup, const u64 *points, const double *weights, u32 count) {
+    if (interval == 0 || count == 0) {
+        return EINVAL;
+    }
+    SamplePlan *plan = (SamplePlan*)calloc(1, sizeof(SamplePlan));
+    SamplePoint *copy = (SamplePoint*)calloc(count, sizeof(SamplePoint));
+    if (plan == NULL || copy == NULL) {
+        free(plan);
+        free(copy);
+        return ENOMEM;
+    }
+    for (u32 i=0; i<count; ++i) {
+        copy[i].index = points[i];
+        copy[i].weight = (weights != NULL) ? weights[i] : 1.0;
+    }
+    qsort(copy, count, sizeof(SamplePoint), comparePoints);
+    plan->interval = interval;
+    plan->warmup = warmup;
+    plan->count = count;
+    plan->points = copy;
+    sampleFree(cpu);
+    cpu->sample = plan;
+    return 0;
+}
+
+// "<value> <id>" lines - "values" is indexed by id, grown as needed (returns 0, ENOENT, EINVAL or ENOMEM)
+static int readPairs(const char *path, double **values, u32 *count) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        LOG_E("Could not open simulation point file ( %s ).\n", path);
+        return ENOENT;
+    }
+    double value;
+    unsigned long id;
+    int err = 0;
+    int matched;
+    while (!err && (matched = fscanf(file, "%lf %lu", &value, &id)) == 2) {
+        if (id >= SAMPLE_MAX_POINT_ID) {
+            LOG_E("Simulation point id ( %lu ) out of range in ( %s ).\n", id, path);
+            err = EINVAL;
+            break;
+        }
+        if (id >= *count) {
+            double *grown = (double*)realloc(*values, (id + 1) * sizeof(double));
+            if (grown == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            for (u32 i=*count; i<=id; ++i) {
+                grown[i] = -1.0;
+            }
+            *values = grown;
+            *count = (u32)id + 1;
+        }
+        (*values)[id] = value;
+    }
+    if (!err && matched != EOF) {
+        LOG_E("Malformed simulation point file ( %s ).\n", path);
+        err = EINVAL;
+    }
+    fclose(file);
+    return err;
+}
+
+int sampleLoad(rv32iHart_t *cpu, u64 interval, u64 warmup, const char *simpointsPath, const char *weightsPath) {
+    double *indices = NULL;
+    double *weights = NULL;
+    u32 idCount = 0;
+    u32 weightCount = 0;
+    int err = readPairs(simpointsPath, &indices, &idCount);
+    if (!err && weightsPath != NULL) {
+        err = readPairs(weightsPath, &weights, &weightCount);
+    }
+    u64 *points = (u64*)calloc(idCount ? idCount : 1, sizeof(u64));
+    double *pointWeights = (double*)calloc(idCount ? idCount : 1, sizeof(double));
+    u32 count = 0;
+    if (!err && (points == NULL || pointWeights == NULL)) {
+        err = ENOMEM;
+    }
+    for (u32 id=0; id<idCount && !err; ++id) {
+        if (indices[id] < 0.0) {
+            continue;
+        }
+        // Every point needs a weight once a weights file is given
+        if (weightsPath != NULL && (id >= weightCount || weights[id] < 0.0)) {
+            LOG_E("No weight for simulation point ( %u ).\n", id);
+            err = EINVAL;
+            break;
+        }
+        points[count] = (u64)indices[id];
+        pointWeights[count] = (weightsPath != NULL) ? weights[id] : 1.0;
+        ++count;
+    }
+    if (!err) {
+        err = sampleCreate(cpu, interval, warmup, points, pointWeights, count);
+    }
+    free(indices);
+    free(weights);
+    free(points);
+    free(pointWeights);
+    return err;
+}
+
+void sampleFree(rv32iHart_t *cpu) {
+    if (cpu->sample == NULL) {
+        return;
+    }
+    free(cpu->sample->points);
+    free(cpu->sample);
+    cpu->sample = NULL;
+}
+
+static void takeSnapshot(rv32iHart_t *cpu, SamplePoint *snap) {
+    memset(snap, 0, sizeof(*snap));
+    snap->instructions = (cpu->timing != NULL) ? cpu->timing->instructions : cpu->cycleCounter;
+    snap->cycles = timingCycles(cpu);
+    for (u32 i=0; i<CACHE_LEVEL_COUNT && cpu->cache != NULL; ++i) {
+        snap->misses[i] = cpu->cache->levels[i].total.misses;
+    }
+}
+
+// Run until cycleCounter reaches "until" (capped at "limit") - with the models fed only if "detailed"
+static int runSegment(rv32iHart_t *cpu, u64 until, u64 limit, int detailed) {
+    if (cpu->runStatus != RISA_RUN_LIMIT || cpu->cycleCounter >= until || cpu->cycleCounter >= limit) {
+        return 0;
+    }
+    cpu->runLimit = (until < limit) ? until : limit;
+    if (detailed) {
+        retireStart(cpu);
+    }
+    else {
+        // Nothing attached to the retire stream - idle loops can be fast-forwarded again
+        cpu->retire.enabled = 0;
+    }
+    int err = runHart(cpu);
+    if (detailed) {
+        retireStop(cpu);
+    }
+    return err;
+}
+
+int sampleRun(rv32iHart_t *cpu) {
+    SamplePlan *plan = cpu->sample;
+    u64 limit = cpu->runLimit;
+    int err = 0;
+    for (u32 i=0; i<plan->count && !err; ++i) {
+        SamplePoint *point = &plan->points[i];
+        u64 start = point->index * plan->interval;
+        u64 warmStart = (start > plan->warmup) ? (start - plan->warmup) : 0;
+        if (cpu->cycleCounter >= start + plan->interval) {
+            continue; // Duplicate index
+        }
+        // Fast-forward, warm the caches/predictor up, then measure the interval itself
+        err = runSegment(cpu, warmStart, limit, 0);
+        err = err ? err : runSegment(cpu, start, limit, 1);
+        if (err || cpu->runStatus != RISA_RUN_LIMIT || cpu->cycleCounter < start) {
+            break;
+        }
+        SamplePoint before;
+        SamplePoint after;
+        takeSnapshot(cpu, &before);
+        err = runSegment(cpu, start + plan->interval, limit, 1);
+        takeSnapshot(cpu, &after);
+        point->simulated = 1;
+        point->instructions = after.instructions - before.instructions;
+        point->cycles = after.cycles - before.cycles;
+        for (u32 level=0; level<CACHE_LEVEL_COUNT; ++level) {
+            point->misses[level] = after.misses[level] - before.misses[level];
+        }
+    }
+    // Whatever is left of the program
+    err = err ? err : runSegment(cpu, limit, limit, 0);
+    cpu->runLimit = limit;
+    return err;
+}
+
+void sampleReport(rv32iHart_t *cpu, FILE *out) {
+    SamplePlan *plan = cpu->sample;
+    if (plan == NULL) {
+        return;
+    }
+    static const char *levelNames[CACHE_LEVEL_COUNT] = { "L1I", "L1D", "L2" };
+    int hasLevel[CACHE_LEVEL_COUNT] = { 0 };
+    for (u32 level=0; level<CACHE_LEVEL_COUNT && cpu->cache != NULL; ++level) {
+        hasLevel[level] = (cpu->cache->levels[level].size != 0);
+    }
+    fprintf(out, "Sampled simulation (interval %llu, warmup %llu):\n", (unsigned long long)plan->interval,
+        (unsigned long long)plan->warmup);
+    fprintf(out, "  %12s %8s %14s", "interval", "weight", "instructions");
+    if (cpu->timing != NULL) {
+        fprintf(out, " %8s", "CPI");
+    }
+    for (u32 level=0; level<CACHE_LEVEL_COUNT; ++level) {
+        if (hasLevel[level]) {
+            fprintf(out, " %5s MPKI", levelNames[level]);
+        }
+    }
+    fprintf(out, "\n");
+
+    // Weighted over the points the program actually reached
+    double weightSum = 0.0;
+    double cpi = 0.0;
+    double mpki[CACHE_LEVEL_COUNT] = { 0.0 };
+    for (u32 i=0; i<plan->count; ++i) {
+        const SamplePoint *point = &plan->points[i];
+        if (!point->simulated || point->instructions == 0) {
+            continue;
+        }
+        double instructions = (double)point->instructions;
+        double pointCpi = (double)point->cycles / instructions;
+        fprintf(out, "  %12llu %8.4f %14llu", (unsigned long long)point->index, point->weight,
+            (unsigned long long)point->instructions);
+        if (cpu->timing != NULL) {
+            fprintf(out, " %8.3f", pointCpi);
+        }
+        weightSum += point->weight;
+        cpi += point->weight * pointCpi;
+        for (u32 level=0; level<CACHE_LEVEL_COUNT; ++level) {
+            double pointMpki = 1000.0 * (double)point->misses[level] / instructions;
+            mpki[level] += point->weight * pointMpki;
+            if (hasLevel[level]) {
+                fprintf(out, " %10.3f", pointMpki);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    if (weightSum == 0.0) {
+        fprintf(out, "  No simulation point was reached.\n");
+        return;
+    }
+    fprintf(out, "  %12s %8s %14s", "estimate", "", "");
+    if (cpu->timing != NULL) {
+        fprintf(out, " %8.3f", cpi / weightSum);
+    }
+    for (u32 level=0; level<CACHE_LEVEL_COUNT; ++level) {
+        if (hasLevel[level]) {
+            fprintf(out, " %10.3f", mpki[level] / weightSum);
+        }
+    }
+    fprintf(out, "\n");
+    if (cpu->timing != NULL) {
+        fprintf(out, "  Estimated cycles for the whole run: %.0f\n", (cpi / weightSum) * (double)cpu->cycleCounter);
+    }
+}
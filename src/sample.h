@@ -0,0 +1,42 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stdio.h>
+#include "risa.h"
+#include "cache.h"
+
+#define SAMPLE_DEFAULT_WARMUP   1000000
+#define SAMPLE_MAX_POINT_ID     (1u << 24)  // Point (cluster) ids in .simpoints/.weights files stay below this
+
+typedef struct {
+    u64     index;                          // Interval index (window is [index * interval, (index + 1) * interval))
+    double  weight;
+    // Detailed window results
+    u32     simulated;                      // Non-zero once the window (or the part of it the program ran) is done
+    u64     instructions;
+    u64     cycles;                         // Timing model estimate (0 without one)
+    u64     misses[CACHE_LEVEL_COUNT];
+} SamplePoint;
+
+// Functional fast-forward between simulation points - the cache/timing models only see the warmup before and the
+// interval of each point
+struct SamplePlan {
+    u64         interval;
+    u64         warmup;
+    u32         count;
+    SamplePoint *points;                    // [count] in index order
+};
+
+// Simulate only the intervals in "points" (with optional "weights", equal otherwise) - returns 0, EINVAL (no
+// points or a zero interval) or ENOMEM
+int sampleCreate(rv32iHart_t *cpu, u64 interval, u64 warmup, const u64 *points, const double *weights, u32 count);
+// Same from SimPoint's "<index> <point id>" .simpoints and "<weight> <point id>" .weights files ("weightsPath" may
+// be NULL) - returns 0, ENOENT, EINVAL or ENOMEM
+int sampleLoad(rv32iHart_t *cpu, u64 interval, u64 warmup, const char *simpointsPath, const char *weightsPath);
+void sampleFree(rv32iHart_t *cpu);
+// Run up to cpu->runLimit (in place of retireStart()/runHart()/retireStop()) - returns runHart()'s result
+int sampleRun(rv32iHart_t *cpu);
+// Per-point results and the weighted CPI/MPKI estimate
+void sampleReport(rv32iHart_t *cpu, FILE *out);
+
+#endif // SAMPLE_H
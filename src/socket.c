@@ -1,10 +1,13 @@
 #ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 typedef int socklen_t;
 #define SOCKET_ERR INVALID_SOCKET
 #else // *nix
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
 #include <unistd.h>
 #define SOCKET_ERR -1
 #endif
@@ -31,7 +34,7 @@ int startServer(rv32iHart_t *cpu){
         return -1;
     }
 #endif
-    struct sockaddr_in serverAddr, client;
+    struct sockaddr_in serverAddr;
     struct in_addr localhostaddr;
     cpu->gdbFields.socketFd = socket(AF_INET, SOCK_STREAM, 0);
     if (cpu->gdbFields.socketFd == SOCKET_ERR) {
@@ -65,22 +68,51 @@ int startServer(rv32iHart_t *cpu){
         return -1;
     }
 
-    // Connect to client
-    int len = sizeof(client);
     LOG_I("GDB server listening on port ( %hu ) (CTRL-C to exit).\n", cpu->gdbFields.serverPort);
+    return 0;
+}
+
+int acceptClient(rv32iHart_t *cpu) {
+    struct sockaddr_in client;
+    int len = sizeof(client);
     cpu->gdbFields.connectFd = accept(cpu->gdbFields.socketFd, (struct sockaddr*)&client, (socklen_t*)&len);
     if (cpu->gdbFields.connectFd < 0) {
         LOG_E("Socket server accept for GDB failed.\n");
-        stopServer(cpu);
+        cpu->gdbFields.connectFd = 0;
         return -1;
     }
-
+    // Packets are already coalesced by the gdbserver transport - don't let Nagle delay the replies
+    int enable = 1;
+    if (setsockopt(cpu->gdbFields.connectFd, IPPROTO_TCP, TCP_NODELAY, (const char*)&enable, sizeof(int)) < 0) {
+        LOG_W("Could not set TCP_NODELAY on GDB connection.\n");
+    }
     return 0;
 }
 
-int readSocket(int clientSocket, char *packet, size_t len) {
+void closeClient(rv32iHart_t *cpu) {
+#ifdef _WIN32
+    shutdown(cpu->gdbFields.connectFd, SD_BOTH);
+    closesocket(cpu->gdbFields.connectFd);
+#else // *nix
+    shutdown(cpu->gdbFields.connectFd, SHUT_RDWR);
+    close(cpu->gdbFields.connectFd);
+#endif
+    cpu->gdbFields.connectFd = 0;
+}
+
+// Non-blocking readability check (i.e. pending connection on a listening socket or data on a client one)
+int pollSocket(int fd) {
+    fd_set readSet;
+    struct timeval timeout = {0, 0};
+    FD_ZERO(&readSet);
+    FD_SET(fd, &readSet);
+    return select(fd + 1, &readSet, NULL, NULL, &timeout) > 0;
+}
+
+int readSocket(int clientSocket, char *packet, size_t len, size_t *received) {
     const int res = recv(clientSocket, packet, len, 0);
 
+    *received = 0;
     switch (res)
     {
         case SOCKET_ERR:
@@ -88,7 +120,7 @@ int readSocket(int clientSocket, char *packet, size_t len) {
         case 0:
             return READ_SOCKET_SHUTDOWN;
         default:
-            len = res;
+            *received = res;
             break;
     }
 
@@ -98,8 +130,15 @@ int writeSocket(int clientSocket, const char *packet, size_t len) {
     if (clientSocket <= 0)
         return -1;
 
-    if (send(clientSocket, packet, len, 0) == -1) {
-        perror("send():");
+    // Buffered replies can be large - keep sending until everything is out
+    while (len > 0) {
+        const int res = send(clientSocket, packet, len, 0);
+        if (res <= 0) {
+            perror("send():");
+            return -1;
+        }
+        packet += res;
+        len -= res;
     }
 
     return 0;
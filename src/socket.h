@@ -5,7 +5,10 @@
 
 void stopServer(rv32iHart_t *cpu);
 int startServer(rv32iHart_t *cpu);
-int readSocket(int clientSocket, char *packet, size_t len);
+int acceptClient(rv32iHart_t *cpu);
+void closeClient(rv32iHart_t *cpu);
+int pollSocket(int fd);
+int readSocket(int clientSocket, char *packet, size_t len, size_t *received);
 int writeSocket(int clientSocket, const char *packet, size_t len);
 
 enum read_socket_err
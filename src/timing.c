@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+#include "memmap.h"
+
+static const char *g_timingPredictorNames[] = { "static", "bimodal", "gshare" };
+static const char *g_timingLatencyNames[TIMING_LAT_COUNT] = { "alu", "load", "mul", "div", "fp", "fdiv" };
+static const char *g_timingStallNames[TIMING_STALL_COUNT] = { "load-use", "exec", "mispredict", "redirect" };
+
+#define FP_REG(reg)         (32 + (reg))
+
+// Registers/latency of one instruction (register 0 is "none" - x0 is never waited on)
+typedef struct {
+    u32 dst;
+    u32 src[3];
+    u32 latency;        // TimingLatency
+} TimingOp;
+
+static void decodeOp(u32 inst, TimingOp *op) {
+    u32 rd = GET_RD(inst);
+    u32 rs1 = GET_RS1(inst);
+    u32 rs2 = GET_RS2(inst);
+    u32 funct7 = GET_FUNCT7(inst);
+    memset(op, 0, sizeof(*op));
+    op->latency = TIMING_LAT_ALU;
+    switch (GET_OPCODE(inst)) {
+        case 0x03: { op->dst = rd;          op->src[0] = rs1;   op->latency = TIMING_LAT_LOAD;  break; } // Loads
+        case 0x07: { op->dst = FP_REG(rd);  op->src[0] = rs1;   op->latency = TIMING_LAT_LOAD;  break; } // FLW
+        case 0x23: { op->src[0] = rs1;      op->src[1] = rs2;                                   break; } // Stores
+        case 0x27: { op->src[0] = rs1;      op->src[1] = FP_REG(rs2);                           break; } // FSW
+        case 0x13:                                                                                       // OP-IMM
+        case 0x67: { op->dst = rd;          op->src[0] = rs1;                                   break; } // JALR
+        case 0x37:                                                                                       // LUI
+        case 0x17:                                                                                       // AUIPC
+        case 0x6f: { op->dst = rd;                                                              break; } // JAL
+        case 0x63: { op->src[0] = rs1;      op->src[1] = rs2;                                   break; } // Branches
+        case 0x33: { // OP (M extension mul/div included should the interpreter ever retire them)
+            op->dst = rd;
+            op->src[0] = rs1;
+            op->src[1] = rs2;
+            if (funct7 == 0x1) {
+                op->latency = (GET_FUNCT3(inst) < 0x4) ? TIMING_LAT_MUL : TIMING_LAT_DIV;
+            }
+            break;
+        }
+        case 0x43:
+        case 0x47:
+        case 0x4b:
+        case 0x4f: { // Fused multiply-add family
+            op->dst = FP_REG(rd);
+            op->src[0] = FP_REG(rs1);
+            op->src[1] = FP_REG(rs2);
+            op->src[2] = FP_REG(GET_RS3(inst));
+            op->latency = TIMING_LAT_FP;
+            break;
+        }
+        case 0x53: { // OP-FP
+            op->dst = FP_REG(rd);
+            op->src[0] = FP_REG(rs1);
+            op->src[1] = FP_REG(rs2);
+            switch (funct7) {
+                case 0x00:
+                case 0x04:
+                case 0x08: { op->latency = TIMING_LAT_FP;                                     break; }
+                case 0x0c: { op->latency = TIMING_LAT_FDIV;                                   break; }
+                case 0x2c: { op->latency = TIMING_LAT_FDIV;  op->src[1] = 0;                  break; }
+                case 0x50: { op->dst = rd;                                                    break; }
+                case 0x60: { op->dst = rd;      op->src[1] = 0;  op->latency = TIMING_LAT_FP; break; }
+                case 0x68: { op->src[0] = rs1;  op->src[1] = 0;  op->latency = TIMING_LAT_FP; break; }
+                case 0x70: { op->dst = rd;      op->src[1] = 0;                               break; }
+                case 0x78: { op->src[0] = rs1;  op->src[1] = 0;                               break; }
+                default:   { break; } // FSGNJ/FMIN/FMAX
+            }
+            break;
+        }
+        case 0x73: { // CSRs (register forms read rs1)
+            op->dst = rd;
+            op->src[0] = (GET_FUNCT3(inst) & 0x4) ? 0 : rs1;
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+static int parseValue(const char *str, const char *end, u32 *val) {
+    char *pos;
+    *val = (u32)strtoul(str, &pos, 0);
+    return (pos == end && pos != str) ? 0 : EINVAL;
+}
+
+// One "<key>:<value>" item (or "bp:<predictor>[:<bits>]") - returns 0 or EINVAL
+static int parseItem(TimingSim *timing, const char *item, u32 len) {
+    const char *end = item + len;
+    const char *colon = memchr(item, ':', len);
+    if (len == 7 && strncmp(item, "default", 7) == 0) {
+        return 0;
+    }
+    if (colon == NULL) {
+        return EINVAL;
+    }
+    u32 keyLen = (u32)(colon - item);
+    const char *value = colon + 1;
+    if (keyLen == 2 && strncmp(item, "bp", 2) == 0) {
+        const char *bits = memchr(value, ':', (size_t)(end - value));
+        const char *nameEnd = (bits != NULL) ? bits : end;
+        for (u32 i=0; i<sizeof(g_timingPredictorNames)/sizeof(g_timingPredictorNames[0]); ++i) {
+            if ((u32)(nameEnd - value) == strlen(g_timingPredictorNames[i]) &&
+                strncmp(value, g_timingPredictorNames[i], (size_t)(nameEnd - value)) == 0) {
+                timing->predictor = i;
+                if (bits == NULL) {
+                    return 0;
+                }
+                return (parseValue(bits + 1, end, &timing->predictorBits) || timing->predictorBits == 0 ||
+                    timing->predictorBits > 24) ? EINVAL : 0;
+            }
+        }
+        return EINVAL;
+    }
+    u32 val;
+    if (parseValue(value, end, &val)) {
+        return EINVAL;
+    }
+    for (u32 i=0; i<TIMING_LAT_COUNT; ++i) {
+        if (keyLen == strlen(g_timingLatencyNames[i]) && strncmp(item, g_timingLatencyNames[i], keyLen) == 0) {
+            timing->latency[i] = (val != 0) ? val : 1;
+            return 0;
+        }
+    }
+    if (keyLen == 3 && strncmp(item, "btb", 3) == 0)                { timing->btbSize = val;           }
+    else if (keyLen == 3 && strncmp(item, "ras", 3) == 0)           { timing->rasSize = val;           }
+    else if (keyLen == 10 && strncmp(item, "mispredict", 10) == 0)  { timing->mispredictPenalty = val; }
+    else if (keyLen == 8 && strncmp(item, "redirect", 8) == 0)      { timing->redirectPenalty = val;   }
+    else                                                            { return EINVAL;                   }
+    // The BTB is direct mapped
+    return (timing->btbSize == 0 || (timing->btbSize & (timing->btbSize - 1)) != 0 || timing->rasSize == 0) ?
+        EINVAL : 0;
+}
+
+int timingCreate(rv32iHart_t *cpu, const char *spec) {
+    TimingSim *timing = (TimingSim*)calloc(1, sizeof(TimingSim));
+    if (timing == NULL) {
+        return ENOMEM;
+    }
+    const u32 defaultLatency[TIMING_LAT_COUNT] = { 1, 2, 3, 20, 4, 12 };
+    memcpy(timing->latency, defaultLatency, sizeof(defaultLatency));
+    timing->mispredictPenalty = 3;
+    timing->redirectPenalty = 1;
+    timing->predictor = TIMING_BP_GSHARE;
+    timing->predictorBits = TIMING_DEFAULT_BP_BITS;
+    timing->btbSize = TIMING_DEFAULT_BTB;
+    timing->rasSize = TIMING_DEFAULT_RAS;
+    for (const char *item = spec; *item != '\0';) {
+        const char *comma = strchr(item, ',');
+        u32 len = (comma != NULL) ? (u32)(comma - item) : (u32)strlen(item);
+        if (parseItem(timing, item, len)) {
+            LOG_E("Invalid timing config item ( %.*s ).\n", (int)len, item);
+            free(timing);
+            return EINVAL;
+        }
+        item += len + ((comma != NULL) ? 1 : 0);
+    }
+
+    timing->counters = (u8*)malloc((size_t)1 << timing->predictorBits);
+    timing->btb = (TimingBtbEntry*)calloc(timing->btbSize, sizeof(TimingBtbEntry));
+    timing->ras = (u32*)calloc(timing->rasSize, sizeof(u32));
+    cpu->timing = timing;
+    if (timing->counters == NULL || timing->btb == NULL || timing->ras == NULL) {
+        LOG_E("Could not allocate timing model.\n");
+        timingFree(cpu);
+        return ENOMEM;
+    }
+    // Weakly not taken
+    memset(timing->counters, 1, (size_t)1 << timing->predictorBits);
+    return 0;
+}
+
+void timingFree(rv32iHart_t *cpu) {
+    TimingSim *timing = cpu->timing;
+    if (timing == NULL) {
+        return;
+    }
+    free(timing->counters);
+    free(timing->btb);
+    free(timing->ras);
+    free(timing);
+    cpu->timing = NULL;
+    cpu->retire.enabled = RETIRE_MODELS_ATTACHED(cpu);
+}
+
+static void timingStall(TimingSim *timing, TimingStall cause, u32 cycles) {
+    timing->issue += cycles;
+    timing->stalls[cause] += cycles;
+}
+
+static u8 *counterFor(TimingSim *timing, u32 pc) {
+    u32 mask = (1u << timing->predictorBits) - 1;
+    u32 index = (pc >> 2) ^ ((timing->predictor == TIMING_BP_GSHARE) ? timing->history : 0);
+    return &timing->counters[index & mask];
+}
+
+// Conditional branch - returns non-zero if the direction was mispredicted
+static int predictBranch(TimingSim *timing, u32 pc, u32 inst, int taken) {
+    int predicted;
+    if (timing->predictor == TIMING_BP_STATIC) {
+        predicted = (inst >> 31) != 0; // Negative offset
+    }
+    else {
+        u8 *counter = counterFor(timing, pc);
+        predicted = (*counter >= 2);
+        if (taken && *counter < 3)      { ++*counter; }
+        else if (!taken && *counter > 0) { --*counter; }
+        timing->history = (timing->history << 1) | (taken ? 1 : 0);
+    }
+    return predicted != taken;
+}
+
+static TimingBtbEntry *btbEntry(TimingSim *timing, u32 pc) {
+    return &timing->btb[(pc >> 2) & (timing->btbSize - 1)];
+}
+
+// BTB hit with the right target (entries are tagged with pc | 1 so an empty entry never hits)
+static int btbHit(TimingSim *timing, u32 pc, u32 target) {
+    TimingBtbEntry *entry = btbEntry(timing, pc);
+    int hit = (entry->pc == (pc | 1)) && (entry->target == target);
+    entry->pc = pc | 1;
+    entry->target = target;
+    return hit;
+}
+
+// x1/x5 are link registers (RISC-V calling convention hint)
+#define IS_LINK_REG(reg)    ((reg) == 1 || (reg) == 5)
+
+static void rasPush(TimingSim *timing, u32 addr) {
+    timing->rasTop = (timing->rasTop + 1) % timing->rasSize;
+    timing->ras[timing->rasTop] = addr;
+}
+
+static u32 rasPop(TimingSim *timing) {
+    u32 addr = timing->ras[timing->rasTop];
+    timing->rasTop = (timing->rasTop + timing->rasSize - 1) % timing->rasSize;
+    return addr;
+}
+
+// Branch/jump predictor penalties for the instruction at "pc" (control continued at "nextPc")
+static void timingControl(TimingSim *timing, u32 pc, u32 inst, u32 nextPc) {
+    int taken = (nextPc != pc + 4);
+    u32 rd = GET_RD(inst);
+    switch (GET_OPCODE(inst)) {
+        case 0x63: { // Branches
+            timing->branches++;
+            int mispredicted = predictBranch(timing, pc, inst, taken);
+            int btbMiss = taken && !btbHit(timing, pc, nextPc);
+            if (mispredicted) {
+                timing->mispredicts++;
+                timingStall(timing, TIMING_STALL_MISPREDICT, timing->mispredictPenalty);
+            }
+            else if (btbMiss) {
+                timingStall(timing, TIMING_STALL_REDIRECT, timing->redirectPenalty);
+            }
+            break;
+        }
+        case 0x6f: { // JAL - target known at decode
+            if (!btbHit(timing, pc, nextPc)) {
+                timingStall(timing, TIMING_STALL_REDIRECT, timing->redirectPenalty);
+            }
+            if (IS_LINK_REG(rd)) {
+                rasPush(timing, pc + 4);
+            }
+            break;
+        }
+        case 0x67: { // JALR - returns predicted by the RAS, anything else by the BTB
+            u32 rs1 = GET_RS1(inst);
+            timing->branches++;
+            int isReturn = !IS_LINK_REG(rd) && IS_LINK_REG(rs1);
+            int hit = isReturn ? (rasPop(timing) == nextPc) : btbHit(timing, pc, nextPc);
+            if (!hit) {
+                timing->mispredicts++;
+                timingStall(timing, TIMING_STALL_MISPREDICT, timing->mispredictPenalty);
+            }
+            if (IS_LINK_REG(rd)) {
+                rasPush(timing, pc + 4);
+            }
+            break;
+        }
+        default: {
+            // Trap, MRET or a handler moving the PC - the pipeline is flushed
+            if (taken) {
+                timingStall(timing, TIMING_STALL_MISPREDICT, timing->mispredictPenalty);
+            }
+            break;
+        }
+    }
+}
+
+void timingBlock(rv32iHart_t *cpu, u32 startPc, u32 endPc, u32 nextPc) {
+    TimingSim *timing = cpu->timing;
+    TimingOp op;
+    for (u32 pc=startPc; pc<=endPc; pc+=4) {
+        const u8 *fetched = memLoadPtr(cpu, pc, 4);
+        if (fetched == NULL) {
+            break;
+        }
+        u32 inst = *(const u32*)fetched;
+        decodeOp(inst, &op);
+        // In-order issue - a cycle after the previous instruction, or once its operands are ready
+        u64 issue = timing->issue + 1;
+        TimingStall cause = TIMING_STALL_EXEC;
+        for (u32 i=0; i<3; ++i) {
+            if (op.src[i] != 0 && timing->ready[op.src[i]] > issue) {
+                issue = timing->ready[op.src[i]];
+                cause = (TimingStall)timing->readyStall[op.src[i]];
+            }
+        }
+        timingStall(timing, cause, (u32)(issue - (timing->issue + 1)));
+        timing->issue = issue;
+        if (op.dst != 0) {
+            timing->ready[op.dst] = issue + timing->latency[op.latency];
+            timing->readyStall[op.dst] = (op.latency == TIMING_LAT_LOAD) ? TIMING_STALL_LOAD_USE : TIMING_STALL_EXEC;
+        }
+        timing->instructions++;
+        if (GET_OPCODE(inst) == 0x63 || pc == endPc) {
+            timingControl(timing, pc, inst, (pc == endPc) ? nextPc : (pc + 4));
+        }
+    }
+}
+
+u64 timingCycles(const rv32iHart_t *cpu) {
+    return (cpu->timing != NULL) ? cpu->timing->issue : 0;
+}
+
+void timingReport(rv32iHart_t *cpu, FILE *out) {
+    TimingSim *timing = cpu->timing;
+    if (timing == NULL || timing->instructions == 0) {
+        return;
+    }
+    double instructions = (double)timing->instructions;
+    fprintf(out, "Timing model (%s", g_timingPredictorNames[timing->predictor]);
+    if (timing->predictor != TIMING_BP_STATIC) {
+        fprintf(out, " %u-bit", timing->predictorBits);
+    }
+    fprintf(out, ", %u-entry BTB, %u-entry RAS):\n", timing->btbSize, timing->rasSize);
+    fprintf(out, "  cycles: %llu  instructions: %llu  CPI: %.3f\n", (unsigned long long)timing->issue,
+        (unsigned long long)timing->instructions, (double)timing->issue / instructions);
+    fprintf(out, "  CPI breakdown: base 1.000");
+    for (u32 i=0; i<TIMING_STALL_COUNT; ++i) {
+        fprintf(out, " + %s %.3f", g_timingStallNames[i], (double)timing->stalls[i] / instructions);
+    }
+    fprintf(out, "\n  predicted branches/indirect jumps: %llu  mispredicted: %llu (%.2f%%)\n",
+        (unsigned long long)timing->branches, (unsigned long long)timing->mispredicts,
+        timing->branches ? (100.0 * (double)timing->mispredicts / (double)timing->branches) : 0.0);
+}
@@ -0,0 +1,77 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+#include "risa.h"
+
+typedef enum {
+    TIMING_BP_STATIC = 0,   // Backward taken, forward not taken
+    TIMING_BP_BIMODAL,      // 2-bit counters indexed by PC
+    TIMING_BP_GSHARE        // 2-bit counters indexed by PC xor global history
+} TimingPredictor;
+
+// Where cycles beyond one per instruction went
+typedef enum {
+    TIMING_STALL_LOAD_USE = 0,      // Waiting on a load result
+    TIMING_STALL_EXEC,              // Waiting on a multi-cycle (mul/div/FP) result
+    TIMING_STALL_MISPREDICT,        // Wrong branch direction or indirect/return target
+    TIMING_STALL_REDIRECT,          // Taken branch/jump missing in the BTB (target only known at decode)
+    TIMING_STALL_COUNT
+} TimingStall;
+
+typedef enum {
+    TIMING_LAT_ALU = 0,
+    TIMING_LAT_LOAD,
+    TIMING_LAT_MUL,
+    TIMING_LAT_DIV,
+    TIMING_LAT_FP,                  // FP add/mul/fused multiply-add/convert
+    TIMING_LAT_FDIV,                // FP divide/square root
+    TIMING_LAT_COUNT
+} TimingLatency;
+
+#define TIMING_REG_COUNT        64  // x0-x31 then f0-f31
+#define TIMING_DEFAULT_BP_BITS  12
+#define TIMING_DEFAULT_BTB      512
+#define TIMING_DEFAULT_RAS      16
+
+typedef struct {
+    u32 pc;
+    u32 target;
+} TimingBtbEntry;
+
+// In-order single-issue pipeline estimate, run over the retired-instruction stream (see retire.c)
+struct TimingSim {
+    // Config
+    u32             latency[TIMING_LAT_COUNT];
+    u32             mispredictPenalty;
+    u32             redirectPenalty;
+    u32             predictor;                  // TimingPredictor
+    u32             predictorBits;
+    u32             btbSize;
+    u32             rasSize;
+    // State
+    u8              *counters;                  // [1 << predictorBits] 2-bit counters
+    u32             history;
+    TimingBtbEntry  *btb;                       // [btbSize] direct mapped
+    u32             *ras;                       // [rasSize] circular
+    u32             rasTop;
+    u64             issue;                      // Cycle the last instruction issued in
+    u64             ready[TIMING_REG_COUNT];    // Cycle each register's pending result is available
+    u8              readyStall[TIMING_REG_COUNT];
+    // Results
+    u64             instructions;
+    u64             stalls[TIMING_STALL_COUNT];
+    u64             branches;
+    u64             mispredicts;
+};
+
+// Attach a timing model from "spec" (i.e. "bp:gshare:12,btb:512,ras:16,load:2,mul:3,div:20,fp:4,fdiv:12,
+// mispredict:3,redirect:1" - anything left out keeps its default, "default" takes them all) - returns 0, EINVAL
+// (bad spec) or ENOMEM
+int timingCreate(rv32iHart_t *cpu, const char *spec);
+void timingFree(rv32iHart_t *cpu);
+void timingBlock(rv32iHart_t *cpu, u32 startPc, u32 endPc, u32 nextPc);
+u64 timingCycles(const rv32iHart_t *cpu);
+void timingReport(rv32iHart_t *cpu, FILE *out);
+
+#endif // TIMING_H
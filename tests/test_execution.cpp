@@ -1,10 +1,29 @@
 #include <iostream>
+#include <string>
 #include <signal.h>
 #include <stdlib.h>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 #include <gtest/gtest.h>
 extern "C" { // rISA is a pure C project - prevent name mangling
 #include "risa.h"
+#include "cache.h"
+#include "timing.h"
+#include "sample.h"
+#include "memmap.h"
+#include "aot.h"
+#include "predecode.h"
+#include "gdbserver.h"
 }
 
 TEST(risa, test_invalid_instruction) {
@@ -35,3 +54,1649 @@ TEST(risa, test_basic_add_addi) {
     EXPECT_EQ(0, err);
     EXPECT_EQ(testCPU.regFile[8], 36U);
 }
+
+TEST(risa, test_rv32f_arith_convert) {
+    rv32iHart testCPU = {0};
+    testCPU.opts.o_timeout = 1;
+    testCPU.timeoutVal = 11;
+    testCPU.virtMem = (u32*)malloc(sizeof(u32) * 11);
+    testCPU.virtMemSize = sizeof(u32) * 11;
+    testCPU.intPeriodVal = 500;
+    testCPU.virtMem[0]  = 0x00700293; // addi t0 x0 7
+    testCPU.virtMem[1]  = 0xd002f0d3; // fcvt.s.w ft1 t0
+    testCPU.virtMem[2]  = 0x00200313; // addi t1 x0 2
+    testCPU.virtMem[3]  = 0xd0037153; // fcvt.s.w ft2 t1
+    testCPU.virtMem[4]  = 0x1820f1d3; // fdiv.s ft3 ft1 ft2     ; ft3 = 3.5
+    testCPU.virtMem[5]  = 0xc0019553; // fcvt.w.s a0 ft3 rtz    ; Expected result: a0 = 3
+    testCPU.virtMem[6]  = 0xc00185d3; // fcvt.w.s a1 ft3 rne    ; Expected result: a1 = 4
+    testCPU.virtMem[7]  = 0xc001c653; // fcvt.w.s a2 ft3 rmm    ; Expected result: a2 = 4
+    testCPU.virtMem[8]  = 0x001026f3; // frflags a3             ; Expected result: a3 = NX
+    testCPU.virtMem[9]  = 0x1010f243; // fmadd.s ft4 ft1 ft1 ft2
+    testCPU.virtMem[10] = 0xe0020753; // fmv.x.w a4 ft4         ; Expected result: a4 = 51.0f
+
+    int err = executionLoop(&testCPU);
+    EXPECT_EQ(0, err);
+    EXPECT_EQ(testCPU.regFile[10], 3U);
+    EXPECT_EQ(testCPU.regFile[11], 4U);
+    EXPECT_EQ(testCPU.regFile[12], 4U);
+    EXPECT_EQ(testCPU.regFile[13], (u32)FFLAG_NX);
+    EXPECT_EQ(testCPU.regFile[14], 0x424c0000U);
+}
+
+TEST(risa, test_rv32f_reserved_rs2) {
+    // rs2 must be 0 for fmv.x.w/fclass.s/fmv.w.x - anything else is an invalid instruction
+    const u32 reserved[] = {
+        0xe0120753, // fmv.x.w a4 ft4 (rs2 = 1)
+        0xe0121753, // fclass.s a4 ft4 (rs2 = 1)
+        0xf0170253  // fmv.w.x ft4 a4 (rs2 = 1)
+    };
+    for (u32 inst : reserved) {
+        rv32iHart testCPU = {0};
+        testCPU.opts.o_timeout = 1;
+        testCPU.timeoutVal = 1;
+        testCPU.virtMem = (u32*)malloc(sizeof(u32));
+        testCPU.virtMemSize = sizeof(u32);
+        testCPU.intPeriodVal = 500;
+        *testCPU.virtMem = inst;
+
+        int err = executionLoop(&testCPU);
+        EXPECT_EQ(EILSEQ, err) << std::hex << inst;
+        EXPECT_EQ(0U, testCPU.regFile[14]);
+    }
+}
+
+TEST(librisa, test_shift_immediates_and_hart_layout) {
+    const u32 program[] = {
+        0xfc000293, // addi t0 x0 -64
+        0x4032d313, // srai t1 t0 3         ; Expected result: t1 = -8
+        0x01c2d393, // srli t2 t0 28        ; Expected result: t2 = 0xf
+        0x00129513, // slli a0 t0 1         ; Expected result: a0 = -128
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    // Hot core at the start of an aligned hart, TLB on its own cache lines
+    EXPECT_EQ(0U, (uintptr_t)sim % CACHE_LINE_SIZE);
+    EXPECT_EQ(0U, offsetof(rv32iHart, pc));
+    EXPECT_EQ(0U, offsetof(rv32iHart, tlb) % CACHE_LINE_SIZE);
+    EXPECT_LT(offsetof(rv32iHart, regFile), offsetof(rv32iHart, tlb));
+    EXPECT_LT(offsetof(rv32iHart, tlb), offsetof(rv32iHart, gdbFields));
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    EXPECT_EQ(program[0], risaReadInstruction(sim));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    u32 t1 = 0, t2 = 0, a0 = 0;
+    risaReadReg(sim, T1, &t1);
+    risaReadReg(sim, T2, &t2);
+    risaReadReg(sim, A0, &a0);
+    EXPECT_EQ((u32)-8, t1);
+    EXPECT_EQ(0xfU, t2);
+    EXPECT_EQ((u32)-128, a0);
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_concurrent_instances) {
+    const u32 program[] = {
+        0x00000513, // addi a0 x0 0
+        0x3e800593, // addi a1 x0 1000
+        0x00150513, // addi a0 a0 1
+        0xfeb51ee3, // bne a0 a1 -4
+        0x00100893, // addi a7 x0 1     ; syscall_exit
+        0x00000073  // ecall            ; Expected result: exit code 1000 after 2004 cycles
+    };
+    std::vector<risaSim*> sims;
+    std::vector<int> status(8);
+    std::vector<std::thread> threads;
+    for (size_t i=0; i<status.size(); ++i) {
+        risaSim *sim = risaCreate(4096, NULL);
+        ASSERT_NE(sim, nullptr);
+        ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+        sims.push_back(sim);
+    }
+    for (size_t i=0; i<sims.size(); ++i) {
+        threads.emplace_back([&sims, &status, i]() {
+            // Stop part way through, then resume until the guest exits
+            if (risaRun(sims[i], 10) == RISA_RUN_LIMIT && risaCycleCount(sims[i]) == 10) {
+                status[i] = risaRun(sims[i], RISA_RUN_UNLIMITED);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (size_t i=0; i<sims.size(); ++i) {
+        u32 a1 = 0;
+        EXPECT_EQ(RISA_RUN_EXIT, status[i]);
+        EXPECT_EQ(1000, risaExitCode(sims[i]));
+        EXPECT_EQ(2004U, risaCycleCount(sims[i]));
+        EXPECT_EQ(0, risaReadReg(sims[i], A1, &a1));
+        EXPECT_EQ(1000U, a1);
+        risaDestroy(sims[i]);
+    }
+}
+
+TEST(librisa, test_halt_before_run) {
+    const u32 program[] = {
+        0x00150513, // addi a0 a0 1
+        0x00100893, // addi a7 x0 1     ; syscall_exit
+        0x00000073  // ecall            ; Expected result: exit code 1
+    };
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    // Requested before the run starts - not lost when risaRun() resets the status
+    risaHalt(sim);
+    EXPECT_EQ(RISA_RUN_HALT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(0U, risaCycleCount(sim));
+    // Consumed by that run - the next one goes to completion
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(1, risaExitCode(sim));
+    risaDestroy(sim);
+}
+
+static uint32_t testMmio(void *ctx, risaSim *hart, uint32_t addr, uint32_t width, uint32_t value, int isWrite) {
+    u32 *deviceReg = (u32*)ctx;
+    if (isWrite) {
+        *deviceReg = value + width;
+        return 0;
+    }
+    return *deviceReg;
+}
+
+static int testEnv(void *ctx, risaSim *hart, RisaEnvKind kind) {
+    // Only take EBREAK - ECALLs still reach the default syscall handler
+    return (kind == RISA_ENV_EBREAK) && (risaWriteReg(hart, A2, 0x55) == 0);
+}
+
+TEST(librisa, test_handler_abi_v2) {
+    const u32 program[] = {
+        0x100002b7, // lui t0 0x10000
+        0x04800313, // addi t1 x0 72
+        0x00628023, // sb t1 0(t0)      ; MMIO store (device reg = 72 + 1)
+        0x0002a503, // lw a0 0(t0)      ; MMIO load     ; Expected result: a0 = 73
+        0x00100073, // ebreak           ; Handled by v2 ; Expected result: a2 = 0x55
+        0x00100893, // addi a7 x0 1     ; syscall_exit
+        0x00000073  // ecall
+    };
+    u32 deviceReg = 0;
+    risaHandlers handlers = {};
+    handlers.abiVersion = RISA_HANDLER_ABI_VERSION;
+    handlers.events = RISA_EVENT_MMIO | RISA_EVENT_ENV;
+    handlers.mmioBase = 0x10000000;
+    handlers.mmioSize = 0x100;
+    handlers.ctx = &deviceReg;
+    handlers.mmio = testMmio;
+    handlers.env = testEnv;
+
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaSetHandlers(sim, &handlers));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    u32 a0 = 0, a2 = 0;
+    risaReadReg(sim, A0, &a0);
+    risaReadReg(sim, A2, &a2);
+    EXPECT_EQ(73U, deviceReg);
+    EXPECT_EQ(73U, a0);
+    EXPECT_EQ(73, risaExitCode(sim));
+    EXPECT_EQ(0x55U, a2);
+    risaDestroy(sim);
+}
+
+#ifdef RISA_STATIC_HANDLER
+// Built into risa_tests_static with examples/risa_handler/risa_handler.c linked in
+TEST(librisa, test_static_handler) {
+    const u32 program[] = {
+        0x100002b7, // lui t0 0x10000
+        0x04800313, // addi t1 x0 72
+        0x00628023, // sb t1 0(t0)      ; UART store    ; Expected result: 'H' on stdout
+        0x00700513, // addi a0 x0 7
+        0x00100893, // addi a7 x0 1     ; syscall_exit
+        0x00000073  // ecall
+    };
+    testing::internal::CaptureStdout();
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    // Registered without a library - and called directly (HANDLER_CALL)
+    EXPECT_EQ(sim->handlers.mmio, risaHandlerMmio);
+    EXPECT_EQ(sim->handlers.exit, risaHandlerExit);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(7, risaExitCode(sim));
+    risaDestroy(sim);
+    std::string out = testing::internal::GetCapturedStdout();
+    EXPECT_EQ("INIT HELLO WORLD\nHEXIT HELLO WORLD\n", out);
+#ifndef _WIN32
+    // Neither the fixed nor the prefixed names are exported - a dlopen'd handler library can't bind to them
+    EXPECT_EQ(nullptr, dlsym(RTLD_DEFAULT, "risaHandlerMmio"));
+    EXPECT_EQ(nullptr, dlsym(RTLD_DEFAULT, "risaHandlerRegister"));
+    EXPECT_EQ(nullptr, dlsym(RTLD_DEFAULT, "risaStaticHandlerMmio"));
+#endif
+}
+#endif
+
+TEST(librisa, test_clint_timer_interrupt) {
+    const u32 program[] = {
+        0x020042b7, // lui t0 0x2004        ; t0 = CLINT mtimecmp
+        0x01400313, // addi t1 x0 20
+        0x0062a023, // sw t1 0(t0)          ; mtimecmp = 20
+        0x0002a223, // sw x0 4(t0)
+        0x04000393, // addi t2 x0 0x40
+        0x30539073, // csrrw x0 mtvec t2
+        0x08000393, // addi t2 x0 0x80
+        0x30439073, // csrrw x0 mie t2      ; MTIE
+        0x30046073, // csrrsi x0 mstatus 8  ; MIE
+        0x00068063, // beq a3 x0 0          ; Spin until the handler sets a3
+        0x00500513, // addi a0 x0 5
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073, // ecall
+        0x00000013, // nop
+        0x00000013, // nop
+        0x00000013, // nop
+        0x34202773, // csrrs a4 mcause x0   ; Timer handler (mtvec) ; Expected result: a4 = 0x80000007
+        0x341027f3, // csrrs a5 mepc x0     ; Expected result: a5 = 0x24
+        0x00100693, // addi a3 x0 1
+        0xfff00313, // addi t1 x0 -1
+        0x0062a223, // sw t1 4(t0)          ; mtimecmp = never (clears MTIP)
+        0x30200073  // mret
+    };
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    risaEnableClint(sim, RISA_CLINT_DEFAULT_BASE);
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, 1000));
+    u32 a4 = 0, a5 = 0;
+    risaReadReg(sim, A4, &a4);
+    risaReadReg(sim, A5, &a5);
+    EXPECT_EQ(5, risaExitCode(sim));
+    EXPECT_EQ(0x80000007U, a4);
+    EXPECT_EQ(0x24U, a5);
+    // Taken once mtime reached 20, then 6 handler instructions and 4 to exit
+    EXPECT_EQ(30U, risaCycleCount(sim));
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_clint_time_set_backwards) {
+    const u32 program[] = {
+        0x00000013, // nop
+        0x00000013, // nop
+        0x0200c2b7, // lui t0 0x200c        ; t0 - 8 = CLINT mtime
+        0xfe02ac23, // sw x0 -8(t0)         ; mtime = 0 (behind the cycle count)
+        0xfe02ae23, // sw x0 -4(t0)
+        0x02004337, // lui t1 0x2004        ; t1 = CLINT mtimecmp
+        0xff000393, // addi t2 x0 -16
+        0x00732023, // sw t2 0(t1)          ; mtimecmp = 0xfffffffffffffff0 (moved back)
+        0x0000006f  // jal x0 0             ; Spin - the timer never comes due
+    };
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    risaEnableClint(sim, RISA_CLINT_DEFAULT_BASE);
+    EXPECT_EQ(RISA_RUN_LIMIT, risaRun(sim, 1000));
+    EXPECT_EQ(1000U, risaCycleCount(sim));
+    EXPECT_EQ(0U, sim->trap.mip & MIP_MTIP);
+    risaDestroy(sim);
+}
+
+// Waits for a CLINT timer interrupt at mtime = 1000000 in "idleLoop" (two instructions at 0x28)
+static risaSim *runIdleProgram(u32 idleLoop0, u32 idleLoop1) {
+    const u32 program[] = {
+        0x020042b7, // lui t0 0x2004        ; t0 = CLINT mtimecmp
+        0x000f4337, // lui t1 0xf4
+        0x24030313, // addi t1 t1 576
+        0x0062a023, // sw t1 0(t0)          ; mtimecmp = 1000000
+        0x0002a223, // sw x0 4(t0)
+        0x04000393, // addi t2 x0 0x40
+        0x30539073, // csrrw x0 mtvec t2
+        0x08000393, // addi t2 x0 0x80
+        0x30439073, // csrrw x0 mie t2      ; MTIE
+        0x30046073, // csrrsi x0 mstatus 8  ; MIE
+        idleLoop0,
+        idleLoop1,
+        0x00500513, // addi a0 x0 5
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073, // ecall
+        0x00000013, // nop
+        0x00100693, // addi a3 x0 1         ; Timer handler (mtvec)
+        0x10d02023, // sw a3 0x100(x0)
+        0xfff00313, // addi t1 x0 -1
+        0x0062a223, // sw t1 4(t0)          ; mtimecmp = never
+        0x30200073  // mret
+    };
+    risaSim *sim = risaCreate(4096, NULL);
+    if (sim != nullptr) {
+        risaLoadImage(sim, program, sizeof(program), 0);
+        risaEnableClint(sim, RISA_CLINT_DEFAULT_BASE);
+        risaRun(sim, RISA_RUN_UNLIMITED);
+    }
+    return sim;
+}
+
+TEST(risa, test_idle_fast_forward) {
+    // Polling loop - taken at the end of the iteration at cycle 1000000, 5 handler instructions, then 5 to exit
+    risaSim *sim = runIdleProgram(
+        0x10002683, // lw a3 0x100(x0)
+        0xfe068ee3  // beq a3 x0 -4
+    );
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(5, risaExitCode(sim));
+    EXPECT_EQ(1000010U, risaCycleCount(sim));
+    EXPECT_GT(sim->idle.skippedCycles, 990000U);
+    risaDestroy(sim);
+
+    // WFI - sleeps until cycle 1000000, then 5 handler instructions and 4 to exit
+    sim = runIdleProgram(
+        0x10500073, // wfi
+        0xfe068ee3  // beq a3 x0 -4
+    );
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(5, risaExitCode(sim));
+    EXPECT_EQ(1000009U, risaCycleCount(sim));
+    EXPECT_GT(sim->idle.skippedCycles, 990000U);
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_cache_model) {
+    const u32 program[] = {
+        0x00200413, // addi s0 x0 2         ; Two passes over a 4KB array
+        0x00001337, // lui t1 1
+        0x000023b7, // lui t2 2
+        0x00032503, // lw a0 0(t1)
+        0x00430313, // addi t1 t1 4
+        0xfe731ce3, // bne t1 t2 -8
+        0xfff40413, // addi s0 s0 -1
+        0xfe0414e3, // bne s0 x0 -24
+        0x00000513, // addi a0 x0 0
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    risaSim *sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    EXPECT_EQ(EINVAL, risaEnableCache(sim, "l1d:1k:3:64"));
+    ASSERT_EQ(0, risaEnableCache(sim, "l1i:1k:1:64,l1d:1k:2:64:lru,l2:8k:4:64:fifo"));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    // 64 lines per pass, only 16 fit in L1D - every line misses on both passes, the second pass hits in L2
+    const CacheLevel *l1d = &sim->cache->levels[CACHE_L1D];
+    EXPECT_EQ(128U, l1d->total.misses);
+    EXPECT_EQ(2048U - 128U, l1d->total.hits);
+    EXPECT_EQ(128U - 16U, l1d->total.evictions);
+    EXPECT_EQ(64U, sim->cache->levels[CACHE_L2].total.hits);
+    // The whole program is in one I-cache line
+    EXPECT_EQ(1U, sim->cache->levels[CACHE_L1I].total.misses);
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_cache_model_long_run) {
+    // Straight-line code longer than CACHE_MAX_FETCH_RUN - every line is still fetched
+    std::vector<u32> program(20000, 0x00000013);   // nop
+    program.push_back(0x00100893);                  // addi a7 x0 1     ; syscall_exit
+    program.push_back(0x00000073);                  // ecall
+    risaSim *sim = risaCreate(128 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program.data(), program.size() * sizeof(u32), 0));
+    ASSERT_EQ(0, risaEnableCache(sim, "l1i:1k:1:64"));
+    ASSERT_EQ(0, risaEnableTiming(sim, "default"));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(((program.size() * sizeof(u32)) + 63) / 64, sim->cache->levels[CACHE_L1I].total.misses);
+    EXPECT_LE(program.size(), risaTimingCycles(sim));
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_timing_model) {
+    const u32 program[] = {
+        0x06400413, // addi s0 x0 100
+        0x00002503, // lw a0 0(x0)          ; Load-use stall on the next instruction
+        0x00150593, // addi a1 a0 1
+        0xfff40413, // addi s0 s0 -1
+        0xfe041ae3, // bne s0 x0 -12
+        0x00000513, // addi a0 x0 0
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    risaSim *sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    EXPECT_EQ(EINVAL, risaEnableTiming(sim, "bp:tage"));
+    EXPECT_EQ(EINVAL, risaEnableTiming(sim, "btb:100"));
+    ASSERT_EQ(0, risaEnableTiming(sim, "bp:bimodal:4,btb:16,load:2,mispredict:3,redirect:1"));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    const TimingSim *timing = sim->timing;
+    EXPECT_EQ(404U, timing->instructions);
+    EXPECT_EQ(100U, timing->stalls[TIMING_STALL_LOAD_USE]);
+    // Weakly not taken counter - the first (taken) and last (not taken) iterations mispredict
+    EXPECT_EQ(100U, timing->branches);
+    EXPECT_EQ(2U, timing->mispredicts);
+    EXPECT_EQ(0U, timing->stalls[TIMING_STALL_REDIRECT]);
+    EXPECT_EQ(404U + 100U + 6U, risaTimingCycles(sim));
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_bbv_and_sampling) {
+    const u32 program[] = {
+        0x06400413, // addi s0 x0 100
+        0x00002503, // lw a0 0(x0)          ; 4 instructions, 5 cycles per iteration
+        0x00150593, // addi a1 a0 1
+        0xfff40413, // addi s0 s0 -1
+        0xfe041ae3, // bne s0 x0 -12
+        0x00000513, // addi a0 x0 0
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    const char *bbvPath = "test_bbv_and_sampling.bb";
+    risaSim *sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaEnableBbv(sim, bbvPath, 100));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    risaDestroy(sim);
+
+    // Intervals close on the first block boundary at/after each 100 cycles
+    std::vector<unsigned long long> intervalSums;
+    FILE *bbvFile = fopen(bbvPath, "r");
+    ASSERT_NE(bbvFile, nullptr);
+    char line[256];
+    while (fgets(line, sizeof(line), bbvFile) != NULL) {
+        ASSERT_EQ('T', line[0]);
+        unsigned long long sum = 0;
+        unsigned id;
+        unsigned long long count;
+        for (char *pos = line + 1; sscanf(pos, ":%u:%llu ", &id, &count) == 2; pos = strchr(pos, ' ') + 1) {
+            sum += count;
+        }
+        intervalSums.push_back(sum);
+    }
+    fclose(bbvFile);
+    remove(bbvPath);
+    EXPECT_EQ(std::vector<unsigned long long>({ 101, 100, 100, 103 }), intervalSums);
+
+    sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaEnableTiming(sim, "bp:bimodal:4,load:2"));
+    const uint64_t points[] = { 3, 1 };
+    EXPECT_EQ(EINVAL, risaEnableSampling(sim, 0, 50, points, NULL, 2));
+    ASSERT_EQ(0, risaEnableSampling(sim, 100, 50, points, NULL, 2));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(404U, risaCycleCount(sim));
+    // The models only saw each point's warmup and interval
+    EXPECT_EQ(300U, sim->timing->instructions);
+    for (u32 i=0; i<2; ++i) {
+        const SamplePoint *point = &sim->sample->points[i];
+        EXPECT_EQ(2U * i + 1U, point->index);
+        EXPECT_EQ(1U, point->simulated);
+        EXPECT_EQ(100U, point->instructions);
+        EXPECT_EQ(125U, point->cycles);
+    }
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_load_simpoints) {
+    const char *simpointsPath = "test_load_simpoints.simpoints";
+    const char *weightsPath = "test_load_simpoints.weights";
+    FILE *file = fopen(simpointsPath, "w");
+    ASSERT_NE(file, nullptr);
+    fputs("7 1\n2 0\n", file);
+    fclose(file);
+    file = fopen(weightsPath, "w");
+    ASSERT_NE(file, nullptr);
+    fputs("0.25 0\n0.75 1\n", file);
+    fclose(file);
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadSimpoints(sim, 100, 10, simpointsPath, weightsPath));
+    ASSERT_EQ(2U, sim->sample->count);
+    EXPECT_EQ(2U, sim->sample->points[0].index);
+    EXPECT_EQ(0.25, sim->sample->points[0].weight);
+    EXPECT_EQ(7U, sim->sample->points[1].index);
+    EXPECT_EQ(0.75, sim->sample->points[1].weight);
+
+    // Point ids that can't index anything are refused (not allocated for)
+    const char *badIds[] = { "0 18446744073709551615\n", "0 4294967295\n", "0 -1\n" };
+    for (const char *bad : badIds) {
+        file = fopen(simpointsPath, "w");
+        ASSERT_NE(file, nullptr);
+        fputs(bad, file);
+        fclose(file);
+        EXPECT_EQ(EINVAL, risaLoadSimpoints(sim, 100, 10, simpointsPath, NULL));
+    }
+    risaDestroy(sim);
+    remove(simpointsPath);
+    remove(weightsPath);
+}
+
+static uint32_t recordMmio(void *ctx, risaSim *hart, uint32_t addr, uint32_t width, uint32_t value, int isWrite) {
+    u32 *reads = (u32*)ctx;
+    return isWrite ? 0 : ((*reads)++ * 7) ^ (u32)(uintptr_t)&value; // Differs from run to run
+}
+
+static void recordInterrupt(void *ctx, risaSim *hart, uint64_t cycle) {
+    u32 stamp = (u32)cycle * 3;
+    risaWriteReg(hart, S1, (u32)cycle);
+    risaWriteMem(hart, 0x100, &stamp, sizeof(stamp));
+}
+
+static int recordEnv(void *ctx, risaSim *hart, RisaEnvKind kind) {
+    return (kind == RISA_ENV_EBREAK) && (risaWriteMem(hart, 0x200, "rr\n", 3) == 0);
+}
+
+TEST(librisa, test_record_replay) {
+    const u32 program[] = {
+        0x100002b7, // lui t0 0x10000
+        0x03200413, // addi s0 x0 50
+        0x00000513, // addi a0 x0 0
+        0x0002a303, // lw t1 0(t0)          ; MMIO load
+        0x00650533, // add a0 a0 t1
+        0x00950533, // add a0 a0 s1         ; s1 set by the interrupt callback
+        0xfff40413, // addi s0 s0 -1
+        0xfe0418e3, // bne s0 x0 -16
+        0x10002383, // lw t2 0x100(x0)      ; Written by the interrupt callback
+        0x00750533, // add a0 a0 t2
+        0x00100073, // ebreak               ; Env callback writes "rr\n" at 0x200
+        0x00500893, // addi a7 x0 5         ; syscall_write
+        0x00100513, // addi a0 x0 1
+        0x20000593, // addi a1 x0 0x200
+        0x00300613, // addi a2 x0 3
+        0x00000073, // ecall
+        0x00c50533, // add a0 a0 a2
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    const char *logPath = "test_record_replay.log";
+    u32 reads = 0;
+    risaHandlers handlers = {};
+    handlers.abiVersion = RISA_HANDLER_ABI_VERSION;
+    handlers.events = RISA_EVENT_MMIO | RISA_EVENT_ENV | RISA_EVENT_INTERRUPT;
+    handlers.mmioBase = 0x10000000;
+    handlers.mmioSize = 0x100;
+    handlers.ctx = &reads;
+    handlers.mmio = recordMmio;
+    handlers.env = recordEnv;
+    handlers.interrupt = recordInterrupt;
+
+    risaSim *recorded = risaCreate(4096, NULL);
+    ASSERT_NE(recorded, nullptr);
+    ASSERT_EQ(0, risaLoadImage(recorded, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaSetHandlers(recorded, &handlers));
+    recorded->intPeriodVal = 20;
+    ASSERT_EQ(0, risaRecord(recorded, logPath));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(recorded, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(50U, reads);
+    EXPECT_EQ(6, risaExitCode(recorded));
+
+    // No handlers at all - every input comes from the log
+    risaSim *replayed = risaCreate(4096, NULL);
+    ASSERT_NE(replayed, nullptr);
+    ASSERT_EQ(0, risaLoadImage(replayed, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaReplay(replayed, logPath));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(replayed, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(risaExitCode(recorded), risaExitCode(replayed));
+    EXPECT_EQ(risaCycleCount(recorded), risaCycleCount(replayed));
+    EXPECT_EQ(0, memcmp(recorded->regFile, replayed->regFile, sizeof(recorded->regFile)));
+    EXPECT_EQ(0, memcmp(recorded->virtMem, replayed->virtMem, 4096));
+    risaDestroy(replayed);
+
+    // A log only replays against the image it was recorded with
+    replayed = risaCreate(4096, NULL);
+    ASSERT_NE(replayed, nullptr);
+    ASSERT_EQ(0, risaLoadImage(replayed, program, sizeof(program) - 4, 0));
+    EXPECT_EQ(EINVAL, risaReplay(replayed, logPath));
+    risaDestroy(replayed);
+    risaDestroy(recorded);
+    remove(logPath);
+}
+
+static uint32_t countMmio(void *ctx, risaSim *hart, uint32_t addr, uint32_t width, uint32_t value, int isWrite) {
+    u32 *accesses = (u32*)ctx;
+    (*accesses)++;
+    return isWrite ? 0 : (addr + 0x55);
+}
+
+TEST(librisa, test_sparse_memory_map) {
+    const u32 program[] = {
+        0x200002b7, // lui t0 0x20000       ; First RAM page
+        0x30000337, // lui t1 0x30000       ; End of RAM (256 MB on)
+        0x06400413, // addi s0 x0 100
+        0x0082a023, // sw s0 0(t0)
+        0xfe832e23, // sw s0 -4(t1)
+        0x0002a583, // lw a1 0(t0)
+        0xfff40413, // addi s0 s0 -1
+        0xfe0418e3, // bne s0 x0 -16
+        0x400003b7, // lui t2 0x40000
+        0x0003a603, // lw a2 0(t2)          ; mmio region ; Expected result: a2 = 0x40000055
+        0x00c3a223, // sw a2 4(t2)
+        0x00002683, // lw a3 0(x0)          ; ROM read
+        0x00d02023  // sw a3 0(x0)          ; ROM store - access fault
+    };
+    u32 accesses = 0;
+    risaHandlers handlers = {};
+    handlers.abiVersion = RISA_HANDLER_ABI_VERSION;
+    handlers.events = RISA_EVENT_MMIO;
+    handlers.ctx = &accesses;
+    handlers.mmio = countMmio;
+
+    risaSim *sim = risaCreate(0, NULL);
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(EINVAL, risaSetMemoryMap(sim, "ram:0x0:64k,rom:0x8000:4k"));
+    EXPECT_EQ(EINVAL, risaSetMemoryMap(sim, "ram:0x1000:100"));
+    ASSERT_EQ(0, risaSetMemoryMap(sim, "rom:0x0:64k,ram:0x20000000:256m,mmio:0x40000000:4k"));
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaSetHandlers(sim, &handlers));
+    EXPECT_EQ(RISA_RUN_ERROR, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(EFAULT, risaExitCode(sim));
+    EXPECT_EQ(0x30U, risaReadPc(sim));
+    u32 a1 = 0, a2 = 0, a3 = 0, last = 0;
+    risaReadReg(sim, A1, &a1);
+    risaReadReg(sim, A2, &a2);
+    risaReadReg(sim, A3, &a3);
+    EXPECT_EQ(1U, a1);
+    EXPECT_EQ(0x40000055U, a2);
+    EXPECT_EQ(program[0], a3);
+    EXPECT_EQ(2U, accesses);
+    EXPECT_EQ(0, risaReadMem(sim, 0x2ffffffc, &last, sizeof(last)));
+    EXPECT_EQ(1U, last);
+    EXPECT_EQ(EFAULT, risaReadMem(sim, 0x30000000, &last, sizeof(last)));
+    // The ROM page and the two RAM pages written - out of 256 MB
+    EXPECT_EQ(3U, sim->memMap->pagesTouched);
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_huge_page_backing) {
+    const u32 program[] = {
+        0x200002b7, // lui t0 0x20000       ; First RAM page
+        0x24000337, // lui t1 0x24000       ; End of RAM (64 MB on)
+        0x00a00413, // addi s0 x0 10
+        0x0082a023, // sw s0 0(t0)
+        0xfe832e23, // sw s0 -4(t1)
+        0xffc32583, // lw a1 -4(t1)
+        0xfff40413, // addi s0 s0 -1
+        0xfe0418e3, // bne s0 x0 -16        ; Expected result: a1 = 1
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    risaSim *sim = risaCreate(0, NULL);
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(EINVAL, risaSetMemoryBacking(sim, "2m"));
+    EXPECT_EQ(EINVAL, risaSetMemoryBacking(sim, "thp,node:64"));
+    EXPECT_EQ(EINVAL, risaSetMemoryBacking(sim, "thp,node:1x"));
+    ASSERT_EQ(0, risaSetMemoryMap(sim, "rom:0x0:4k,ram:0x20000000:64m"));
+    // Whatever the host has - explicit huge pages, THP or plain 4 KB pages - the layout and contents are the same
+    ASSERT_EQ(0, risaSetMemoryBacking(sim, "hugetlb,node:local"));
+    ASSERT_EQ(2U, sim->memMap->regionCount);
+    const MemRegion *ram = &sim->memMap->regions[1];
+    EXPECT_EQ(0x20000000U, ram->base);
+    EXPECT_EQ(64U * 1024 * 1024, ram->size);
+    if (ram->pages != MEM_PAGES_DEFAULT) {
+        EXPECT_EQ(0U, (uintptr_t)ram->host & (MEM_HUGE_PAGE_SIZE - 1));
+    }
+    EXPECT_GE(ram->numaNode, MEM_NUMA_NONE);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    u32 a1 = 0, first = 0;
+    risaReadReg(sim, A1, &a1);
+    EXPECT_EQ(1U, a1);
+    EXPECT_EQ(0, risaReadMem(sim, 0x20000000, &first, sizeof(first)));
+    EXPECT_EQ(1U, first);
+    EXPECT_EQ(3U, sim->memMap->pagesTouched);
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_aot_translation) {
+    const u32 program[] = {
+        0x06400413, // addi s0 x0 100
+        0x00000513, // addi a0 x0 0
+        0x40000113, // addi sp x0 0x400
+        0x02c000ef, // jal ra 44            ; loop: call func
+        0x00a12023, // sw a0 0(sp)
+        0x00110303, // lb t1 1(sp)
+        0x006585b3, // add a1 a1 t1
+        0xfff40413, // addi s0 s0 -1
+        0xfe0416e3, // bne s0 x0 -20
+        0x00002e03, // lw t3 0(x0)
+        0x01c02023, // sw t3 0(x0)          ; Rewrites translated code (with itself)
+        0x4035d613, // srai a2 a1 3
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073, // ecall
+        0x00750513, // addi a0 a0 7         ; func
+        0x00251293, // slli t0 a0 2
+        0x00554533, // xor a0 a0 t0
+        0x00008067  // jalr x0 ra 0
+    };
+    const char *sourcePath = "test_aot_translation.c";
+    const char *libPath = "./test_aot_translation.so";
+    const u32 entry = 0;
+    u32 blockCount = 0;
+    FILE *source = fopen(sourcePath, "w");
+    ASSERT_NE(source, nullptr);
+    ASSERT_EQ(0, aotTranslate((const u8*)program, sizeof(program), &entry, 1, source, &blockCount));
+    fclose(source);
+    // Entry, loop head, return site, exit path, func
+    EXPECT_EQ(5U, blockCount);
+    std::string build = std::string("cc -O1 -shared -fPIC -I") + RISA_INCLUDE_DIR + " " + sourcePath + " -o " +
+        libPath;
+    int built = system(build.c_str());
+    remove(sourcePath);
+    if (built != 0) {
+        GTEST_SKIP() << "No host C compiler to build the translation with";
+    }
+
+    risaSim *interpreted = risaCreate(4096, NULL);
+    risaSim *translated = risaCreate(4096, NULL);
+    ASSERT_NE(interpreted, nullptr);
+    ASSERT_NE(translated, nullptr);
+    ASSERT_EQ(0, risaLoadImage(interpreted, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaLoadImage(translated, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaLoadTranslation(translated, libPath));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(interpreted, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(translated, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(risaExitCode(interpreted), risaExitCode(translated));
+    EXPECT_EQ(risaCycleCount(interpreted), risaCycleCount(translated));
+    EXPECT_EQ(0, memcmp(interpreted->regFile, translated->regFile, sizeof(interpreted->regFile)));
+    EXPECT_EQ(0, memcmp(interpreted->virtMem, translated->virtMem, 4096));
+    // Every loop iteration ran translated (the entry block waits on the first event check), then the store over
+    // the code handed the rest to the interpreter
+    EXPECT_EQ(301U, translated->aot->blocksRun);
+    EXPECT_EQ(1002U, translated->aot->instructionsRun);
+    EXPECT_EQ(0U, translated->aot->enabled);
+    risaDestroy(translated);
+    risaDestroy(interpreted);
+
+    // Only loads against the code it was translated from
+    u32 changed[sizeof(program) / sizeof(u32)];
+    memcpy(changed, program, sizeof(program));
+    changed[15] = 0x00351293; // slli t0 a0 3
+    translated = risaCreate(4096, NULL);
+    ASSERT_NE(translated, nullptr);
+    ASSERT_EQ(0, risaLoadImage(translated, changed, sizeof(changed), 0));
+    EXPECT_EQ(EINVAL, risaLoadTranslation(translated, libPath));
+    EXPECT_EQ(ENOENT, risaLoadTranslation(translated, "./test_aot_missing.so"));
+    risaDestroy(translated);
+    remove(libPath);
+}
+
+#ifndef _WIN32 // POSIX directory calls
+// Files left in a translation cache directory - "removeAll" empties it
+static std::vector<std::string> aotCacheFiles(const char *dir, bool removeAll) {
+    std::vector<std::string> files;
+    DIR *listing = opendir(dir);
+    struct dirent *entry;
+    while (listing != NULL && (entry = readdir(listing)) != NULL) {
+        std::string path = std::string(dir) + "/" + entry->d_name;
+        if (entry->d_name[0] != '.') {
+            files.push_back(path);
+            if (removeAll) {
+                remove(path.c_str());
+            }
+        }
+    }
+    if (listing != NULL) {
+        closedir(listing);
+    }
+    return files;
+}
+
+TEST(librisa, test_aot_cache) {
+    const u32 program[] = {
+        0x00a00413, // addi s0 x0 10
+        0x00150513, // addi a0 a0 1         ; loop
+        0xfff40413, // addi s0 s0 -1
+        0xfe041ce3, // bne s0 x0 -8
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    const char *dir = "./test_aot_cache";
+    aotCacheFiles(dir, true);
+    mkdir(dir, 0755);
+
+    // Miss - translated, built and moved into place (nothing else left behind)
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    int err = risaLoadCachedTranslation(sim, dir);
+    if (err == ENOENT) {
+        risaDestroy(sim);
+        aotCacheFiles(dir, true);
+        rmdir(dir);
+        GTEST_SKIP() << "No host C compiler to build the translation with";
+    }
+    ASSERT_EQ(0, err);
+    ASSERT_NE(sim->aot, nullptr);
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(10, risaExitCode(sim));
+    EXPECT_NE(0U, sim->aot->blocksRun);
+    risaDestroy(sim);
+    std::vector<std::string> files = aotCacheFiles(dir, false);
+    ASSERT_EQ(1U, files.size());
+    struct stat built;
+    ASSERT_EQ(0, stat(files[0].c_str(), &built));
+
+    // Hit - the same library, not built again
+    sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaLoadCachedTranslation(sim, dir));
+    ASSERT_NE(sim->aot, nullptr);
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(10, risaExitCode(sim));
+    risaDestroy(sim);
+    struct stat cached;
+    ASSERT_EQ(0, stat(files[0].c_str(), &cached));
+    EXPECT_EQ(built.st_ino, cached.st_ino);
+    EXPECT_EQ(1U, aotCacheFiles(dir, false).size());
+
+    // A different image gets an entry of its own
+    u32 changed[sizeof(program) / sizeof(u32)];
+    memcpy(changed, program, sizeof(program));
+    changed[0] = 0x01400413; // addi s0 x0 20
+    sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, changed, sizeof(changed), 0));
+    ASSERT_EQ(0, risaLoadCachedTranslation(sim, dir));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(20, risaExitCode(sim));
+    risaDestroy(sim);
+    EXPECT_EQ(2U, aotCacheFiles(dir, true).size());
+    rmdir(dir);
+
+    // Shell metacharacters in the cache path are just part of the path (the compiler runs without a shell)
+    const char *oddDir = "./test_aot_cache \"`touch test_aot_pwned`$HOME";
+    remove("test_aot_pwned");
+    aotCacheFiles(oddDir, true);
+    mkdir(oddDir, 0755);
+    sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    EXPECT_EQ(0, risaLoadCachedTranslation(sim, oddDir));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(10, risaExitCode(sim));
+    risaDestroy(sim);
+    EXPECT_EQ(1U, aotCacheFiles(oddDir, true).size());
+    rmdir(oddDir);
+    struct stat pwned;
+    EXPECT_NE(0, stat("test_aot_pwned", &pwned));
+}
+#endif
+
+TEST(librisa, test_predecode) {
+    // Every kernel against the scalar one - random words with each opcode, and a count that leaves a tail
+    std::vector<u32> words(1003);
+    u32 seed = 12345;
+    for (size_t i=0; i<words.size(); ++i) {
+        seed = seed * 1664525 + 1013904223;
+        words[i] = (seed & ~0x7fu) | (u32)(i & 0x7f);
+    }
+    Predecode *scalar = predecodeBuild((const u8*)words.data(), 0x100, (u32)words.size(), PREDECODE_SCALAR);
+    ASSERT_NE(scalar, nullptr);
+    EXPECT_EQ((u32)PREDECODE_SCALAR, scalar->kernel);
+    for (u32 kernel : { (u32)PREDECODE_SSE2, (u32)PREDECODE_AVX2, (u32)PREDECODE_AUTO }) {
+        Predecode *pre = predecodeBuild((const u8*)words.data(), 0x100, (u32)words.size(), kernel);
+        ASSERT_NE(pre, nullptr);
+        EXPECT_EQ(0x100U, pre->base);
+        EXPECT_EQ(0, memcmp(scalar->inst, pre->inst, words.size() * sizeof(u32)));
+        EXPECT_EQ(0, memcmp(scalar->imm, pre->imm, words.size() * sizeof(s32))) << predecodeKernelName(pre->kernel);
+        EXPECT_EQ(0, memcmp(scalar->opcode, pre->opcode, words.size()));
+        EXPECT_EQ(0, memcmp(scalar->rd, pre->rd, words.size()));
+        EXPECT_EQ(0, memcmp(scalar->rs1, pre->rs1, words.size()));
+        EXPECT_EQ(0, memcmp(scalar->rs2, pre->rs2, words.size()));
+        EXPECT_EQ(0, memcmp(scalar->funct3, pre->funct3, words.size()));
+        predecodeTableFree(pre);
+    }
+    // Spot checks of the immediates
+    const u32 known[] = {
+        0xfe041ce3, // bne s0 x0 -8
+        0xfd5ff0ef, // jal ra -44
+        0xfe112e23, // sw ra -4(sp)
+        0x800002b7, // lui t0 0x80000
+        0xffc10113  // addi sp sp -4
+    };
+    const s32 knownImm[] = { -8, -44, -4, (s32)0x80000000, -4 };
+    Predecode *pre = predecodeBuild((const u8*)known, 0, 5, PREDECODE_AUTO);
+    ASSERT_NE(pre, nullptr);
+    for (u32 i=0; i<5; ++i) {
+        EXPECT_EQ(knownImm[i], pre->imm[i]);
+    }
+    predecodeTableFree(pre);
+    predecodeTableFree(scalar);
+
+    // Same run with the table - including once the program has rewritten its own code
+    const u32 program[] = {
+        0x00000513, // addi a0 x0 0
+        0x00150513, // addi a0 a0 1         ; patch
+        0x00041c63, // bne s0 x0 24         ; -> done
+        0x005502b7, // lui t0 0x550
+        0x51328293, // addi t0 t0 0x513
+        0x00502223, // sw t0 4(x0)          ; patch becomes "addi a0 a0 5"
+        0x00100413, // addi s0 x0 1
+        0xfe9ff06f, // jal x0 -24           ; -> patch
+        0x00100893, // addi a7 x0 1         ; done: syscall_exit
+        0x00000073  // ecall
+    };
+    risaSim *interpreted = risaCreate(4096, NULL);
+    risaSim *predecoded = risaCreate(4096, NULL);
+    ASSERT_NE(interpreted, nullptr);
+    ASSERT_NE(predecoded, nullptr);
+    ASSERT_EQ(0, risaLoadImage(interpreted, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaLoadImage(predecoded, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaPredecode(predecoded));
+    ASSERT_NE(predecoded->predecode, nullptr);
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(interpreted, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(predecoded, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(6, risaExitCode(predecoded));
+    EXPECT_EQ(risaExitCode(interpreted), risaExitCode(predecoded));
+    EXPECT_EQ(risaCycleCount(interpreted), risaCycleCount(predecoded));
+    EXPECT_EQ(0, memcmp(interpreted->regFile, predecoded->regFile, sizeof(interpreted->regFile)));
+    risaDestroy(predecoded);
+    risaDestroy(interpreted);
+}
+
+TEST(librisa, test_fusion) {
+    const u32 program[] = {
+        0x03200413, // addi s0 x0 50
+        0x123455b7, // lui a1 0x12345       ; loop: constant
+        0x67858593, // addi a1 a1 0x678
+        0x00000297, // auipc t0 0           ; pc-relative load
+        0x03c2a603, // lw a2 60(t0)
+        0x01059693, // slli a3 a1 16        ; zero-extension
+        0x0106d693, // srli a3 a3 16
+        0x00d50533, // add a0 a0 a3
+        0x00c50533, // add a0 a0 a2
+        0x00000317, // auipc t1 0           ; far call
+        0x01c300e7, // jalr ra 28(t1)
+        0xfff40413, // addi s0 s0 -1
+        0x008023b3, // slt t2 x0 s0         ; compare and branch
+        0xfc0398e3, // bne t2 x0 -48
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073, // ecall
+        0x05554513, // xori a0 a0 0x55      ; func
+        0x00008067, // jalr x0 ra 0
+        0x00000011  // data
+    };
+    Predecode *pre = predecodeBuild((const u8*)program, 0, sizeof(program) / sizeof(u32), PREDECODE_AUTO);
+    ASSERT_NE(pre, nullptr);
+    EXPECT_EQ((u8)PREDECODE_FUSE_LUI_ADDI, pre->fuse[1]);
+    EXPECT_EQ((u8)PREDECODE_FUSE_AUIPC_LW, pre->fuse[3]);
+    EXPECT_EQ((u8)PREDECODE_FUSE_SLLI_SRLI, pre->fuse[5]);
+    EXPECT_EQ((u8)PREDECODE_FUSE_AUIPC_JALR, pre->fuse[9]);
+    EXPECT_EQ((u8)PREDECODE_FUSE_CMP_BRANCH, pre->fuse[12]);
+    u32 pairs = 0;
+    for (u32 i=0; i<pre->count; ++i) {
+        pairs += (pre->fuse[i] != PREDECODE_FUSE_NONE);
+    }
+    EXPECT_EQ(5U, pairs);
+    predecodeTableFree(pre);
+
+    // Whole run, then in chunks that keep ending between the two halves of a pair - every instruction still counts
+    for (u64 chunk : { (u64)RISA_RUN_UNLIMITED, (u64)7 }) {
+        risaSim *interpreted = risaCreate(4096, NULL);
+        risaSim *fused = risaCreate(4096, NULL);
+        ASSERT_NE(interpreted, nullptr);
+        ASSERT_NE(fused, nullptr);
+        ASSERT_EQ(0, risaLoadImage(interpreted, program, sizeof(program), 0));
+        ASSERT_EQ(0, risaLoadImage(fused, program, sizeof(program), 0));
+        ASSERT_EQ(0, risaPredecode(fused));
+        int status = RISA_RUN_LIMIT;
+        while (status == RISA_RUN_LIMIT) {
+            status = risaRun(interpreted, chunk);
+            EXPECT_EQ(status, risaRun(fused, chunk));
+            ASSERT_EQ(risaCycleCount(interpreted), risaCycleCount(fused));
+            ASSERT_EQ(0, memcmp(interpreted->regFile, fused->regFile, sizeof(interpreted->regFile)));
+            ASSERT_EQ(interpreted->pc, fused->pc);
+        }
+        EXPECT_EQ(RISA_RUN_EXIT, status);
+        EXPECT_EQ(risaExitCode(interpreted), risaExitCode(fused));
+        // 5 pairs an iteration - less the ones an event check or chunk boundary split
+        EXPECT_GT(fused->predecode->fusedPairs, (chunk == 7) ? 50U : 200U);
+        EXPECT_LE(fused->predecode->fusedPairs, 250U);
+        risaDestroy(fused);
+        risaDestroy(interpreted);
+    }
+}
+
+// One accelerated intrinsic ECALL (args from 0x3000) on a 16KB sim charging 3 cycles a word - returns its result
+// (the exit code - EFAULT - if the run stops with "status" RISA_RUN_ERROR)
+static int accelCall(risaSim *sim, u32 syscall, u32 a0, u32 a1, u32 a2, RisaRunStatus status = RISA_RUN_EXIT) {
+    const u32 program[] = {
+        0x000032b7, // lui t0 0x3
+        0x0002a503, // lw a0 0(t0)
+        0x0042a583, // lw a1 4(t0)
+        0x0082a603, // lw a2 8(t0)
+        0x00c2a883, // lw a7 12(t0)
+        0x00000073, // ecall
+        0x00100893, // addi a7 x0 1         ; syscall_exit (result as the exit code)
+        0x00000073  // ecall
+    };
+    const u32 args[] = { a0, a1, a2, syscall };
+    sim->envFields.accelCyclesPerWord = 3;
+    EXPECT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    EXPECT_EQ(0, risaWriteMem(sim, 0x3000, args, sizeof(args)));
+    EXPECT_EQ(status, risaRun(sim, RISA_RUN_UNLIMITED));
+    return risaExitCode(sim);
+}
+
+// Cycles accelCall() charges for the instructions themselves - a faulting op stops the hart on its ECALL
+#define ACCEL_PROGRAM_CYCLES    8U
+#define ACCEL_FAULT_CYCLES      6U
+
+TEST(librisa, test_accel_memcpy) {
+    risaSim *sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaWriteMem(sim, 0x1100, "0123456789", 10));
+    EXPECT_EQ(0x1000, accelCall(sim, 0x5200, 0x1000, 0x1100, 10));
+    char dst[12] = {0};
+    EXPECT_EQ(0, risaReadMem(sim, 0x1000, dst, 11));
+    EXPECT_STREQ("0123456789", dst);
+    EXPECT_EQ(ACCEL_PROGRAM_CYCLES + (3 * 3), risaCycleCount(sim));   // 10 bytes - 3 words
+    risaDestroy(sim);
+
+    // Out of range - an access fault stops the hart, nothing copied or charged
+    sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(EFAULT, accelCall(sim, 0x5200, 0x3ff8, 0x1000, 0x100, RISA_RUN_ERROR));
+    EXPECT_EQ(ACCEL_FAULT_CYCLES, risaCycleCount(sim));
+    risaDestroy(sim);
+    sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(EFAULT, accelCall(sim, 0x5200, 0x1000, 0x80000000, 4, RISA_RUN_ERROR));
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_accel_memset) {
+    risaSim *sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(0x1001, accelCall(sim, 0x5201, 0x1001, 0x1ab, 9));     // Only the low byte of the value counts
+    u8 dst[11] = {0};
+    EXPECT_EQ(0, risaReadMem(sim, 0x1000, dst, sizeof(dst)));
+    EXPECT_EQ(0, dst[0]);
+    for (int i=1; i<10; ++i) {
+        EXPECT_EQ(0xab, dst[i]);
+    }
+    EXPECT_EQ(0, dst[10]);
+    EXPECT_EQ(ACCEL_PROGRAM_CYCLES + (3 * 3), risaCycleCount(sim));   // 9 bytes - 3 words
+    risaDestroy(sim);
+
+    sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(EFAULT, accelCall(sim, 0x5201, 0x3ffc, 0xab, 8, RISA_RUN_ERROR));
+    EXPECT_EQ(0, risaReadMem(sim, 0x3ffc, dst, 4));
+    EXPECT_EQ(0, dst[0]);
+    EXPECT_EQ(ACCEL_FAULT_CYCLES, risaCycleCount(sim));
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_accel_memcmp) {
+    risaSim *sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaWriteMem(sim, 0x1000, "abcdefgh", 8));
+    ASSERT_EQ(0, risaWriteMem(sim, 0x1100, "abcdeXgh", 8));
+    EXPECT_EQ('f' - 'X', accelCall(sim, 0x5202, 0x1000, 0x1100, 8));
+    EXPECT_EQ(ACCEL_PROGRAM_CYCLES + (2 * 3), risaCycleCount(sim));
+    risaDestroy(sim);
+
+    sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaWriteMem(sim, 0x1000, "abcd", 4));
+    ASSERT_EQ(0, risaWriteMem(sim, 0x1100, "abcd", 4));
+    EXPECT_EQ(0, accelCall(sim, 0x5202, 0x1000, 0x1100, 4));
+    EXPECT_EQ(ACCEL_PROGRAM_CYCLES + 3, risaCycleCount(sim));
+    risaDestroy(sim);
+
+    sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    EXPECT_EQ(EFAULT, accelCall(sim, 0x5202, 0x1000, 0x3ff0, 0x20, RISA_RUN_ERROR));
+    EXPECT_EQ(ACCEL_FAULT_CYCLES, risaCycleCount(sim));
+    u32 a0 = 0;
+    EXPECT_EQ(0, risaReadReg(sim, 10, &a0));
+    EXPECT_EQ(0x1000U, a0);                                         // No in-band error result
+    risaDestroy(sim);
+}
+
+TEST(librisa, test_accel_strlen) {
+    risaSim *sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaWriteMem(sim, 0x1000, "hello", 6));
+    EXPECT_EQ(5, accelCall(sim, 0x5203, 0x1000, 0, 0));
+    EXPECT_EQ(ACCEL_PROGRAM_CYCLES + (2 * 3), risaCycleCount(sim));   // Terminator included - 6 bytes, 2 words
+    risaDestroy(sim);
+
+    // Runs off the end of guest memory without a terminator
+    sim = risaCreate(16 * 1024, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaWriteMem(sim, 0x3ffc, "abcd", 4));
+    EXPECT_EQ(EFAULT, accelCall(sim, 0x5203, 0x3ffc, 0, 0, RISA_RUN_ERROR));
+    EXPECT_EQ(ACCEL_FAULT_CYCLES, risaCycleCount(sim));
+    risaDestroy(sim);
+}
+
+#ifndef _WIN32
+// One open (syscall 2) or unlink (syscall 7) ECALL on "path" with the guest's files sandboxed to "dir" - returns its
+// result (fd or -errno)
+static int sandboxCall(const char *dir, const char *path, u32 syscall, u32 flags) {
+    const u32 program[] = {
+        0x00001537, // lui a0 0x1           ; Path at 0x1000
+        0x10052583, // lw a1 0x100(a0)      ; Flags
+        0x1a400613, // addi a2 x0 0644
+        0x10452883, // lw a7 0x104(a0)      ; Syscall
+        0x00000073, // ecall
+        0x00100893, // addi a7 x0 1         ; syscall_exit (result as the exit code)
+        0x00000073  // ecall
+    };
+    const u32 args[] = { flags, syscall };
+    risaSim *sim = risaCreate(8192, NULL);
+    EXPECT_NE(sim, nullptr);
+    if (sim == NULL) {
+        return 0;
+    }
+    sim->envFields.sandboxDir = dir;
+    EXPECT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    EXPECT_EQ(0, risaWriteMem(sim, 0x1000, path, strlen(path) + 1));
+    EXPECT_EQ(0, risaWriteMem(sim, 0x1100, args, sizeof(args)));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    int res = risaExitCode(sim);
+    risaDestroy(sim);
+    return res;
+}
+
+TEST(librisa, test_sandboxed_files) {
+    const u32 openSyscall = 2;
+    const u32 unlinkSyscall = 7;
+    const u32 createFlags = 0x601;  // O_WRONLY | O_CREAT | O_TRUNC (newlib numbering)
+    mkdir("test_sandbox", 0755);
+    mkdir("test_sandbox/root", 0755);
+    mkdir("test_sandbox/root/sub", 0755);
+    mkdir("test_sandbox/outside", 0755);
+    FILE *secret = fopen("test_sandbox/outside/secret.txt", "w");
+    ASSERT_NE(secret, nullptr);
+    fputs("secret", secret);
+    fclose(secret);
+    symlink("../outside", "test_sandbox/root/dirlink");
+    symlink("../outside/secret.txt", "test_sandbox/root/filelink");
+    symlink("sub", "test_sandbox/root/inner");
+    symlink("../outside/pwned.txt", "test_sandbox/root/dangle");
+    const char *root = "test_sandbox/root";
+
+    // ".." traversal, absolute paths and symlinks out of the root are all refused
+    EXPECT_EQ(-EACCES, sandboxCall(root, "../outside/secret.txt", openSyscall, 0));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "sub/../../outside/secret.txt", openSyscall, 0));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "../escape.txt", openSyscall, createFlags));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "/etc/passwd", openSyscall, 0));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "dirlink/secret.txt", openSyscall, 0));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "dirlink/new.txt", openSyscall, createFlags));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "filelink", openSyscall, 0));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "dangle", openSyscall, createFlags));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "dirlink/secret.txt", unlinkSyscall, 0));
+    EXPECT_EQ(-EACCES, sandboxCall(root, "../outside/secret.txt", unlinkSyscall, 0));
+    EXPECT_EQ(-ENOENT, sandboxCall(root, "missing/file.txt", openSyscall, createFlags));
+    struct stat info;
+    EXPECT_EQ(0, stat("test_sandbox/outside/secret.txt", &info));
+    EXPECT_NE(0, stat("test_sandbox/escape.txt", &info));
+    EXPECT_NE(0, stat("test_sandbox/outside/new.txt", &info));
+    EXPECT_NE(0, stat("test_sandbox/outside/pwned.txt", &info));
+    // Symlinks that stay inside are fine
+    EXPECT_LE(3, sandboxCall(root, "inner/ok.txt", openSyscall, createFlags));
+    EXPECT_EQ(0, stat("test_sandbox/root/sub/ok.txt", &info));
+    EXPECT_EQ(0, sandboxCall(root, "inner/ok.txt", unlinkSyscall, 0));
+
+    // Allowed file - create/write/close, then open/read/close it again
+    const u32 program[] = {
+        0x000014b7, // lui s1 0x1           ; Path at 0x1000
+        0x00048513, // addi a0 s1 0
+        0x60100593, // addi a1 x0 0x601     ; O_WRONLY | O_CREAT | O_TRUNC
+        0x1a400613, // addi a2 x0 0644
+        0x00200893, // addi a7 x0 2         ; syscall_open
+        0x00000073, // ecall
+        0x00050913, // addi s2 a0 0
+        0x10048593, // addi a1 s1 0x100     ; Data at 0x1100
+        0x00500613, // addi a2 x0 5
+        0x00500893, // addi a7 x0 5         ; syscall_write     ; Expected result: s3 = 5
+        0x00000073, // ecall
+        0x00050993, // addi s3 a0 0
+        0x00090513, // addi a0 s2 0
+        0x00300893, // addi a7 x0 3         ; syscall_close
+        0x00000073, // ecall
+        0x00048513, // addi a0 s1 0
+        0x00000593, // addi a1 x0 0         ; O_RDONLY
+        0x00200893, // addi a7 x0 2         ; syscall_open
+        0x00000073, // ecall
+        0x00050913, // addi s2 a0 0
+        0x20048593, // addi a1 s1 0x200     ; Buffer at 0x1200
+        0x01000613, // addi a2 x0 16
+        0x00400893, // addi a7 x0 4         ; syscall_read      ; Expected result: s4 = 5
+        0x00000073, // ecall
+        0x00050a13, // addi s4 a0 0
+        0x00090513, // addi a0 s2 0
+        0x00300893, // addi a7 x0 3         ; syscall_close     ; Expected result: exit code 0
+        0x00000073, // ecall
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    risaSim *sim = risaCreate(8192, NULL);
+    ASSERT_NE(sim, nullptr);
+    sim->envFields.sandboxDir = root;
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaWriteMem(sim, 0x1000, "data.txt", 9));
+    ASSERT_EQ(0, risaWriteMem(sim, 0x1100, "hello", 5));
+    EXPECT_EQ(RISA_RUN_EXIT, risaRun(sim, RISA_RUN_UNLIMITED));
+    EXPECT_EQ(0, risaExitCode(sim));
+    u32 s2 = 0, s3 = 0, s4 = 0;
+    char data[6] = {0};
+    risaReadReg(sim, S2, &s2);
+    risaReadReg(sim, S3, &s3);
+    risaReadReg(sim, S4, &s4);
+    EXPECT_LE(3U, s2);
+    EXPECT_EQ(5U, s3);
+    EXPECT_EQ(5U, s4);
+    EXPECT_EQ(0, risaReadMem(sim, 0x1200, data, 5));
+    EXPECT_STREQ("hello", data);
+    risaDestroy(sim);
+    EXPECT_EQ(0, sandboxCall(root, "data.txt", unlinkSyscall, 0));
+    EXPECT_NE(0, stat("test_sandbox/root/data.txt", &info));
+
+    unlink("test_sandbox/root/dirlink");
+    unlink("test_sandbox/root/filelink");
+    unlink("test_sandbox/root/inner");
+    unlink("test_sandbox/root/dangle");
+    unlink("test_sandbox/outside/pwned.txt");
+    unlink("test_sandbox/outside/secret.txt");
+    rmdir("test_sandbox/root/sub");
+    rmdir("test_sandbox/root");
+    rmdir("test_sandbox/outside");
+    rmdir("test_sandbox");
+}
+
+// Guest output captured from fd 1 and 2 (one pipe, so their relative order shows) - "seen" is what had arrived
+// by each ECALL, before it ran
+struct WriteCapture {
+    int fd;
+    std::string out;
+    std::vector<std::string> seen;
+    void drain() {
+        char buf[256];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            out.append(buf, (size_t)len);
+        }
+    }
+};
+
+static int captureEnv(void *ctx, risaSim *hart, RisaEnvKind kind) {
+    (void)hart;
+    WriteCapture *capture = (WriteCapture*)ctx;
+    if (kind == RISA_ENV_ECALL) {
+        capture->drain();
+        capture->seen.push_back(capture->out);
+        capture->out.clear();
+    }
+    return 0;   // Default handler does the write
+}
+
+TEST(librisa, test_buffered_write) {
+    const u32 program[] = {
+        0x00500893, // addi a7 x0 5         ; syscall_write
+        0x00100513, // addi a0 x0 1
+        0x40000593, // addi a1 x0 0x400     ; "ab"          ; Staged
+        0x00200613, // addi a2 x0 2
+        0x00000073, // ecall
+        0x00100513, // addi a0 x0 1
+        0x40200593, // addi a1 x0 0x402     ; "cd\n"        ; Newline - flushed with the staged bytes
+        0x00300613, // addi a2 x0 3
+        0x00000073, // ecall
+        0x00100513, // addi a0 x0 1
+        0x40500593, // addi a1 x0 0x405     ; "ef"          ; Staged
+        0x00200613, // addi a2 x0 2
+        0x00000073, // ecall
+        0x00200513, // addi a0 x0 2
+        0x40700593, // addi a1 x0 0x407     ; "E\n"         ; stderr - staged stdout goes out first
+        0x00200613, // addi a2 x0 2
+        0x00000073, // ecall
+        0x00100513, // addi a0 x0 1
+        0x40900593, // addi a1 x0 0x409     ; "0123456"     ; Staged (one byte short of the threshold)
+        0x00700613, // addi a2 x0 7
+        0x00000073, // ecall
+        0x00100513, // addi a0 x0 1
+        0x41000593, // addi a1 x0 0x410     ; "x"           ; Threshold reached - flushed
+        0x00100613, // addi a2 x0 1
+        0x00000073, // ecall
+        0x00100513, // addi a0 x0 1
+        0x41100593, // addi a1 x0 0x411     ; "yz"          ; Staged until the run ends
+        0x00200613, // addi a2 x0 2
+        0x00000073, // ecall
+        0x00700513, // addi a0 x0 7         ; Not open      ; Expected result: a0 = -EBADF
+        0x40000593, // addi a1 x0 0x400
+        0x00200613, // addi a2 x0 2
+        0x00000073, // ecall
+        0x00100513, // addi a0 x0 1
+        0x800005b7, // lui a1 0x80000       ; Out of range  ; Expected result: a0 = -EFAULT
+        0x00200613, // addi a2 x0 2
+        0x00000073  // ecall
+    };
+    const char data[] = "abcd\nefE\n0123456xyz";
+    int output[2];
+    ASSERT_EQ(0, pipe(output));
+    fcntl(output[0], F_SETFL, fcntl(output[0], F_GETFL) | O_NONBLOCK);
+    WriteCapture capture = { output[0], "", {} };
+    risaHandlers handlers = {};
+    handlers.abiVersion = RISA_HANDLER_ABI_VERSION;
+    handlers.events = RISA_EVENT_ENV;
+    handlers.ctx = &capture;
+    handlers.env = captureEnv;
+
+    risaSim *sim = risaCreate(4096, NULL);
+    ASSERT_NE(sim, nullptr);
+    sim->opts.o_bufferedWrite = 1;
+    sim->writeBuf.threshold = 8;
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    ASSERT_EQ(0, risaWriteMem(sim, 0x400, data, sizeof(data)));
+    ASSERT_EQ(0, risaSetHandlers(sim, &handlers));
+    fflush(stdout);
+    fflush(stderr);
+    int savedStdout = dup(STDOUT_FILENO);
+    int savedStderr = dup(STDERR_FILENO);
+    dup2(output[1], STDOUT_FILENO);
+    dup2(output[1], STDERR_FILENO);
+    // Up to the "yz" write
+    int status = risaRun(sim, 29);
+    capture.drain();
+    std::string runEnd = capture.out;
+    capture.out.clear();
+    u32 written = 0;
+    risaReadReg(sim, A0, &written);
+    int statusBadFd = risaRun(sim, 4);
+    u32 badFd = 0;
+    risaReadReg(sim, A0, &badFd);
+    int statusBadBuf = risaRun(sim, 4);
+    u32 badBuf = 0;
+    risaReadReg(sim, A0, &badBuf);
+    capture.drain();
+    dup2(savedStdout, STDOUT_FILENO);
+    dup2(savedStderr, STDERR_FILENO);
+    close(savedStdout);
+    close(savedStderr);
+    close(output[0]);
+    close(output[1]);
+    risaDestroy(sim);
+
+    EXPECT_EQ(RISA_RUN_LIMIT, status);
+    const std::vector<std::string> expected = { "", "", "abcd\n", "", "efE\n", "", "0123456x", "", "" };
+    EXPECT_EQ(expected, capture.seen);
+    EXPECT_EQ("yz", runEnd);            // Flushed when risaRun() returns
+    EXPECT_EQ(2U, written);             // A staged write still reports every byte
+    EXPECT_EQ(RISA_RUN_LIMIT, statusBadFd);
+    EXPECT_EQ((u32)-EBADF, badFd);
+    EXPECT_EQ(RISA_RUN_LIMIT, statusBadBuf);
+    EXPECT_EQ((u32)-EFAULT, badBuf);
+    EXPECT_EQ("", capture.out);         // Neither failed write put anything out
+}
+#endif
+
+#ifndef _WIN32
+// Minimal gdb remote protocol client - drives a GDB-mode run on another thread (the server listens on port 3333)
+class GdbClient {
+public:
+    GdbClient() {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(3333);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (int tries=0; tries<500; ++tries) {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+                break;
+            }
+            close(fd);
+            fd = -1;
+            usleep(10000);
+        }
+        // Don't hang the test run if the simulator never answers
+        timeval timeout = { 10, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    ~GdbClient() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    bool connected() const {
+        return fd >= 0;
+    }
+    void sendRaw(const std::string &data) {
+        EXPECT_EQ((ssize_t)data.size(), write(fd, data.data(), data.size()));
+    }
+    void send(const std::string &body) {
+        u8 checksum = 0;
+        for (char c : body) {
+            checksum += (u8)c;
+        }
+        char trailer[4];
+        snprintf(trailer, sizeof(trailer), "#%02x", checksum);
+        sendRaw("$" + body + trailer);
+    }
+    // Next packet body from the simulator (acks skipped, the packet acked) - empty on timeout
+    std::string reply() {
+        std::string body;
+        int c;
+        while ((c = readChar()) >= 0 && c != '$') {}
+        while ((c = readChar()) >= 0 && c != '#') {
+            body += (char)c;
+        }
+        readChar();
+        readChar();
+        sendRaw("+");
+        return body;
+    }
+    std::string request(const std::string &body) {
+        send(body);
+        return reply();
+    }
+    // Register from a 'g' reply (32 = pc)
+    u32 reg(unsigned index) {
+        std::string regs = request("g");
+        u32 value = 0;
+        for (int i=3; i>=0 && regs.size() >= ((index + 1) * 8); --i) {
+            value = (value << 8) | (u32)strtoul(regs.substr((index * 8) + (i * 2), 2).c_str(), NULL, 16);
+        }
+        return value;
+    }
+
+private:
+    int readChar() {
+        if (rxPos == rxLen) {
+            ssize_t received = recv(fd, rxBuf, sizeof(rxBuf), 0);
+            if (received <= 0) {
+                return -1;
+            }
+            rxPos = 0;
+            rxLen = (size_t)received;
+        }
+        return (u8)rxBuf[rxPos++];
+    }
+    int fd = -1;
+    char rxBuf[4096];
+    size_t rxPos = 0;
+    size_t rxLen = 0;
+};
+
+// GDB-mode run of "sim" on its own thread (the fault handler and run state belong to the thread that runs it)
+static std::thread gdbRun(risaSim *sim, int *status) {
+    sim->opts.o_gdbEnabled = 1;
+    return std::thread([sim, status]() {
+        *status = (gdbserverInit(sim) == 0) ? risaRun(sim, RISA_RUN_UNLIMITED) : -1;
+    });
+}
+
+TEST(gdb, test_watch_accel_memset) {
+    const u32 program[] = {
+        0x00002537, // lui a0 0x2
+        0xff050513, // addi a0 a0 -16       ; a0 = 0x1ff0
+        0x05a00593, // addi a1 x0 0x5a
+        0x00003637, // lui a2 0x3           ; a2 = 0x3000
+        0x000058b7, // lui a7 0x5
+        0x20188893, // addi a7 a7 0x201     ; syscall_memset (0x1ff0-0x4fef, four pages)
+        0x00000073, // ecall
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    risaSim *sim = risaCreate(0x10000, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    int status = 0;
+    std::thread run = gdbRun(sim, &status);
+    {
+        GdbClient gdb;
+        ASSERT_TRUE(gdb.connected());
+        // One watch per protected page the memset crosses - the hit is past the first faulting byte of its page
+        EXPECT_EQ("OK", gdb.request("Z2,4800,4"));
+        EXPECT_EQ("OK", gdb.request("Z2,3800,4"));
+        EXPECT_EQ("OK", gdb.request("Z2,2800,4"));
+        EXPECT_EQ("T05watch:4800;", gdb.request("c"));
+        EXPECT_EQ(0x1cU, gdb.reg(32));
+        EXPECT_EQ("5a5a5a5a", gdb.request("m4800,4"));
+        EXPECT_EQ("5a5a5a5a", gdb.request("m4fec,4"));
+        EXPECT_EQ("00000000", gdb.request("m4ff0,4"));
+        EXPECT_EQ("OK", gdb.request("z2,4800,4"));
+        EXPECT_EQ("OK", gdb.request("z2,3800,4"));
+        EXPECT_EQ("OK", gdb.request("z2,2800,4"));
+        gdb.send("c");
+        run.join();
+    }
+    EXPECT_EQ(RISA_RUN_EXIT, status);
+    EXPECT_EQ(0x1ff0, risaExitCode(sim));
+    risaDestroy(sim);
+}
+
+TEST(gdb, test_reverse_step_replays_inputs) {
+    const u32 program[] = {
+        0x000015b7, // lui a1 0x1           ; a1 = 0x1000
+        0x01100293, // addi t0 x0 0x11
+        0x0055a023, // sw t0 0(a1)
+        0x00000513, // addi a0 x0 0         ; stdin
+        0x00400613, // addi a2 x0 4
+        0x00400893, // addi a7 x0 4         ; syscall_read
+        0x00000073, // ecall                ; Expected result: "abcd" at 0x1000, a0 = 4
+        0x00100313, // addi t1 x0 1
+        0x00200393, // addi t2 x0 2
+        0x00100893, // addi a7 x0 1         ; syscall_exit
+        0x00000073  // ecall
+    };
+    // Guest stdin from a pipe - whatever a re-executed read takes from it is gone for good (non-blocking so a
+    // read that isn't replayed can't hang the test)
+    int input[2];
+    ASSERT_EQ(0, pipe(input));
+    fcntl(input[0], F_SETFL, O_NONBLOCK);
+    int savedStdin = dup(STDIN_FILENO);
+    dup2(input[0], STDIN_FILENO);
+    close(input[0]);
+    ASSERT_EQ(4, write(input[1], "abcd", 4));
+
+    risaSim *sim = risaCreate(0x10000, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    sim->opts.o_gdbReverse = 1;
+    int status = 0;
+    std::thread run = gdbRun(sim, &status);
+    {
+        GdbClient gdb;
+        ASSERT_TRUE(gdb.connected());
+        EXPECT_EQ("OK", gdb.request("Z0,20,4"));
+        gdb.request("c");
+        EXPECT_EQ(0x20U, gdb.reg(32));
+        EXPECT_EQ("61626364", gdb.request("m1000,4"));
+        ASSERT_EQ(4, write(input[1], "WXYZ", 4));
+
+        // Re-executing from the checkpoint gets the read's recorded data, not the next bytes on stdin
+        gdb.request("bs");
+        EXPECT_EQ(0x1cU, gdb.reg(32));
+        EXPECT_EQ(4U, gdb.reg(A0));
+        EXPECT_EQ(0U, gdb.reg(T1));
+        EXPECT_EQ("61626364", gdb.request("m1000,4"));
+        // Over the read ECALL
+        gdb.request("bs");
+        EXPECT_EQ(0x18U, gdb.reg(32));
+        EXPECT_EQ(0U, gdb.reg(A0));
+        EXPECT_EQ("11000000", gdb.request("m1000,4"));
+        // Over the store
+        for (int i=0; i<4; ++i) {
+            gdb.request("bs");
+        }
+        EXPECT_EQ(0x08U, gdb.reg(32));
+        EXPECT_EQ(0x11U, gdb.reg(T0));
+        EXPECT_EQ("00000000", gdb.request("m1000,4"));
+
+        // Forward again through the recorded history
+        gdb.request("c");
+        EXPECT_EQ(0x20U, gdb.reg(32));
+        EXPECT_EQ(4U, gdb.reg(A0));
+        EXPECT_EQ(1U, gdb.reg(T1));
+        EXPECT_EQ("61626364", gdb.request("m1000,4"));
+        EXPECT_EQ("OK", gdb.request("z0,20,4"));
+        gdb.send("c");
+        run.join();
+    }
+    EXPECT_EQ(RISA_RUN_EXIT, status);
+    EXPECT_EQ(4, risaExitCode(sim));
+    risaDestroy(sim);
+    // The replays never read stdin again
+    char rest[8] = {};
+    close(input[1]);
+    EXPECT_EQ(4, read(STDIN_FILENO, rest, sizeof(rest)));
+    EXPECT_STREQ("WXYZ", rest);
+    dup2(savedStdin, STDIN_FILENO);
+    close(savedStdin);
+}
+
+TEST(gdb, test_breakpoint_range) {
+    const u32 program[] = {
+        0x00100293, // addi t0 x0 1
+        0x7ffff337, // lui t1 0x7ffff
+        0x00030067  // jalr x0 0(t1)        ; Past guest memory - fetch fault, not a breakpoint lookup
+    };
+    risaSim *sim = risaCreate(0x10000, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    int status = 0;
+    std::thread run = gdbRun(sim, &status);
+    {
+        GdbClient gdb;
+        ASSERT_TRUE(gdb.connected());
+        EXPECT_EQ("E02", gdb.request("Z0,7ffff000,4"));
+        EXPECT_EQ("E02", gdb.request("Z0,100000008,4"));
+        EXPECT_EQ("E02", gdb.request("Z0,6,4"));
+        EXPECT_EQ("OK", gdb.request("Z0,8,4"));
+        gdb.request("c");
+        EXPECT_EQ(8U, gdb.reg(32));
+        EXPECT_EQ(1U, gdb.reg(T0));
+        gdb.send("c");
+        run.join();
+    }
+    EXPECT_EQ(RISA_RUN_ERROR, status);
+    EXPECT_EQ(EFAULT, risaExitCode(sim));
+    EXPECT_EQ(0x7ffff000U, risaReadPc(sim));
+    risaDestroy(sim);
+}
+
+TEST(gdb, test_interrupt_only_on_ctrl_c) {
+    const u32 program[] = {
+        0x0000006f  // jal x0 0             ; Spin until interrupted
+    };
+    risaSim *sim = risaCreate(0x10000, NULL);
+    ASSERT_NE(sim, nullptr);
+    ASSERT_EQ(0, risaLoadImage(sim, program, sizeof(program), 0));
+    int status = 0;
+    std::thread run = gdbRun(sim, &status);
+    {
+        GdbClient gdb;
+        ASSERT_TRUE(gdb.connected());
+        gdb.send("c");
+        // A stray packet while running is dropped - only 0x03 stops the target
+        usleep(50000);
+        gdb.send("g");
+        usleep(50000);
+        gdb.sendRaw("\x03");
+        EXPECT_EQ("S02", gdb.reply());
+        EXPECT_EQ("6f000000", gdb.request("m0,4"));
+        gdb.send("k");
+        run.join();
+    }
+    EXPECT_EQ(RISA_RUN_HALT, status);
+    risaDestroy(sim);
+}
+#endif